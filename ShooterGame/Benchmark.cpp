@@ -0,0 +1,1171 @@
+#include "Benchmark.h"
+#include "CollisionMesh.h"
+#include "Game.h"
+#include "JobSystem.h"
+#include "Navigation.h"
+#include "Parallel.h"
+#include "TransformHierarchy.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#pragma comment(lib, "opengl32.lib")
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+namespace {
+
+//
+// GL context without a visible window
+//
+class HeadlessContext {
+
+#ifdef _WIN32
+    HWND                    mWindow;
+    HDC                     mDC;
+    HGLRC                   mContext;
+#else
+    EGLDisplay              mDisplay;
+    EGLContext              mContext;
+#endif
+
+public:
+    HeadlessContext();
+    ~HeadlessContext();
+
+    bool                    create();
+    void                    destroy();
+};
+
+#ifdef _WIN32
+
+HeadlessContext::HeadlessContext()
+    : mWindow(NULL)
+    , mDC(NULL)
+    , mContext(NULL)
+{
+}
+
+bool HeadlessContext::create()
+{
+    HINSTANCE instance = GetModuleHandleA(NULL);
+
+    WNDCLASSA wc;
+    ZeroMemory(&wc, sizeof(wc));
+    wc.style = CS_OWNDC;
+    wc.lpfnWndProc = DefWindowProcA;
+    wc.hInstance = instance;
+    wc.lpszClassName = "ShooterGameHeadless";
+    RegisterClassA(&wc);
+
+    // the window is never shown, everything is drawn into a framebuffer object
+    mWindow = CreateWindowA(wc.lpszClassName, "", WS_OVERLAPPEDWINDOW, 0, 0, 16, 16, NULL, NULL, instance, NULL);
+    if (!mWindow) {
+        std::cerr << "ERROR: Failed to create the benchmark window" << std::endl;
+        return false;
+    }
+    mDC = GetDC(mWindow);
+
+    PIXELFORMATDESCRIPTOR pfd;
+    ZeroMemory(&pfd, sizeof(pfd));
+    pfd.nSize = sizeof(pfd);
+    pfd.nVersion = 1;
+    pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+    pfd.iPixelType = PFD_TYPE_RGBA;
+    pfd.cColorBits = 32;
+    pfd.cDepthBits = 24;
+    pfd.iLayerType = PFD_MAIN_PLANE;
+
+    int format = ChoosePixelFormat(mDC, &pfd);
+    if (!format || !SetPixelFormat(mDC, format, &pfd)) {
+        std::cerr << "ERROR: Failed to set a pixel format" << std::endl;
+        return false;
+    }
+
+    mContext = wglCreateContext(mDC);
+    if (!mContext || !wglMakeCurrent(mDC, mContext)) {
+        std::cerr << "ERROR: Failed to create a GL context" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void HeadlessContext::destroy()
+{
+    if (mContext) {
+        wglMakeCurrent(NULL, NULL);
+        wglDeleteContext(mContext);
+        mContext = NULL;
+    }
+    if (mWindow) {
+        ReleaseDC(mWindow, mDC);
+        DestroyWindow(mWindow);
+        mWindow = NULL;
+        mDC = NULL;
+    }
+}
+
+#else
+
+HeadlessContext::HeadlessContext()
+    : mDisplay(EGL_NO_DISPLAY)
+    , mContext(EGL_NO_CONTEXT)
+{
+}
+
+bool HeadlessContext::create()
+{
+    // prefer Mesa's surfaceless platform, which needs no X server
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        mDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (mDisplay == EGL_NO_DISPLAY) {
+        mDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    EGLint major, minor;
+    if (mDisplay == EGL_NO_DISPLAY || !eglInitialize(mDisplay, &major, &minor)) {
+        std::cerr << "ERROR: Failed to initialize EGL" << std::endl;
+        return false;
+    }
+
+    const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    eglChooseConfig(mDisplay, configAttribs, &config, 1, &numConfigs);
+
+    eglBindAPI(EGL_OPENGL_API);
+
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+        EGL_NONE
+    };
+    mContext = eglCreateContext(mDisplay, numConfigs > 0 ? config : (EGLConfig)0, EGL_NO_CONTEXT, contextAttribs);
+    if (mContext == EGL_NO_CONTEXT || !eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, mContext)) {
+        std::cerr << "ERROR: Failed to create a GL context" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void HeadlessContext::destroy()
+{
+    if (mContext != EGL_NO_CONTEXT) {
+        eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(mDisplay, mContext);
+        mContext = EGL_NO_CONTEXT;
+    }
+    if (mDisplay != EGL_NO_DISPLAY) {
+        eglTerminate(mDisplay);
+        mDisplay = EGL_NO_DISPLAY;
+    }
+}
+
+#endif
+
+HeadlessContext::~HeadlessContext()
+{
+    destroy();
+}
+
+struct FrameSample {
+    unsigned                mesh;
+    int                     frame;
+    double                  cpuMs;          // update + draw submission
+    double                  gpuMs;          // GL timer query around draw (-1 if unsupported)
+    double                  frameMs;        // submission + waiting for the GL to finish
+    unsigned                draws;
+    unsigned long long      triangles;
+    unsigned                lights;         // point lights in the frame (0 without clustered lighting)
+};
+
+// nearest-rank percentile
+double Percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p * values.size());
+    if (rank > 0) {
+        --rank;
+    }
+    if (rank >= values.size()) {
+        rank = values.size() - 1;
+    }
+    return values[rank];
+}
+
+void WriteTimeStats(std::ostream& out, const char* name, const std::vector<double>& values)
+{
+    double sum = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+        sum += values[i];
+    }
+    double mean = values.empty() ? 0 : sum / values.size();
+
+    out << "\"" << name << "\": { \"mean\": " << mean
+        << ", \"p50\": " << Percentile(values, 0.50)
+        << ", \"p99\": " << Percentile(values, 0.99) << " }";
+}
+
+std::string JsonString(const std::string& s)
+{
+    std::string r = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '"' || s[i] == '\\') {
+            r += '\\';
+        }
+        r += s[i];
+    }
+    r += "\"";
+    return r;
+}
+
+// summary over a range of samples
+void WriteSummary(std::ostream& out, const std::vector<FrameSample>& samples, size_t begin, size_t end)
+{
+    std::vector<double> cpu, gpu, frame;
+    unsigned long long draws = 0;
+    unsigned long long triangles = 0;
+    unsigned long long lights = 0;
+    for (size_t i = begin; i < end; i++) {
+        cpu.push_back(samples[i].cpuMs);
+        if (samples[i].gpuMs >= 0) {
+            gpu.push_back(samples[i].gpuMs);
+        }
+        frame.push_back(samples[i].frameMs);
+        draws += samples[i].draws;
+        triangles += samples[i].triangles;
+        lights += samples[i].lights;
+    }
+    size_t n = end - begin;
+
+    out << "\"frames\": " << n << ", ";
+    WriteTimeStats(out, "cpu_ms", cpu);
+    out << ", ";
+    WriteTimeStats(out, "gpu_ms", gpu);
+    out << ", ";
+    WriteTimeStats(out, "frame_ms", frame);
+    out << ", \"draws_per_frame\": " << (n ? (double)draws / n : 0.0)
+        << ", \"triangles_per_frame\": " << (n ? (double)triangles / n : 0.0)
+        << ", \"lights_per_frame\": " << (n ? (double)lights / n : 0.0);
+}
+
+}
+
+
+//
+// Camera script
+//
+
+CameraKey::CameraKey()
+    : frames(1)
+    , position(0.0f, 3.0f, 12.0f)
+    , target(0.0f, 0.0f, 0.0f)
+    , yawRate(0)
+    , pitchRate(0)
+    , worldSpace(false)
+{
+}
+
+bool CameraScript::load(const std::string& path)
+{
+    std::ifstream file(path.c_str());
+    if (!file) {
+        std::cerr << "ERROR: Failed to open " << path << std::endl;
+        return false;
+    }
+
+    mKeys.clear();
+
+    std::string line;
+    int lineno = 0;
+    while (std::getline(file, line)) {
+        ++lineno;
+
+        std::vector<std::string> tokens = glsh::Tokenize(line);
+        if (tokens.empty() || tokens[0][0] == '#') {
+            continue;
+        }
+        if (tokens.size() < 7) {
+            std::cerr << "ERROR: Expected at least 7 values on line " << lineno << " of " << path << std::endl;
+            return false;
+        }
+
+        CameraKey key;
+        key.frames = glsh::FromString<int>(tokens[0]);
+        key.position = glm::vec3(glsh::FromString<float>(tokens[1]), glsh::FromString<float>(tokens[2]), glsh::FromString<float>(tokens[3]));
+        key.target = glm::vec3(glsh::FromString<float>(tokens[4]), glsh::FromString<float>(tokens[5]), glsh::FromString<float>(tokens[6]));
+        if (tokens.size() >= 9) {
+            key.yawRate = glsh::FromString<float>(tokens[7]);
+            key.pitchRate = glsh::FromString<float>(tokens[8]);
+        }
+        key.worldSpace = tokens.size() >= 10 && tokens[9] == "world";
+
+        if (key.frames < 1) {
+            key.frames = 1;
+        }
+        mKeys.push_back(key);
+    }
+
+    if (mKeys.empty()) {
+        std::cerr << "ERROR: No keyframes in " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void CameraScript::makeOrbit(int frames, float radius, float height)
+{
+    const int numKeys = 16;
+
+    mKeys.clear();
+    for (int i = 0; i <= numKeys; i++) {
+        float angle = 2 * glsh::PI * i / numKeys;
+
+        CameraKey key;
+        key.frames = (i == 0 || frames < numKeys) ? 1 : frames / numKeys;
+        key.position = glm::vec3(radius * std::sin(angle), height, radius * std::cos(angle));
+        key.target = glm::vec3(0.0f);
+        key.yawRate = 0.5f;
+        mKeys.push_back(key);
+    }
+}
+
+int CameraScript::getNumFrames() const
+{
+    int n = 0;
+    for (size_t i = 0; i < mKeys.size(); i++) {
+        n += mKeys[i].frames;
+    }
+    return n;
+}
+
+CameraKey CameraScript::evaluate(int frame) const
+{
+    if (mKeys.empty()) {
+        return CameraKey();
+    }
+
+    for (size_t i = 0; i < mKeys.size(); i++) {
+        const CameraKey& key = mKeys[i];
+        if (frame < key.frames) {
+            // blend from the previous pose (the first key just holds its pose)
+            const CameraKey& prev = (i > 0) ? mKeys[i - 1] : key;
+            float t = (float)(frame + 1) / key.frames;
+
+            CameraKey result = key;
+            result.position = glm::mix(prev.position, key.position, t);
+            result.target = glm::mix(prev.target, key.target, t);
+            return result;
+        }
+        frame -= key.frames;
+    }
+
+    return mKeys.back();
+}
+
+
+//
+// Benchmark
+//
+
+BenchmarkOptions::BenchmarkOptions()
+    : outputPath("benchmark.json")
+    , width(1280)
+    , height(720)
+    , warmupFrames(10)
+    , timeStep(1.0f / 60.0f)
+{
+}
+
+int RunBenchmark(Game& game, const BenchmarkOptions& options)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    CameraScript script;
+    if (options.scriptPath.empty()) {
+        script.makeOrbit(240, 12.0f, 3.0f);
+    }
+    else if (!script.load(options.scriptPath)) {
+        return 1;
+    }
+
+    HeadlessContext context;
+    if (!context.create()) {
+        return 1;
+    }
+
+    glewExperimental = GL_TRUE;
+    GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // EGL contexts have no GLX display, but the GL entry points are loaded anyway
+    if (err == GLEW_ERROR_NO_GLX_DISPLAY) {
+        err = GLEW_OK;
+    }
+#endif
+    if (err != GLEW_OK) {
+        std::cerr << "ERROR: Failed to initialize GLEW: " << glewGetErrorString(err) << std::endl;
+        return 1;
+    }
+
+    std::string renderer = (const char*)glGetString(GL_RENDERER);
+    std::string version = (const char*)glGetString(GL_VERSION);
+    std::cout << "Benchmark renderer: " << renderer << " (" << version << ")" << std::endl;
+
+    // offscreen render target
+    GLuint fbo, colorRb, depthRb;
+    glGenFramebuffers(1, &fbo);
+    glGenRenderbuffers(1, &colorRb);
+    glGenRenderbuffers(1, &depthRb);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorRb);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, options.width, options.height);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthRb);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, options.width, options.height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorRb);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthRb);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "ERROR: Benchmark framebuffer is incomplete" << std::endl;
+        return 1;
+    }
+
+    if (!game.initialize(options.width, options.height)) {
+        std::cerr << "ERROR: Game initialization failed" << std::endl;
+        return 1;
+    }
+    game.resize(options.width, options.height);
+    game.resetLatency();
+
+    bool haveTimer = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    GLuint query = 0;
+    if (haveTimer) {
+        glGenQueries(1, &query);
+    }
+    else {
+        std::cout << "Warning: Timer queries are not supported, gpu_ms will be empty" << std::endl;
+    }
+
+    const int numFrames = script.getNumFrames();
+    const float dt = options.timeStep;
+
+    std::vector<FrameSample> samples;
+    std::vector<size_t> meshBegin;          // first sample of each mesh
+    std::vector<bool> meshLoaded;
+
+    for (unsigned m = 0; m < game.getNumMeshes(); m++) {
+        meshBegin.push_back(samples.size());
+        meshLoaded.push_back(game.selectMesh(m));
+        if (!meshLoaded.back()) {
+            continue;
+        }
+
+        std::cout << "Benchmarking '" << game.getMeshName(m) << "'" << std::endl;
+
+        GameInput reset;
+        reset.resetRotation = true;
+        game.applyInput(reset, 0);
+
+        for (int f = -options.warmupFrames; f < numFrames; f++) {
+            CameraKey key = script.evaluate(f < 0 ? 0 : f);
+
+            Clock::time_point t0 = Clock::now();
+
+            // a whole frame, update() included, with the script standing in for the keyboard
+            // and the camera; the simulated step keeps every run the same
+            GameInput input;
+            input.yaw = key.yawRate * dt;
+            input.pitch = key.pitchRate * dt;
+            input.worldSpace = key.worldSpace;
+            game.setScriptedFrame(input, key.position, key.target);
+            game.update(dt);
+
+            if (haveTimer) {
+                glBeginQuery(GL_TIME_ELAPSED, query);
+            }
+            game.draw();
+            if (haveTimer) {
+                glEndQuery(GL_TIME_ELAPSED);
+            }
+
+            Clock::time_point t1 = Clock::now();
+            glFinish();
+            Clock::time_point t2 = Clock::now();
+
+            if (f < 0) {
+                continue;
+            }
+
+            FrameSample s;
+            s.mesh = m;
+            s.frame = f;
+            s.cpuMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+            s.frameMs = std::chrono::duration<double, std::milli>(t2 - t0).count();
+            s.gpuMs = -1;
+            if (haveTimer) {
+                GLuint64 ns = 0;
+                glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+                s.gpuMs = ns / 1e6;
+            }
+            s.draws = game.getRenderStats().numDraws;
+            s.triangles = game.getRenderStats().numTriangles;
+            s.lights = game.isClusteredLighting() ? game.getNumLights() : 0;
+            samples.push_back(s);
+        }
+    }
+    meshBegin.push_back(samples.size());
+
+    //
+    // write the results
+    //
+
+    std::ofstream file;
+    std::ostream* out = &std::cout;
+    if (options.outputPath != "-") {
+        file.open(options.outputPath.c_str());
+        if (!file) {
+            std::cerr << "ERROR: Failed to open " << options.outputPath << std::endl;
+            return 1;
+        }
+        out = &file;
+    }
+
+    *out << "{\n";
+    *out << "  \"renderer\": " << JsonString(renderer) << ",\n";
+    *out << "  \"version\": " << JsonString(version) << ",\n";
+    *out << "  \"width\": " << options.width << ", \"height\": " << options.height << ",\n";
+    *out << "  \"script\": " << JsonString(options.scriptPath) << ", \"script_frames\": " << numFrames << ",\n";
+    *out << "  \"depth_mode\": " << JsonString(Game::GetDepthModeName(game.getDepthMode())) << ",\n";
+    *out << "  \"low_latency\": " << (game.isLowLatency() ? "true" : "false") << ",\n";
+    *out << "  \"clustered_lighting\": " << (game.isClusteredLighting() ? "true" : "false") << ",\n";
+    *out << "  \"input_to_present\": ";
+    game.getLatency().writeJson(*out);
+    *out << ",\n";
+
+    *out << "  \"total\": { ";
+    WriteSummary(*out, samples, 0, samples.size());
+    *out << " },\n";
+
+    *out << "  \"meshes\": [\n";
+    for (unsigned m = 0; m < game.getNumMeshes(); m++) {
+        *out << "    { \"name\": " << JsonString(game.getMeshName(m))
+             << ", \"loaded\": " << (meshLoaded[m] ? "true" : "false") << ", ";
+        WriteSummary(*out, samples, meshBegin[m], meshBegin[m + 1]);
+        *out << " }" << (m + 1 < game.getNumMeshes() ? "," : "") << "\n";
+    }
+    *out << "  ],\n";
+
+    *out << "  \"samples\": [\n";
+    for (size_t i = 0; i < samples.size(); i++) {
+        const FrameSample& s = samples[i];
+        *out << "    { \"mesh\": " << s.mesh << ", \"frame\": " << s.frame
+             << ", \"cpu_ms\": " << s.cpuMs << ", \"gpu_ms\": " << s.gpuMs << ", \"frame_ms\": " << s.frameMs
+             << ", \"draws\": " << s.draws << ", \"triangles\": " << s.triangles << ", \"lights\": " << s.lights << " }"
+             << (i + 1 < samples.size() ? "," : "") << "\n";
+    }
+    *out << "  ]\n";
+    *out << "}\n";
+
+    if (file.is_open()) {
+        std::cout << "Wrote " << samples.size() << " frames to " << options.outputPath << std::endl;
+    }
+
+    if (haveTimer) {
+        glDeleteQueries(1, &query);
+    }
+
+    game.shutdown();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteRenderbuffers(1, &colorRb);
+    glDeleteRenderbuffers(1, &depthRb);
+
+    return 0;
+}
+
+
+//
+// Job system benchmark
+//
+
+namespace {
+
+// some arithmetic per item, so the loops can't be optimized away
+float JobWork(size_t i)
+{
+    float x = (float)(i & 1023);
+    return std::sqrt(x * x + 1.0f) * 0.5f;
+}
+
+// jobs that each start two more until 'depth' reaches zero
+void FanOut(JobSystem& jobs, JobCounter& counter, int depth)
+{
+    if (depth == 0) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        jobs.run([&jobs, &counter, depth]() { FanOut(jobs, counter, depth - 1); }, &counter);
+    }
+}
+
+}
+
+int RunJobBenchmark(const BenchmarkOptions& options)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    const int numRuns = 5;
+    const size_t numEmptyJobs = 100000;
+    const size_t numItems = 1 << 22;
+    const size_t grain = 4096;
+    const int chainLength = 1000;
+    const int fanOutDepth = 16;
+
+    std::vector<float> results(numItems);
+    std::vector<double> serialMs, threadMs, jobMs, emptyNs, chainUs, fanOutMs;
+
+    // the loop the others are compared to
+    for (int r = 0; r < numRuns; r++) {
+        Clock::time_point t0 = Clock::now();
+        for (size_t i = 0; i < numItems; i++) {
+            results[i] = JobWork(i);
+        }
+        serialMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+    }
+
+    // ParallelFor without a job system spawns a thread per range
+    for (int r = 0; r < numRuns; r++) {
+        Clock::time_point t0 = Clock::now();
+        ParallelFor(numItems, grain, [&results](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                results[i] = JobWork(i);
+            }
+        });
+        threadMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+    }
+
+    JobSystem jobs;
+    jobs.start();
+
+    for (int r = 0; r < numRuns; r++) {
+        Clock::time_point t0 = Clock::now();
+        jobs.parallelFor(numItems, grain, [&results](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                results[i] = JobWork(i);
+            }
+        });
+        jobMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+    }
+
+    // scheduling overhead: start, run and finish jobs that do nothing
+    for (int r = 0; r < numRuns; r++) {
+        JobCounter counter;
+        Clock::time_point t0 = Clock::now();
+        for (size_t i = 0; i < numEmptyJobs; i++) {
+            jobs.run([]() {}, &counter);
+        }
+        jobs.wait(counter);
+        emptyNs.push_back(std::chrono::duration<double, std::nano>(Clock::now() - t0).count() / numEmptyJobs);
+    }
+
+    // dependency latency: each job starts once the previous one is done
+    for (int r = 0; r < numRuns; r++) {
+        std::vector<JobCounter> links(chainLength);
+        Clock::time_point t0 = Clock::now();
+        jobs.run([]() {}, &links[0]);
+        for (int i = 1; i < chainLength; i++) {
+            jobs.runAfter(links[i - 1], []() {}, &links[i]);
+        }
+        jobs.wait(links[chainLength - 1]);
+        chainUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count() / chainLength);
+
+        // a link's finishing thread may still be releasing it
+        for (int i = 0; i < chainLength; i++) {
+            jobs.wait(links[i]);
+        }
+    }
+
+    // recursive fan-out: every worker has to steal to get anything to do
+    unsigned long long stealsBefore = jobs.getNumSteals();
+    for (int r = 0; r < numRuns; r++) {
+        JobCounter counter;
+        Clock::time_point t0 = Clock::now();
+        FanOut(jobs, counter, fanOutDepth);
+        jobs.wait(counter);
+        fanOutMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+    }
+    unsigned long long fanOutSteals = (jobs.getNumSteals() - stealsBefore) / numRuns;
+
+    unsigned numThreads = jobs.getNumThreads();
+    jobs.printStats();
+    jobs.stop();
+
+    //
+    // write the results
+    //
+
+    std::ofstream file;
+    std::ostream* out = &std::cout;
+    if (options.outputPath != "-") {
+        file.open(options.outputPath.c_str());
+        if (!file) {
+            std::cerr << "ERROR: Failed to open " << options.outputPath << std::endl;
+            return 1;
+        }
+        out = &file;
+    }
+
+    double serial = Percentile(serialMs, 0.5);
+
+    *out << "{\n";
+    *out << "  \"threads\": " << numThreads << ", \"runs\": " << numRuns << ",\n";
+    *out << "  \"empty_jobs\": { \"jobs\": " << numEmptyJobs << ", ";
+    WriteTimeStats(*out, "ns_per_job", emptyNs);
+    *out << " },\n";
+    *out << "  \"parallel_for\": { \"items\": " << numItems << ", \"grain\": " << grain << ", ";
+    WriteTimeStats(*out, "serial_ms", serialMs);
+    *out << ", ";
+    WriteTimeStats(*out, "thread_per_range_ms", threadMs);
+    *out << ", ";
+    WriteTimeStats(*out, "jobs_ms", jobMs);
+    *out << ", \"speedup\": " << serial / Percentile(jobMs, 0.5) << " },\n";
+    *out << "  \"dependency_chain\": { \"length\": " << chainLength << ", ";
+    WriteTimeStats(*out, "us_per_link", chainUs);
+    *out << " },\n";
+    *out << "  \"fan_out\": { \"jobs\": " << ((2ull << fanOutDepth) - 2) << ", ";
+    WriteTimeStats(*out, "ms", fanOutMs);
+    *out << ", \"steals\": " << fanOutSteals << " }\n";
+    *out << "}\n";
+
+    if (file.is_open()) {
+        std::cout << "Wrote job benchmark to " << options.outputPath << std::endl;
+    }
+
+    return 0;
+}
+
+
+//
+// Transform hierarchy benchmark
+//
+
+namespace {
+
+// in [0, 1), from a linear congruential generator
+float BenchRandom(unsigned& seed)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return (seed >> 8) * (1.0f / 16777216.0f);
+}
+
+glm::quat RandomRotation(unsigned& seed)
+{
+    float angle = BenchRandom(seed) * 2 * glsh::PI;
+    glm::vec3 axis = glm::normalize(glm::vec3(BenchRandom(seed) - 0.5f, BenchRandom(seed) - 0.5f, BenchRandom(seed) - 0.5f) + glm::vec3(0, 1e-3f, 0));
+    float s = std::sin(angle * 0.5f);
+    return glm::quat(std::cos(angle * 0.5f), axis.x * s, axis.y * s, axis.z * s);
+}
+
+}
+
+int RunTransformBenchmark(const BenchmarkOptions& options)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    const unsigned numNodes = 100000;
+    const unsigned numRoots = 64;
+    const unsigned maxChildren = 8;
+    const float changedFraction = 0.01f;
+    const int numFrames = 200;
+
+    unsigned seed = 12345;
+
+    // a scene-like tree: every node of a level gets up to a few children, so the tree is wide
+    // and several levels deep
+    TransformHierarchy scene;
+    std::vector<unsigned> nodes;
+    nodes.reserve(numNodes);
+    size_t levelBegin = 0;
+    for (unsigned i = 0; i < numRoots; i++) {
+        nodes.push_back(scene.create());
+    }
+    while (nodes.size() < numNodes) {
+        size_t levelEnd = nodes.size();
+        for (size_t i = levelBegin; i < levelEnd && nodes.size() < numNodes; i++) {
+            unsigned n = (unsigned)(BenchRandom(seed) * (maxChildren + 1));
+            for (unsigned c = 0; c < n && nodes.size() < numNodes; c++) {
+                nodes.push_back(scene.create(nodes[i]));
+            }
+        }
+        levelBegin = levelEnd;
+    }
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        glm::vec3 position(BenchRandom(seed) * 4 - 2, BenchRandom(seed) * 4 - 2, BenchRandom(seed) * 4 - 2);
+        scene.setLocal(nodes[i], position, RandomRotation(seed), glm::vec3(0.9f + 0.2f * BenchRandom(seed)));
+    }
+
+    Clock::time_point t0 = Clock::now();
+    scene.update();
+    double firstMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+    JobSystem jobs;
+    jobs.start();
+
+    // the same nodes change in every mode
+    const unsigned numChanged = (unsigned)(numNodes * changedFraction);
+    std::vector<unsigned> changed(numChanged * numFrames);
+    for (size_t i = 0; i < changed.size(); i++) {
+        changed[i] = nodes[(size_t)(BenchRandom(seed) * nodes.size())];
+    }
+
+    std::vector<double> fullMs, serialMs, jobMs;
+    unsigned long long numUpdated = 0;
+
+    for (int mode = 0; mode < 3; mode++) {
+        for (int f = 0; f < numFrames; f++) {
+            for (unsigned i = 0; i < numChanged; i++) {
+                unsigned node = changed[f * numChanged + i];
+                scene.setRotation(node, RandomRotation(seed));
+            }
+
+            t0 = Clock::now();
+            if (mode == 0) {
+                // every world matrix every frame, as if nothing tracked what changed
+                scene.invalidate();
+                scene.update();
+            }
+            else {
+                scene.update(mode == 2 ? &jobs : NULL);
+            }
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+            if (mode == 0) {
+                fullMs.push_back(ms);
+            }
+            else if (mode == 1) {
+                serialMs.push_back(ms);
+                numUpdated += scene.getNumUpdated();
+            }
+            else {
+                jobMs.push_back(ms);
+            }
+        }
+    }
+
+    // the incremental result should match a full recompute
+    std::vector<glm::mat4> incremental(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        incremental[i] = scene.getWorld(nodes[i]);
+    }
+    scene.invalidate();
+    scene.update();
+    float maxError = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const glm::mat4& full = scene.getWorld(nodes[i]);
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                float e = std::fabs(full[c][r] - incremental[i][c][r]);
+                maxError = e > maxError ? e : maxError;
+            }
+        }
+    }
+
+    unsigned numThreads = jobs.getNumThreads();
+    jobs.stop();
+
+    //
+    // write the results
+    //
+
+    std::ofstream file;
+    std::ostream* out = &std::cout;
+    if (options.outputPath != "-") {
+        file.open(options.outputPath.c_str());
+        if (!file) {
+            std::cerr << "ERROR: Failed to open " << options.outputPath << std::endl;
+            return 1;
+        }
+        out = &file;
+    }
+
+    *out << "{\n";
+    *out << "  \"threads\": " << numThreads << ", \"frames\": " << numFrames << ",\n";
+    *out << "  \"nodes\": " << scene.getNumNodes() << ", \"levels\": " << scene.getNumLevels()
+         << ", \"changed_per_frame\": " << numChanged << ", \"updated_per_frame\": " << (double)numUpdated / numFrames << ",\n";
+    *out << "  \"first_update_ms\": " << firstMs << ",\n";
+    *out << "  ";
+    WriteTimeStats(*out, "full_ms", fullMs);
+    *out << ",\n  ";
+    WriteTimeStats(*out, "incremental_ms", serialMs);
+    *out << ",\n  ";
+    WriteTimeStats(*out, "incremental_jobs_ms", jobMs);
+    *out << ",\n";
+    *out << "  \"speedup\": " << Percentile(fullMs, 0.5) / Percentile(jobMs, 0.5) << ", \"max_error\": " << maxError << "\n";
+    *out << "}\n";
+
+    if (file.is_open()) {
+        std::cout << "Wrote transform benchmark to " << options.outputPath << std::endl;
+    }
+
+    return 0;
+}
+
+//
+// Navigation benchmark
+//
+
+namespace {
+
+float PathLength(const std::vector<glm::vec3>& path)
+{
+    float length = 0;
+    for (size_t i = 1; i < path.size(); i++) {
+        length += glm::length(path[i] - path[i - 1]);
+    }
+    return length;
+}
+
+}
+
+int RunNavBenchmark(const BenchmarkOptions& options)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+
+    const unsigned agentCounts[] = { 250, 500, 1000, 2000, 4000, 8000 };
+    const unsigned numCounts = sizeof(agentCounts) / sizeof(agentCounts[0]);
+    const unsigned numRallyPoints = 4;
+    const float sharedFraction = 0.75f;     // agents heading for a rally point; the rest each go somewhere of their own
+    const double budgetMs = 2.0;            // per frame
+    const unsigned numBaseline = 200;       // queries timed one at a time with plain and hierarchical A*
+
+    std::vector<std::string> levels = options.levels;
+    if (levels.empty()) {
+        std::vector<std::string> names = Game::LoadAssetList("meshes/meshes.txt");
+        for (unsigned i = 0; i < names.size(); i++) {
+            levels.push_back("meshes/" + names[i]);
+        }
+    }
+
+    JobSystem jobs;
+    jobs.start();
+
+    //
+    // the level with the most floor to walk on
+    //
+    std::vector<CollisionMesh> maps(levels.size());
+    jobs.parallelFor(levels.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            OBJMesh mesh;
+            mesh.setDeferUpload(true);
+            if (mesh.load(levels[i]) && maps[i].addMesh(mesh)) {
+                maps[i].build();
+            }
+        }
+    });
+
+    VoxelGrid grid;
+    size_t levelIndex = levels.size();
+    unsigned long long mostWalkable = 0;
+    for (size_t i = 0; i < levels.size(); i++) {
+        if (maps[i].getNumTriangles() > 0 &&
+            grid.build(maps[i], VoxelSettings::ForLevel(maps[i].getMax() - maps[i].getMin()), &jobs) &&
+            grid.getNumWalkable() > mostWalkable) {
+            mostWalkable = grid.getNumWalkable();
+            levelIndex = i;
+        }
+    }
+    if (levelIndex == levels.size()) {
+        std::cerr << "ERROR: None of the levels has a floor to walk on" << std::endl;
+        jobs.stop();
+        return 1;
+    }
+
+    const CollisionMesh& map = maps[levelIndex];
+    grid.build(map, VoxelSettings::ForLevel(map.getMax() - map.getMin()), &jobs);
+
+    Navigation nav;
+    if (!nav.build(grid, &jobs)) {
+        jobs.stop();
+        return 1;
+    }
+    std::cout << "Navigating '" << levels[levelIndex] << "'" << std::endl;
+    nav.printStats();
+
+    //
+    // agents: a start each, and a goal that is one of a few rally points or their own
+    //
+    unsigned seed = 12345;
+    const unsigned maxAgents = agentCounts[numCounts - 1];
+    const unsigned numNodes = nav.getNumNodes();
+    std::vector<glm::vec3> rallyPoints(numRallyPoints);
+    for (unsigned i = 0; i < numRallyPoints; i++) {
+        rallyPoints[i] = nav.getNodePosition((unsigned)(BenchRandom(seed) * numNodes));
+    }
+    std::vector<glm::vec3> starts(maxAgents), goals(maxAgents);
+    for (unsigned i = 0; i < maxAgents; i++) {
+        starts[i] = nav.getNodePosition((unsigned)(BenchRandom(seed) * numNodes));
+        if (BenchRandom(seed) < sharedFraction) {
+            goals[i] = rallyPoints[i % numRallyPoints];
+        }
+        else {
+            goals[i] = nav.getNodePosition((unsigned)(BenchRandom(seed) * numNodes));
+        }
+    }
+
+    //
+    // one query at a time: plain A* over every node against hierarchical A*, and how much longer
+    // the hierarchical paths are
+    //
+    std::vector<glm::vec3> path;
+    std::vector<float> flatLength(numBaseline, -1.0f);
+    Clock::time_point t0 = Clock::now();
+    for (unsigned i = 0; i < numBaseline; i++) {
+        if (nav.findPath(starts[i], goals[i], path, false)) {
+            flatLength[i] = PathLength(path);
+        }
+    }
+    double flatMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+    double lengthRatio = 0;
+    unsigned numCompared = 0;
+    t0 = Clock::now();
+    for (unsigned i = 0; i < numBaseline; i++) {
+        if (nav.findPath(starts[i], goals[i], path) && flatLength[i] > 0) {
+            lengthRatio += PathLength(path) / flatLength[i];
+            ++numCompared;
+        }
+    }
+    double hierarchicalMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+    //
+    // batches of agents: every query answered separately across the workers, then queued and
+    // answered by the time-sliced service with shared flow fields
+    //
+    std::vector<unsigned> counts, frames, found;
+    std::vector<double> separateMs, serviceMs, maxFrameMs;
+    std::vector<unsigned long long> flowQueries, flowFields;
+
+    for (unsigned c = 0; c < numCounts; c++) {
+        const unsigned numAgents = agentCounts[c];
+
+        t0 = Clock::now();
+        jobs.parallelFor(numAgents, 8, [&](size_t begin, size_t end) {
+            std::vector<glm::vec3> agentPath;
+            for (size_t i = begin; i < end; i++) {
+                nav.findPath(starts[i], goals[i], agentPath);
+            }
+        });
+        separateMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+
+        nav.clearFlowFields();
+        unsigned long long flowBefore = nav.getNumFlow();
+        unsigned long long fieldsBefore = nav.getNumFlowFieldsBuilt();
+
+        std::vector<unsigned> tickets(numAgents);
+        double totalMs = 0, maxMs = 0;
+        unsigned numFrames = 0;
+
+        t0 = Clock::now();
+        for (unsigned i = 0; i < numAgents; i++) {
+            tickets[i] = nav.request(starts[i], goals[i]);
+        }
+        totalMs += std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+        unsigned left;
+        do {
+            t0 = Clock::now();
+            left = nav.update(jobs, budgetMs);
+            double ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+            totalMs += ms;
+            maxMs = ms > maxMs ? ms : maxMs;
+            ++numFrames;
+        } while (left > 0);
+
+        unsigned numFound = 0;
+        for (unsigned i = 0; i < numAgents; i++) {
+            if (nav.getResult(tickets[i], path) == NAV_FOUND) {
+                ++numFound;
+            }
+        }
+
+        counts.push_back(numAgents);
+        frames.push_back(numFrames);
+        found.push_back(numFound);
+        serviceMs.push_back(totalMs);
+        maxFrameMs.push_back(maxMs);
+        flowQueries.push_back(nav.getNumFlow() - flowBefore);
+        flowFields.push_back(nav.getNumFlowFieldsBuilt() - fieldsBefore);
+
+        std::cout << numAgents << " agents: " << numAgents * 1000.0 / totalMs << " queries/s over " << numFrames
+                  << " frames (max " << maxMs << " ms), separately " << numAgents * 1000.0 / separateMs.back()
+                  << " queries/s" << std::endl;
+    }
+
+    unsigned numThreads = jobs.getNumThreads();
+    jobs.stop();
+
+    //
+    // write the results
+    //
+
+    std::ofstream file;
+    std::ostream* out = &std::cout;
+    if (options.outputPath != "-") {
+        file.open(options.outputPath.c_str());
+        if (!file) {
+            std::cerr << "ERROR: Failed to open " << options.outputPath << std::endl;
+            return 1;
+        }
+        out = &file;
+    }
+
+    *out << "{\n";
+    *out << "  \"level\": " << JsonString(levels[levelIndex]) << ", \"threads\": " << numThreads << ",\n";
+    *out << "  \"voxels\": [" << grid.getDim(0) << ", " << grid.getDim(1) << ", " << grid.getDim(2) << "], \"voxel_build_ms\": "
+         << grid.getBuildMs() << ",\n";
+    *out << "  \"nodes\": " << nav.getNumNodes() << ", \"clusters\": " << nav.getNumClusters() << ", \"entries\": "
+         << nav.getNumEntries() << ", \"edges\": " << nav.getNumEdges() << ", \"nav_build_ms\": " << nav.getBuildMs() << ",\n";
+    *out << "  \"baseline\": { \"queries\": " << numBaseline
+         << ", \"flat_queries_per_second\": " << numBaseline * 1000.0 / flatMs
+         << ", \"hierarchical_queries_per_second\": " << numBaseline * 1000.0 / hierarchicalMs
+         << ", \"hierarchical_path_length_ratio\": " << (numCompared ? lengthRatio / numCompared : 0.0) << " },\n";
+    *out << "  \"budget_ms\": " << budgetMs << ", \"rally_points\": " << numRallyPoints << ", \"shared_fraction\": " << sharedFraction << ",\n";
+    *out << "  \"scaling\": [\n";
+    for (size_t i = 0; i < counts.size(); i++) {
+        *out << "    { \"agents\": " << counts[i]
+             << ", \"found\": " << found[i]
+             << ", \"frames\": " << frames[i]
+             << ", \"max_frame_ms\": " << maxFrameMs[i]
+             << ", \"queries_per_second\": " << counts[i] * 1000.0 / serviceMs[i]
+             << ", \"separate_queries_per_second\": " << counts[i] * 1000.0 / separateMs[i]
+             << ", \"flow_field_queries\": " << flowQueries[i]
+             << ", \"flow_fields\": " << flowFields[i] << " }" << (i + 1 < counts.size() ? "," : "") << "\n";
+    }
+    *out << "  ]\n";
+    *out << "}\n";
+
+    if (file.is_open()) {
+        std::cout << "Wrote navigation benchmark to " << options.outputPath << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include "GLSH.h"
+
+#include <string>
+#include <vector>
+
+class Game;
+
+//
+// Camera script, one keyframe per line:
+//
+//   frames  px py pz  tx ty tz  [yawRate pitchRate [world]]
+//
+// The camera moves linearly from the previous keyframe's pose to position p looking at
+// target t over 'frames' frames, while the mesh spins at the given rates (radians per second).
+// Lines starting with '#' are comments.  Game::startRecording writes this format, one frame per line.
+//
+struct CameraKey {
+    int                     frames;
+    glm::vec3               position;
+    glm::vec3               target;
+    float                   yawRate;
+    float                   pitchRate;
+    bool                    worldSpace;
+
+    CameraKey();
+};
+
+class CameraScript {
+
+    std::vector<CameraKey>  mKeys;
+
+public:
+    bool                    load(const std::string& path);
+
+    // slow orbit around the origin, used when no script is given
+    void                    makeOrbit(int frames, float radius, float height);
+
+    // total number of frames
+    int                     getNumFrames() const;
+
+    // camera pose and mesh rotation rates at a frame
+    CameraKey               evaluate(int frame) const;
+};
+
+struct BenchmarkOptions {
+    std::string             scriptPath;     // camera script (empty for the default orbit)
+    std::string             outputPath;     // JSON results ('-' for stdout)
+    int                     width;
+    int                     height;
+    int                     warmupFrames;   // frames per mesh that are drawn but not measured
+    float                   timeStep;       // simulated seconds per frame
+    std::vector<std::string> levels;        // OBJ levels for the navigation benchmark (empty for meshes.txt)
+
+    BenchmarkOptions();
+};
+
+//
+// Run the game without a window: creates an offscreen GL context (a hidden window on Windows,
+// a surfaceless EGL display elsewhere, so Mesa's llvmpipe works with LIBGL_ALWAYS_SOFTWARE=1),
+// replays the camera script once for every mesh in meshes.txt and writes per-frame CPU and
+// GPU times, p50/p99, draw/triangle/point light counts and an input-to-present latency
+// histogram as JSON.
+//
+// Returns the process exit code.
+//
+int RunBenchmark(Game& game, const BenchmarkOptions& options);
+
+//
+// Measure the job system: the cost of an empty job, parallelFor against a serial loop and
+// against a thread per range, the latency of a chain of dependent jobs and a recursive
+// fan-out that only finishes quickly if the workers steal.  Writes JSON to options.outputPath.
+//
+int RunJobBenchmark(const BenchmarkOptions& options);
+
+//
+// Measure TransformHierarchy::update on a 100K-node tree where 1% of the nodes change each
+// frame: recomputing every node against the dirty subtrees only, on one thread and on the job
+// system, and check the incremental matrices against a full recompute.  Writes JSON to
+// options.outputPath.
+//
+int RunTransformBenchmark(const BenchmarkOptions& options);
+
+//
+// Measure Navigation on the level with the most walkable floor: single queries with plain A*
+// against hierarchical A* (and how much longer its paths are), then batches of 250 to 8000
+// agents, most heading for a few rally points, answered separately across the workers and by
+// the time-sliced service with shared flow fields.  Writes queries per second to
+// options.outputPath.
+//
+int RunNavBenchmark(const BenchmarkOptions& options);
+
+#endif
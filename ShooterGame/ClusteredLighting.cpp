@@ -0,0 +1,380 @@
+#include "ClusteredLighting.h"
+#include "GLDebug.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include <xmmintrin.h>
+
+namespace {
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// bigger lights first, for dropping the smallest when there are too many
+bool LargerRadius(const PointLight* a, const PointLight* b)
+{
+    return a->radius > b->radius;
+}
+
+// a point of the ray through an NDC (x, y), at a view depth
+glm::vec3 PointAtDepth(const glm::mat4& invProj, float x, float y, float depth)
+{
+    glm::vec4 a = invProj * glm::vec4(x, y, -1.0f, 1.0f);     // on the near plane
+    glm::vec4 b = invProj * glm::vec4(x, y, 1.0f, 1.0f);      // on the far plane
+    glm::vec3 nearPoint = glm::vec3(a) / a.w;
+    glm::vec3 farPoint = glm::vec3(b) / b.w;
+
+    float t = (-depth - nearPoint.z) / (farPoint.z - nearPoint.z);
+    return nearPoint + t * (farPoint - nearPoint);
+}
+
+}
+
+ClusteredLighting::ClusteredLighting()
+    : mHaveBoxes(false)
+    , mNear(0.1f)
+    , mFar(1000.0f)
+    , mLogSlices(true)
+    , mSliceScale(0)
+    , mSliceBias(0)
+    , mViewportWidth(1)
+    , mViewportHeight(1)
+    , mNumFrames(0)
+    , mTotalLights(0)
+    , mTotalIndices(0)
+    , mTotalOccupied(0)
+    , mMaxPerCluster(0)
+    , mNumDropped(0)
+    , mAssignMs(0)
+{
+    for (int i = 0; i < 3; i++) {
+        mBuffers[i] = 0;
+        mTextures[i] = 0;
+    }
+}
+
+ClusteredLighting::~ClusteredLighting()
+{
+    shutdown();
+}
+
+bool ClusteredLighting::initialize()
+{
+    mMinX.resize(NUM_CLUSTERS);
+    mMinY.resize(NUM_CLUSTERS);
+    mMinZ.resize(NUM_CLUSTERS);
+    mMaxX.resize(NUM_CLUSTERS);
+    mMaxY.resize(NUM_CLUSTERS);
+    mMaxZ.resize(NUM_CLUSTERS);
+    mHaveBoxes = false;
+
+    mSlots.resize((size_t)NUM_CLUSTERS * MAX_LIGHTS_PER_CLUSTER);
+    mCounts.resize(NUM_CLUSTERS);
+    mGrid.resize(2 * NUM_CLUSTERS);
+
+    // texel formats of the lights, the grid and the indices
+    static const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R16UI };
+
+    glGenBuffers(3, mBuffers);
+    glGenTextures(3, mTextures);
+    for (int i = 0; i < 3; i++) {
+        glBindBuffer(GL_TEXTURE_BUFFER, mBuffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);     // never empty
+        glBindTexture(GL_TEXTURE_BUFFER, mTextures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, formats[i], mBuffers[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    GL_DEBUG_CHECK("creating the light buffers");
+
+    return true;
+}
+
+void ClusteredLighting::shutdown()
+{
+    if (mTextures[0]) {
+        glDeleteTextures(3, mTextures);
+        glDeleteBuffers(3, mBuffers);
+        for (int i = 0; i < 3; i++) {
+            mBuffers[i] = 0;
+            mTextures[i] = 0;
+        }
+    }
+    mHaveBoxes = false;
+}
+
+void ClusteredLighting::setViewportSize(int w, int h)
+{
+    mViewportWidth = w > 0 ? w : 1;
+    mViewportHeight = h > 0 ? h : 1;
+}
+
+float ClusteredLighting::getSlice(float depth) const
+{
+    if (mLogSlices) {
+        return std::log(depth > 1e-6f ? depth : 1e-6f) * mSliceScale + mSliceBias;
+    }
+    return depth * mSliceScale + mSliceBias;
+}
+
+void ClusteredLighting::buildClusters(const glm::mat4& projMatrix)
+{
+    mProjMatrix = projMatrix;
+    mHaveBoxes = true;
+
+    // near and far distances from the projection
+    const glm::mat4& P = projMatrix;
+    mLogSlices = P[3][3] == 0;
+    if (mLogSlices) {
+        mNear = P[3][2] / (P[2][2] - 1.0f);
+        mFar = P[3][2] / (P[2][2] + 1.0f);
+    }
+    else {
+        mNear = (P[3][2] + 1.0f) / P[2][2];
+        mFar = (P[3][2] - 1.0f) / P[2][2];
+    }
+    if (mLogSlices && !(mNear > 0)) {
+        mNear = 0.01f;
+    }
+    if (!(mFar > mNear)) {
+        mFar = mNear + 1000.0f;
+    }
+
+    // slice boundaries, exponential so each cluster is about as deep as it is wide
+    float sliceDepth[SLICES + 1];
+    for (int s = 0; s <= SLICES; s++) {
+        float t = (float)s / SLICES;
+        sliceDepth[s] = mLogSlices ? mNear * std::pow(mFar / mNear, t) : mNear + (mFar - mNear) * t;
+    }
+    if (mLogSlices) {
+        mSliceScale = SLICES / std::log(mFar / mNear);
+        mSliceBias = -std::log(mNear) * mSliceScale;
+    }
+    else {
+        mSliceScale = SLICES / (mFar - mNear);
+        mSliceBias = -mNear * mSliceScale;
+    }
+
+    // each box bounds the tile's four corner rays between the slice's depths
+    glm::mat4 invProj = glm::inverse(projMatrix);
+    for (int s = 0; s < SLICES; s++) {
+        for (int y = 0; y < TILES_Y; y++) {
+            for (int x = 0; x < TILES_X; x++) {
+                glm::vec3 lo(1e30f);
+                glm::vec3 hi(-1e30f);
+                for (int corner = 0; corner < 8; corner++) {
+                    float ndcX = -1.0f + 2.0f * (x + (corner & 1)) / TILES_X;
+                    float ndcY = -1.0f + 2.0f * (y + ((corner >> 1) & 1)) / TILES_Y;
+                    glm::vec3 p = PointAtDepth(invProj, ndcX, ndcY, sliceDepth[s + (corner >> 2)]);
+                    lo = glm::vec3(p.x < lo.x ? p.x : lo.x, p.y < lo.y ? p.y : lo.y, p.z < lo.z ? p.z : lo.z);
+                    hi = glm::vec3(p.x > hi.x ? p.x : hi.x, p.y > hi.y ? p.y : hi.y, p.z > hi.z ? p.z : hi.z);
+                }
+
+                int c = (s * TILES_Y + y) * TILES_X + x;
+                mMinX[c] = lo.x;
+                mMinY[c] = lo.y;
+                mMinZ[c] = lo.z;
+                mMaxX[c] = hi.x;
+                mMaxY[c] = hi.y;
+                mMaxZ[c] = hi.z;
+            }
+        }
+    }
+}
+
+void ClusteredLighting::update(const std::vector<PointLight>& lights, const glm::mat4& viewMatrix,
+                               const glm::mat4& projMatrix, JobSystem& jobs)
+{
+    Clock::time_point t0 = Clock::now();
+
+    if (!mHaveBoxes || std::memcmp(&projMatrix[0][0], &mProjMatrix[0][0], sizeof(glm::mat4)) != 0) {
+        buildClusters(projMatrix);
+    }
+
+    // the lights that reach between the near and far planes
+    std::vector<const PointLight*> visible;
+    visible.reserve(lights.size());
+    for (size_t i = 0; i < lights.size(); i++) {
+        float depth = -(viewMatrix * glm::vec4(lights[i].position, 1.0f)).z;
+        if (lights[i].radius > 0 && depth + lights[i].radius > mNear && depth - lights[i].radius < mFar) {
+            visible.push_back(&lights[i]);
+        }
+    }
+    if (visible.size() > MAX_LIGHTS) {
+        std::nth_element(visible.begin(), visible.begin() + MAX_LIGHTS, visible.end(), LargerRadius);
+        mNumDropped += visible.size() - MAX_LIGHTS;
+        visible.resize(MAX_LIGHTS);
+    }
+
+    mViewLights.resize(visible.size());
+    mLightData.resize(8 * (visible.size() > 0 ? visible.size() : 1), 0.0f);
+    for (size_t i = 0; i < visible.size(); i++) {
+        const PointLight& light = *visible[i];
+        ViewLight& vl = mViewLights[i];
+        vl.position = glm::vec3(viewMatrix * glm::vec4(light.position, 1.0f));
+        vl.radius = light.radius;
+
+        float depth = -vl.position.z;
+        float first = getSlice(depth - vl.radius > mNear ? depth - vl.radius : mNear);
+        float last = getSlice(depth + vl.radius < mFar ? depth + vl.radius : mFar);
+        vl.firstSlice = first > 0 ? (int)first : 0;
+        vl.lastSlice = last < SLICES - 1 ? (int)last : SLICES - 1;
+
+        float* texels = &mLightData[8 * i];
+        texels[0] = vl.position.x;
+        texels[1] = vl.position.y;
+        texels[2] = vl.position.z;
+        texels[3] = vl.radius;
+        texels[4] = light.color.r;
+        texels[5] = light.color.g;
+        texels[6] = light.color.b;
+        texels[7] = 0;
+    }
+
+    // each slice's clusters are written by one thread only
+    std::fill(mCounts.begin(), mCounts.end(), 0u);
+    if (!mViewLights.empty()) {
+        jobs.parallelFor(SLICES, 1, [this](size_t begin, size_t end) {
+            for (size_t s = begin; s < end; s++) {
+                assignSlice((int)s);
+            }
+        });
+    }
+
+    // compact the lists, clusters in order
+    mIndices.clear();
+    unsigned occupied = 0;
+    for (unsigned c = 0; c < NUM_CLUSTERS; c++) {
+        unsigned count = mCounts[c];
+        mGrid[2 * c] = (unsigned)mIndices.size();
+        mGrid[2 * c + 1] = count;
+        if (count) {
+            const unsigned short* slots = &mSlots[(size_t)c * MAX_LIGHTS_PER_CLUSTER];
+            mIndices.insert(mIndices.end(), slots, slots + count);
+            ++occupied;
+            if (count > mMaxPerCluster) {
+                mMaxPerCluster = count;
+            }
+        }
+    }
+
+    ++mNumFrames;
+    mTotalLights += mViewLights.size();
+    mTotalIndices += mIndices.size();
+    mTotalOccupied += occupied;
+    mAssignMs += std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+    if (mIndices.empty()) {
+        mIndices.push_back(0);      // a buffer texture needs some storage
+    }
+
+    // replace the buffers' storage, so the GL doesn't wait for last frame's draws
+    const GLsizeiptr sizes[3] = {
+        (GLsizeiptr)(mLightData.size() * sizeof(float)),
+        (GLsizeiptr)(mGrid.size() * sizeof(unsigned)),
+        (GLsizeiptr)(mIndices.size() * sizeof(unsigned short))
+    };
+    const void* data[3] = { &mLightData[0], &mGrid[0], &mIndices[0] };
+    for (int i = 0; i < 3; i++) {
+        glBindBuffer(GL_TEXTURE_BUFFER, mBuffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, sizes[i], data[i], GL_STREAM_DRAW);
+        GL_DEBUG_STATE(1);
+        GL_DEBUG_UPLOAD(sizes[i]);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    GL_DEBUG_STATE(1);
+}
+
+void ClusteredLighting::assignSlice(int slice)
+{
+    const int base = slice * CLUSTERS_PER_SLICE;
+    unsigned dropped = 0;
+
+    for (size_t i = 0; i < mViewLights.size(); i++) {
+        const ViewLight& light = mViewLights[i];
+        if (slice < light.firstSlice || slice > light.lastSlice) {
+            continue;
+        }
+
+        const __m128 cx = _mm_set1_ps(light.position.x);
+        const __m128 cy = _mm_set1_ps(light.position.y);
+        const __m128 cz = _mm_set1_ps(light.position.z);
+        const __m128 r2 = _mm_set1_ps(light.radius * light.radius);
+        const __m128 zero = _mm_setzero_ps();
+
+        // squared distance from the center to each box: per axis, how far it's outside
+        for (int c = base; c < base + CLUSTERS_PER_SLICE; c += 4) {
+            __m128 dx = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&mMinX[c]), cx), zero),
+                                   _mm_max_ps(_mm_sub_ps(cx, _mm_loadu_ps(&mMaxX[c])), zero));
+            __m128 dy = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&mMinY[c]), cy), zero),
+                                   _mm_max_ps(_mm_sub_ps(cy, _mm_loadu_ps(&mMaxY[c])), zero));
+            __m128 dz = _mm_add_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&mMinZ[c]), cz), zero),
+                                   _mm_max_ps(_mm_sub_ps(cz, _mm_loadu_ps(&mMaxZ[c])), zero));
+            __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+            int hits = _mm_movemask_ps(_mm_cmple_ps(d2, r2));
+            while (hits) {
+                int lane = 0;
+                while (!(hits & (1 << lane))) {
+                    ++lane;
+                }
+                hits &= ~(1 << lane);
+
+                unsigned& count = mCounts[c + lane];
+                if (count < MAX_LIGHTS_PER_CLUSTER) {
+                    mSlots[(size_t)(c + lane) * MAX_LIGHTS_PER_CLUSTER + count++] = (unsigned short)i;
+                }
+                else {
+                    ++dropped;
+                }
+            }
+        }
+    }
+
+    if (dropped) {
+        mNumDropped += dropped;
+    }
+}
+
+void ClusteredLighting::bind() const
+{
+    for (int i = 0; i < 3; i++) {
+        glActiveTexture(GL_TEXTURE0 + FIRST_TEXTURE_UNIT + i);
+        glBindTexture(GL_TEXTURE_BUFFER, mTextures[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    GL_DEBUG_STATE(7);
+}
+
+void ClusteredLighting::setUniforms() const
+{
+    glsh::SetShaderUniform("u_Lights", (int)FIRST_TEXTURE_UNIT);
+    glsh::SetShaderUniform("u_ClusterLights", (int)FIRST_TEXTURE_UNIT + 1);
+    glsh::SetShaderUniform("u_LightIndices", (int)FIRST_TEXTURE_UNIT + 2);
+
+    // pixels to tiles, and the grid size
+    glsh::SetShaderUniform("u_ClusterGrid", glm::vec4((float)TILES_X / mViewportWidth, (float)TILES_Y / mViewportHeight,
+                                                      (float)TILES_X, (float)TILES_Y));
+    // view depth to slice
+    glsh::SetShaderUniform("u_ClusterSlices", glm::vec4((float)SLICES, mSliceScale, mSliceBias, mLogSlices ? 1.0f : 0.0f));
+
+    GL_DEBUG_CALLS(10);
+}
+
+void ClusteredLighting::printStats() const
+{
+    if (!mNumFrames) {
+        return;
+    }
+
+    double lights = (double)mTotalLights / mNumFrames;
+    double occupied = (double)mTotalOccupied / mNumFrames;
+    std::cout << "Clustered lighting: " << lights << " lights per frame, in " << occupied << " of " << NUM_CLUSTERS
+              << " clusters, " << (occupied > 0 ? (double)mTotalIndices / mNumFrames / occupied : 0)
+              << " per occupied cluster (at most " << mMaxPerCluster << "), " << mNumDropped.load() << " dropped; "
+              << mAssignMs / mNumFrames << " ms to assign" << std::endl;
+}
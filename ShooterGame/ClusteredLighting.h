@@ -0,0 +1,141 @@
+#ifndef CLUSTEREDLIGHTING_H_
+#define CLUSTEREDLIGHTING_H_
+
+#include "GLSH.h"
+#include "JobSystem.h"
+
+#include <atomic>
+#include <vector>
+
+// a light that fades out to nothing at its radius
+struct PointLight {
+    glm::vec3               position;       // world space
+    float                   radius;
+    glm::vec3               color;          // premultiplied by the intensity
+
+    PointLight()
+        : radius(0)
+    {
+    }
+
+    PointLight(const glm::vec3& pos, float r, const glm::vec3& c)
+        : position(pos)
+        , radius(r)
+        , color(c)
+    {
+    }
+};
+
+//
+// Clustered forward lighting.
+//
+// The view frustum is cut into TILES_X x TILES_Y screen tiles and SLICES depth slices, spaced
+// exponentially with a perspective projection so the clusters stay roughly cube-shaped.  Each
+// frame the lights are assigned to the clusters they touch on the CPU: the slices are split
+// among the worker threads, and each tests a light's sphere against four cluster boxes at a time
+// with SSE.  The result is compacted into one index list with an (offset, count) pair per
+// cluster and uploaded to texture buffers, along with the lights in view space.
+//
+// The clustered shaders find the cluster of each fragment from gl_FragCoord and the view depth
+// and loop over its lights only, so a pixel costs about the same whether a thousand lights are
+// alive or ten, as long as few of them reach it.
+//
+class ClusteredLighting {
+
+public:
+    enum {
+        TILES_X = 16,
+        TILES_Y = 9,
+        SLICES = 24,
+        CLUSTERS_PER_SLICE = TILES_X * TILES_Y,
+        NUM_CLUSTERS = CLUSTERS_PER_SLICE * SLICES,
+
+        MAX_LIGHTS = 1024,                  // the rest are dropped, smallest first
+        MAX_LIGHTS_PER_CLUSTER = 128,       // ditto, in the order they were given
+
+        FIRST_TEXTURE_UNIT = 1              // units 1-3; materials use unit 0
+    };
+
+private:
+    // cluster boxes in view space, a slice at a time, x then y within a slice (SoA for SSE)
+    std::vector<float>      mMinX, mMinY, mMinZ;
+    std::vector<float>      mMaxX, mMaxY, mMaxZ;
+
+    // what the boxes were built for
+    glm::mat4               mProjMatrix;
+    bool                    mHaveBoxes;
+
+    // view depth -> slice: slice = f(depth) * mSliceScale + mSliceBias, f = log for perspective
+    float                   mNear;
+    float                   mFar;
+    bool                    mLogSlices;
+    float                   mSliceScale;
+    float                   mSliceBias;
+
+    // this frame's lights in view space, and the slices each one spans
+    struct ViewLight {
+        glm::vec3           position;
+        float               radius;
+        int                 firstSlice;
+        int                 lastSlice;
+    };
+    std::vector<ViewLight>  mViewLights;
+    std::vector<float>      mLightData;     // 2 RGBA texels per light: view position + radius, color
+
+    // per-cluster light lists, filled in parallel into fixed slots, then compacted
+    std::vector<unsigned short> mSlots;     // MAX_LIGHTS_PER_CLUSTER per cluster
+    std::vector<unsigned>   mCounts;
+    std::vector<unsigned>   mGrid;          // (offset, count) per cluster
+    std::vector<unsigned short> mIndices;
+
+    // texture buffers: lights, grid and indices
+    GLuint                  mBuffers[3];
+    GLuint                  mTextures[3];
+
+    int                     mViewportWidth;
+    int                     mViewportHeight;
+
+    // stats
+    unsigned long long      mNumFrames;
+    unsigned long long      mTotalLights;
+    unsigned long long      mTotalIndices;
+    unsigned long long      mTotalOccupied; // clusters with at least one light
+    unsigned                mMaxPerCluster;
+    std::atomic<unsigned long long> mNumDropped;    // over MAX_LIGHTS or MAX_LIGHTS_PER_CLUSTER
+    double                  mAssignMs;
+
+    void                    buildClusters(const glm::mat4& projMatrix);
+
+    // slice of a view depth (not clamped)
+    float                   getSlice(float depth) const;
+
+    void                    assignSlice(int slice);
+
+    ClusteredLighting(const ClusteredLighting&);    // not copyable
+    ClusteredLighting& operator=(const ClusteredLighting&);
+
+public:
+    ClusteredLighting();
+    ~ClusteredLighting();
+
+    bool                    initialize();
+    void                    shutdown();
+
+    void                    setViewportSize(int w, int h);
+
+    // assign the lights to clusters and upload the lists, once per frame before drawing
+    void                    update(const std::vector<PointLight>& lights, const glm::mat4& viewMatrix,
+                                   const glm::mat4& projMatrix, JobSystem& jobs);
+
+    // bind the texture buffers, on FIRST_TEXTURE_UNIT and up
+    void                    bind() const;
+
+    // samplers and cluster layout for the program in use
+    void                    setUniforms() const;
+
+    unsigned                getNumLights() const        { return (unsigned)mViewLights.size(); }
+
+    void                    printStats() const;
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include "CollisionMesh.h"
+
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+CollisionMesh::CollisionMesh()
+{
+    clear();
+}
+
+void CollisionMesh::clear()
+{
+    mVertices.clear();
+    mIndices.clear();
+    mCellStart.clear();
+    mCellTris.clear();
+    mMin = glm::vec3(0.0f);
+    mMax = glm::vec3(0.0f);
+    mCellSize = glm::vec3(1.0f);
+    mDims[0] = mDims[1] = mDims[2] = 0;
+}
+
+bool CollisionMesh::addMesh(const OBJMesh& mesh, const glm::mat4& transform)
+{
+    if (mesh.mPendingChunks.size() != mesh.mChunks.size() || mesh.mPendingChunks.empty()) {
+        std::cerr << "ERROR: Collision meshes need the CPU copy of a mesh loaded with deferred upload" << std::endl;
+        return false;
+    }
+    if (mesh.mPositionOffset != 0 || mesh.mPositionSize != 3) {
+        std::cerr << "ERROR: Collision meshes need positions at the start of each vertex" << std::endl;
+        return false;
+    }
+
+    const size_t floatsPerVertex = mesh.mStride / sizeof(GLfloat);
+
+    for (size_t c = 0; c < mesh.mPendingChunks.size(); c++) {
+        const OBJPendingChunk& chunk = mesh.mPendingChunks[c];
+        unsigned base = (unsigned)mVertices.size();
+
+        size_t numVertices = chunk.vertexData.size() / floatsPerVertex;
+        for (size_t i = 0; i < numVertices; i++) {
+            const GLfloat* p = &chunk.vertexData[i * floatsPerVertex];
+            mVertices.push_back(glm::vec3(transform * glm::vec4(p[0], p[1], p[2], 1.0f)));
+        }
+        for (size_t i = 0; i < chunk.indices.size(); i++) {
+            mIndices.push_back(base + chunk.indices[i]);
+        }
+    }
+
+    return true;
+}
+
+void CollisionMesh::build(unsigned trianglesPerCell)
+{
+    mCellStart.clear();
+    mCellTris.clear();
+
+    unsigned numTris = getNumTriangles();
+    if (numTris == 0) {
+        mDims[0] = mDims[1] = mDims[2] = 0;
+        return;
+    }
+
+    mMin = mMax = mVertices[0];
+    for (size_t i = 1; i < mVertices.size(); i++) {
+        mMin = glm::min(mMin, mVertices[i]);
+        mMax = glm::max(mMax, mVertices[i]);
+    }
+
+    // pad flat boxes, so every cell has some volume
+    glm::vec3 extent = mMax - mMin;
+    float pad = 1e-3f * (extent.x + extent.y + extent.z) + 1e-6f;
+    mMin -= glm::vec3(pad);
+    mMax += glm::vec3(pad);
+    extent = mMax - mMin;
+
+    // cube-ish cells, about trianglesPerCell triangles each
+    float numCells = (float)numTris / (trianglesPerCell > 0 ? trianglesPerCell : 1);
+    float cellSize = std::pow(extent.x * extent.y * extent.z / numCells, 1.0f / 3.0f);
+    for (int a = 0; a < 3; a++) {
+        int n = (int)(extent[a] / cellSize + 0.5f);
+        mDims[a] = n < 1 ? 1 : (n > 256 ? 256 : n);
+        mCellSize[a] = extent[a] / mDims[a];
+    }
+
+    size_t totalCells = (size_t)mDims[0] * mDims[1] * mDims[2];
+
+    // count, then fill: each triangle goes into every cell its bounding box touches
+    std::vector<int> triCells(numTris * 6);
+    std::vector<unsigned> counts(totalCells + 1, 0);
+    for (unsigned t = 0; t < numTris; t++) {
+        const glm::vec3& a = mVertices[mIndices[3 * t + 0]];
+        const glm::vec3& b = mVertices[mIndices[3 * t + 1]];
+        const glm::vec3& c = mVertices[mIndices[3 * t + 2]];
+        glm::vec3 lo = (glm::min(a, glm::min(b, c)) - mMin) / mCellSize;
+        glm::vec3 hi = (glm::max(a, glm::max(b, c)) - mMin) / mCellSize;
+
+        int* range = &triCells[6 * t];
+        for (int k = 0; k < 3; k++) {
+            int l = (int)lo[k];
+            int h = (int)hi[k];
+            range[k] = l < 0 ? 0 : (l >= mDims[k] ? mDims[k] - 1 : l);
+            range[3 + k] = h < 0 ? 0 : (h >= mDims[k] ? mDims[k] - 1 : h);
+        }
+        for (int z = range[2]; z <= range[5]; z++)
+            for (int y = range[1]; y <= range[4]; y++)
+                for (int x = range[0]; x <= range[3]; x++)
+                    ++counts[cellIndex(x, y, z)];
+    }
+
+    mCellStart.resize(totalCells + 1);
+    unsigned sum = 0;
+    for (size_t i = 0; i < totalCells; i++) {
+        mCellStart[i] = sum;
+        sum += counts[i];
+        counts[i] = mCellStart[i];     // fill position
+    }
+    mCellStart[totalCells] = sum;
+
+    mCellTris.resize(sum);
+    for (unsigned t = 0; t < numTris; t++) {
+        const int* range = &triCells[6 * t];
+        for (int z = range[2]; z <= range[5]; z++)
+            for (int y = range[1]; y <= range[4]; y++)
+                for (int x = range[0]; x <= range[3]; x++)
+                    mCellTris[counts[cellIndex(x, y, z)]++] = t;
+    }
+}
+
+//
+// Moller-Trumbore
+//
+bool CollisionMesh::intersect(unsigned tri, const glm::vec3& origin, const glm::vec3& dir, float maxT, RayHit& hit) const
+{
+    const glm::vec3& a = mVertices[mIndices[3 * tri + 0]];
+    const glm::vec3& b = mVertices[mIndices[3 * tri + 1]];
+    const glm::vec3& c = mVertices[mIndices[3 * tri + 2]];
+
+    glm::vec3 e1 = b - a;
+    glm::vec3 e2 = c - a;
+    glm::vec3 p = glm::cross(dir, e2);
+    float det = glm::dot(e1, p);
+    if (std::fabs(det) < 1e-12f) {
+        return false;   // parallel
+    }
+
+    float invDet = 1.0f / det;
+    glm::vec3 s = origin - a;
+    float u = glm::dot(s, p) * invDet;
+    if (u < 0 || u > 1) {
+        return false;
+    }
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(dir, q) * invDet;
+    if (v < 0 || u + v > 1) {
+        return false;
+    }
+    float t = glm::dot(e2, q) * invDet;
+    if (t < 0 || t >= maxT) {
+        return false;
+    }
+
+    glm::vec3 n = glm::normalize(glm::cross(e1, e2));
+    hit.t = t;
+    hit.triangle = tri;
+    hit.point = origin + t * dir;
+    hit.normal = glm::dot(n, dir) > 0 ? -n : n;
+    return true;
+}
+
+bool CollisionMesh::raycast(const glm::vec3& origin, const glm::vec3& dir, float maxT, RayHit& hit) const
+{
+    if (mCellStart.empty()) {
+        return false;
+    }
+
+    // clip the ray to the grid
+    float t0 = 0;
+    float t1 = maxT;
+    for (int a = 0; a < 3; a++) {
+        if (std::fabs(dir[a]) < 1e-12f) {
+            if (origin[a] < mMin[a] || origin[a] > mMax[a]) {
+                return false;
+            }
+            continue;
+        }
+        float inv = 1.0f / dir[a];
+        float tNear = (mMin[a] - origin[a]) * inv;
+        float tFar = (mMax[a] - origin[a]) * inv;
+        if (tNear > tFar) {
+            float tmp = tNear;
+            tNear = tFar;
+            tFar = tmp;
+        }
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar < t1 ? tFar : t1;
+        if (t0 > t1) {
+            return false;
+        }
+    }
+
+    // the cell where the ray enters, and how far it goes to cross each cell
+    glm::vec3 start = origin + t0 * dir;
+    int cell[3];
+    int step[3];
+    float tMax[3];
+    float tDelta[3];
+    for (int a = 0; a < 3; a++) {
+        int c = (int)((start[a] - mMin[a]) / mCellSize[a]);
+        cell[a] = c < 0 ? 0 : (c >= mDims[a] ? mDims[a] - 1 : c);
+
+        if (dir[a] > 0) {
+            step[a] = 1;
+            tMax[a] = t0 + ((mMin[a] + (cell[a] + 1) * mCellSize[a]) - start[a]) / dir[a];
+            tDelta[a] = mCellSize[a] / dir[a];
+        }
+        else if (dir[a] < 0) {
+            step[a] = -1;
+            tMax[a] = t0 + ((mMin[a] + cell[a] * mCellSize[a]) - start[a]) / dir[a];
+            tDelta[a] = -mCellSize[a] / dir[a];
+        }
+        else {
+            step[a] = 0;
+            tMax[a] = std::numeric_limits<float>::max();
+            tDelta[a] = std::numeric_limits<float>::max();
+        }
+    }
+
+    bool found = false;
+    float best = maxT;
+
+    for (;;) {
+        int c = cellIndex(cell[0], cell[1], cell[2]);
+        for (unsigned i = mCellStart[c]; i < mCellStart[c + 1]; i++) {
+            RayHit h;
+            if (intersect(mCellTris[i], origin, dir, best, h)) {
+                hit = h;
+                best = h.t;
+                found = true;
+            }
+        }
+
+        // step to the next cell along the axis whose boundary is closest
+        int a = tMax[0] < tMax[1] ? (tMax[0] < tMax[2] ? 0 : 2) : (tMax[1] < tMax[2] ? 1 : 2);
+
+        // a hit closer than the next cell can't be beaten
+        if (found && best <= tMax[a]) {
+            break;
+        }
+        if (tMax[a] > t1) {
+            break;
+        }
+
+        cell[a] += step[a];
+        if (cell[a] < 0 || cell[a] >= mDims[a]) {
+            break;
+        }
+        tMax[a] += tDelta[a];
+    }
+
+    return found;
+}
+
+unsigned long long CollisionMesh::getBytes() const
+{
+    return mVertices.capacity() * sizeof(glm::vec3) +
+           (mIndices.capacity() + mCellStart.capacity() + mCellTris.capacity()) * sizeof(unsigned);
+}
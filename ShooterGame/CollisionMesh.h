@@ -0,0 +1,63 @@
+#ifndef COLLISIONMESH_H_
+#define COLLISIONMESH_H_
+
+#include "Wavefront.h"
+
+#include <vector>
+
+struct RayHit {
+    float                   t;              // distance along the ray (the direction is normalized)
+    unsigned                triangle;
+    glm::vec3               point;
+    glm::vec3               normal;         // unit face normal, facing the ray origin
+};
+
+//
+// Triangles for collision queries, with no GL objects.
+//
+// The triangles are bucketed in a uniform grid that holds a few triangles per cell, and
+// rays walk the grid cell by cell (Amanatides & Woo), so a ray only tests the triangles
+// near it.
+//
+class CollisionMesh {
+
+    std::vector<glm::vec3>  mVertices;
+    std::vector<unsigned>   mIndices;
+
+    glm::vec3               mMin;
+    glm::vec3               mMax;
+    glm::vec3               mCellSize;
+    int                     mDims[3];
+    std::vector<unsigned>   mCellStart;     // triangles of cell c are mCellTris[mCellStart[c] .. mCellStart[c + 1])
+    std::vector<unsigned>   mCellTris;
+
+    bool                    intersect(unsigned tri, const glm::vec3& origin, const glm::vec3& dir, float maxT, RayHit& hit) const;
+
+    int                     cellIndex(int x, int y, int z) const { return (z * mDims[1] + y) * mDims[0] + x; }
+
+public:
+    CollisionMesh();
+
+    // the triangles kept in RAM by a mesh that was loaded with OBJMesh::setDeferUpload(true)
+    // (positions must be the first attribute of each vertex)
+    bool                    addMesh(const OBJMesh& mesh, const glm::mat4& transform = glm::mat4(1.0f));
+
+    // bucket the triangles; call after adding meshes and before any queries
+    void                    build(unsigned trianglesPerCell = 4);
+
+    void                    clear();
+
+    // closest hit within maxT, 'dir' must be normalized
+    bool                    raycast(const glm::vec3& origin, const glm::vec3& dir, float maxT, RayHit& hit) const;
+
+    unsigned                getNumTriangles() const     { return (unsigned)(mIndices.size() / 3); }
+    const std::vector<glm::vec3>& getVertices() const   { return mVertices; }
+    const std::vector<unsigned>& getIndices() const     { return mIndices; }
+    unsigned                getNumCells() const         { return (unsigned)(mCellStart.empty() ? 0 : mCellStart.size() - 1); }
+    const glm::vec3&        getMin() const              { return mMin; }
+    const glm::vec3&        getMax() const              { return mMax; }
+
+    unsigned long long      getBytes() const;
+};
+
+#endif
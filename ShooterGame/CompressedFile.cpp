@@ -0,0 +1,404 @@
+#include "CompressedFile.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#ifdef SHOOTER_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef SHOOTER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+const size_t CompressedFile::BUFFER_SIZE = 1 << 20;
+const unsigned CompressedFile::NUM_BUFFERS = 4;
+
+namespace {
+
+const size_t INPUT_SIZE = 256 << 10;        // compressed bytes read at a time
+
+typedef std::chrono::high_resolution_clock Clock;
+
+double MsSince(Clock::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+}
+
+bool EndsWith(const std::string& str, const char* suffix)
+{
+    size_t n = std::strlen(suffix);
+    return str.size() >= n && str.compare(str.size() - n, n, suffix) == 0;
+}
+
+}
+
+CompressedFile::CompressedFile()
+    : mFormat(COMPRESSION_NONE)
+    , mReading(-1)
+    , mDone(false)
+    , mFailed(false)
+    , mStop(false)
+    , mWriting(0)
+    , mOut(NULL)
+    , mOutPos(0)
+    , mCompressedBytes(0)
+    , mBytes(0)
+    , mReaderWaitMs(0)
+    , mWriterWaitMs(0)
+{
+}
+
+CompressedFile::~CompressedFile()
+{
+    close();
+}
+
+CompressionFormat CompressedFile::GetFormat(const std::string& path)
+{
+    if (EndsWith(path, ".gz")) {
+        return COMPRESSION_GZIP;
+    }
+    if (EndsWith(path, ".zst")) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+bool CompressedFile::IsSupported(CompressionFormat format)
+{
+    switch (format) {
+#ifdef SHOOTER_HAVE_ZLIB
+    case COMPRESSION_GZIP:  return true;
+#endif
+#ifdef SHOOTER_HAVE_ZSTD
+    case COMPRESSION_ZSTD:  return true;
+#endif
+    default:                return false;
+    }
+}
+
+bool CompressedFile::open(const std::string& path, CompressionFormat format)
+{
+    close();
+
+    if (!IsSupported(format)) {
+        std::cerr << "ERROR: Can't read " << path << ", this build has no "
+                  << (format == COMPRESSION_GZIP ? "zlib" : "zstd") << " support" << std::endl;
+        return false;
+    }
+
+    mFile.open(path.c_str(), std::ios::binary);
+    if (!mFile) {
+        std::cerr << "ERROR: Failed to open " << path << std::endl;
+        return false;
+    }
+
+    mPath = path;
+    mFormat = format;
+
+    mBuffers.resize(NUM_BUFFERS);
+    mFree.clear();
+    for (unsigned i = 0; i < NUM_BUFFERS; i++) {
+        mBuffers[i].resize(BUFFER_SIZE);
+        mFree.push_back(i);
+    }
+    mFull.clear();
+    mReading = -1;
+    setg(NULL, NULL, NULL);
+
+    mDone = false;
+    mFailed = false;
+    mStop = false;
+    mCompressedBytes = 0;
+    mBytes = 0;
+    mReaderWaitMs = 0;
+    mWriterWaitMs = 0;
+
+    mThread = std::thread(&CompressedFile::run, this);
+
+    return true;
+}
+
+void CompressedFile::close()
+{
+    if (mThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCanWrite.notify_one();
+        mThread.join();
+    }
+
+    mFile.close();
+    std::vector<std::vector<char> >().swap(mBuffers);
+    mFree.clear();
+    mFull.clear();
+    mReading = -1;
+    setg(NULL, NULL, NULL);
+}
+
+bool CompressedFile::failed()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mFailed;
+}
+
+CompressedFile::int_type CompressedFile::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    // done with the current buffer, the thread can have it back
+    if (mReading >= 0) {
+        mFree.push_back((unsigned)mReading);
+        mReading = -1;
+        mCanWrite.notify_one();
+    }
+
+    if (mFull.empty() && !mDone) {
+        Clock::time_point t0 = Clock::now();
+        mCanRead.wait(lock, [this] { return !mFull.empty() || mDone; });
+        mReaderWaitMs += MsSince(t0);
+    }
+
+    if (mFull.empty()) {
+        setg(NULL, NULL, NULL);
+        return traits_type::eof();
+    }
+
+    FullBuffer full = mFull.front();
+    mFull.pop_front();
+    mReading = (int)full.index;
+
+    char* data = &mBuffers[full.index][0];
+    setg(data, data, data + full.size);
+
+    return traits_type::to_int_type(*data);
+}
+
+bool CompressedFile::beginBuffer()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+
+    if (mFree.empty() && !mStop) {
+        Clock::time_point t0 = Clock::now();
+        mCanWrite.wait(lock, [this] { return !mFree.empty() || mStop; });
+        mWriterWaitMs += MsSince(t0);
+    }
+    if (mStop) {
+        return false;
+    }
+
+    mWriting = mFree.back();
+    mFree.pop_back();
+    mOut = &mBuffers[mWriting][0];
+    mOutPos = 0;
+    return true;
+}
+
+void CompressedFile::endBuffer()
+{
+    if (!mOut) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    if (mOutPos > 0) {
+        FullBuffer full;
+        full.index = mWriting;
+        full.size = mOutPos;
+        mFull.push_back(full);
+        mBytes += mOutPos;
+        mCanRead.notify_one();
+    }
+    else {
+        mFree.push_back(mWriting);
+    }
+    mOut = NULL;
+    mOutPos = 0;
+}
+
+size_t CompressedFile::readInput(std::vector<unsigned char>& in)
+{
+    mFile.read((char*)&in[0], in.size());
+    size_t n = (size_t)mFile.gcount();
+    mCompressedBytes += n;
+    return n;
+}
+
+void CompressedFile::run()
+{
+    std::vector<unsigned char> in(INPUT_SIZE);
+    mOut = NULL;
+
+    bool ok = false;
+    if (beginBuffer()) {
+        if (mFormat == COMPRESSION_GZIP) {
+            ok = inflateGzip(in);
+        }
+        else {
+            ok = decompressZstd(in);
+        }
+        endBuffer();
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mFailed = !ok && !mStop;
+    mDone = true;
+    mCanRead.notify_one();
+}
+
+//
+// Both decoders write into mOut until it's full, then queue it and carry on in the next
+// buffer.  Each returns false on corrupt or truncated data, or when the reader went away.
+//
+
+#ifdef SHOOTER_HAVE_ZLIB
+
+bool CompressedFile::inflateGzip(std::vector<unsigned char>& in)
+{
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {      // 15 + 32: gzip or zlib header, detected
+        std::cerr << "ERROR: Failed to start inflating " << mPath << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    bool streamEnd = false;
+
+    zs.next_out = (Bytef*)mOut;
+    zs.avail_out = (uInt)BUFFER_SIZE;
+
+    for (;;) {
+        if (zs.avail_in == 0) {
+            size_t n = readInput(in);
+            if (n == 0) {
+                if (!streamEnd) {
+                    std::cerr << "ERROR: " << mPath << " is truncated" << std::endl;
+                    ok = false;
+                }
+                break;
+            }
+            zs.next_in = &in[0];
+            zs.avail_in = (uInt)n;
+        }
+
+        if (streamEnd) {
+            // gzip files may be several members back to back
+            inflateReset(&zs);
+            streamEnd = false;
+        }
+
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        mOutPos = BUFFER_SIZE - zs.avail_out;
+
+        if (ret == Z_STREAM_END) {
+            streamEnd = true;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            std::cerr << "ERROR: Failed to inflate " << mPath << " (" << (zs.msg ? zs.msg : "corrupt data") << ")" << std::endl;
+            ok = false;
+            break;
+        }
+
+        if (zs.avail_out == 0) {
+            endBuffer();
+            if (!beginBuffer()) {
+                ok = false;
+                break;
+            }
+            zs.next_out = (Bytef*)mOut;
+            zs.avail_out = (uInt)BUFFER_SIZE;
+        }
+    }
+
+    inflateEnd(&zs);
+    return ok;
+}
+
+#else
+
+bool CompressedFile::inflateGzip(std::vector<unsigned char>&)
+{
+    return false;
+}
+
+#endif
+
+#ifdef SHOOTER_HAVE_ZSTD
+
+bool CompressedFile::decompressZstd(std::vector<unsigned char>& in)
+{
+    ZSTD_DStream* stream = ZSTD_createDStream();
+    if (!stream || ZSTD_isError(ZSTD_initDStream(stream))) {
+        std::cerr << "ERROR: Failed to start decompressing " << mPath << std::endl;
+        ZSTD_freeDStream(stream);
+        return false;
+    }
+
+    bool ok = true;
+    size_t remaining = 0;       // nonzero while a frame is unfinished
+
+    ZSTD_inBuffer input = { &in[0], 0, 0 };
+    ZSTD_outBuffer output = { mOut, BUFFER_SIZE, 0 };
+
+    for (;;) {
+        // a full output buffer may mean the decoder holds more, so call it again before reading
+        if (input.pos == input.size && output.pos < output.size) {
+            size_t n = readInput(in);
+            if (n == 0) {
+                if (remaining) {
+                    std::cerr << "ERROR: " << mPath << " is truncated" << std::endl;
+                    ok = false;
+                }
+                break;
+            }
+            input.size = n;
+            input.pos = 0;
+        }
+
+        remaining = ZSTD_decompressStream(stream, &output, &input);
+        mOutPos = output.pos;
+
+        if (ZSTD_isError(remaining)) {
+            std::cerr << "ERROR: Failed to decompress " << mPath << " (" << ZSTD_getErrorName(remaining) << ")" << std::endl;
+            ok = false;
+            break;
+        }
+
+        if (output.pos == output.size) {
+            endBuffer();
+            if (!beginBuffer()) {
+                ok = false;
+                break;
+            }
+            output.dst = mOut;
+            output.pos = 0;
+        }
+    }
+
+    ZSTD_freeDStream(stream);
+    return ok;
+}
+
+#else
+
+bool CompressedFile::decompressZstd(std::vector<unsigned char>&)
+{
+    return false;
+}
+
+#endif
+
+void CompressedFile::printStats() const
+{
+    std::cout << "  Decompressed " << mBytes / (1024.0 * 1024.0) << " MB from " << mCompressedBytes / (1024.0 * 1024.0)
+              << " MB; the parser waited " << mReaderWaitMs << " ms, the decompressor " << mWriterWaitMs << " ms" << std::endl;
+}
@@ -0,0 +1,107 @@
+#ifndef COMPRESSEDFILE_H_
+#define COMPRESSEDFILE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+// define SHOOTER_HAVE_ZLIB and/or SHOOTER_HAVE_ZSTD (and link the library) to read those formats;
+// the Visual Studio project does both, with the libraries from vcpkg.json
+
+enum CompressionFormat {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,               // .gz
+    COMPRESSION_ZSTD                // .zst
+};
+
+//
+// A compressed file read as a stream, e.g. std::istream in(&compressedFile).
+//
+// A thread of its own reads and decompresses the file into fixed-size buffers and queues them
+// for the reader, so decompression overlaps with whatever the reader does with the data (like
+// parsing it).  The queue holds at most NUM_BUFFERS buffers and they are reused, so memory use
+// doesn't depend on the size of the file.  The decompressor is a plain thread rather than a
+// job, because it blocks whenever the reader falls behind.
+//
+class CompressedFile : public std::streambuf {
+
+    struct FullBuffer {
+        unsigned            index;          // into mBuffers
+        size_t              size;
+    };
+
+    std::string             mPath;
+    CompressionFormat       mFormat;
+    std::ifstream           mFile;
+    std::thread             mThread;
+
+    std::vector<std::vector<char> > mBuffers;
+    std::vector<unsigned>   mFree;
+    std::deque<FullBuffer>  mFull;
+    int                     mReading;       // buffer the reader is in, -1 if none
+
+    std::mutex              mMutex;
+    std::condition_variable mCanRead;       // a buffer was queued, or the thread is done
+    std::condition_variable mCanWrite;      // a buffer was freed, or close() wants the thread to stop
+    bool                    mDone;
+    bool                    mFailed;
+    bool                    mStop;
+
+    // the buffer the thread is filling
+    unsigned                mWriting;
+    char*                   mOut;
+    size_t                  mOutPos;
+
+    // stats
+    unsigned long long      mCompressedBytes;
+    unsigned long long      mBytes;
+    double                  mReaderWaitMs;
+    double                  mWriterWaitMs;
+
+    // the thread
+    void                    run();
+    bool                    inflateGzip(std::vector<unsigned char>& in);
+    bool                    decompressZstd(std::vector<unsigned char>& in);
+    size_t                  readInput(std::vector<unsigned char>& in);
+
+    // get an empty buffer to fill (false if stopping), queue the filled one
+    bool                    beginBuffer();
+    void                    endBuffer();
+
+    CompressedFile(const CompressedFile&);      // not copyable
+    CompressedFile& operator=(const CompressedFile&);
+
+protected:
+    int_type                underflow() override;
+
+public:
+    static const size_t     BUFFER_SIZE;
+    static const unsigned   NUM_BUFFERS;
+
+    CompressedFile();
+    ~CompressedFile();
+
+    // from the extension: .gz or .zst, anything else is not compressed
+    static CompressionFormat GetFormat(const std::string& path);
+    static bool             IsSupported(CompressionFormat format);
+
+    // open the file and start decompressing
+    bool                    open(const std::string& path, CompressionFormat format);
+    void                    close();
+
+    // true if reading stopped because of an error rather than at the end (the error has been printed)
+    bool                    failed();
+
+    unsigned long long      getCompressedBytes() const  { return mCompressedBytes; }
+    unsigned long long      getBytes() const            { return mBytes; }
+
+    // "decompressed X MB from Y MB, ..." for the load report
+    void                    printStats() const;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "FileWatcher.h"
+
+#include <iostream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+const int FileWatcher::SETTLE_MS = 100;
+
+FileWatcher::FileWatcher()
+    : mStop(false)
+#ifndef _WIN32
+    , mFd(-1)
+#endif
+{
+}
+
+FileWatcher::~FileWatcher()
+{
+    stop();
+}
+
+void FileWatcher::notify(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mChanged[path] = Clock::now();
+}
+
+void FileWatcher::poll(std::vector<std::string>& changed)
+{
+    changed.clear();
+
+    Clock::time_point now = Clock::now();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    std::map<std::string, Clock::time_point>::iterator it = mChanged.begin();
+    while (it != mChanged.end()) {
+        if (now - it->second >= std::chrono::milliseconds(SETTLE_MS)) {
+            changed.push_back(it->first);
+            mChanged.erase(it++);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+#ifdef _WIN32
+
+bool FileWatcher::start(const std::vector<std::string>& dirs)
+{
+    stop();
+
+    for (unsigned i = 0; i < dirs.size(); i++) {
+        HANDLE dir = CreateFileA(dirs[i].c_str(), FILE_LIST_DIRECTORY,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        if (dir == INVALID_HANDLE_VALUE) {
+            std::cerr << "ERROR: Failed to watch " << dirs[i] << std::endl;
+            stop();
+            return false;
+        }
+        mDirs.push_back(dirs[i]);
+        mDirHandles.push_back(dir);
+        mEvents.push_back(CreateEventA(NULL, FALSE, FALSE, NULL));
+    }
+
+    mStop = false;
+    mThread = std::thread(&FileWatcher::run, this);
+    return true;
+}
+
+void FileWatcher::stop()
+{
+    if (mThread.joinable()) {
+        mStop = true;
+        mThread.join();
+    }
+
+    for (unsigned i = 0; i < mDirHandles.size(); i++) {
+        CloseHandle(mDirHandles[i]);
+        CloseHandle(mEvents[i]);
+    }
+    mDirHandles.clear();
+    mEvents.clear();
+    mDirs.clear();
+}
+
+void FileWatcher::run()
+{
+    const DWORD filter = FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME;
+    const size_t n = mDirHandles.size();
+    if (n == 0) {
+        return;
+    }
+
+    // the notification records must be DWORD aligned
+    std::vector<std::vector<DWORD> > buffers(n, std::vector<DWORD>(4096));
+    std::vector<OVERLAPPED> overlapped(n);
+
+    for (size_t i = 0; i < n; i++) {
+        ZeroMemory(&overlapped[i], sizeof(OVERLAPPED));
+        overlapped[i].hEvent = mEvents[i];
+        ReadDirectoryChangesW(mDirHandles[i], &buffers[i][0], (DWORD)(buffers[i].size() * sizeof(DWORD)),
+            FALSE, filter, NULL, &overlapped[i], NULL);
+    }
+
+    while (!mStop) {
+        // wake up now and then to check for stop()
+        DWORD r = WaitForMultipleObjects((DWORD)n, (const HANDLE*)&mEvents[0], FALSE, 100);
+        if (r < WAIT_OBJECT_0 || r >= WAIT_OBJECT_0 + n) {
+            continue;
+        }
+        size_t i = r - WAIT_OBJECT_0;
+
+        DWORD bytes = 0;
+        if (GetOverlappedResult(mDirHandles[i], &overlapped[i], &bytes, FALSE) && bytes > 0) {
+            const char* p = (const char*)&buffers[i][0];
+            for (;;) {
+                const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)p;
+                if (info->Action == FILE_ACTION_MODIFIED || info->Action == FILE_ACTION_ADDED ||
+                    info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+                    int wlen = (int)(info->FileNameLength / sizeof(WCHAR));
+                    int len = WideCharToMultiByte(CP_UTF8, 0, info->FileName, wlen, NULL, 0, NULL, NULL);
+                    std::string name(len, '\0');
+                    WideCharToMultiByte(CP_UTF8, 0, info->FileName, wlen, &name[0], len, NULL, NULL);
+                    notify(mDirs[i] + "/" + name);
+                }
+                if (!info->NextEntryOffset) {
+                    break;
+                }
+                p += info->NextEntryOffset;
+            }
+        }
+
+        ReadDirectoryChangesW(mDirHandles[i], &buffers[i][0], (DWORD)(buffers[i].size() * sizeof(DWORD)),
+            FALSE, filter, NULL, &overlapped[i], NULL);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        CancelIo(mDirHandles[i]);
+    }
+}
+
+#else
+
+bool FileWatcher::start(const std::vector<std::string>& dirs)
+{
+    stop();
+
+    mFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (mFd < 0) {
+        std::cerr << "ERROR: inotify_init1 failed" << std::endl;
+        return false;
+    }
+
+    for (unsigned i = 0; i < dirs.size(); i++) {
+        // closing after a write, or an editor renaming its temp file over the original
+        int wd = inotify_add_watch(mFd, dirs[i].c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            std::cerr << "ERROR: Failed to watch " << dirs[i] << std::endl;
+            stop();
+            return false;
+        }
+        mDirs.push_back(dirs[i]);
+        mWatches.push_back(wd);
+    }
+
+    mStop = false;
+    mThread = std::thread(&FileWatcher::run, this);
+    return true;
+}
+
+void FileWatcher::stop()
+{
+    if (mThread.joinable()) {
+        mStop = true;
+        mThread.join();
+    }
+
+    if (mFd >= 0) {
+        ::close(mFd);       // removes the watches too
+        mFd = -1;
+    }
+    mWatches.clear();
+    mDirs.clear();
+}
+
+void FileWatcher::run()
+{
+    // big enough for many events, aligned for struct inotify_event
+    union {
+        inotify_event       event;
+        char                bytes[16 * 1024];
+    } buf;
+
+    while (!mStop) {
+        // wake up now and then to check for stop()
+        pollfd pfd;
+        pfd.fd = mFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        ssize_t len = ::read(mFd, buf.bytes, sizeof(buf.bytes));
+        if (len <= 0) {
+            continue;
+        }
+
+        for (const char* p = buf.bytes; p < buf.bytes + len; ) {
+            const inotify_event* ev = (const inotify_event*)p;
+            if (ev->len > 0) {
+                for (unsigned i = 0; i < mWatches.size(); i++) {
+                    if (mWatches[i] == ev->wd) {
+                        notify(mDirs[i] + "/" + ev->name);
+                        break;
+                    }
+                }
+            }
+            p += sizeof(inotify_event) + ev->len;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef FILEWATCHER_H_
+#define FILEWATCHER_H_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// Watches directories for files that are written or moved in, on a background thread
+// (inotify on Linux, ReadDirectoryChangesW on Windows).
+//
+// Editors often save a file in several writes, so a file is only reported once it has
+// been quiet for a short while.
+//
+class FileWatcher {
+
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<std::string>            mDirs;
+
+    std::thread                         mThread;
+    std::atomic<bool>                   mStop;
+
+    std::mutex                          mMutex;
+    std::map<std::string, Clock::time_point> mChanged;   // path -> time of the last event
+
+    // OS handles
+#ifdef _WIN32
+    std::vector<void*>                  mDirHandles;
+    std::vector<void*>                  mEvents;
+#else
+    int                                 mFd;
+    std::vector<int>                    mWatches;       // one per directory
+#endif
+
+    void                    run();
+    void                    notify(const std::string& path);
+
+    FileWatcher(const FileWatcher&);            // not copyable
+    FileWatcher& operator=(const FileWatcher&);
+
+public:
+    FileWatcher();
+    ~FileWatcher();
+
+    bool                    start(const std::vector<std::string>& dirs);
+    void                    stop();
+
+    bool                    isRunning() const       { return mThread.joinable(); }
+
+    // files that changed since the last call, as "<dir>/<name>", each listed once
+    void                    poll(std::vector<std::string>& changed);
+
+    // how long a file must be left alone before it's reported
+    static const int        SETTLE_MS;
+};
+
+#endif
@@ -0,0 +1,294 @@
+#include "FramePacer.h"
+
+#include <cmath>
+#include <iostream>
+
+//
+// LatencyHistogram
+//
+
+LatencyHistogram::LatencyHistogram(double binMs, unsigned numBins)
+    : mBins(numBins, 0)
+    , mBinMs(binMs)
+    , mCount(0)
+    , mSum(0)
+    , mMax(0)
+{
+}
+
+void LatencyHistogram::add(double ms)
+{
+    if (ms < 0) {
+        ms = 0;
+    }
+
+    size_t bin = (size_t)(ms / mBinMs);
+    if (bin >= mBins.size()) {
+        bin = mBins.size() - 1;
+    }
+    ++mBins[bin];
+
+    ++mCount;
+    mSum += ms;
+    if (ms > mMax) {
+        mMax = ms;
+    }
+}
+
+void LatencyHistogram::clear()
+{
+    mBins.assign(mBins.size(), 0);
+    mCount = 0;
+    mSum = 0;
+    mMax = 0;
+}
+
+double LatencyHistogram::getPercentile(double p) const
+{
+    if (mCount == 0) {
+        return 0;
+    }
+
+    unsigned rank = (unsigned)std::ceil(p * mCount);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    unsigned seen = 0;
+    for (size_t i = 0; i < mBins.size(); i++) {
+        seen += mBins[i];
+        if (seen >= rank) {
+            // the overflow bin has no upper edge
+            return i + 1 < mBins.size() ? (i + 1) * mBinMs : mMax;
+        }
+    }
+    return mMax;
+}
+
+void LatencyHistogram::writeJson(std::ostream& out) const
+{
+    size_t numBins = mBins.size();
+    while (numBins > 0 && mBins[numBins - 1] == 0) {
+        --numBins;
+    }
+
+    out << "{ \"samples\": " << mCount
+        << ", \"mean_ms\": " << getMean()
+        << ", \"p50_ms\": " << getPercentile(0.50)
+        << ", \"p99_ms\": " << getPercentile(0.99)
+        << ", \"max_ms\": " << mMax
+        << ", \"bin_ms\": " << mBinMs
+        << ", \"bins\": [";
+    for (size_t i = 0; i < numBins; i++) {
+        out << (i ? ", " : "") << mBins[i];
+    }
+    out << "] }";
+}
+
+
+//
+// FramePacer
+//
+
+const unsigned FramePacer::MAX_TRACKED_FRAMES = 8;
+const unsigned FramePacer::CALIBRATE_INTERVAL = 600;
+const double FramePacer::MAX_CLOCK_DRIFT_MS = 1.0;
+
+FramePacer::FramePacer()
+    : mMaxQueuedFrames(MAX_TRACKED_FRAMES)
+    , mHaveTimer(false)
+    , mStarted(false)
+    , mHaveInput(false)
+    , mClockOffset(0)
+    , mFramesSinceCalibration(0)
+    , mClockDrifted(false)
+    , mNumWaits(0)
+    , mWaitMs(0)
+{
+}
+
+FramePacer::~FramePacer()
+{
+}
+
+bool FramePacer::initialize(unsigned maxQueuedFrames)
+{
+    if (!GLEW_VERSION_3_2 && !GLEW_ARB_sync) {
+        std::cout << "Warning: Fences are not supported, frame pacing is disabled" << std::endl;
+        return false;
+    }
+
+    mHaveTimer = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    if (!mHaveTimer) {
+        std::cout << "Warning: Timer queries are not supported, latencies include up to a frame of polling delay" << std::endl;
+    }
+
+    setMaxQueuedFrames(maxQueuedFrames);
+    mStarted = true;
+    calibrate();
+    return true;
+}
+
+void FramePacer::shutdown()
+{
+    // don't wait for them, just let go
+    for (size_t i = 0; i < mInFlight.size(); i++) {
+        glDeleteSync(mInFlight[i].fence);
+        if (mInFlight[i].query) {
+            glDeleteQueries(1, &mInFlight[i].query);
+        }
+    }
+    mInFlight.clear();
+
+    if (!mFreeQueries.empty()) {
+        glDeleteQueries((GLsizei)mFreeQueries.size(), &mFreeQueries[0]);
+        mFreeQueries.clear();
+    }
+
+    mStarted = false;
+}
+
+void FramePacer::setMaxQueuedFrames(unsigned n)
+{
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > MAX_TRACKED_FRAMES) {
+        n = MAX_TRACKED_FRAMES;
+    }
+    mMaxQueuedFrames = n;
+}
+
+void FramePacer::calibrate()
+{
+    if (!mHaveTimer) {
+        return;
+    }
+
+    GLint64 glNow = 0;
+    glGetInteger64v(GL_TIMESTAMP, &glNow);
+    long long cpuNow = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    mClockOffset = (long long)glNow - cpuNow;
+
+    mFramesSinceCalibration = 0;
+    mClockDrifted = false;
+}
+
+bool FramePacer::retire(bool wait)
+{
+    Frame& frame = mInFlight.front();
+
+    GLenum result = glClientWaitSync(frame.fence, 0, 0);
+    if (result == GL_TIMEOUT_EXPIRED) {
+        if (!wait) {
+            return false;
+        }
+
+        Clock::time_point t0 = Clock::now();
+        do {
+            result = glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);  // 1 ms
+        } while (result == GL_TIMEOUT_EXPIRED);
+        ++mNumWaits;
+        mWaitMs += std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    }
+    Clock::time_point doneTime = Clock::now();
+
+    if (result == GL_WAIT_FAILED) {
+        std::cerr << "ERROR: Failed waiting on frame fence" << std::endl;
+    }
+
+    if (frame.query) {
+        // when the GPU got to the end of the frame, on the CPU clock
+        GLuint64 glDone = 0;
+        glGetQueryObjectui64v(frame.query, GL_QUERY_RESULT, &glDone);
+        long long cpuNs = (long long)glDone - mClockOffset;
+        Clock::time_point gpuTime(std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds(cpuNs)));
+        mFreeQueries.push_back(frame.query);
+
+        // the GPU can't finish after the fence was seen, or before the input was read: if it
+        // seems to, the clocks have drifted apart and this frame keeps the time it was seen at
+        Clock::duration slack = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(MAX_CLOCK_DRIFT_MS));
+        if (gpuTime > doneTime + slack || (frame.haveInput && gpuTime + slack < frame.inputTime)) {
+            mClockDrifted = true;
+        }
+        else {
+            doneTime = gpuTime;
+        }
+    }
+
+    if (frame.haveInput) {
+        mLatency.add(std::chrono::duration<double, std::milli>(doneTime - frame.inputTime).count());
+    }
+
+    glDeleteSync(frame.fence);
+    mInFlight.pop_front();
+    return true;
+}
+
+void FramePacer::beginFrame()
+{
+    if (!mStarted) {
+        return;
+    }
+
+    // collect what has finished, then wait until there is room for this frame
+    while (!mInFlight.empty() && retire(false)) {
+    }
+    while (mInFlight.size() >= mMaxQueuedFrames) {
+        retire(true);
+    }
+
+    if (mClockDrifted || ++mFramesSinceCalibration >= CALIBRATE_INTERVAL) {
+        calibrate();
+    }
+}
+
+void FramePacer::markInput()
+{
+    mInputTime = Clock::now();
+    mHaveInput = true;
+}
+
+void FramePacer::endFrame()
+{
+    if (!mStarted) {
+        return;
+    }
+
+    Frame frame;
+    frame.query = 0;
+    if (mHaveTimer) {
+        if (mFreeQueries.empty()) {
+            GLuint query;
+            glGenQueries(1, &query);
+            mFreeQueries.push_back(query);
+        }
+        frame.query = mFreeQueries.back();
+        mFreeQueries.pop_back();
+        glQueryCounter(frame.query, GL_TIMESTAMP);
+    }
+    frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame.inputTime = mInputTime;
+    frame.haveInput = mHaveInput;
+    mHaveInput = false;
+
+    mInFlight.push_back(frame);
+}
+
+void FramePacer::resetStats()
+{
+    mLatency.clear();
+    mNumWaits = 0;
+    mWaitMs = 0;
+}
+
+void FramePacer::printStats() const
+{
+    std::cout << "Frame pacing: " << mMaxQueuedFrames << " queued frames at most, "
+              << mNumWaits << " waits (" << mWaitMs << " ms)" << std::endl;
+    if (mLatency.getCount() > 0) {
+        std::cout << "  Input to present: mean " << mLatency.getMean() << " ms, p50 " << mLatency.getPercentile(0.50)
+                  << " ms, p99 " << mLatency.getPercentile(0.99) << " ms, max " << mLatency.getMax()
+                  << " ms over " << mLatency.getCount() << " frames" << std::endl;
+    }
+}
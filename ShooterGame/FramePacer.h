@@ -0,0 +1,122 @@
+#ifndef FRAMEPACER_H_
+#define FRAMEPACER_H_
+
+#include "GLSH.h"
+
+#include <chrono>
+#include <deque>
+#include <ostream>
+#include <vector>
+
+// latencies in fixed-size bins
+class LatencyHistogram {
+
+    std::vector<unsigned>   mBins;          // the last one also counts everything above the range
+    double                  mBinMs;
+    unsigned                mCount;
+    double                  mSum;
+    double                  mMax;
+
+public:
+    LatencyHistogram(double binMs = 0.5, unsigned numBins = 200);
+
+    void                    add(double ms);
+    void                    clear();
+
+    unsigned                getCount() const        { return mCount; }
+    double                  getMean() const         { return mCount ? mSum / mCount : 0.0; }
+    double                  getMax() const          { return mMax; }
+
+    // upper edge of the bin that holds the p-th fraction of the samples
+    double                  getPercentile(double p) const;
+
+    // { "samples": n, "mean_ms": ..., "p50_ms": ..., "p99_ms": ..., "max_ms": ..., "bin_ms": ..., "bins": [...] }
+    // (trailing empty bins are left out)
+    void                    writeJson(std::ostream& out) const;
+};
+
+//
+// Limits how many frames the GL can queue up and measures input-to-present latency.
+//
+// endFrame() puts a fence (and a GL_TIMESTAMP query, if supported) after the last command of
+// every frame.  beginFrame() collects the frames that have finished and, if more than
+// 'maxQueuedFrames' are still in flight, waits for the oldest ones.  With one queued frame,
+// the next frame's input is read only after the GPU has caught up, so it isn't shown a few
+// frames late.
+//
+// A frame's latency runs from markInput() (when the input it shows was read) to the time the
+// GPU finished the frame, which is as close to the swap as the app can observe.  GPU
+// timestamps are put on the CPU clock with an offset read at startup (a synchronous query),
+// and read again only every CALIBRATE_INTERVAL frames or once a frame's timestamp is
+// impossible on the CPU clock.
+//
+class FramePacer {
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Frame {
+        GLsync              fence;
+        GLuint              query;          // 0 without timer queries
+        Clock::time_point   inputTime;
+        bool                haveInput;
+    };
+
+    std::deque<Frame>       mInFlight;
+    std::vector<GLuint>     mFreeQueries;
+
+    unsigned                mMaxQueuedFrames;
+    bool                    mHaveTimer;
+    bool                    mStarted;       // markInput and endFrame only work after initialize
+
+    Clock::time_point       mInputTime;
+    bool                    mHaveInput;
+
+    // GL timestamp minus steady_clock time, both in nanoseconds
+    long long               mClockOffset;
+    unsigned                mFramesSinceCalibration;
+    bool                    mClockDrifted;  // a timestamp fell outside the frame's CPU times
+
+    LatencyHistogram        mLatency;
+    unsigned                mNumWaits;      // frames that waited for the GPU
+    double                  mWaitMs;        // total time spent waiting
+
+    // wait for (or poll) the oldest frame, returns false if it hasn't finished
+    bool                    retire(bool wait);
+
+    void                    calibrate();
+
+    FramePacer(const FramePacer&);          // not copyable
+    FramePacer& operator=(const FramePacer&);
+
+public:
+    FramePacer();
+    ~FramePacer();
+
+    // frames kept track of at most; also the limit when queuing isn't restricted
+    static const unsigned   MAX_TRACKED_FRAMES;
+
+    // frames between clock calibrations, and how far off a timestamp may be before one is forced
+    static const unsigned   CALIBRATE_INTERVAL;
+    static const double     MAX_CLOCK_DRIFT_MS;
+
+    bool                    initialize(unsigned maxQueuedFrames = MAX_TRACKED_FRAMES);
+    void                    shutdown();
+
+    void                    setMaxQueuedFrames(unsigned n);
+    unsigned                getMaxQueuedFrames() const  { return mMaxQueuedFrames; }
+
+    // call before any GL work of the frame
+    void                    beginFrame();
+
+    // the input shown by this frame is being read now
+    void                    markInput();
+
+    // call after the last GL command of the frame
+    void                    endFrame();
+
+    const LatencyHistogram& getLatency() const      { return mLatency; }
+    void                    resetStats();
+    void                    printStats() const;
+};
+
+#endif
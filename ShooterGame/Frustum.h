@@ -0,0 +1,45 @@
+#ifndef FRUSTUM_H_
+#define FRUSTUM_H_
+
+#include "GLSH.h"
+
+//
+// The six clip planes of a view-projection matrix (Gribb & Hartmann), pointing inward.
+//
+struct Frustum {
+    glm::vec4               planes[6];      // left, right, bottom, top, near, far
+
+    void extract(const glm::mat4& viewProj)
+    {
+        glm::vec4 row0(viewProj[0][0], viewProj[1][0], viewProj[2][0], viewProj[3][0]);
+        glm::vec4 row1(viewProj[0][1], viewProj[1][1], viewProj[2][1], viewProj[3][1]);
+        glm::vec4 row2(viewProj[0][2], viewProj[1][2], viewProj[2][2], viewProj[3][2]);
+        glm::vec4 row3(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+
+        planes[0] = row3 + row0;
+        planes[1] = row3 - row0;
+        planes[2] = row3 + row1;
+        planes[3] = row3 - row1;
+        planes[4] = row3 + row2;
+        planes[5] = row3 - row2;
+    }
+
+    // false only if the box is entirely outside one of the planes
+    bool intersectsBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+    {
+        for (int i = 0; i < 6; i++) {
+            const glm::vec4& p = planes[i];
+
+            // the corner furthest along the plane normal
+            glm::vec3 corner(p.x >= 0 ? boxMax.x : boxMin.x,
+                             p.y >= 0 ? boxMax.y : boxMin.y,
+                             p.z >= 0 ? boxMax.z : boxMin.z);
+            if (p.x * corner.x + p.y * corner.y + p.z * corner.z + p.w < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
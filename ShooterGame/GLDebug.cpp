@@ -0,0 +1,290 @@
+#include "GLDebug.h"
+
+#if SHOOTER_GL_DEBUG
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+bool GLDebug::Initialized = false;
+bool GLDebug::HaveDebugOutput = false;
+bool GLDebug::Synchronous = false;
+
+std::vector<GLDebug::GroupStats> GLDebug::Groups;
+std::map<std::string, unsigned> GLDebug::GroupIndex;
+std::vector<unsigned> GLDebug::Stack;
+unsigned GLDebug::Current = 0;
+unsigned long long GLDebug::NumFrames = 0;
+
+std::mutex GLDebug::MessageMutex;
+std::map<unsigned long long, GLDebug::MessageStats> GLDebug::Messages;
+unsigned long long GLDebug::NumErrors = 0;
+unsigned long long GLDebug::NumPerformanceWarnings = 0;
+
+namespace {
+
+const char* TypeName(GLenum type)
+{
+    switch (type) {
+    case GL_DEBUG_TYPE_ERROR:               return "error";
+    case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+    case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  return "undefined behavior";
+    case GL_DEBUG_TYPE_PORTABILITY:         return "portability";
+    case GL_DEBUG_TYPE_PERFORMANCE:         return "performance";
+    default:                                return "other";
+    }
+}
+
+const char* CounterName(int counter)
+{
+    static const char* names[GLDebug::NUM_COUNTERS] = { "calls", "draws", "uploads", "upload KB", "state" };
+    return names[counter];
+}
+
+}
+
+void GLAPIENTRY GLDebug::MessageCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
+    GLsizei length, const GLchar* message, const void* userParam)
+{
+    (void)source;
+    (void)userParam;
+
+    std::lock_guard<std::mutex> lock(MessageMutex);
+
+    if (type == GL_DEBUG_TYPE_ERROR) {
+        ++NumErrors;
+    }
+    else if (type == GL_DEBUG_TYPE_PERFORMANCE) {
+        ++NumPerformanceWarnings;
+    }
+
+    // the same message tends to come every frame, so only the first one is printed
+    MessageStats& stats = Messages[((unsigned long long)type << 32) | id];
+    if (stats.count++) {
+        return;
+    }
+    stats.text.assign(message, length >= 0 ? (size_t)length : std::strlen(message));
+
+    // the group is only known for sure when the message comes from the call that caused it
+    std::string where;
+    if (Synchronous && Current) {
+        where = " in '" + Groups[Current].name + "'";
+    }
+
+    if (type == GL_DEBUG_TYPE_ERROR || severity == GL_DEBUG_SEVERITY_HIGH) {
+        std::cerr << "ERROR: GL " << TypeName(type) << where << ": " << stats.text << std::endl;
+    }
+    else {
+        std::cout << "Warning: GL " << TypeName(type) << where << ": " << stats.text << std::endl;
+    }
+}
+
+bool GLDebug::Initialize(bool synchronous)
+{
+    Groups.clear();
+    GroupIndex.clear();
+    Stack.clear();
+    Groups.push_back(GroupStats());     // value-initialized, so the counts start at 0
+    Groups[0].name = "(no group)";
+    Current = 0;
+    NumFrames = 0;
+
+    Synchronous = synchronous;
+    HaveDebugOutput = GLEW_KHR_debug || GLEW_VERSION_4_3;
+    Initialized = true;
+
+    if (!HaveDebugOutput) {
+        std::cout << "Warning: KHR_debug is not supported, GL errors are checked with glGetError" << std::endl;
+        return false;
+    }
+
+    // many drivers only say much in a debug context, which has to be asked for when it's created
+    GLint flags = 0;
+    glGetIntegerv(GL_CONTEXT_FLAGS, &flags);
+    if (!(flags & GL_CONTEXT_FLAG_DEBUG_BIT)) {
+        std::cout << "Warning: Not a debug context, the driver may not report everything" << std::endl;
+    }
+
+    glEnable(GL_DEBUG_OUTPUT);
+    if (synchronous) {
+        glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    }
+    else {
+        glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    }
+    glDebugMessageCallback(MessageCallback, NULL);
+
+    // drop the chatter, and the echoes of our own groups
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
+    glDebugMessageControl(GL_DONT_CARE, GL_DEBUG_TYPE_PUSH_GROUP, GL_DONT_CARE, 0, NULL, GL_FALSE);
+    glDebugMessageControl(GL_DONT_CARE, GL_DEBUG_TYPE_POP_GROUP, GL_DONT_CARE, 0, NULL, GL_FALSE);
+
+    std::cout << "GL debug output: " << (synchronous ? "synchronous" : "asynchronous") << std::endl;
+
+    return true;
+}
+
+void GLDebug::Shutdown()
+{
+    if (HaveDebugOutput) {
+        glDebugMessageCallback(NULL, NULL);
+        glDisable(GL_DEBUG_OUTPUT);
+        HaveDebugOutput = false;
+    }
+    Initialized = false;
+}
+
+void GLDebug::PushGroup(const char* name)
+{
+    if (!Initialized) {
+        return;
+    }
+
+    std::map<std::string, unsigned>::iterator it = GroupIndex.find(name);
+    if (it == GroupIndex.end()) {
+        GroupStats group = GroupStats();
+        group.name = name;
+        it = GroupIndex.insert(std::make_pair(group.name, (unsigned)Groups.size())).first;
+        Groups.push_back(group);
+    }
+
+    Stack.push_back(it->second);
+    Current = it->second;
+
+    if (HaveDebugOutput) {
+        glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, it->second, -1, name);
+    }
+}
+
+void GLDebug::PopGroup()
+{
+    if (!Initialized || Stack.empty()) {
+        return;
+    }
+
+    Stack.pop_back();
+    Current = Stack.empty() ? 0 : Stack.back();
+
+    if (HaveDebugOutput) {
+        glPopDebugGroup();
+    }
+}
+
+void GLDebug::Count(Counter counter, unsigned long long n)
+{
+    if (!Initialized) {
+        return;
+    }
+
+    unsigned long long* frame = Groups[Current].frame;
+    frame[counter] += n;
+    if (counter != COUNT_CALLS) {
+        frame[COUNT_CALLS] += n;
+    }
+}
+
+void GLDebug::CountUpload(unsigned long long bytes)
+{
+    if (!Initialized) {
+        return;
+    }
+
+    unsigned long long* frame = Groups[Current].frame;
+    ++frame[COUNT_CALLS];
+    ++frame[COUNT_UPLOADS];
+    frame[COUNT_UPLOAD_BYTES] += bytes;
+}
+
+void GLDebug::EndFrame()
+{
+    if (!Initialized) {
+        return;
+    }
+
+    for (unsigned g = 0; g < Groups.size(); g++) {
+        GroupStats& group = Groups[g];
+        for (int c = 0; c < NUM_COUNTERS; c++) {
+            group.total[c] += group.frame[c];
+            if (group.frame[c] > group.peak[c]) {
+                group.peak[c] = group.frame[c];
+            }
+            group.frame[c] = 0;
+        }
+    }
+    ++NumFrames;
+}
+
+void GLDebug::CheckErrors(const char* where)
+{
+    if (HaveDebugOutput) {
+        return;     // the callback has it covered, without the wait
+    }
+
+    for (GLenum err = glGetError(); err != GL_NO_ERROR; err = glGetError()) {
+        std::cerr << "ERROR: GL error 0x" << std::hex << err << std::dec << " " << where << std::endl;
+        std::lock_guard<std::mutex> lock(MessageMutex);
+        ++NumErrors;
+    }
+}
+
+unsigned long long GLDebug::GetNumErrors()
+{
+    std::lock_guard<std::mutex> lock(MessageMutex);
+    return NumErrors;
+}
+
+void GLDebug::PrintStats()
+{
+    if (!Initialized) {
+        return;
+    }
+
+    std::cout << "GL debug: " << NumFrames << " frames";
+    {
+        std::lock_guard<std::mutex> lock(MessageMutex);
+        std::cout << ", " << NumErrors << " errors, " << NumPerformanceWarnings << " performance warnings" << std::endl;
+        for (std::map<unsigned long long, MessageStats>::const_iterator it = Messages.begin(); it != Messages.end(); ++it) {
+            if (it->second.count > 1) {
+                std::cout << "  " << std::setw(8) << it->second.count << " x " << TypeName((GLenum)(it->first >> 32))
+                          << ": " << it->second.text << std::endl;
+            }
+        }
+    }
+
+    if (!NumFrames) {
+        return;
+    }
+
+    // per-frame averages, with the peaks in brackets
+    std::cout << "  " << std::left << std::setw(24) << "group" << std::right;
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        std::cout << std::setw(20) << CounterName(c);
+    }
+    std::cout << std::endl;
+
+    for (unsigned g = 0; g < Groups.size(); g++) {
+        const GroupStats& group = Groups[g];
+        if (!group.total[COUNT_CALLS]) {
+            continue;
+        }
+
+        std::cout << "  " << std::left << std::setw(24) << group.name << std::right << std::fixed << std::setprecision(1);
+        for (int c = 0; c < NUM_COUNTERS; c++) {
+            double avg = (double)group.total[c] / NumFrames;
+            unsigned long long peak = group.peak[c];
+            if (c == COUNT_UPLOAD_BYTES) {
+                avg /= 1024;
+                peak /= 1024;
+            }
+            std::ostringstream cell;
+            cell << std::fixed << std::setprecision(1) << avg << " (" << peak << ")";
+            std::cout << std::setw(20) << cell.str();
+        }
+        std::cout << std::endl;
+    }
+    std::cout.unsetf(std::ios::fixed);
+    std::cout << std::setprecision(6);
+}
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef GLDEBUG_H_
+#define GLDEBUG_H_
+
+#include "GLSH.h"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// debug builds get the instrumentation unless it's turned off with SHOOTER_GL_DEBUG=0
+#ifndef SHOOTER_GL_DEBUG
+#ifdef _DEBUG
+#define SHOOTER_GL_DEBUG 1
+#else
+#define SHOOTER_GL_DEBUG 0
+#endif
+#endif
+
+//
+// GL instrumentation for debug builds.
+//
+// Errors and performance warnings come from the driver through a KHR_debug callback rather than
+// glGetError, which makes the CPU wait for the GL to catch up.  Output is asynchronous unless
+// asked for otherwise, so the callback costs nothing until the driver has something to say; with
+// synchronous output a breakpoint in the callback stops on the call that caused the message.
+// Each distinct message is printed once and counted after that.  Without KHR_debug, the
+// GL_DEBUG_CHECK points fall back to glGetError.
+//
+// The hot paths count their GL calls, draws, uploads and state changes with the GL_DEBUG_*
+// macros.  Counts go to the innermost debug group (GL_DEBUG_GROUP), which is pushed to the GL
+// as well so capture tools show the same names, and are printed as per-frame averages and
+// peaks for each group.  Only the main thread makes GL calls, so the counters aren't atomic.
+//
+// When SHOOTER_GL_DEBUG is 0 the macros expand to nothing and the functions are empty.
+//
+class GLDebug {
+
+public:
+    enum Counter {
+        COUNT_CALLS,                        // every counted GL call, including the ones below
+        COUNT_DRAWS,
+        COUNT_UPLOADS,                      // buffer and texture data sent to the GL
+        COUNT_UPLOAD_BYTES,
+        COUNT_STATE_CHANGES,                // binds and enables
+        NUM_COUNTERS
+    };
+
+#if SHOOTER_GL_DEBUG
+
+private:
+    struct GroupStats {
+        std::string         name;
+        unsigned long long  frame[NUM_COUNTERS];    // so far this frame
+        unsigned long long  total[NUM_COUNTERS];
+        unsigned long long  peak[NUM_COUNTERS];     // the most in one frame
+    };
+
+    struct MessageStats {
+        std::string         text;
+        unsigned long long  count;
+    };
+
+    static bool             Initialized;
+    static bool             HaveDebugOutput;        // KHR_debug callback installed
+    static bool             Synchronous;
+
+    static std::vector<GroupStats> Groups;          // 0 is for counts outside any group
+    static std::map<std::string, unsigned> GroupIndex;
+    static std::vector<unsigned> Stack;             // open groups, innermost last
+    static unsigned         Current;                // Groups index the counts go to
+    static unsigned long long NumFrames;
+
+    // written by the callback, which may run on a driver thread
+    static std::mutex       MessageMutex;
+    static std::map<unsigned long long, MessageStats> Messages;    // by type and id
+    static unsigned long long NumErrors;
+    static unsigned long long NumPerformanceWarnings;
+
+    static void GLAPIENTRY  MessageCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
+                                            GLsizei length, const GLchar* message, const void* userParam);
+
+public:
+    // call with the context current, before any counted GL calls
+    static bool             Initialize(bool synchronous = false);
+    static void             Shutdown();
+
+    static void             PushGroup(const char* name);
+    static void             PopGroup();
+
+    static void             Count(Counter counter, unsigned long long n);
+    static void             CountUpload(unsigned long long bytes);
+
+    // once per frame, after the last counted call
+    static void             EndFrame();
+
+    // glGetError, only when there is no debug output
+    static void             CheckErrors(const char* where);
+
+    static unsigned long long GetNumErrors();
+
+    static void             PrintStats();
+
+    // pushes a group for the lifetime of a scope
+    class Group {
+        Group(const Group&);                        // not copyable
+        Group& operator=(const Group&);
+
+    public:
+        explicit Group(const char* name)            { PushGroup(name); }
+        ~Group()                                    { PopGroup(); }
+    };
+
+#else
+
+public:
+    static bool             Initialize(bool = false)    { return true; }
+    static void             Shutdown()                  { }
+    static void             EndFrame()                  { }
+    static unsigned long long GetNumErrors()            { return 0; }
+    static void             PrintStats()                { }
+
+#endif
+};
+
+#if SHOOTER_GL_DEBUG
+
+#define GL_DEBUG_CONCAT_(a, b)      a##b
+#define GL_DEBUG_CONCAT(a, b)       GL_DEBUG_CONCAT_(a, b)
+
+#define GL_DEBUG_GROUP(name)        GLDebug::Group GL_DEBUG_CONCAT(glDebugGroup, __LINE__)(name)
+#define GL_DEBUG_PUSH(name)         GLDebug::PushGroup(name)
+#define GL_DEBUG_POP()              GLDebug::PopGroup()
+#define GL_DEBUG_CALLS(n)           GLDebug::Count(GLDebug::COUNT_CALLS, n)
+#define GL_DEBUG_STATE(n)           GLDebug::Count(GLDebug::COUNT_STATE_CHANGES, n)
+#define GL_DEBUG_DRAW()             GLDebug::Count(GLDebug::COUNT_DRAWS, 1)
+#define GL_DEBUG_UPLOAD(bytes)      GLDebug::CountUpload(bytes)
+#define GL_DEBUG_CHECK(where)       GLDebug::CheckErrors(where)
+
+#else
+
+#define GL_DEBUG_GROUP(name)        ((void)0)
+#define GL_DEBUG_PUSH(name)         ((void)0)
+#define GL_DEBUG_POP()              ((void)0)
+#define GL_DEBUG_CALLS(n)           ((void)0)
+#define GL_DEBUG_STATE(n)           ((void)0)
+#define GL_DEBUG_DRAW()             ((void)0)
+#define GL_DEBUG_UPLOAD(bytes)      ((void)0)
+#define GL_DEBUG_CHECK(where)       ((void)0)
+
+#endif
+
+#endif
@@ -1,4 +1,5 @@
 #include "Game.h"
+#include "GLDebug.h"
 #include "Wavefront.h"
 
 #include <fstream>
@@ -6,15 +7,74 @@
 #include <vector>
 #include <iostream>
 
+const unsigned Game::CHUNKS_PER_JOB = 64;
+
+const float Game::MAX_LATCH_STEP = 0.1f;
+
+const float Game::MAX_SORT_DEPTH = 1000.0f;
+
+const float Game::MUZZLE_FLASHES_PER_SECOND = 2000.0f;
+const float Game::EXPLOSIONS_PER_SECOND = 10.0f;
+
+namespace {
+
+// in [0, 1), from a linear congruential generator
+float RandomFloat(unsigned& seed)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return (seed >> 8) * (1.0f / 16777216.0f);
+}
+
+float RandomRange(unsigned& seed, float lo, float hi)
+{
+    return lo + (hi - lo) * RandomFloat(seed);
+}
+
+}
+
+GameInput::GameInput()
+    : yaw(0)
+    , pitch(0)
+    , worldSpace(false)
+    , resetRotation(false)
+    , toggleOrthographic(false)
+    , toggleAxes(false)
+    , meshStep(0)
+    , cycleDepthMode(false)
+    , toggleLowLatency(false)
+    , toggleSolidGround(false)
+    , toggleClusteredLighting(false)
+{
+}
+
 Game::Game()
     : mUColorProgram(0)
-    , mVColorProgram(0)
     , mUColorDirLightProgram(0)
-    , mPlane(NULL)
+    , mVColorProgram(0)
+    , mTextureDirLightProgram(0)
+    , mDepthProgram(0)
+    , mUColorClusteredProgram(0)
+    , mTextureClusteredProgram(0)
     , mWorldAxes(NULL)
     , mMeshIndex(0)
+    , mMeshNode(TransformHierarchy::NONE)
     , mShowAxes(true)
+    , mSolidGround(false)
+    , mStreamVAO(0)
+    , mGroundMaterial(0)
+    , mAxesMaterial(0)
+    , mMeshMaterial(0)
+    , mDepthMaterial(0)
+    , mDepthMode(DEPTH_MODE_NORMAL)
+    , mClusteredLighting(true)
+    , mFlashesDue(0)
+    , mFlashSeed(12345)
+    , mLowLatency(false)
+    , mLatchPending(false)
+    , mScriptPending(false)
+    , mScriptStep(0)
     , mCamera(NULL)
+    , mViewportHeight(1)
 {
 }
 
@@ -49,6 +109,9 @@ std::vector<std::string> Game::LoadAssetList(const std::string& fname)
 
 bool Game::initialize(int w, int h)
 {
+    // driver errors and performance warnings, in debug builds
+    GLDebug::Initialize();
+
     // set screen clearing color
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
@@ -56,34 +119,253 @@ bool Game::initialize(int w, int h)
 
     glEnable(GL_CULL_FACE);
 
+    // worker threads for loading and per-frame work; this thread is thread 0
+    mJobs.start();
+    mRenderQueue.setNumBuckets(mJobs.getNumThreads());
+
+    // kick off shader builds first, so the driver can compile them while the meshes load
+    mShaderCache.initialize();
+    requestProgram(mUColorProgram, "shaders/ucolor-vs.glsl", "shaders/ucolor-fs.glsl");
+    requestProgram(mVColorProgram, "shaders/vcolor-vs.glsl", "shaders/vcolor-fs.glsl");
+    requestProgram(mUColorDirLightProgram, "shaders/ucolor-DirLight-vs.glsl", "shaders/ucolor-DirLight-fs.glsl");
+    requestProgram(mTextureDirLightProgram, "shaders/texture-DirLight-vs.glsl", "shaders/texture-DirLight-fs.glsl");
+    requestProgram(mDepthProgram, "shaders/depth-vs.glsl", "shaders/depth-fs.glsl");
+    requestProgram(mUColorClusteredProgram, "shaders/clustered-vs.glsl", "shaders/clustered-ucolor-fs.glsl");
+    requestProgram(mTextureClusteredProgram, "shaders/clustered-vs.glsl", "shaders/clustered-texture-fs.glsl");
+
     // load all meshes listed in the asset file
     // - comment out the meshes that you cannot load yet!
+    // - the files are parsed in parallel, the same file listed twice (or two identical files) share one mesh
     std::vector<std::string> meshNames = LoadAssetList("meshes/meshes.txt");
+    std::vector<std::string> meshPaths;
     for (unsigned i = 0; i < meshNames.size(); i++) {
-        mMeshes.push_back(LoadWavefrontOBJ("meshes/" + meshNames[i]));
+        meshPaths.push_back("meshes/" + meshNames[i]);
     }
+    mMeshes = mMeshManager.loadAll(meshPaths, mJobs);
+    mMeshNames = meshNames;
 
-    mPlane = glsh::CreateWireframePlane(100, 100, 100, 100);
+    mTerrain.initialize(mJobs);
     mWorldAxes = glsh::CreateFullAxes(50);
 
-    mUColorProgram = glsh::BuildShaderProgram("shaders/ucolor-vs.glsl", "shaders/ucolor-fs.glsl");
-    mVColorProgram = glsh::BuildShaderProgram("shaders/vcolor-vs.glsl", "shaders/vcolor-fs.glsl");
-    mUColorDirLightProgram = glsh::BuildShaderProgram("shaders/ucolor-DirLight-vs.glsl", "shaders/ucolor-DirLight-fs.glsl");
+    mMeshManager.printStats();
+
+    // start decoding the textures now; they show up as they finish
+    mTextures.initialize();
+    for (unsigned i = 0; i < mMeshes.size(); i++) {
+        if (!mMeshes[i].isValid()) {
+            continue;
+        }
+        const std::vector<OBJMaterial>& materials = mMeshes[i]->mMaterials;
+        for (unsigned j = 0; j < materials.size(); j++) {
+            if (!materials[j].diffuseMap.empty()) {
+                mTextures.request(materials[j].diffuseMap);
+            }
+        }
+    }
+
+    // wait for any shaders that were not in the cache
+    if (!mShaderCache.finish()) {
+        return false;
+    }
 
     mPrograms.push_back(mUColorProgram);
     mPrograms.push_back(mVColorProgram);
     mPrograms.push_back(mUColorDirLightProgram);
+    mPrograms.push_back(mTextureDirLightProgram);
+    mPrograms.push_back(mDepthProgram);
+    mPrograms.push_back(mUColorClusteredProgram);
+    mPrograms.push_back(mTextureClusteredProgram);
+
+    mLighting.initialize();
+
+    mGroundMaterial = mRenderQueue.addMaterial(Material(glm::vec4(0.54f, 0.8f, 0.9f, 1.0f)));
+    mAxesMaterial = mRenderQueue.addMaterial(Material(glm::vec4(1.0f), false));     // world axes ignore depth
+    mMeshMaterial = mRenderQueue.addMaterial(Material(glm::vec4(1.0f, 1.0f, 0.0f, 1.0f)));
+    mDepthMaterial = mRenderQueue.addMaterial(Material());
+
+    // streaming vertex buffer for per-frame geometry (position + color)
+    mStreamBuffer.create(GL_ARRAY_BUFFER, 64 * 1024);
+
+    glGenVertexArrays(1, &mStreamVAO);
+    glBindVertexArray(mStreamVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, mStreamBuffer.getBuffer());
+    glVertexAttribPointer(glsh::VA_POSITION, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (void*)0);
+    glEnableVertexAttribArray(glsh::VA_POSITION);
+    glVertexAttribPointer(glsh::VA_COLOR, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (void*)(3 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(glsh::VA_COLOR);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // fences to limit the frames queued in low-latency mode, and to measure latency in any mode
+    mPacer.initialize();
+    setLowLatency(mLowLatency);
+    mLastLatch = LatchClock::now();
+
+    mMeshNode = mScene.create();
 
     mCamera = new glsh::FreeLookCamera(this);
     mCamera->setPosition(0, 3, 12);
     mCamera->lookAt(0, 0, -12);
 
+    // the ground around the start position, so the first frames aren't missing any
+    mTerrain.prepare(glm::vec3(glm::inverse(mCamera->getViewMatrix())[3]));
+
+    // hot reload
+    std::vector<std::string> watchDirs;
+    watchDirs.push_back("meshes");
+    watchDirs.push_back("shaders");
+    if (!mWatcher.start(watchDirs)) {
+        std::cout << "Warning: Hot reload is disabled" << std::endl;
+    }
+
     return true;
 }
 
 void Game::shutdown()
 {
-    // FIXME: cleanup
+    mWatcher.stop();
+
+    // wait for shader rebuilds still in flight
+    mShaderCache.finish();
+    for (unsigned i = 0; i < mProgramSources.size(); i++) {
+        if (mProgramSources[i].pending) {
+            glDeleteProgram(mProgramSources[i].pending);
+        }
+    }
+    mProgramSources.clear();
+
+    // release the meshes; the manager frees their buffers as the last handle goes away
+    mMeshes.clear();
+    mMeshManager.shutdown();
+
+    mTextures.printStats();
+    mTextures.shutdown();
+
+    mPacer.printStats();
+    mPacer.shutdown();
+
+    mTerrain.printStats();
+    mTerrain.shutdown();
+
+    mLighting.printStats();
+    mLighting.shutdown();
+
+    delete mWorldAxes;
+    mWorldAxes = NULL;
+
+    delete mCamera;
+    mCamera = NULL;
+
+    for (unsigned i = 0; i < mPrograms.size(); i++) {
+        glDeleteProgram(mPrograms[i]);
+    }
+    mPrograms.clear();
+
+    mRecordFile.close();
+
+    glDeleteVertexArrays(1, &mStreamVAO);
+    mStreamVAO = 0;
+    mStreamBuffer.destroy();
+
+    mJobs.printStats();
+    mJobs.stop();
+
+    GLDebug::PrintStats();
+    GLDebug::Shutdown();
+}
+
+void Game::requestProgram(GLuint& program, const std::string& vsPath, const std::string& fsPath)
+{
+    program = mShaderCache.request(vsPath, fsPath);
+
+    ProgramSource src;
+    src.vsPath = vsPath;
+    src.fsPath = fsPath;
+    src.program = &program;
+    src.pending = 0;
+    src.again = false;
+    mProgramSources.push_back(src);
+}
+
+void Game::processReloads()
+{
+    std::vector<std::string> changed;
+    mWatcher.poll(changed);
+
+    for (unsigned i = 0; i < changed.size(); i++) {
+        const std::string& path = changed[i];
+        std::string ext = path.substr(path.find_last_of('.') + 1);
+        if (ext == "obj" || ext == "mtl" || ext == "gz" || ext == "zst") {     // compressed files are OBJs
+            mMeshManager.reload(path);
+        }
+        else if (ext == "glsl") {
+            reloadShader(path);
+        }
+    }
+
+    mMeshManager.update();
+
+    // swap in rebuilt programs once they are linked
+    bool pending = false;
+    for (unsigned i = 0; i < mProgramSources.size(); i++) {
+        pending |= mProgramSources[i].pending != 0;
+    }
+    if (!pending) {
+        return;
+    }
+
+    mShaderCache.poll();
+
+    for (unsigned i = 0; i < mProgramSources.size(); i++) {
+        ProgramSource& src = mProgramSources[i];
+        if (!src.pending || !mShaderCache.isReady(src.pending)) {
+            continue;
+        }
+
+        GLint linked = GL_FALSE;
+        glGetProgramiv(src.pending, GL_LINK_STATUS, &linked);
+        if (linked) {
+            GLuint old = *src.program;
+            for (unsigned j = 0; j < mPrograms.size(); j++) {
+                if (mPrograms[j] == old) {
+                    mPrograms[j] = src.pending;
+                }
+            }
+            *src.program = src.pending;
+
+            mRenderQueue.forgetProgram(old);
+            glDeleteProgram(old);
+
+            std::cout << "Reloaded " << src.vsPath << " + " << src.fsPath << std::endl;
+        }
+        else {
+            // the errors were already printed; keep drawing with the old program
+            glDeleteProgram(src.pending);
+            std::cout << "Warning: Keeping the old program for " << src.vsPath << " + " << src.fsPath << std::endl;
+        }
+        src.pending = 0;
+
+        if (src.again) {
+            src.again = false;
+            src.pending = mShaderCache.request(src.vsPath, src.fsPath);
+        }
+    }
+}
+
+void Game::reloadShader(const std::string& path)
+{
+    for (unsigned i = 0; i < mProgramSources.size(); i++) {
+        ProgramSource& src = mProgramSources[i];
+        if (src.vsPath != path && src.fsPath != path) {
+            continue;
+        }
+        if (src.pending) {
+            src.again = true;
+        }
+        else {
+            src.pending = mShaderCache.request(src.vsPath, src.fsPath);
+        }
+    }
 }
 
 void Game::resize(int w, int h)
@@ -92,90 +374,402 @@ void Game::resize(int w, int h)
     glViewport(0, 0, w, h);
 
     mCamera->setViewportSize(w, h);         // !!!!111!!!@22(*#*&@!!
+    mViewportHeight = h;
+    mLighting.setViewportSize(w, h);
 }
 
 void Game::draw()
 {
+    // in low-latency mode, wait here until the GPU has caught up, before any input is read
+    mPacer.beginFrame();
+
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);   // !!!!!!111!!1!!!11!^&#(!@^(!!!!!!
+    GL_DEBUG_CALLS(1);
+
+    // GL work that jobs handed back to this thread
+    {
+        GL_DEBUG_GROUP("main thread jobs");
+        mJobs.runMainThreadJobs();
+    }
+
+    // create the textures that finished decoding and stream in mips for last frame's sizes
+    {
+        GL_DEBUG_GROUP("textures");
+        mTextures.update();
+    }
+
+    mStreamBuffer.beginFrame();
+
+    // everything slow is done, read the input as late as possible
+    if (mLatchPending) {
+        latchInput();
+    }
 
     glm::mat4 projMatrix = mCamera->getProjectionMatrix();
     glm::mat4 viewMatrix = mCamera->getViewMatrix();
 
+    OBJMesh* mesh = NULL;
+    if (mMeshIndex < mMeshes.size()) {
+        mesh = mMeshes[mMeshIndex].get();
+    }
+
+    // the programs for lit surfaces
+    GLuint litProgram = mUColorDirLightProgram;
+    GLuint texturedProgram = mTextureDirLightProgram;
+
+    if (mClusteredLighting) {
+        GL_DEBUG_GROUP("lights");
+
+        // assign them to clusters on the workers, then upload the lists (before the uniforms
+        // below, which depend on this frame's projection)
+        mLighting.update(mLights, viewMatrix, projMatrix, mJobs);
+        mLighting.bind();
+
+        litProgram = mUColorClusteredProgram;
+        texturedProgram = mTextureClusteredProgram;
+    }
+
+    GL_DEBUG_PUSH("frame uniforms");
+
     // send projection matrix to ALL programs
     for (unsigned i = 0; i < mPrograms.size(); i++) {
         glUseProgram(mPrograms[i]);
         glsh::SetShaderUniform("u_ProjectionMatrix", projMatrix);
+        GL_DEBUG_STATE(1);
+        GL_DEBUG_CALLS(2);      // the uniform's location and value
     }
 
-    if (mShowAxes) {
-        // draw ground plane
-        glUseProgram(mUColorProgram);
-        glsh::SetShaderUniform("u_ModelViewMatrix", viewMatrix);
-        glsh::SetShaderUniform("u_Color", glm::vec4(0.54f, 0.8f, 0.9f, 1.0f));
-        mPlane->draw();
-
-        // draw world axes
-        glUseProgram(mVColorProgram);
-        glDisable(GL_DEPTH_TEST);       // temporarily disable depth test
-        glsh::SetShaderUniform("u_ModelViewMatrix", viewMatrix);
-        mWorldAxes->draw();
-        glEnable(GL_DEPTH_TEST);        // restore depth test
+    // set lighting parameters for the directional light shaders
+    glm::vec3 lightDir(1.5f, 2.0f, 3.0f);           // direction to light in world space
+    lightDir = glm::mat3(viewMatrix) * lightDir;    // direction to light in camera space
+    lightDir = glm::normalize(lightDir);            // normalized for sanity
+    GLuint litPrograms[4] = { mUColorDirLightProgram, mTextureDirLightProgram, mUColorClusteredProgram, mTextureClusteredProgram };
+    for (unsigned i = 0; i < 4; i++) {
+        glUseProgram(litPrograms[i]);
+        glsh::SetShaderUniform("u_LightDir", lightDir);
+        glsh::SetShaderUniform("u_LightColor", glm::vec3(1.0f, 1.0f, 1.0f));
+        GL_DEBUG_STATE(1);
+        GL_DEBUG_CALLS(4);
+        if (i >= 2) {
+            mLighting.setUniforms();
+        }
     }
 
+    GL_DEBUG_POP();
 
+    DrawBucket& bucket = mRenderQueue.getBucket(0);
+
+    if (mShowAxes) {
+        // ground: stream chunks around the camera and draw the ones in view
+        glm::vec3 cameraPos(glm::inverse(viewMatrix)[3]);
+        {
+            GL_DEBUG_GROUP("terrain");
+            mTerrain.update(cameraPos, projMatrix * viewMatrix);
+        }
+
+        DrawItem ground;
+        ground.program = mSolidGround ? litProgram : mUColorProgram;
+        ground.material = mGroundMaterial;
+        mTerrain.submit(bucket, ground, viewMatrix, PASS_BACKGROUND, !mSolidGround, MAX_SORT_DEPTH);
+
+        // world axes (no depth test)
+        DrawItem axes;
+        axes.program = mVColorProgram;
+        axes.material = mAxesMaterial;
+        axes.mesh = mWorldAxes;
+        axes.modelView = viewMatrix;
+        axes.key = RenderQueue::MakeKey(PASS_AXES, axes.program, axes.material, 0, 0, 1);
+        bucket.submit(axes);
+    }
 
     //
     // draw the active mesh
     //
 
-    glsh::Mesh* mesh = NULL;
-    if (mMeshIndex < mMeshes.size()) {
-        mesh = mMeshes[mMeshIndex];
-    }
+    // world matrices of whatever moved since the last frame
+    mScene.update(&mJobs);
 
     if (mesh) {
-        glUseProgram(mUColorDirLightProgram);
+        glm::mat4 MV = viewMatrix * mScene.getWorld(mMeshNode);
+
+        DrawItem item;
+        item.program = litProgram;
+        item.material = mMeshMaterial;
+        item.mode = GL_TRIANGLES;
+        item.indexType = GL_UNSIGNED_INT;
+        item.modelView = MV;
+        item.normalMatrix = glm::mat3(viewMatrix) * mScene.getNormal(mMeshNode);     // the view is a rotation, its own inverse transpose
+        item.hasNormalMatrix = true;
+
+        if (mDepthMode != DEPTH_MODE_NORMAL) {
+            // lay down depth first, fetching nothing but the positions
+            DrawItem depth = item;
+            depth.program = mDepthProgram;
+            depth.material = mDepthMaterial;
+            depth.hasNormalMatrix = false;
+            mJobs.parallelFor(mesh->mChunks.size(), CHUNKS_PER_JOB, [this, mesh, &MV, depth](size_t begin, size_t end) {
+                DrawBucket& jobBucket = mRenderQueue.getBucket(mJobs.getThreadIndex());
+                DrawItem chunkItem = depth;
+                for (size_t i = begin; i < end; i++) {
+                    chunkItem.vao = mesh->getDepthVAO((unsigned)i);
+                    chunkItem.count = mesh->mChunks[i].numIndices;
+                    chunkItem.key = RenderQueue::MakeKey(PASS_DEPTH, chunkItem.program, chunkItem.material, chunkItem.vao, -MV[3].z, MAX_SORT_DEPTH);
+                    jobBucket.submit(chunkItem);
+                }
+            });
+        }
 
-        // set lighting parameters for the directional light shader
-        glm::vec3 lightDir(1.5f, 2.0f, 3.0f);           // direction to light in world space
-        lightDir = glm::mat3(viewMatrix) * lightDir;    // direction to light in camera space
-        lightDir = glm::normalize(lightDir);            // normalized for sanity
-        glsh::SetShaderUniform("u_LightDir", lightDir);
-        glsh::SetShaderUniform("u_LightColor", glm::vec3(1.0f, 1.0f, 1.0f));
+        if (mDepthMode == DEPTH_MODE_ONLY) {
+            // no color pass
+        }
+        else if (mesh->mChunks.size() == 1 && !mesh->mMaterialRanges.empty()) {
+            // rough on-screen diameter of the mesh, which its textures are assumed to cover
+            float dist = -MV[3].z;
+            float screenSize = mesh->mRadius * projMatrix[1][1] * mViewportHeight;
+            if (projMatrix[3][3] == 0) {
+                screenSize /= (dist > 0.001f ? dist : 0.001f);     // perspective
+            }
+
+            // one draw per material; the faces are sorted so each is a single index range
+            item.vao = mesh->mChunks[0].vao;
+            for (unsigned i = 0; i < mesh->mMaterialRanges.size(); i++) {
+                const OBJSubmesh& range = mesh->mMaterialRanges[i];
+                const OBJMaterial& objMat = mesh->mMaterials[range.material];
+
+                GLuint texture = 0;
+                if (!objMat.diffuseMap.empty() && mesh->mTexCoordSize > 0) {
+                    unsigned texId = mTextures.request(objMat.diffuseMap);
+                    mTextures.setScreenSize(texId, screenSize);
+                    texture = mTextures.getTexture(texId);
+                }
+
+                // untextured until the texture has been decoded
+                item.program = texture ? texturedProgram : litProgram;
+                item.material = objMat.defined ? mRenderQueue.findMaterial(Material(glm::vec4(objMat.diffuse, 1.0f), true, texture)) : mMeshMaterial;
+                item.indexOffset = (const GLvoid*)(size_t)(range.firstIndex * sizeof(unsigned));
+                item.count = (GLsizei)range.numIndices;
+                item.key = RenderQueue::MakeKey(PASS_OPAQUE, item.program, item.material, item.vao, -MV[3].z, MAX_SORT_DEPTH);
+                bucket.submit(item);
+            }
+            item.indexOffset = NULL;
+            item.program = litProgram;
+            item.material = mMeshMaterial;
+        }
+        else {
+            // one draw per chunk (only huge meshes have more than one), built on the workers
+            mJobs.parallelFor(mesh->mChunks.size(), CHUNKS_PER_JOB, [this, mesh, &MV, item](size_t begin, size_t end) {
+                DrawBucket& jobBucket = mRenderQueue.getBucket(mJobs.getThreadIndex());
+                DrawItem chunkItem = item;
+                for (size_t i = begin; i < end; i++) {
+                    chunkItem.vao = mesh->mChunks[i].vao;
+                    chunkItem.count = mesh->mChunks[i].numIndices;
+                    chunkItem.key = RenderQueue::MakeKey(PASS_OPAQUE, chunkItem.program, chunkItem.material, chunkItem.vao, -MV[3].z, MAX_SORT_DEPTH);
+                    jobBucket.submit(chunkItem);
+                }
+            });
+        }
 
-        // set transform and material properties
-        glm::mat4 MV = viewMatrix * mMeshRotMatrix;
-        glsh::SetShaderUniform("u_ModelViewMatrix", MV);
-        glsh::SetShaderUniform("u_NormalMatrix", glm::transpose(glm::inverse(glm::mat3(MV))));
+        // the mesh's local axes
+        if (mShowAxes) {
+            submitMeshAxes(bucket, MV);
+        }
+    }
+
+    {
+        GL_DEBUG_GROUP("render queue");
 
-        // set material properties
-        glsh::SetShaderUniform("u_Color", glm::vec4(1.0f, 1.0f, 0.0f, 1.0f));
+        // everything in the stream buffer must be visible to the GL before the draws execute
+        mStreamBuffer.flush();
 
-        // issue drawing call
-        mesh->draw();
+        mRenderQueue.sort();
+        mRenderQueue.execute();
+
+        mStreamBuffer.endFrame();
     }
 
-    GLSH_CHECK_GL_ERRORS("drawing");
+    mPacer.endFrame();
+
+    GL_DEBUG_CHECK("drawing");
+    GLDebug::EndFrame();
 }
 
+void Game::setLowLatency(bool enable)
+{
+    mLowLatency = enable;
+    mLatchPending = false;
+    mPacer.setMaxQueuedFrames(enable ? 1 : FramePacer::MAX_TRACKED_FRAMES);
+    mLastLatch = LatchClock::now();
+}
 
-void Game::update(float dt)
+const char* Game::GetDepthModeName(DepthMode mode)
 {
-    const glsh::Keyboard* kb = getKeyboard();
+    switch (mode) {
+    case DEPTH_MODE_NORMAL:     return "normal";
+    case DEPTH_MODE_PREPASS:    return "prepass";
+    case DEPTH_MODE_ONLY:       return "only";
+    default:                    return "?";
+    }
+}
+
+void Game::submitMeshAxes(DrawBucket& bucket, const glm::mat4& MV)
+{
+    const int numVerts = 6;
+    const GLsizeiptr vertSize = 7 * sizeof(GLfloat);
 
-    if (kb->keyPressed(glsh::KC_ESCAPE)) {
-        quit();  // request to exit
+    // align to the vertex size, so the offset can be passed to glDrawArrays as the first vertex
+    StreamAllocation alloc = mStreamBuffer.allocate(numVerts * vertSize, vertSize);
+    if (!alloc.ptr) {
         return;
     }
 
-    if (kb->keyPressed(glsh::KC_O)) {
-        mCamera->toggleOrthographic();
+    // write straight into the buffer: a line from the origin along each axis, colored red, green and blue
+    GLfloat* v = (GLfloat*)alloc.ptr;
+    for (int axis = 0; axis < 3; axis++) {
+        for (int end = 0; end < 2; end++) {
+            *v++ = (end && axis == 0) ? 2.0f : 0.0f;
+            *v++ = (end && axis == 1) ? 2.0f : 0.0f;
+            *v++ = (end && axis == 2) ? 2.0f : 0.0f;
+            *v++ = (axis == 0) ? 1.0f : 0.0f;
+            *v++ = (axis == 1) ? 1.0f : 0.0f;
+            *v++ = (axis == 2) ? 1.0f : 0.0f;
+            *v++ = 1.0f;
+        }
     }
 
-    if (kb->keyPressed(glsh::KC_V)) {
-        mShowAxes ^= true;
+    // drawn on top of the mesh
+    DrawItem item;
+    item.program = mVColorProgram;
+    item.material = mAxesMaterial;
+    item.vao = mStreamVAO;
+    item.mode = GL_LINES;
+    item.first = (GLint)(alloc.offset / vertSize);
+    item.count = numVerts;
+    item.modelView = MV;
+    item.key = RenderQueue::MakeKey(PASS_OVERLAY, item.program, item.material, item.vao, 0, 1);
+    bucket.submit(item);
+}
+
+void Game::updateFlashes(float dt, float sceneRadius)
+{
+    // age the flashes, and fade them out
+    mLights.clear();
+    for (size_t i = 0; i < mFlashes.size(); ) {
+        Flash& flash = mFlashes[i];
+        flash.age += dt;
+        if (flash.age >= flash.lifetime) {
+            flash = mFlashes.back();
+            mFlashes.pop_back();
+            continue;
+        }
+        float fade = 1.0f - flash.age / flash.lifetime;
+        mLights.push_back(PointLight(flash.light.position, flash.light.radius, flash.light.color * (fade * fade)));
+        ++i;
+    }
+
+    // and start new ones, anywhere around the mesh
+    const float total = MUZZLE_FLASHES_PER_SECOND + EXPLOSIONS_PER_SECOND;
+    mFlashesDue += dt * total;
+    while (mFlashesDue >= 1.0f) {
+        mFlashesDue -= 1.0f;
+
+        Flash flash;
+        flash.age = 0;
+        flash.light.position = glm::vec3(RandomRange(mFlashSeed, -1.5f, 1.5f) * sceneRadius,
+                                         RandomRange(mFlashSeed, -0.5f, 1.0f) * sceneRadius,
+                                         RandomRange(mFlashSeed, -1.5f, 1.5f) * sceneRadius);
+        if (RandomFloat(mFlashSeed) * total < EXPLOSIONS_PER_SECOND) {
+            flash.light.radius = RandomRange(mFlashSeed, 0.6f, 1.2f) * sceneRadius;
+            flash.light.color = glm::vec3(1.0f, 0.45f, 0.1f) * 4.0f;
+            flash.lifetime = RandomRange(mFlashSeed, 0.6f, 1.2f);
+        }
+        else {
+            flash.light.radius = RandomRange(mFlashSeed, 0.1f, 0.25f) * sceneRadius;
+            flash.light.color = glm::vec3(1.0f, 0.8f, 0.4f) * 3.0f;
+            flash.lifetime = RandomRange(mFlashSeed, 0.05f, 0.12f);
+        }
+        mFlashes.push_back(flash);
+    }
+}
+
+void Game::stepFlashes(float dt)
+{
+    if (!mClusteredLighting) {
+        return;
     }
 
+    OBJMesh* mesh = NULL;
+    if (mMeshIndex < mMeshes.size()) {
+        mesh = mMeshes[mMeshIndex].get();
+    }
+    updateFlashes(dt, mesh ? mesh->mRadius : 5.0f);
+}
+
+void Game::update(float dt)
+{
+    processReloads();
+
+    stepFlashes(dt);
+
+    GameInput input;
+
+    if (mScriptPending) {
+        mScriptStep = dt;
+    }
+    else {
+        const glsh::Keyboard* kb = getKeyboard();
+
+        if (kb->keyPressed(glsh::KC_ESCAPE)) {
+            quit();  // request to exit
+            return;
+        }
+
+        input.toggleOrthographic = kb->keyPressed(glsh::KC_O);
+        input.toggleAxes = kb->keyPressed(glsh::KC_V);
+        input.cycleDepthMode = kb->keyPressed(glsh::KC_P);
+        input.toggleLowLatency = kb->keyPressed(glsh::KC_L);
+        input.toggleSolidGround = kb->keyPressed(glsh::KC_G);
+        input.toggleClusteredLighting = kb->keyPressed(glsh::KC_F);
+
+        // reset mesh orientation
+        input.resetRotation = kb->keyPressed(glsh::KC_R);
+
+        // cycle through the meshes
+        if (kb->keyPressed(glsh::KC_X)) {
+            input.meshStep = 1;
+        }
+        if (kb->keyPressed(glsh::KC_Z)) {
+            input.meshStep = -1;
+        }
+    }
+
+    if (mLowLatency) {
+        // the held keys and the camera are read right before the draws are built, and all of the
+        // input is applied there at once (see latchInput)
+        mLatchInput = input;
+        mLatchPending = true;
+        return;
+    }
+
+    readHeldKeys(input, dt);
+
+    applyInput(input, dt);
+
+    moveCamera(dt);
+
+    recordFrame(input, dt);
+}
+
+void Game::readHeldKeys(GameInput& input, float dt) const
+{
+    if (mScriptPending) {
+        input.yaw = mScriptInput.yaw;
+        input.pitch = mScriptInput.pitch;
+        input.worldSpace = mScriptInput.worldSpace;
+        return;
+    }
+
+    const glsh::Keyboard* kb = getKeyboard();
+
     const float rotSpeed = glsh::PI;
 
     //
@@ -183,49 +777,125 @@ void Game::update(float dt)
     // Hold CTRL to pitch and yaw in world space.
     //
 
-    float yaw = 0;
-    float pitch = 0;
     if (kb->isKeyDown(glsh::KC_LEFT)) {
-        yaw -= dt * rotSpeed;
+        input.yaw -= dt * rotSpeed;
     }
     if (kb->isKeyDown(glsh::KC_RIGHT)) {
-        yaw += dt * rotSpeed;
+        input.yaw += dt * rotSpeed;
     }
     if (kb->isKeyDown(glsh::KC_UP)) {
-        pitch += dt * rotSpeed;
+        input.pitch += dt * rotSpeed;
     }
     if (kb->isKeyDown(glsh::KC_DOWN)) {
-        pitch -= dt * rotSpeed;
+        input.pitch -= dt * rotSpeed;
     }
+    input.worldSpace = kb->isKeyDown(glsh::KC_CTRL);
+}
 
-    // rotate the mesh
-    if (kb->isKeyDown(glsh::KC_CTRL)) {
-        // apply rotations about the world axes
-        glm::vec3 xAxis = glm::vec3(1.0f, 0.0f, 0.0f);
-        glm::vec3 yAxis = glm::vec3(0.0f, 1.0f, 0.0f);
-        glm::quat yawQuat = glsh::CreateQuaternion(yaw, yAxis);
-        glm::quat pitchQuat = glsh::CreateQuaternion(pitch, xAxis);
-        glm::quat Q = pitchQuat * yawQuat;
-        mMeshRotMatrix = glm::toMat4(Q) * mMeshRotMatrix;
+void Game::latchInput()
+{
+    mLatchPending = false;
+
+    // the time since the last latch, so the motion stays as fast as with update()'s dt
+    LatchClock::time_point now = LatchClock::now();
+    float dt = std::chrono::duration<float>(now - mLastLatch).count();
+    mLastLatch = now;
+    if (dt > MAX_LATCH_STEP) {
+        dt = MAX_LATCH_STEP;
     }
-    else {
-        // apply rotations about the model's local axes
-        glm::vec3 xAxis = glm::vec3(mMeshRotMatrix[0]);
-        glm::vec3 yAxis = glm::vec3(mMeshRotMatrix[1]);
-        glm::quat yawQuat = glsh::CreateQuaternion(yaw, yAxis);
-        glm::quat pitchQuat = glsh::CreateQuaternion(pitch, yawQuat * xAxis);
-        glm::quat Q = pitchQuat * yawQuat;
-        mMeshRotMatrix = glm::toMat4(Q) * mMeshRotMatrix;
+    if (mScriptPending) {
+        dt = mScriptStep;       // scripted frames keep their simulated step
     }
 
-    // reset mesh orientation
-    if (kb->keyPressed(glsh::KC_R)) {
-        mMeshRotMatrix = glm::mat4(1.0f);
+    // one applyInput per frame, so the input is marked once, as late as possible
+    GameInput input = mLatchInput;
+    mLatchInput = GameInput();
+    readHeldKeys(input, dt);
+    applyInput(input, dt);
+
+    moveCamera(dt);
+
+    recordFrame(input, dt);
+}
+
+void Game::recordFrame(const GameInput& input, float dt)
+{
+    if (mRecordFile.is_open()) {
+        // camera pose from the inverse of the view matrix
+        glm::mat4 camMatrix = glm::inverse(mCamera->getViewMatrix());
+        glm::vec3 pos = glm::vec3(camMatrix[3]);
+        glm::vec3 target = pos - glm::vec3(camMatrix[2]);
+
+        // one frame per line, rotation as a rate so the script can be replayed at any step
+        float yawRate = dt > 0 ? input.yaw / dt : 0;
+        float pitchRate = dt > 0 ? input.pitch / dt : 0;
+        mRecordFile << "1 " << pos.x << ' ' << pos.y << ' ' << pos.z << ' '
+                    << target.x << ' ' << target.y << ' ' << target.z << ' '
+                    << yawRate << ' ' << pitchRate << (input.worldSpace ? " world" : "") << '\n';
+    }
+}
+
+void Game::applyInput(const GameInput& input, float dt)
+{
+    if (input.toggleOrthographic) {
+        mCamera->toggleOrthographic();
+    }
+
+    if (input.toggleAxes) {
+        mShowAxes ^= true;
+    }
+
+    if (input.toggleSolidGround) {
+        mSolidGround ^= true;
+    }
+
+    if (input.toggleClusteredLighting) {
+        mClusteredLighting ^= true;
+        std::cout << "Clustered lighting: " << (mClusteredLighting ? "on" : "off") << std::endl;
+    }
+
+    if (input.cycleDepthMode) {
+        mDepthMode = (DepthMode)((mDepthMode + 1) % NUM_DEPTH_MODES);
+        std::cout << "Depth mode: " << GetDepthModeName(mDepthMode) << std::endl;
+    }
+
+    if (input.toggleLowLatency) {
+        setLowLatency(!mLowLatency);
+        std::cout << "Low latency: " << (mLowLatency ? "on" : "off") << std::endl;
+    }
+
+    // this frame shows the input read so far
+    mPacer.markInput();
+
+    // rotate the mesh (only when it turns, so its transform stays clean otherwise)
+    if (input.yaw != 0 || input.pitch != 0) {
+        const glm::quat rotation = mScene.getRotation(mMeshNode);
+        if (input.worldSpace) {
+            // apply rotations about the world axes
+            glm::vec3 xAxis = glm::vec3(1.0f, 0.0f, 0.0f);
+            glm::vec3 yAxis = glm::vec3(0.0f, 1.0f, 0.0f);
+            glm::quat yawQuat = glsh::CreateQuaternion(input.yaw, yAxis);
+            glm::quat pitchQuat = glsh::CreateQuaternion(input.pitch, xAxis);
+            glm::quat Q = pitchQuat * yawQuat;
+            mScene.setRotation(mMeshNode, glm::normalize(Q * rotation));
+        }
+        else {
+            // apply rotations about the model's local axes
+            glm::vec3 xAxis = rotation * glm::vec3(1.0f, 0.0f, 0.0f);
+            glm::vec3 yAxis = rotation * glm::vec3(0.0f, 1.0f, 0.0f);
+            glm::quat yawQuat = glsh::CreateQuaternion(input.yaw, yAxis);
+            glm::quat pitchQuat = glsh::CreateQuaternion(input.pitch, yawQuat * xAxis);
+            glm::quat Q = pitchQuat * yawQuat;
+            mScene.setRotation(mMeshNode, glm::normalize(Q * rotation));
+        }
+    }
+
+    if (input.resetRotation) {
+        mScene.setRotation(mMeshNode, glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
     }
 
     // cycle through the meshes
-    // cycle through the meshes
-    if (kb->keyPressed(glsh::KC_X)) {
+    if (input.meshStep > 0 && !mMeshes.empty()) {
         if (mMeshIndex < mMeshes.size() - 1) {
             ++mMeshIndex;
         }
@@ -233,7 +903,7 @@ void Game::update(float dt)
             mMeshIndex = 0;
         }
     }
-    if (kb->keyPressed(glsh::KC_Z)) {
+    if (input.meshStep < 0 && !mMeshes.empty()) {
         if (mMeshIndex > 0) {
             --mMeshIndex;
         }
@@ -241,6 +911,49 @@ void Game::update(float dt)
             mMeshIndex = mMeshes.size() - 1;
         }
     }
+}
+
+bool Game::selectMesh(unsigned i)
+{
+    if (i >= mMeshes.size()) {
+        return false;
+    }
+    mMeshIndex = i;
+    return mMeshes[i].isValid();
+}
+
+void Game::setCameraPose(const glm::vec3& position, const glm::vec3& target)
+{
+    mCamera->setPosition(position.x, position.y, position.z);
+    mCamera->lookAt(target.x, target.y, target.z);
+}
+
+void Game::setScriptedFrame(const GameInput& input, const glm::vec3& position, const glm::vec3& target)
+{
+    mScriptPending = true;
+    mScriptInput = input;
+    mScriptPosition = position;
+    mScriptTarget = target;
+}
+
+void Game::moveCamera(float dt)
+{
+    if (mScriptPending) {
+        setCameraPose(mScriptPosition, mScriptTarget);
+        mScriptPending = false;
+    }
+    else {
+        mCamera->update(dt);
+    }
+}
 
-    mCamera->update(dt);
+bool Game::startRecording(const std::string& path)
+{
+    mRecordFile.open(path.c_str());
+    if (!mRecordFile) {
+        std::cerr << "ERROR: Failed to open " << path << " for recording" << std::endl;
+        return false;
+    }
+    mRecordFile << "# recorded camera script: frames  px py pz  tx ty tz  yawRate pitchRate [world]" << std::endl;
+    return true;
 }
@@ -2,40 +2,235 @@
 #define GAME_H_
 
 #include "GLSH.h"
+#include "ClusteredLighting.h"
+#include "FileWatcher.h"
+#include "FramePacer.h"
+#include "JobSystem.h"
+#include "MeshManager.h"
+#include "RenderQueue.h"
+#include "ShaderCache.h"
+#include "StreamBuffer.h"
+#include "Terrain.h"
+#include "TransformHierarchy.h"
+#include "TextureManager.h"
+#include "Wavefront.h"
 
+#include <chrono>
+#include <fstream>
+#include <string>
 #include <vector>
 
+// how the meshes are drawn
+enum DepthMode {
+    DEPTH_MODE_NORMAL,          // one pass that writes color and depth
+    DEPTH_MODE_PREPASS,         // a depth-only pass first, then color without depth writes
+    DEPTH_MODE_ONLY,            // the depth-only pass alone (like a shadow map pass)
+    NUM_DEPTH_MODES
+};
+
+// one frame of player input, from the keyboard or from a benchmark script
+struct GameInput {
+    float                   yaw;            // mesh rotation this frame (radians)
+    float                   pitch;
+    bool                    worldSpace;     // rotate about the world axes instead of the mesh's own
+    bool                    resetRotation;
+    bool                    toggleOrthographic;
+    bool                    toggleAxes;
+    int                     meshStep;       // +1 / -1 to cycle through the meshes
+    bool                    cycleDepthMode;
+    bool                    toggleLowLatency;
+    bool                    toggleSolidGround;
+    bool                    toggleClusteredLighting;
+
+    GameInput();
+};
+
 class Game : public glsh::App {
 
+    JobSystem               mJobs;              // owns the worker threads, started first and stopped last
+
     GLuint                  mUColorProgram;
     GLuint                  mUColorDirLightProgram;
     GLuint                  mVColorProgram;
+    GLuint                  mTextureDirLightProgram;
+    GLuint                  mDepthProgram;
+    GLuint                  mUColorClusteredProgram;
+    GLuint                  mTextureClusteredProgram;
 
     std::vector<GLuint>     mPrograms;
 
-    glsh::Mesh* mPlane;
+    // where each program comes from, so it can be rebuilt when a shader file changes
+    struct ProgramSource {
+        std::string         vsPath;
+        std::string         fsPath;
+        GLuint*             program;        // the member that holds it
+        GLuint              pending;        // rebuild in progress, 0 if none
+        bool                again;          // changed again during the rebuild
+    };
+    std::vector<ProgramSource> mProgramSources;
+
+    ShaderCache             mShaderCache;
+
+    Terrain                 mTerrain;           // streamed ground around the camera
     glsh::Mesh* mWorldAxes;
 
-    std::vector<glsh::Mesh*> mMeshes;       // list of viewable meshes
+    MeshManager             mMeshManager;
+    std::vector<MeshHandle>  mMeshes;       // list of viewable meshes (invalid if loading failed)
+    std::vector<std::string> mMeshNames;    // file names from meshes.txt
     unsigned                 mMeshIndex;    // index of the currently displayed mesh
 
-    glm::mat4               mMeshRotMatrix;    // transform of the currently displayed mesh
+    TransformHierarchy      mScene;
+    unsigned                mMeshNode;          // transform of the currently displayed mesh
+
+    TextureManager          mTextures;          // diffuse maps from the MTL files, streamed in while drawing
+
+    bool                    mShowAxes;          // and the ground
+    bool                    mSolidGround;       // lit triangles instead of grid lines
+
+    StreamBuffer            mStreamBuffer;      // per-frame vertex data
+    GLuint                  mStreamVAO;         // position + color layout over mStreamBuffer
+
+    RenderQueue             mRenderQueue;
+    unsigned                mGroundMaterial;
+    unsigned                mAxesMaterial;
+    unsigned                mMeshMaterial;
+    unsigned                mDepthMaterial;
 
-    bool                    mShowAxes;
+    DepthMode               mDepthMode;
+
+    // per-pixel lighting with the point lights below, instead of the per-vertex directional light
+    ClusteredLighting       mLighting;
+    bool                    mClusteredLighting;
+
+    // short-lived point lights, muzzle flashes and explosions around the mesh
+    struct Flash {
+        PointLight          light;          // at full strength
+        float               age;
+        float               lifetime;
+    };
+    std::vector<Flash>      mFlashes;
+    std::vector<PointLight> mLights;        // this frame's, faded with age
+    float                   mFlashesDue;    // spawns carried over to the next step
+    unsigned                mFlashSeed;     // the same flashes on every run
+
+    static const float      MUZZLE_FLASHES_PER_SECOND;
+    static const float      EXPLOSIONS_PER_SECOND;
+
+    // low-latency mode: at most one frame queued, and the held keys and the camera are read in
+    // draw() right before the draws are built instead of in update()
+    typedef std::chrono::steady_clock LatchClock;
+    FramePacer              mPacer;
+    bool                    mLowLatency;
+    bool                    mLatchPending;      // update() left the input for draw()
+    GameInput               mLatchInput;        // the keys update() saw pressed, applied at the latch
+    LatchClock::time_point  mLastLatch;
+
+    // the benchmark's rotation and camera pose for the next update(), in place of the held keys
+    // and the free-look camera
+    bool                    mScriptPending;
+    GameInput               mScriptInput;
+    glm::vec3               mScriptPosition;
+    glm::vec3               mScriptTarget;
+    float                   mScriptStep;        // that update()'s dt, which a late latch uses too
+
+    // longest time step a late latch applies (after a hitch)
+    static const float      MAX_LATCH_STEP;
+
+    // view depth that maps to the far end of the sort key's depth range
+    static const float      MAX_SORT_DEPTH;
+
+    // mesh chunks per draw-building job
+    static const unsigned   CHUNKS_PER_JOB;
 
     glsh::FreeLookCamera* mCamera;
+    int                     mViewportHeight;    // for on-screen texture sizes
 
-    static std::vector<std::string> LoadAssetList(const std::string& fname);
+    std::ofstream           mRecordFile;        // camera script being recorded, if open
+
+    FileWatcher             mWatcher;           // meshes/ and shaders/, for hot reload
+
+    void                    submitMeshAxes(DrawBucket& bucket, const glm::mat4& MV);
+
+    // spawn and age the flashes, within sceneRadius of the origin
+    void                    updateFlashes(float dt, float sceneRadius);
+
+    // the same around the current mesh, if clustered lighting is on (update() does this with its dt)
+    void                    stepFlashes(float dt);
+
+    // mesh rotation from the arrow keys (or from the script)
+    void                    readHeldKeys(GameInput& input, float dt) const;
+
+    // free-look camera update, or the script's pose
+    void                    moveCamera(float dt);
+
+    // read the held keys and update the camera, just before drawing (low-latency mode)
+    void                    latchInput();
+
+    // append the camera pose to the recording, if one is open
+    void                    recordFrame(const GameInput& input, float dt);
+
+    void                    requestProgram(GLuint& program, const std::string& vsPath, const std::string& fsPath);
+
+    // pick up changed files: meshes are re-parsed on worker threads and shaders are
+    // rebuilt in the background, and each is swapped in once it's ready
+    void                    processReloads();
+    void                    reloadShader(const std::string& path);
 
 public:
     Game();
     ~Game();
 
+    // non-comment lines of an asset list such as meshes/meshes.txt (exits if it can't be read)
+    static std::vector<std::string> LoadAssetList(const std::string& fname);
+
     bool                    initialize(int w, int h)    override;
     void                    shutdown()                  override;
     void                    resize(int w, int h)        override;
     void                    draw()                      override;
     void                    update(float dt)            override;
+
+    // apply one frame of input (update() does this with the keyboard state)
+    void                    applyInput(const GameInput& input, float dt);
+
+    //
+    // hooks for the benchmark harness
+    //
+
+    unsigned                getNumMeshes() const        { return (unsigned)mMeshes.size(); }
+    const std::string&      getMeshName(unsigned i) const { return mMeshNames[i]; }
+
+    // show mesh i, returns false if it failed to load
+    bool                    selectMesh(unsigned i);
+
+    void                    setCameraPose(const glm::vec3& position, const glm::vec3& target);
+
+    // drive the next update() from a script: the rotation (yaw, pitch and worldSpace) of input
+    // instead of the held keys, and a camera pose instead of the free-look camera; the pressed
+    // keys are not read
+    void                    setScriptedFrame(const GameInput& input, const glm::vec3& position, const glm::vec3& target);
+
+    void                    setDepthMode(DepthMode mode)    { mDepthMode = mode; }
+    DepthMode               getDepthMode() const            { return mDepthMode; }
+    static const char*      GetDepthModeName(DepthMode mode);
+
+    void                    setClusteredLighting(bool enable)   { mClusteredLighting = enable; }
+    bool                    isClusteredLighting() const     { return mClusteredLighting; }
+
+    // point lights of the last step
+    unsigned                getNumLights() const            { return (unsigned)mLights.size(); }
+
+    void                    setLowLatency(bool enable);
+    bool                    isLowLatency() const            { return mLowLatency; }
+
+    // input-to-present latency of the frames so far
+    const LatencyHistogram& getLatency() const              { return mPacer.getLatency(); }
+    void                    resetLatency()                  { mPacer.resetStats(); }
+
+    // draws and triangles of the last frame
+    const RenderStats&      getRenderStats() const      { return mRenderQueue.getStats(); }
+
+    // write the camera path and input of every update() to a script that the benchmark can replay
+    bool                    startRecording(const std::string& path);
 };
 
 #endif
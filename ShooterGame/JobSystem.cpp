@@ -0,0 +1,448 @@
+#include "JobSystem.h"
+
+#include <chrono>
+#include <iostream>
+
+struct Job {
+    std::function<void()>   fn;
+    JobCounter*             counter;
+};
+
+const unsigned JobSystem::QUEUE_SIZE = 4096;
+
+JobSystem* JobSystem::ActiveSystem = NULL;
+
+namespace {
+
+// the job system the current thread belongs to, and its index there
+thread_local JobSystem* tOwner = NULL;
+thread_local int tIndex = -1;
+
+} // end of unnamed namespace
+
+
+//
+// Chase-Lev work-stealing deque with a fixed capacity
+// (memory orderings as in Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models")
+//
+class JobSystem::WorkQueue {
+
+    std::atomic<long long>              mTop;       // thieves take from here
+    std::atomic<long long>              mBottom;    // the owner pushes and pops here
+    std::vector<std::atomic<Job*> >     mSlots;
+    long long                           mMask;
+
+public:
+    WorkQueue(unsigned capacity)        // power of two
+        : mTop(0)
+        , mBottom(0)
+        , mSlots(capacity)
+        , mMask(capacity - 1)
+    {
+    }
+
+    // owner only; false if the queue is full
+    bool push(Job* job)
+    {
+        long long b = mBottom.load(std::memory_order_relaxed);
+        long long t = mTop.load(std::memory_order_acquire);
+        if (b - t > mMask) {
+            return false;
+        }
+        mSlots[b & mMask].store(job, std::memory_order_release);     // release as well, for thread sanitizers
+        std::atomic_thread_fence(std::memory_order_release);
+        mBottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // owner only
+    Job* pop()
+    {
+        long long b = mBottom.load(std::memory_order_relaxed) - 1;
+        mBottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long t = mTop.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            // empty
+            mBottom.store(b + 1, std::memory_order_relaxed);
+            return NULL;
+        }
+
+        Job* job = mSlots[b & mMask].load(std::memory_order_relaxed);
+        if (t == b) {
+            // the last job: race the thieves for it
+            if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                job = NULL;
+            }
+            mBottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return job;
+    }
+
+    // any thread
+    Job* steal()
+    {
+        long long t = mTop.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long long b = mBottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return NULL;
+        }
+
+        Job* job = mSlots[t & mMask].load(std::memory_order_acquire);
+        if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return NULL;    // lost the race to another thief or the owner
+        }
+        return job;
+    }
+};
+
+
+//
+// JobCounter
+//
+
+JobCounter::JobCounter()
+    : mValue(0)
+    , mBusy(0)
+{
+}
+
+JobCounter::~JobCounter()
+{
+    if (!mContinuations.empty()) {
+        std::cerr << "ERROR: Job counter destroyed with " << mContinuations.size() << " jobs still waiting on it" << std::endl;
+    }
+}
+
+bool JobCounter::isDone() const
+{
+    // the finishing thread may still be starting the continuations
+    return mValue.load() == 0 && mBusy.load() == 0;
+}
+
+
+//
+// JobSystem
+//
+
+JobSystem::JobSystem()
+    : mStop(false)
+    , mNumInjected(0)
+    , mNumMainJobs(0)
+    , mEpoch(0)
+    , mNumSleeping(0)
+    , mNumJobs(0)
+    , mNumSteals(0)
+{
+}
+
+JobSystem::~JobSystem()
+{
+    stop();
+}
+
+bool JobSystem::start(unsigned numWorkers)
+{
+    stop();
+
+    if (numWorkers == 0) {
+        unsigned cores = std::thread::hardware_concurrency();
+        numWorkers = cores > 1 ? cores - 1 : 0;
+    }
+
+    // the calling thread is thread 0
+    tOwner = this;
+    tIndex = 0;
+
+    mStop = false;
+    for (unsigned i = 0; i <= numWorkers; i++) {
+        mQueues.push_back(new WorkQueue(QUEUE_SIZE));
+    }
+    for (unsigned i = 1; i <= numWorkers; i++) {
+        mThreads.push_back(std::thread(&JobSystem::workerMain, this, i));
+    }
+
+    ActiveSystem = this;
+
+    std::cout << "Job system: " << numWorkers << " worker threads" << std::endl;
+    return true;
+}
+
+void JobSystem::stop()
+{
+    if (mQueues.empty()) {
+        return;
+    }
+
+    if (ActiveSystem == this) {
+        ActiveSystem = NULL;
+    }
+
+    mStop = true;
+    {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+        mWake.notify_all();
+    }
+    for (size_t i = 0; i < mThreads.size(); i++) {
+        mThreads[i].join();
+    }
+    mThreads.clear();
+
+    // nobody is waiting for these anymore
+    unsigned numDropped = 0;
+    for (size_t i = 0; i < mQueues.size(); i++) {
+        while (Job* job = mQueues[i]->steal()) {
+            delete job;
+            ++numDropped;
+        }
+        delete mQueues[i];
+    }
+    mQueues.clear();
+    numDropped += (unsigned)(mInjected.size() + mMainJobs.size());
+    for (size_t i = 0; i < mInjected.size(); i++) {
+        delete mInjected[i];
+    }
+    for (size_t i = 0; i < mMainJobs.size(); i++) {
+        delete mMainJobs[i];
+    }
+    mInjected.clear();
+    mMainJobs.clear();
+    mNumInjected = 0;
+    mNumMainJobs = 0;
+
+    if (numDropped) {
+        std::cout << "Warning: " << numDropped << " jobs were never run" << std::endl;
+    }
+
+    if (tOwner == this) {
+        tOwner = NULL;
+        tIndex = -1;
+    }
+}
+
+int JobSystem::getThreadIndex() const
+{
+    return tOwner == this ? tIndex : -1;
+}
+
+void JobSystem::workerMain(unsigned index)
+{
+    tOwner = this;
+    tIndex = (int)index;
+
+    while (!mStop) {
+        unsigned epoch = mEpoch.load();
+
+        Job* job = findJob((int)index);
+        if (job) {
+            execute(job);
+            continue;
+        }
+
+        // nothing to do: sleep until someone schedules a job
+        // (the timeout is only a safety net)
+        std::unique_lock<std::mutex> lock(mSleepMutex);
+        ++mNumSleeping;
+        if (epoch == mEpoch.load() && !mStop) {
+            mWake.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        --mNumSleeping;
+    }
+
+    tOwner = NULL;
+    tIndex = -1;
+}
+
+Job* JobSystem::findJob(int index)
+{
+    Job* job = NULL;
+
+    // GL work can only be done here, so it goes first
+    if (index == 0 && mNumMainJobs.load() > 0) {
+        std::lock_guard<std::mutex> lock(mMainMutex);
+        if (!mMainJobs.empty()) {
+            job = mMainJobs.front();
+            mMainJobs.pop_front();
+            --mNumMainJobs;
+            return job;
+        }
+    }
+
+    if (index >= 0) {
+        job = mQueues[index]->pop();
+        if (job) {
+            return job;
+        }
+    }
+
+    if (mNumInjected.load() > 0) {
+        std::lock_guard<std::mutex> lock(mInjectMutex);
+        if (!mInjected.empty()) {
+            job = mInjected.front();
+            mInjected.pop_front();
+            --mNumInjected;
+            return job;
+        }
+    }
+
+    // threads outside the system only run what they handed in, because jobs in the
+    // deques may expect to know which thread they are on
+    if (index < 0) {
+        return NULL;
+    }
+
+    // steal, starting from the next thread over so the victims are spread out
+    size_t n = mQueues.size();
+    for (size_t i = 1; i < n; i++) {
+        job = mQueues[(index + i) % n]->steal();
+        if (job) {
+            ++mNumSteals;
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+void JobSystem::wake()
+{
+    ++mEpoch;
+    if (mNumSleeping.load() > 0) {
+        std::lock_guard<std::mutex> lock(mSleepMutex);
+        mWake.notify_one();
+    }
+}
+
+void JobSystem::schedule(Job* job)
+{
+    int index = getThreadIndex();
+    if (index >= 0) {
+        if (!mQueues[index]->push(job)) {
+            // our queue is full, so there is plenty to steal already
+            execute(job);
+            return;
+        }
+    }
+    else {
+        std::lock_guard<std::mutex> lock(mInjectMutex);
+        mInjected.push_back(job);
+        ++mNumInjected;
+    }
+    wake();
+}
+
+void JobSystem::execute(Job* job)
+{
+    job->fn();
+    if (job->counter) {
+        finish(*job->counter);
+    }
+    delete job;
+    ++mNumJobs;
+}
+
+void JobSystem::finish(JobCounter& counter)
+{
+    ++counter.mBusy;
+
+    if (counter.mValue.fetch_sub(1) == 1) {
+        std::vector<Job*> next;
+        {
+            std::lock_guard<std::mutex> lock(counter.mMutex);
+            next.swap(counter.mContinuations);
+        }
+        for (size_t i = 0; i < next.size(); i++) {
+            schedule(next[i]);
+        }
+    }
+
+    // the counter may be destroyed as soon as this drops to zero
+    --counter.mBusy;
+}
+
+void JobSystem::run(const std::function<void()>& fn, JobCounter* counter)
+{
+    Job* job = new Job;
+    job->fn = fn;
+    job->counter = counter;
+    if (counter) {
+        ++counter->mValue;
+    }
+    schedule(job);
+}
+
+void JobSystem::runAfter(JobCounter& dependency, const std::function<void()>& fn, JobCounter* counter)
+{
+    Job* job = new Job;
+    job->fn = fn;
+    job->counter = counter;
+    if (counter) {
+        ++counter->mValue;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(dependency.mMutex);
+        if (dependency.mValue.load() > 0) {
+            dependency.mContinuations.push_back(job);
+            return;
+        }
+    }
+
+    // already done
+    schedule(job);
+}
+
+void JobSystem::runOnMainThread(const std::function<void()>& fn, JobCounter* counter)
+{
+    Job* job = new Job;
+    job->fn = fn;
+    job->counter = counter;
+    if (counter) {
+        ++counter->mValue;
+    }
+
+    std::lock_guard<std::mutex> lock(mMainMutex);
+    mMainJobs.push_back(job);
+    ++mNumMainJobs;
+}
+
+void JobSystem::wait(JobCounter& counter)
+{
+    int index = getThreadIndex();
+
+    while (!counter.isDone()) {
+        Job* job = findJob(index);
+        if (job) {
+            execute(job);
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void JobSystem::runMainThreadJobs()
+{
+    // only the ones queued so far, in case the jobs queue more
+    int n = mNumMainJobs.load();
+    for (int i = 0; i < n; i++) {
+        Job* job = NULL;
+        {
+            std::lock_guard<std::mutex> lock(mMainMutex);
+            if (mMainJobs.empty()) {
+                break;
+            }
+            job = mMainJobs.front();
+            mMainJobs.pop_front();
+            --mNumMainJobs;
+        }
+        execute(job);
+    }
+}
+
+void JobSystem::printStats() const
+{
+    std::cout << "Jobs: " << mNumJobs << " run, " << mNumSteals << " stolen" << std::endl;
+}
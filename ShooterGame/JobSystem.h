@@ -0,0 +1,173 @@
+#ifndef JOBSYSTEM_H_
+#define JOBSYSTEM_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Job;
+
+//
+// Counts unfinished jobs.
+//
+// Jobs started with a counter add one to it and take it away when they finish.  A job can
+// also be set to start once a counter drops to zero (JobSystem::runAfter), which is how
+// dependencies between jobs are expressed.
+//
+class JobCounter {
+    friend class JobSystem;
+
+    std::atomic<int>        mValue;
+    std::atomic<int>        mBusy;          // threads still touching the counter after decrementing it
+
+    std::mutex              mMutex;         // guards mContinuations
+    std::vector<Job*>       mContinuations; // jobs to start when mValue drops to zero
+
+    JobCounter(const JobCounter&);          // not copyable
+    JobCounter& operator=(const JobCounter&);
+
+public:
+    JobCounter();
+    ~JobCounter();
+
+    // true once every job started with this counter has finished
+    bool                    isDone() const;
+};
+
+//
+// Work-stealing job scheduler.
+//
+// Every thread in the system (the main thread and the workers) has its own Chase-Lev deque:
+// it pushes and pops jobs at the bottom, and idle threads steal from the top of the others.
+// Threads outside the system (e.g. std::async tasks) hand their jobs in through a shared queue.
+//
+// Jobs that make GL calls must run on the main thread: runOnMainThread() queues them, and
+// the main thread runs them whenever it waits on a counter or calls runMainThreadJobs().
+// Only the main thread should wait on a counter that main-thread jobs count towards.
+//
+class JobSystem {
+
+    class WorkQueue;
+
+    std::vector<WorkQueue*>     mQueues;        // one per thread, [0] is the main thread's
+    std::vector<std::thread>    mThreads;
+    std::atomic<bool>           mStop;
+
+    // jobs from threads outside the system
+    std::mutex                  mInjectMutex;
+    std::deque<Job*>            mInjected;
+    std::atomic<int>            mNumInjected;
+
+    std::mutex                  mMainMutex;
+    std::deque<Job*>            mMainJobs;
+    std::atomic<int>            mNumMainJobs;
+
+    // idle workers sleep until the epoch changes
+    std::mutex                  mSleepMutex;
+    std::condition_variable     mWake;
+    std::atomic<unsigned>       mEpoch;
+    std::atomic<int>            mNumSleeping;
+
+    // stats
+    std::atomic<unsigned long long> mNumJobs;
+    std::atomic<unsigned long long> mNumSteals;
+
+    static JobSystem*           ActiveSystem;
+
+    void                    workerMain(unsigned index);
+    Job*                    findJob(int index);
+    void                    schedule(Job* job);
+    void                    execute(Job* job);
+    void                    finish(JobCounter& counter);
+    void                    wake();
+
+    JobSystem(const JobSystem&);            // not copyable
+    JobSystem& operator=(const JobSystem&);
+
+public:
+    JobSystem();
+    ~JobSystem();
+
+    // jobs each thread can have queued before new ones run inline
+    static const unsigned   QUEUE_SIZE;
+
+    // call on the main thread; 0 workers means one per core besides the main thread
+    bool                    start(unsigned numWorkers = 0);
+
+    // all jobs must be finished
+    void                    stop();
+
+    bool                    isRunning() const       { return !mQueues.empty(); }
+
+    // the main thread and the workers
+    unsigned                getNumThreads() const   { return (unsigned)mQueues.size(); }
+
+    // 0 on the main thread, 1..n on workers, -1 on any other thread
+    int                     getThreadIndex() const;
+
+    // the most recently started job system (used by ParallelFor), NULL if none is running
+    static JobSystem*       GetActive()             { return ActiveSystem; }
+
+    void                    run(const std::function<void()>& fn, JobCounter* counter = NULL);
+
+    // start fn once 'dependency' drops to zero
+    void                    runAfter(JobCounter& dependency, const std::function<void()>& fn, JobCounter* counter = NULL);
+
+    void                    runOnMainThread(const std::function<void()>& fn, JobCounter* counter = NULL);
+
+    // run other jobs until the counter drops to zero
+    void                    wait(JobCounter& counter);
+
+    // run the queued main-thread jobs (call once per frame on the main thread)
+    void                    runMainThreadJobs();
+
+    // split [0, count) into ranges of at least 'grain' items and call fn(begin, end) on each
+    // in parallel, returning when all are done
+    template <typename Fn>
+    void                    parallelFor(size_t count, size_t grain, Fn fn);
+
+    unsigned long long      getNumJobs() const      { return mNumJobs; }
+    unsigned long long      getNumSteals() const    { return mNumSteals; }
+
+    void                    printStats() const;
+};
+
+template <typename Fn>
+void JobSystem::parallelFor(size_t count, size_t grain, Fn fn)
+{
+    if (grain < 1) {
+        grain = 1;
+    }
+
+    // a few ranges per thread, so stealing can even out the load
+    size_t numRanges = (count + grain - 1) / grain;
+    size_t maxRanges = 4 * (size_t)getNumThreads();
+    if (numRanges > maxRanges) {
+        numRanges = maxRanges;
+    }
+
+    if (numRanges <= 1) {
+        if (count > 0) {
+            fn((size_t)0, count);
+        }
+        return;
+    }
+
+    size_t rangeSize = (count + numRanges - 1) / numRanges;
+
+    JobCounter counter;
+    for (size_t begin = rangeSize; begin < count; begin += rangeSize) {
+        size_t end = (begin + rangeSize < count) ? begin + rangeSize : count;
+        run([&fn, begin, end]() { fn(begin, end); }, &counter);
+    }
+
+    // the calling thread does the first range, then helps with the rest
+    fn((size_t)0, rangeSize);
+    wait(counter);
+}
+
+#endif
@@ -0,0 +1,218 @@
+#include "MappedFile.h"
+
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// temporary files are named on worker threads too
+std::atomic<unsigned> TempFileCounter(0);
+
+}
+
+MappedFile::MappedFile()
+    : mData(NULL)
+    , mSize(0)
+    , mOpen(false)
+    , mDeleteOnClose(false)
+#ifdef _WIN32
+    , mFile(INVALID_HANDLE_VALUE)
+    , mMapping(NULL)
+#else
+    , mFd(-1)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string& path, bool writable, unsigned long long size)
+{
+    close();
+
+    mPath = path;
+
+    DWORD access = writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+    DWORD creation = writable ? OPEN_ALWAYS : OPEN_EXISTING;
+    mFile = CreateFileA(path.c_str(), access, FILE_SHARE_READ, NULL, creation, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mFile == INVALID_HANDLE_VALUE) {
+        std::cerr << "ERROR: Failed to open " << path << std::endl;
+        return false;
+    }
+
+    if (writable) {
+        // mapping a writable view extends the file to the mapping size
+        mSize = size;
+    }
+    else {
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(mFile, &fileSize);
+        mSize = (unsigned long long)fileSize.QuadPart;
+    }
+
+    mOpen = true;
+
+    if (mSize == 0) {
+        return true;    // can't map empty files
+    }
+
+    if ((SIZE_T)mSize != mSize) {
+        std::cerr << "ERROR: " << path << " is too big to map in a 32-bit build" << std::endl;
+        close();
+        return false;
+    }
+
+    mMapping = CreateFileMappingA(mFile, NULL, writable ? PAGE_READWRITE : PAGE_READONLY,
+                                  (DWORD)(mSize >> 32), (DWORD)(mSize & 0xFFFFFFFF), NULL);
+    if (!mMapping) {
+        std::cerr << "ERROR: Failed to map " << path << std::endl;
+        close();
+        return false;
+    }
+
+    mData = MapViewOfFile(mMapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)mSize);
+    if (!mData) {
+        std::cerr << "ERROR: Failed to map " << path << std::endl;
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mData) {
+        UnmapViewOfFile(mData);
+        mData = NULL;
+    }
+    if (mMapping) {
+        CloseHandle(mMapping);
+        mMapping = NULL;
+    }
+    if (mFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(mFile);
+        mFile = INVALID_HANDLE_VALUE;
+    }
+    if (mOpen && mDeleteOnClose) {
+        DeleteFileA(mPath.c_str());
+    }
+    mOpen = false;
+    mSize = 0;
+}
+
+std::string MappedFile::MakeTempPath(const std::string& tag)
+{
+    char dir[MAX_PATH + 1];
+    DWORD len = GetTempPathA(sizeof(dir), dir);
+    if (len == 0 || len > MAX_PATH) {
+        dir[0] = '.';
+        dir[1] = '\\';
+        dir[2] = '\0';
+    }
+
+    std::ostringstream ss;
+    ss << dir << "ShooterGame-" << GetCurrentProcessId() << "-" << TempFileCounter.fetch_add(1) << "-" << tag << ".tmp";
+    return ss.str();
+}
+
+#else
+
+bool MappedFile::open(const std::string& path, bool writable, unsigned long long size)
+{
+    close();
+
+    mPath = path;
+
+    mFd = ::open(path.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (mFd < 0) {
+        std::cerr << "ERROR: Failed to open " << path << std::endl;
+        return false;
+    }
+
+    if (writable) {
+        if (ftruncate(mFd, (off_t)size) != 0) {
+            std::cerr << "ERROR: Failed to resize " << path << " to " << size << " bytes" << std::endl;
+            close();
+            return false;
+        }
+        mSize = size;
+    }
+    else {
+        struct stat st;
+        fstat(mFd, &st);
+        mSize = (unsigned long long)st.st_size;
+    }
+
+    mOpen = true;
+
+    if (mSize == 0) {
+        return true;    // can't map empty files
+    }
+
+    if ((size_t)mSize != mSize) {
+        std::cerr << "ERROR: " << path << " is too big to map in a 32-bit build" << std::endl;
+        close();
+        return false;
+    }
+
+    void* p = mmap(NULL, (size_t)mSize, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, mFd, 0);
+    if (p == MAP_FAILED) {
+        std::cerr << "ERROR: Failed to map " << path << std::endl;
+        close();
+        return false;
+    }
+    mData = p;
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mData) {
+        munmap(mData, (size_t)mSize);
+        mData = NULL;
+    }
+    if (mFd >= 0) {
+        ::close(mFd);
+        mFd = -1;
+    }
+    if (mOpen && mDeleteOnClose) {
+        unlink(mPath.c_str());
+    }
+    mOpen = false;
+    mSize = 0;
+}
+
+std::string MappedFile::MakeTempPath(const std::string& tag)
+{
+    const char* dir = std::getenv("TMPDIR");
+    if (!dir || !*dir) {
+        dir = "/tmp";
+    }
+
+    std::ostringstream ss;
+    ss << dir << "/ShooterGame-" << getpid() << "-" << TempFileCounter.fetch_add(1) << "-" << tag << ".tmp";
+    return ss.str();
+}
+
+#endif
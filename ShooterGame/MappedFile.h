@@ -0,0 +1,49 @@
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <string>
+
+//
+// A file mapped into memory, for data that is too big to keep in RAM.
+// Sizes are 64-bit, so files over 4 GB work in 64-bit builds.
+//
+class MappedFile {
+
+    std::string             mPath;
+    void*                   mData;
+    unsigned long long      mSize;
+    bool                    mOpen;
+    bool                    mDeleteOnClose;
+
+    // OS handles
+#ifdef _WIN32
+    void*                   mFile;
+    void*                   mMapping;
+#else
+    int                     mFd;
+#endif
+
+    MappedFile(const MappedFile&);              // not copyable
+    MappedFile& operator=(const MappedFile&);
+
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // map an existing file (writable = false), or create/resize one to 'size' bytes and map it writable
+    bool                    open(const std::string& path, bool writable, unsigned long long size = 0);
+    void                    close();
+
+    bool                    isOpen() const          { return mOpen; }
+    void*                   data() const            { return mData; }
+    unsigned long long      size() const            { return mSize; }
+    const std::string&      path() const            { return mPath; }
+
+    // remove the file from disk when it's closed (for temporary spill files)
+    void                    setDeleteOnClose(bool b) { mDeleteOnClose = b; }
+
+    // unique file name in the system's temp directory
+    static std::string      MakeTempPath(const std::string& tag);
+};
+
+#endif
@@ -0,0 +1,386 @@
+#include "MeshCodec.h"
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MESHCODEC_USE_SSE 1
+#endif
+
+namespace {
+
+//
+// rANS with byte-wise renormalization (after Fabian Giesen's rans_byte.h),
+// two interleaved states so the decoder has some instruction-level parallelism
+//
+
+const unsigned  RANS_L = 1u << 23;      // lower bound of the normalization interval
+const unsigned  PROB_BITS = 14;
+const unsigned  PROB_SCALE = 1u << PROB_BITS;
+
+void PutVarint(std::vector<unsigned char>& out, unsigned long long v)
+{
+    while (v >= 0x80) {
+        out.push_back((unsigned char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((unsigned char)v);
+}
+
+bool GetVarint(const unsigned char*& p, const unsigned char* end, unsigned long long& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p >= end) {
+            return false;
+        }
+        unsigned char b = *p++;
+        v |= (unsigned long long)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline unsigned ZigZag(int v)
+{
+    return ((unsigned)v << 1) ^ (unsigned)(v >> 31);
+}
+
+inline int UnZigZag(unsigned v)
+{
+    return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+// scale symbol counts so they sum to PROB_SCALE, keeping every used symbol at least 1
+void NormalizeFreqs(const size_t counts[256], size_t total, unsigned freqs[256])
+{
+    unsigned sum = 0;
+    int largest = 0;
+    for (int s = 0; s < 256; s++) {
+        if (counts[s] == 0) {
+            freqs[s] = 0;
+            continue;
+        }
+        unsigned long long f = (unsigned long long)counts[s] * PROB_SCALE / total;
+        freqs[s] = f > 0 ? (unsigned)f : 1;
+        sum += freqs[s];
+        if (freqs[s] > freqs[largest]) {
+            largest = s;
+        }
+    }
+
+    // rounding leftovers go to the most common symbol
+    if (sum < PROB_SCALE) {
+        freqs[largest] += PROB_SCALE - sum;
+    }
+    while (sum > PROB_SCALE) {
+        // too many symbols bumped up to 1, take from whatever is biggest
+        int s = 0;
+        for (int i = 1; i < 256; i++) {
+            if (freqs[i] > freqs[s]) {
+                s = i;
+            }
+        }
+        --freqs[s];
+        --sum;
+    }
+}
+
+inline void RansPut(unsigned& x, unsigned char*& ptr, unsigned start, unsigned freq)
+{
+    unsigned xMax = ((RANS_L >> PROB_BITS) << 8) * freq;
+    while (x >= xMax) {
+        *--ptr = (unsigned char)(x & 0xFF);
+        x >>= 8;
+    }
+    x = ((x / freq) << PROB_BITS) + (x % freq) + start;
+}
+
+inline void RansFlush(unsigned x, unsigned char*& ptr)
+{
+    ptr -= 4;
+    ptr[0] = (unsigned char)(x >> 0);
+    ptr[1] = (unsigned char)(x >> 8);
+    ptr[2] = (unsigned char)(x >> 16);
+    ptr[3] = (unsigned char)(x >> 24);
+}
+
+inline unsigned RansInit(const unsigned char*& ptr)
+{
+    unsigned x = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned)ptr[3] << 24);
+    ptr += 4;
+    return x;
+}
+
+// split 32-bit words into 4 byte planes
+void Transpose(const unsigned* words, size_t n, std::vector<unsigned char> planes[4])
+{
+    for (int k = 0; k < 4; k++) {
+        planes[k].resize(n);
+    }
+    for (size_t i = 0; i < n; i++) {
+        unsigned w = words[i];
+        planes[0][i] = (unsigned char)(w);
+        planes[1][i] = (unsigned char)(w >> 8);
+        planes[2][i] = (unsigned char)(w >> 16);
+        planes[3][i] = (unsigned char)(w >> 24);
+    }
+}
+
+// reassemble 32-bit words from 4 byte planes and undo the zigzag
+void UntransposeUnZigZag(const std::vector<unsigned char> planes[4], size_t n, unsigned* words)
+{
+    size_t i = 0;
+
+#ifdef MESHCODEC_USE_SSE
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    for (; i + 16 <= n; i += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)&planes[0][i]);
+        __m128i b1 = _mm_loadu_si128((const __m128i*)&planes[1][i]);
+        __m128i b2 = _mm_loadu_si128((const __m128i*)&planes[2][i]);
+        __m128i b3 = _mm_loadu_si128((const __m128i*)&planes[3][i]);
+
+        // interleave bytes 0/1 and 2/3, then the 16-bit halves
+        __m128i lo01 = _mm_unpacklo_epi8(b0, b1);
+        __m128i hi01 = _mm_unpackhi_epi8(b0, b1);
+        __m128i lo23 = _mm_unpacklo_epi8(b2, b3);
+        __m128i hi23 = _mm_unpackhi_epi8(b2, b3);
+
+        __m128i w[4];
+        w[0] = _mm_unpacklo_epi16(lo01, lo23);
+        w[1] = _mm_unpackhi_epi16(lo01, lo23);
+        w[2] = _mm_unpacklo_epi16(hi01, hi23);
+        w[3] = _mm_unpackhi_epi16(hi01, hi23);
+
+        for (int k = 0; k < 4; k++) {
+            // (x >> 1) ^ -(x & 1)
+            __m128i v = _mm_xor_si128(_mm_srli_epi32(w[k], 1), _mm_sub_epi32(zero, _mm_and_si128(w[k], one)));
+            _mm_storeu_si128((__m128i*)&words[i + 4 * k], v);
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        unsigned w = planes[0][i] | (planes[1][i] << 8) | (planes[2][i] << 16) | ((unsigned)planes[3][i] << 24);
+        words[i] = (unsigned)UnZigZag(w);
+    }
+}
+
+}
+
+
+void MeshCodec::EntropyEncode(const unsigned char* data, size_t n, std::vector<unsigned char>& out)
+{
+    PutVarint(out, n);
+    if (n == 0) {
+        return;
+    }
+
+    size_t counts[256] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        ++counts[data[i]];
+    }
+
+    unsigned freqs[256];
+    NormalizeFreqs(counts, n, freqs);
+
+    unsigned starts[256];
+    unsigned start = 0;
+    for (int s = 0; s < 256; s++) {
+        starts[s] = start;
+        start += freqs[s];
+        PutVarint(out, freqs[s]);
+    }
+
+    // encode backwards into a scratch buffer that is big enough for the worst case
+    std::vector<unsigned char> buf(n * 2 + 16);
+    unsigned char* end = &buf[0] + buf.size();
+    unsigned char* ptr = end;
+
+    unsigned x[2] = { RANS_L, RANS_L };
+    for (size_t i = n; i-- > 0; ) {
+        unsigned char s = data[i];
+        RansPut(x[i & 1], ptr, starts[s], freqs[s]);
+    }
+    RansFlush(x[1], ptr);
+    RansFlush(x[0], ptr);
+
+    PutVarint(out, (unsigned long long)(end - ptr));
+    out.insert(out.end(), ptr, end);
+}
+
+bool MeshCodec::EntropyDecode(const unsigned char*& p, const unsigned char* end, std::vector<unsigned char>& out)
+{
+    unsigned long long n;
+    if (!GetVarint(p, end, n)) {
+        return false;
+    }
+    out.resize((size_t)n);
+    if (n == 0) {
+        return true;
+    }
+
+    unsigned freqs[256];
+    unsigned starts[256];
+    unsigned start = 0;
+    for (int s = 0; s < 256; s++) {
+        unsigned long long f;
+        if (!GetVarint(p, end, f) || f > PROB_SCALE) {
+            return false;
+        }
+        freqs[s] = (unsigned)f;
+        starts[s] = start;
+        start += freqs[s];
+    }
+    if (start != PROB_SCALE) {
+        return false;
+    }
+
+    // slot -> symbol lookup
+    std::vector<unsigned char> symbolOf(PROB_SCALE);
+    for (int s = 0; s < 256; s++) {
+        if (freqs[s]) {
+            std::memset(&symbolOf[starts[s]], s, freqs[s]);
+        }
+    }
+
+    unsigned long long numBytes;
+    if (!GetVarint(p, end, numBytes) || numBytes < 8 || numBytes > (unsigned long long)(end - p)) {
+        return false;
+    }
+    const unsigned char* ptr = p;
+    const unsigned char* streamEnd = p + numBytes;
+    p = streamEnd;
+
+    unsigned x[2];
+    x[0] = RansInit(ptr);
+    x[1] = RansInit(ptr);
+
+    const unsigned mask = PROB_SCALE - 1;
+    unsigned char* dst = &out[0];
+    for (size_t i = 0; i < n; i++) {
+        unsigned& xi = x[i & 1];
+        unsigned char s = symbolOf[xi & mask];
+        dst[i] = s;
+        xi = freqs[s] * (xi >> PROB_BITS) + (xi & mask) - starts[s];
+        while (xi < RANS_L) {
+            if (ptr >= streamEnd) {
+                return false;
+            }
+            xi = (xi << 8) | *ptr++;
+        }
+    }
+
+    return true;
+}
+
+void MeshCodec::EncodeIndices(const unsigned* indices, size_t numIndices, std::vector<unsigned char>& out)
+{
+    std::vector<unsigned char> bytes;
+    bytes.reserve(numIndices * 2);
+
+    unsigned prev = 0;
+    for (size_t i = 0; i < numIndices; i++) {
+        PutVarint(bytes, ZigZag((int)(indices[i] - prev)));
+        prev = indices[i];
+    }
+
+    EntropyEncode(bytes.empty() ? NULL : &bytes[0], bytes.size(), out);
+}
+
+bool MeshCodec::DecodeIndices(const unsigned char* data, size_t size, unsigned* indices, size_t numIndices)
+{
+    const unsigned char* p = data;
+    const unsigned char* end = data + size;
+
+    std::vector<unsigned char> bytes;
+    if (!EntropyDecode(p, end, bytes)) {
+        return false;
+    }
+
+    const unsigned char* b = bytes.empty() ? NULL : &bytes[0];
+    const unsigned char* bend = b + bytes.size();
+
+    unsigned prev = 0;
+    for (size_t i = 0; i < numIndices; i++) {
+        // varints here are at most 5 bytes, so decode them inline
+        unsigned v = 0;
+        int shift = 0;
+        for (;;) {
+            if (b >= bend || shift > 28) {
+                return false;
+            }
+            unsigned char c = *b++;
+            v |= (unsigned)(c & 0x7F) << shift;
+            if (!(c & 0x80)) {
+                break;
+            }
+            shift += 7;
+        }
+        prev += (unsigned)UnZigZag(v);
+        indices[i] = prev;
+    }
+
+    return b == bend;
+}
+
+void MeshCodec::EncodeVertices(const float* vertexData, size_t numVertices, int floatsPerVertex, std::vector<unsigned char>& out)
+{
+    const size_t n = numVertices * floatsPerVertex;
+
+    // delta against the same component of the previous vertex, on the raw bits
+    std::vector<unsigned> words(n);
+    const unsigned* bits = (const unsigned*)vertexData;
+    for (size_t i = 0; i < n; i++) {
+        unsigned prev = (i >= (size_t)floatsPerVertex) ? bits[i - floatsPerVertex] : 0;
+        words[i] = ZigZag((int)(bits[i] - prev));
+    }
+
+    std::vector<unsigned char> planes[4];
+    Transpose(words.empty() ? NULL : &words[0], n, planes);
+
+    for (int k = 0; k < 4; k++) {
+        EntropyEncode(planes[k].empty() ? NULL : &planes[k][0], n, out);
+    }
+}
+
+bool MeshCodec::DecodeVertices(const unsigned char* data, size_t size, float* vertexData, size_t numVertices, int floatsPerVertex)
+{
+    const size_t n = numVertices * floatsPerVertex;
+    const unsigned char* p = data;
+    const unsigned char* end = data + size;
+
+    std::vector<unsigned char> planes[4];
+    for (int k = 0; k < 4; k++) {
+        if (!EntropyDecode(p, end, planes[k]) || planes[k].size() != n) {
+            return false;
+        }
+    }
+
+    unsigned* words = (unsigned*)vertexData;
+    UntransposeUnZigZag(planes, n, words);
+
+    // undo the delta: each word adds the one a vertex back
+    const size_t stride = floatsPerVertex;
+    size_t i = stride;
+
+#ifdef MESHCODEC_USE_SSE
+    // words i..i+3 only depend on words at least 'stride' back, which are already done
+    if (stride >= 4) {
+        for (; i + 4 <= n; i += 4) {
+            __m128i prev = _mm_loadu_si128((const __m128i*)&words[i - stride]);
+            __m128i cur = _mm_loadu_si128((const __m128i*)&words[i]);
+            _mm_storeu_si128((__m128i*)&words[i], _mm_add_epi32(cur, prev));
+        }
+    }
+#endif
+
+    for (; i < n; i++) {
+        words[i] += words[i - stride];
+    }
+
+    return true;
+}
@@ -0,0 +1,31 @@
+#ifndef MESHCODEC_H_
+#define MESHCODEC_H_
+
+#include <cstddef>
+#include <vector>
+
+//
+// Compact encoding of the vertex and index arrays built by the OBJ loader.
+//
+// Indices are delta coded against the previous index, zigzagged and written as varints.
+// Vertices are treated as a stream of 32-bit words: each word is delta coded against
+// the same attribute component of the previous vertex, zigzagged and split into four
+// byte planes, so the high bytes (mostly zero) end up together.
+// Every byte stream then goes through an order-0 rANS entropy coder.
+//
+// Decoding is lossless; the byte planes are reassembled with SSE2 where available.
+//
+class MeshCodec {
+
+    static void             EntropyEncode(const unsigned char* data, size_t n, std::vector<unsigned char>& out);
+    static bool             EntropyDecode(const unsigned char*& p, const unsigned char* end, std::vector<unsigned char>& out);
+
+public:
+    static void             EncodeIndices(const unsigned* indices, size_t numIndices, std::vector<unsigned char>& out);
+    static bool             DecodeIndices(const unsigned char* data, size_t size, unsigned* indices, size_t numIndices);
+
+    static void             EncodeVertices(const float* vertexData, size_t numVertices, int floatsPerVertex, std::vector<unsigned char>& out);
+    static bool             DecodeVertices(const unsigned char* data, size_t size, float* vertexData, size_t numVertices, int floatsPerVertex);
+};
+
+#endif
@@ -0,0 +1,469 @@
+#include "MeshManager.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+//
+// MeshHandle
+//
+
+MeshHandle::MeshHandle()
+    : mManager(NULL)
+    , mSlot(0)
+{
+}
+
+MeshHandle::MeshHandle(MeshManager* manager, unsigned slot)
+    : mManager(manager)
+    , mSlot(slot)
+{
+    mManager->addRef(mSlot);
+}
+
+MeshHandle::MeshHandle(const MeshHandle& other)
+    : mManager(other.mManager)
+    , mSlot(other.mSlot)
+{
+    if (mManager) {
+        mManager->addRef(mSlot);
+    }
+}
+
+MeshHandle& MeshHandle::operator=(const MeshHandle& other)
+{
+    // add the new reference first, in case both handles point to the same mesh
+    if (other.mManager) {
+        other.mManager->addRef(other.mSlot);
+    }
+    release();
+    mManager = other.mManager;
+    mSlot = other.mSlot;
+    return *this;
+}
+
+MeshHandle::~MeshHandle()
+{
+    release();
+}
+
+void MeshHandle::release()
+{
+    if (mManager) {
+        mManager->releaseRef(mSlot);
+        mManager = NULL;
+        mSlot = 0;
+    }
+}
+
+OBJMesh* MeshHandle::get() const
+{
+    return mManager ? mManager->mResources[mSlot].mesh : NULL;
+}
+
+unsigned long long MeshHandle::getCPUBytes() const
+{
+    return mManager ? mManager->mResources[mSlot].cpuBytes : 0;
+}
+
+unsigned long long MeshHandle::getGPUBytes() const
+{
+    return mManager ? mManager->mResources[mSlot].gpuBytes : 0;
+}
+
+
+//
+// MeshManager
+//
+
+MeshManager::MeshManager()
+    : mCPUBytes(0)
+    , mGPUBytes(0)
+    , mNumLoads(0)
+    , mNumShared(0)
+{
+}
+
+MeshManager::~MeshManager()
+{
+    shutdown();
+}
+
+std::string MeshManager::MakeKey(const std::string& path, bool shouldComputeTangents, float creaseAngle)
+{
+    std::ostringstream key;
+    key << path << '|' << shouldComputeTangents << '|' << creaseAngle;
+    return key.str();
+}
+
+MeshHandle MeshManager::load(const std::string& path, bool shouldComputeTangents, float creaseAngle)
+{
+    std::string key = MakeKey(path, shouldComputeTangents, creaseAngle);
+
+    // already loaded with the same options
+    std::map<std::string, unsigned>::iterator it = mByKey.find(key);
+    if (it != mByKey.end()) {
+        ++mNumShared;
+        return MeshHandle(this, it->second);
+    }
+
+    OBJMesh* mesh = new OBJMesh(path, shouldComputeTangents, creaseAngle);
+    if (!mesh->isLoaded()) {
+        mesh->destroy();
+        delete mesh;
+        return MeshHandle();
+    }
+
+    Source source = { key, path, shouldComputeTangents, creaseAngle };
+    return add(mesh, source);
+}
+
+std::vector<MeshHandle> MeshManager::loadAll(const std::vector<std::string>& paths, JobSystem& jobs,
+    bool shouldComputeTangents, float creaseAngle)
+{
+    std::vector<MeshHandle> handles(paths.size());
+
+    // one job per file that isn't loaded yet; each parses on any thread and then
+    // uploads on this one
+    std::vector<OBJMesh*> meshes(paths.size(), NULL);
+    std::vector<char> parsed(paths.size(), 0);
+    std::vector<char> later(paths.size(), 0);
+    std::map<std::string, size_t> started;
+
+    JobCounter done;
+    for (size_t i = 0; i < paths.size(); i++) {
+        const std::string& path = paths[i];
+        std::string key = MakeKey(path, shouldComputeTangents, creaseAngle);
+        if (mByKey.count(key) || started.count(path)) {
+            later[i] = 1;   // shared, or loaded once the first request for the file is done
+            continue;
+        }
+
+        // out-of-core meshes are uploaded while they're read, so they can't be deferred
+        std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+        if (file && (unsigned long long)file.tellg() >= OBJMesh::OUT_OF_CORE_THRESHOLD) {
+            later[i] = 1;
+            continue;
+        }
+        file.close();
+
+        started[path] = i;
+
+        OBJMesh* mesh = new OBJMesh;
+        mesh->setDeferUpload(true);
+        meshes[i] = mesh;
+
+        char* ok = &parsed[i];
+        jobs.run([&jobs, &done, mesh, ok, path, shouldComputeTangents, creaseAngle]() {
+            if (!mesh->load(path, shouldComputeTangents, creaseAngle)) {
+                return;
+            }
+            *ok = 1;
+            jobs.runOnMainThread([mesh]() { mesh->uploadDeferred(~0u); }, &done);
+        }, &done);
+    }
+
+    jobs.wait(done);
+
+    // register in order, so duplicates resolve the same way as with load()
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (later[i]) {
+            handles[i] = load(paths[i], shouldComputeTangents, creaseAngle);
+            continue;
+        }
+
+        OBJMesh* mesh = meshes[i];
+        if (!parsed[i] || !mesh->isLoaded()) {
+            mesh->destroy();
+            delete mesh;
+            continue;
+        }
+
+        Source source = { MakeKey(paths[i], shouldComputeTangents, creaseAngle), paths[i], shouldComputeTangents, creaseAngle };
+        handles[i] = add(mesh, source);
+    }
+
+    return handles;
+}
+
+MeshHandle MeshManager::add(OBJMesh* mesh, const Source& source)
+{
+    ++mNumLoads;
+
+    // a different file with the same contents
+    std::unordered_map<unsigned long long, unsigned>::iterator cit = mByContent.find(mesh->mContentHash);
+    if (cit != mByContent.end()) {
+        Resource& res = mResources[cit->second];
+        if (res.mesh->mNumVertices == mesh->mNumVertices &&
+            res.mesh->mNumIndices == mesh->mNumIndices &&
+            res.mesh->mStride == mesh->mStride &&
+            res.mesh->mMaterials.size() == mesh->mMaterials.size()) {
+
+            std::cout << "  Same contents as '" << res.sources[0].path << "', sharing its buffers" << std::endl;
+
+            mesh->destroy();
+            delete mesh;
+
+            res.sources.push_back(source);
+            mByKey[source.key] = cit->second;
+            ++mNumShared;
+            return MeshHandle(this, cit->second);
+        }
+    }
+
+    unsigned slot;
+    if (!mFreeSlots.empty()) {
+        slot = mFreeSlots.back();
+        mFreeSlots.pop_back();
+    }
+    else {
+        slot = (unsigned)mResources.size();
+        mResources.push_back(Resource());
+    }
+
+    Resource& res = mResources[slot];
+    res.mesh = mesh;
+    res.refCount = 0;
+    res.contentHash = mesh->mContentHash;
+    res.sources.clear();
+    res.sources.push_back(source);
+    res.cpuBytes = mesh->getCPUBytes();
+    res.gpuBytes = mesh->mGPUBytes;
+
+    mByKey[source.key] = slot;
+    mByContent[res.contentHash] = slot;
+
+    mCPUBytes += res.cpuBytes;
+    mGPUBytes += res.gpuBytes;
+
+    return MeshHandle(this, slot);
+}
+
+void MeshManager::addRef(unsigned slot)
+{
+    ++mResources[slot].refCount;
+}
+
+void MeshManager::releaseRef(unsigned slot)
+{
+    if (slot >= mResources.size()) {
+        return;     // the manager was already shut down
+    }
+
+    Resource& res = mResources[slot];
+    if (!res.mesh || --res.refCount > 0) {
+        return;
+    }
+
+    // last reference gone: free the GL objects right away
+    res.mesh->destroy();
+    delete res.mesh;
+    res.mesh = NULL;
+
+    for (size_t i = 0; i < res.sources.size(); i++) {
+        mByKey.erase(res.sources[i].key);
+    }
+    res.sources.clear();
+
+    // a reload in flight has nothing to swap into anymore
+    for (size_t i = 0; i < mReloads.size(); i++) {
+        if (mReloads[i]->slot == slot) {
+            mReloads[i]->cancelled = true;
+        }
+    }
+    mByContent.erase(res.contentHash);
+
+    mCPUBytes -= res.cpuBytes;
+    mGPUBytes -= res.gpuBytes;
+    res.cpuBytes = 0;
+    res.gpuBytes = 0;
+
+    mFreeSlots.push_back(slot);
+}
+
+void MeshManager::reload(const std::string& path)
+{
+    for (unsigned slot = 0; slot < mResources.size(); slot++) {
+        Resource& res = mResources[slot];
+        if (!res.mesh) {
+            continue;
+        }
+
+        // a mesh also depends on its material libraries
+        bool usesLib = std::find(res.mesh->mMaterialLibs.begin(), res.mesh->mMaterialLibs.end(), path) != res.mesh->mMaterialLibs.end();
+
+        for (size_t i = 0; i < res.sources.size(); i++) {
+            if (res.sources[i].path != path && !usesLib) {
+                continue;
+            }
+
+            if (res.sources.size() > 1 && !usesLib) {
+                std::cout << "Warning: '" << path << "' shares its buffers with other requests, they will all change" << std::endl;
+            }
+
+            // only one worker per mesh; if one is running, it starts over when it's done
+            bool running = false;
+            for (size_t j = 0; j < mReloads.size(); j++) {
+                if (mReloads[j]->slot == slot && !mReloads[j]->cancelled) {
+                    mReloads[j]->again = true;
+                    running = true;
+                }
+            }
+            if (!running) {
+                startReload(slot, res.sources[i]);
+            }
+            break;
+        }
+    }
+}
+
+void MeshManager::startReload(unsigned slot, const Source& source)
+{
+    Reload* r = new Reload;
+    r->slot = slot;
+    r->source = source;
+    r->mesh = new OBJMesh;
+    r->mesh->setDeferUpload(true);
+    r->mesh->setUseCache(false);
+    r->parsed = false;
+    r->failed = false;
+    r->again = false;
+    r->cancelled = false;
+    r->startTime = std::chrono::steady_clock::now();
+
+    OBJMesh* mesh = r->mesh;
+    r->loaded = std::async(std::launch::async, [mesh, source]() {
+        return mesh->load(source.path, source.shouldComputeTangents, source.creaseAngle);
+    });
+
+    mReloads.push_back(r);
+}
+
+void MeshManager::update()
+{
+    for (size_t i = 0; i < mReloads.size(); ) {
+        Reload* r = mReloads[i];
+
+        if (!r->parsed) {
+            if (r->loaded.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                ++i;
+                continue;
+            }
+            r->parsed = true;
+            r->failed = !r->loaded.get();
+
+            if (r->failed && !r->cancelled) {
+                std::cout << "Warning: Failed to reload '" << r->source.path << "', keeping the old mesh" << std::endl;
+            }
+        }
+
+        bool swap = !r->failed && !r->cancelled;
+
+        // one chunk per frame, so big meshes don't stall a frame
+        if (swap && !r->mesh->uploadDeferred(1)) {
+            ++i;
+            continue;
+        }
+
+        if (swap) {
+            swapReloaded(*r);
+        }
+        else {
+            r->mesh->destroy();
+            delete r->mesh;
+        }
+
+        // the file changed again while this worker was busy
+        bool again = r->again && !r->cancelled;
+        unsigned slot = r->slot;
+        Source source = r->source;
+        delete r;
+        mReloads.erase(mReloads.begin() + i);
+
+        if (again) {
+            startReload(slot, source);
+        }
+    }
+}
+
+void MeshManager::swapReloaded(Reload& r)
+{
+    Resource& res = mResources[r.slot];
+    OBJMesh* fresh = r.mesh;
+
+    // the live mesh object stays where it is, only its contents change
+    OBJMesh old = *res.mesh;
+    *res.mesh = *fresh;
+    old.destroy();
+    fresh->clear();
+    delete fresh;
+    r.mesh = NULL;
+
+    std::unordered_map<unsigned long long, unsigned>::iterator it = mByContent.find(res.contentHash);
+    if (it != mByContent.end() && it->second == r.slot) {
+        mByContent.erase(it);
+    }
+    res.contentHash = res.mesh->mContentHash;
+    if (mByContent.find(res.contentHash) == mByContent.end()) {
+        mByContent[res.contentHash] = r.slot;
+    }
+
+    mCPUBytes -= res.cpuBytes;
+    mGPUBytes -= res.gpuBytes;
+    res.cpuBytes = res.mesh->getCPUBytes();
+    res.gpuBytes = res.mesh->mGPUBytes;
+    mCPUBytes += res.cpuBytes;
+    mGPUBytes += res.gpuBytes;
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - r.startTime).count();
+    std::cout << "Reloaded '" << r.source.path << "' in " << ms << " ms" << std::endl;
+}
+
+void MeshManager::shutdown()
+{
+    // wait for the workers before their meshes go away
+    for (size_t i = 0; i < mReloads.size(); i++) {
+        Reload* r = mReloads[i];
+        if (!r->parsed) {
+            r->loaded.wait();
+        }
+        r->mesh->destroy();
+        delete r->mesh;
+        delete r;
+    }
+    mReloads.clear();
+
+    for (unsigned i = 0; i < mResources.size(); i++) {
+        Resource& res = mResources[i];
+        if (res.mesh) {
+            std::cout << "Warning: Mesh '" << res.sources[0].path << "' still has " << res.refCount << " reference(s) at shutdown" << std::endl;
+            res.mesh->destroy();
+            delete res.mesh;
+            res.mesh = NULL;
+        }
+    }
+
+    mResources.clear();
+    mFreeSlots.clear();
+    mByKey.clear();
+    mByContent.clear();
+    mCPUBytes = 0;
+    mGPUBytes = 0;
+}
+
+void MeshManager::printStats() const
+{
+    std::cout << "Meshes: " << getNumMeshes() << " resident, "
+              << mNumLoads << " loaded from disk, " << mNumShared << " shared" << std::endl;
+
+    for (unsigned i = 0; i < mResources.size(); i++) {
+        const Resource& res = mResources[i];
+        if (res.mesh) {
+            std::cout << "  " << res.sources[0].path << ": " << res.refCount << " ref(s), "
+                      << res.cpuBytes << " CPU bytes, " << res.gpuBytes << " GPU bytes" << std::endl;
+        }
+    }
+
+    std::cout << "  Total: " << mCPUBytes << " CPU bytes, " << mGPUBytes << " GPU bytes" << std::endl;
+}
@@ -0,0 +1,148 @@
+#ifndef MESHMANAGER_H_
+#define MESHMANAGER_H_
+
+#include "JobSystem.h"
+#include "Wavefront.h"
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class MeshManager;
+
+//
+// Reference-counted handle to a mesh owned by a MeshManager.
+// The mesh's GL objects are freed as soon as the last handle to it is released.
+//
+class MeshHandle {
+    friend class MeshManager;
+
+    MeshManager*            mManager;
+    unsigned                mSlot;
+
+    MeshHandle(MeshManager* manager, unsigned slot);
+
+public:
+    MeshHandle();
+    MeshHandle(const MeshHandle& other);
+    MeshHandle& operator=(const MeshHandle& other);
+    ~MeshHandle();
+
+    // drop this reference
+    void                    release();
+
+    bool                    isValid() const         { return mManager != NULL; }
+
+    OBJMesh*                get() const;
+    OBJMesh*                operator->() const      { return get(); }
+
+    unsigned long long      getCPUBytes() const;
+    unsigned long long      getGPUBytes() const;
+};
+
+//
+// Loads meshes once and shares them.
+//
+// Requests for a file that is already loaded (with the same options) return the existing
+// mesh without touching the disk.  Newly loaded meshes are keyed by a hash of their final
+// vertex and index data and their materials, so different files with identical contents
+// share one set of buffers.
+//
+// Meshes can be reloaded in place when their file changes.
+// All handles must be released before the manager is shut down.
+//
+class MeshManager {
+    friend class MeshHandle;
+
+    // a load request
+    struct Source {
+        std::string         key;
+        std::string         path;
+        bool                shouldComputeTangents;
+        float               creaseAngle;
+    };
+
+    struct Resource {
+        OBJMesh*            mesh;           // NULL for a free slot
+        unsigned            refCount;
+        unsigned long long  contentHash;
+        std::vector<Source> sources;        // load requests that resolved to this mesh
+        unsigned long long  cpuBytes;
+        unsigned long long  gpuBytes;
+    };
+
+    // a mesh being re-parsed on a worker thread
+    struct Reload {
+        unsigned            slot;
+        Source              source;
+        OBJMesh*            mesh;           // parsed with deferred upload
+        std::future<bool>   loaded;
+        bool                parsed;
+        bool                failed;
+        bool                again;          // the file changed again while parsing
+        bool                cancelled;      // the resource was freed meanwhile
+        std::chrono::steady_clock::time_point startTime;
+    };
+
+    std::vector<Resource>   mResources;
+    std::vector<unsigned>   mFreeSlots;
+    std::vector<Reload*>    mReloads;
+
+    std::map<std::string, unsigned>                 mByKey;
+    std::unordered_map<unsigned long long, unsigned> mByContent;
+
+    unsigned long long      mCPUBytes;
+    unsigned long long      mGPUBytes;
+    unsigned                mNumLoads;      // files actually parsed
+    unsigned                mNumShared;     // requests served by an existing mesh
+
+    // take ownership of a loaded mesh, or share an existing one with the same contents
+    MeshHandle              add(OBJMesh* mesh, const Source& source);
+
+    void                    addRef(unsigned slot);
+    void                    releaseRef(unsigned slot);
+
+    void                    startReload(unsigned slot, const Source& source);
+    void                    swapReloaded(Reload& r);
+
+    static std::string      MakeKey(const std::string& path, bool shouldComputeTangents, float creaseAngle);
+
+    MeshManager(const MeshManager&);            // not copyable
+    MeshManager& operator=(const MeshManager&);
+
+public:
+    MeshManager();
+    ~MeshManager();
+
+    // returns an invalid handle if the mesh fails to load
+    MeshHandle              load(const std::string& path, bool shouldComputeTangents = false,
+                                 float creaseAngle = OBJMesh::DEFAULT_CREASE_ANGLE);
+
+    // load several files at once: they are parsed in parallel on the job system and uploaded
+    // on this (the GL) thread, returns one handle per path (invalid if that file failed)
+    std::vector<MeshHandle> loadAll(const std::vector<std::string>& paths, JobSystem& jobs,
+                                    bool shouldComputeTangents = false,
+                                    float creaseAngle = OBJMesh::DEFAULT_CREASE_ANGLE);
+
+    // re-parse every mesh loaded from 'path' (or using it as a material library) on a worker thread; update() swaps
+    // the new buffers into the live meshes, so existing handles see the new data
+    void                    reload(const std::string& path);
+
+    // call once per frame on the GL thread: uploads reloaded meshes a chunk at a time
+    // and swaps them in once they are complete
+    void                    update();
+
+    // free everything, reporting meshes that are still referenced
+    void                    shutdown();
+
+    unsigned                getNumMeshes() const    { return (unsigned)(mResources.size() - mFreeSlots.size()); }
+    unsigned long long      getCPUBytes() const     { return mCPUBytes; }
+    unsigned long long      getGPUBytes() const     { return mGPUBytes; }
+
+    void                    printStats() const;
+};
+
+#endif
@@ -0,0 +1,937 @@
+#include "Navigation.h"
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <unordered_map>
+
+const unsigned Navigation::NONE = 0xffffffffu;
+
+namespace {
+
+typedef std::chrono::high_resolution_clock Clock;
+
+const float SQRT2 = 1.41421356f;
+
+// link directions: the orthogonal ones, then the diagonals
+const int DX[8] = { 1, 0, -1, 0, 1, -1, -1, 1 };
+const int DZ[8] = { 0, 1, 0, -1, 1, 1, -1, -1 };
+
+// the two orthogonal steps that make up each diagonal
+const int DIAGONAL_STEPS[4][2] = { { 0, 1 }, { 2, 1 }, { 2, 3 }, { 0, 3 } };
+
+const float LINK_COST[8] = { 1, 1, 1, 1, SQRT2, SQRT2, SQRT2, SQRT2 };
+
+// an entrance run at least this long gets a transition at each end instead of one in the middle
+const unsigned LONG_ENTRANCE = 6;
+
+struct OpenNode {
+    float                   f;
+    float                   g;
+    unsigned                node;
+
+    bool operator<(const OpenNode& other) const
+    {
+        return f > other.f;     // a min-heap with the std heap functions
+    }
+};
+
+}
+
+//
+// Scratch for one search at a time: costs, parents and a generation mark per node, so starting
+// a search doesn't have to clear them.  A node is open in this search if its mark is the
+// generation, closed if it is one more.
+//
+struct Navigation::NavSearch {
+    std::vector<float>      cost;
+    std::vector<unsigned>   parent;
+    std::vector<unsigned>   mark;
+    unsigned                generation;
+    std::vector<OpenNode>   open;
+
+    // hierarchical queries
+    std::vector<float>      startCost;
+    std::vector<float>      goalCost;
+    std::vector<unsigned>   abstractPath;
+    std::vector<unsigned>   reversed;
+
+    explicit NavSearch(size_t size)
+        : cost(size)
+        , parent(size)
+        , mark(size, 0)
+        , generation(0)
+    {
+    }
+
+    void begin()
+    {
+        generation += 2;
+        if (generation >= 0xfffffff0u) {
+            std::fill(mark.begin(), mark.end(), 0u);
+            generation = 2;
+        }
+        open.clear();
+    }
+
+    bool isSeen(unsigned n) const       { return mark[n] >= generation; }
+    bool isClosed(unsigned n) const     { return mark[n] == generation + 1; }
+
+    // returns false if the node was already reached as cheaply
+    bool relax(unsigned n, float g, float h, unsigned from)
+    {
+        if (isSeen(n) && (isClosed(n) || cost[n] <= g)) {
+            return false;
+        }
+        mark[n] = generation;
+        cost[n] = g;
+        parent[n] = from;
+        OpenNode item = { g + h, g, n };
+        open.push_back(item);
+        std::push_heap(open.begin(), open.end());
+        return true;
+    }
+
+    // the cheapest open node, NONE when there are none left
+    unsigned pop()
+    {
+        while (!open.empty()) {
+            std::pop_heap(open.begin(), open.end());
+            OpenNode item = open.back();
+            open.pop_back();
+            if (!isClosed(item.node) && item.g <= cost[item.node]) {
+                mark[item.node] = generation + 1;
+                return item.node;
+            }
+        }
+        return NONE;
+    }
+
+    // the nodes after 'from' up to 'to', following the parents back from 'to'
+    void appendPath(unsigned from, unsigned to, std::vector<unsigned>& path)
+    {
+        reversed.clear();
+        for (unsigned n = to; n != from; n = parent[n]) {
+            reversed.push_back(n);
+        }
+        path.insert(path.end(), reversed.rbegin(), reversed.rend());
+    }
+};
+
+Navigation::Navigation()
+    : mGrid(NULL)
+    , mNumUpdates(0)
+    , mBuildMs(0)
+    , mNumHierarchical(0)
+    , mNumLocal(0)
+    , mNumFlow(0)
+    , mNumFlowFieldsBuilt(0)
+    , mMaxUpdateMs(0)
+{
+    mClusters[0] = mClusters[1] = 0;
+}
+
+Navigation::~Navigation()
+{
+    clear();
+}
+
+void Navigation::clear()
+{
+    mGrid = NULL;
+    mColumnStart.clear();
+    mNodeX.clear();
+    mNodeZ.clear();
+    mNodeY.clear();
+    mLinks.clear();
+    mClusters[0] = mClusters[1] = 0;
+    mEntryNode.clear();
+    mClusterEntryStart.clear();
+    mEdgeStart.clear();
+    mEdgeTo.clear();
+    mEdgeCost.clear();
+
+    std::lock_guard<std::mutex> lock(mSearchMutex);
+    for (size_t i = 0; i < mFreeSearches.size(); i++) {
+        delete mFreeSearches[i];
+    }
+    mFreeSearches.clear();
+
+    mQueries.clear();
+    mFreeTickets.clear();
+    mPending.clear();
+    mFlowFields.clear();
+}
+
+Navigation::NavSearch* Navigation::acquireSearch() const
+{
+    {
+        std::lock_guard<std::mutex> lock(mSearchMutex);
+        if (!mFreeSearches.empty()) {
+            NavSearch* search = mFreeSearches.back();
+            mFreeSearches.pop_back();
+            return search;
+        }
+    }
+
+    // the abstract graph has fewer nodes than the grid, but a tiny level may have more
+    size_t size = mNodeY.size() > mEntryNode.size() + 2 ? mNodeY.size() : mEntryNode.size() + 2;
+    return new NavSearch(size);
+}
+
+void Navigation::releaseSearch(NavSearch* search) const
+{
+    std::lock_guard<std::mutex> lock(mSearchMutex);
+    mFreeSearches.push_back(search);
+}
+
+bool Navigation::build(const VoxelGrid& grid, JobSystem* jobs)
+{
+    Clock::time_point t0 = Clock::now();
+
+    clear();
+
+    const int dimX = grid.getDim(0);
+    const int dimZ = grid.getDim(2);
+    if (grid.getNumWalkable() == 0 || dimX > 0xffff || dimZ > 0xffff) {
+        std::cerr << "ERROR: No walkable floors to navigate" << std::endl;
+        return false;
+    }
+
+    mGrid = &grid;
+
+    //
+    // a node per walkable span, and the top of the free space above it while building
+    //
+    std::vector<unsigned> nodeTop;
+    mColumnStart.resize((size_t)dimX * dimZ + 1);
+    for (int z = 0; z < dimZ; z++) {
+        for (int x = 0; x < dimX; x++) {
+            mColumnStart[(size_t)z * dimX + x] = (unsigned)mNodeY.size();
+
+            unsigned count;
+            const WalkableSpan* spans = grid.getWalkable(x, z, count);
+            for (unsigned i = 0; i < count; i++) {
+                mNodeX.push_back((unsigned short)x);
+                mNodeZ.push_back((unsigned short)z);
+                mNodeY.push_back(spans[i].floor);
+                nodeTop.push_back(spans[i].clearance == VoxelGrid::NO_CEILING ? NONE : (unsigned)spans[i].floor + spans[i].clearance);
+            }
+        }
+    }
+    mColumnStart[(size_t)dimX * dimZ] = (unsigned)mNodeY.size();
+
+    const unsigned numNodes = (unsigned)mNodeY.size();
+    mLinks.assign((size_t)numNodes * 8, NONE);
+
+    //
+    // link the nodes a row at a time: straight steps to the floor within a climb that leaves
+    // room to stand, then diagonals where both ways around the corner lead to the same node
+    //
+    const int climb = grid.getClimbCells();
+    const int height = grid.getHeightCells();
+    auto linkRows = [&](size_t begin, size_t end, bool diagonals) {
+        for (size_t z = begin; z < end; z++) {
+            for (int x = 0; x < dimX; x++) {
+                size_t column = z * dimX + x;
+                for (unsigned n = mColumnStart[column]; n < mColumnStart[column + 1]; n++) {
+                    unsigned* links = &mLinks[(size_t)n * 8];
+                    if (diagonals) {
+                        for (int d = 0; d < 4; d++) {
+                            unsigned a = links[DIAGONAL_STEPS[d][0]];
+                            unsigned b = links[DIAGONAL_STEPS[d][1]];
+                            if (a == NONE || b == NONE) {
+                                continue;
+                            }
+                            unsigned viaA = mLinks[(size_t)a * 8 + DIAGONAL_STEPS[d][1]];
+                            unsigned viaB = mLinks[(size_t)b * 8 + DIAGONAL_STEPS[d][0]];
+                            if (viaA != NONE && viaA == viaB) {
+                                links[4 + d] = viaA;
+                            }
+                        }
+                        continue;
+                    }
+
+                    for (int d = 0; d < 4; d++) {
+                        int nx = x + DX[d];
+                        int nz = (int)z + DZ[d];
+                        if (nx < 0 || nz < 0 || nx >= dimX || nz >= dimZ) {
+                            continue;
+                        }
+                        size_t other = (size_t)nz * dimX + nx;
+                        int best = climb + 1;
+                        for (unsigned m = mColumnStart[other]; m < mColumnStart[other + 1]; m++) {
+                            int step = std::abs((int)mNodeY[m] - (int)mNodeY[n]);
+                            unsigned top = nodeTop[m] < nodeTop[n] ? nodeTop[m] : nodeTop[n];
+                            unsigned floor = mNodeY[m] > mNodeY[n] ? mNodeY[m] : mNodeY[n];
+                            if (step < best && top >= floor + height) {
+                                best = step;
+                                links[d] = m;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    };
+    for (int pass = 0; pass < 2; pass++) {
+        if (jobs) {
+            jobs->parallelFor(dimZ, 8, [&](size_t begin, size_t end) { linkRows(begin, end, pass == 1); });
+        }
+        else {
+            linkRows(0, dimZ, pass == 1);
+        }
+    }
+
+    //
+    // entrances between clusters, numbered cluster by cluster
+    //
+    mClusters[0] = (dimX + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    mClusters[1] = (dimZ + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    const unsigned numClusters = (unsigned)(mClusters[0] * mClusters[1]);
+
+    std::vector<unsigned> pairs;
+    findEntrances(true, pairs);
+    findEntrances(false, pairs);
+
+    std::vector<unsigned> entryOf(numNodes, NONE);
+    std::vector<unsigned> entries;
+    for (size_t i = 0; i < pairs.size(); i++) {
+        if (entryOf[pairs[i]] == NONE) {
+            entryOf[pairs[i]] = 0;
+            entries.push_back(pairs[i]);
+        }
+    }
+    std::stable_sort(entries.begin(), entries.end(), [this](unsigned a, unsigned b) { return getCluster(a) < getCluster(b); });
+
+    const unsigned numEntries = (unsigned)entries.size();
+    mEntryNode.swap(entries);
+    mClusterEntryStart.assign(numClusters + 1, 0);
+    for (unsigned e = 0; e < numEntries; e++) {
+        entryOf[mEntryNode[e]] = e;
+        ++mClusterEntryStart[getCluster(mEntryNode[e]) + 1];
+    }
+    for (unsigned c = 0; c < numClusters; c++) {
+        mClusterEntryStart[c + 1] += mClusterEntryStart[c];
+    }
+
+    //
+    // edges: one step across each entrance, and the paths between the entries inside each cluster
+    //
+    std::vector<std::vector<unsigned> > to(numEntries);
+    std::vector<std::vector<float> > cost(numEntries);
+    for (size_t i = 0; i < pairs.size(); i += 2) {
+        unsigned a = entryOf[pairs[i]];
+        unsigned b = entryOf[pairs[i + 1]];
+        to[a].push_back(b);
+        cost[a].push_back(1.0f);
+        to[b].push_back(a);
+        cost[b].push_back(1.0f);
+    }
+
+    auto connectRange = [&](size_t begin, size_t end) {
+        NavSearch* search = acquireSearch();
+        for (size_t c = begin; c < end; c++) {
+            connectCluster((int)c, *search, to, cost);
+        }
+        releaseSearch(search);
+    };
+    if (jobs) {
+        jobs->parallelFor(numClusters, 4, connectRange);
+    }
+    else {
+        connectRange(0, numClusters);
+    }
+
+    mEdgeStart.resize(numEntries + 1);
+    for (unsigned e = 0; e < numEntries; e++) {
+        mEdgeStart[e] = (unsigned)mEdgeTo.size();
+        mEdgeTo.insert(mEdgeTo.end(), to[e].begin(), to[e].end());
+        mEdgeCost.insert(mEdgeCost.end(), cost[e].begin(), cost[e].end());
+    }
+    mEdgeStart[numEntries] = (unsigned)mEdgeTo.size();
+
+    mBuildMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+    return true;
+}
+
+void Navigation::findEntrances(bool acrossX, std::vector<unsigned>& pairs) const
+{
+    // walk along each border a column at a time; u is the coordinate along it
+    const int across = acrossX ? 0 : 1;         // the link that crosses the border
+    const int along = acrossX ? 1 : 0;          // the link to the next column along it
+    const int dimX = mGrid->getDim(0);
+    const int dimZ = mGrid->getDim(2);
+    const int numBorders = (acrossX ? mClusters[0] : mClusters[1]) - 1;
+    const int length = acrossX ? dimZ : dimX;
+
+    // a run of pairs that continue each other along the border; the previous column's pairs
+    // remember the run they are in
+    std::vector<std::vector<unsigned> > runs;
+    std::vector<unsigned> previous, previousRun, current, currentRun;
+
+    for (int border = 1; border <= numBorders; border++) {
+        int v = border * CLUSTER_SIZE - 1;      // the column before the border
+
+        runs.clear();
+        previous.clear();
+        previousRun.clear();
+        for (int u = 0; u < length; u++) {
+            current.clear();
+            currentRun.clear();
+
+            int x = acrossX ? v : u;
+            int z = acrossX ? u : v;
+            size_t column = (size_t)z * dimX + x;
+            for (unsigned a = mColumnStart[column]; a < mColumnStart[column + 1]; a++) {
+                unsigned b = mLinks[(size_t)a * 8 + across];
+                if (b == NONE) {
+                    continue;
+                }
+
+                // runs stop at the corners of clusters, so each stays between two of them
+                unsigned run = NONE;
+                if (u % CLUSTER_SIZE != 0) {
+                    for (size_t k = 0; k < previous.size(); k += 2) {
+                        if (mLinks[(size_t)previous[k] * 8 + along] == a && mLinks[(size_t)previous[k + 1] * 8 + along] == b) {
+                            run = previousRun[k / 2];
+                            break;
+                        }
+                    }
+                }
+                if (run == NONE) {
+                    run = (unsigned)runs.size();
+                    runs.push_back(std::vector<unsigned>());
+                }
+                runs[run].push_back(a);
+                runs[run].push_back(b);
+
+                current.push_back(a);
+                current.push_back(b);
+                currentRun.push_back(run);
+            }
+
+            previous.swap(current);
+            previousRun.swap(currentRun);
+        }
+
+        // a transition in the middle of a short entrance, at both ends of a long one
+        for (size_t r = 0; r < runs.size(); r++) {
+            const std::vector<unsigned>& run = runs[r];
+            unsigned count = (unsigned)run.size() / 2;
+            if (count < LONG_ENTRANCE) {
+                pairs.push_back(run[count / 2 * 2]);
+                pairs.push_back(run[count / 2 * 2 + 1]);
+            }
+            else {
+                pairs.push_back(run[0]);
+                pairs.push_back(run[1]);
+                pairs.push_back(run[run.size() - 2]);
+                pairs.push_back(run[run.size() - 1]);
+            }
+        }
+    }
+}
+
+void Navigation::connectCluster(int cluster, NavSearch& search, std::vector<std::vector<unsigned> >& to,
+                                std::vector<std::vector<float> >& cost) const
+{
+    unsigned begin = mClusterEntryStart[cluster];
+    unsigned end = mClusterEntryStart[cluster + 1];
+    for (unsigned e = begin; e < end; e++) {
+        flood(search, mEntryNode[e], cluster);
+        for (unsigned f = begin; f < end; f++) {
+            unsigned n = mEntryNode[f];
+            if (f != e && search.isSeen(n)) {
+                to[e].push_back(f);
+                cost[e].push_back(search.cost[n]);
+            }
+        }
+    }
+}
+
+int Navigation::getCluster(unsigned node) const
+{
+    return (mNodeZ[node] / CLUSTER_SIZE) * mClusters[0] + mNodeX[node] / CLUSTER_SIZE;
+}
+
+float Navigation::estimate(unsigned a, unsigned b) const
+{
+    // octile distance, never more than the cost of a path
+    int dx = std::abs((int)mNodeX[a] - (int)mNodeX[b]);
+    int dz = std::abs((int)mNodeZ[a] - (int)mNodeZ[b]);
+    return dx > dz ? dx + (SQRT2 - 1) * dz : dz + (SQRT2 - 1) * dx;
+}
+
+bool Navigation::searchNodes(NavSearch& search, unsigned a, unsigned b, int cluster, std::vector<unsigned>& path) const
+{
+    search.begin();
+    search.relax(a, 0.0f, estimate(a, b), NONE);
+
+    unsigned n;
+    while ((n = search.pop()) != NONE) {
+        if (n == b) {
+            search.appendPath(a, b, path);
+            return true;
+        }
+
+        const unsigned* links = &mLinks[(size_t)n * 8];
+        for (int d = 0; d < 8; d++) {
+            unsigned m = links[d];
+            if (m == NONE || (cluster >= 0 && getCluster(m) != cluster)) {
+                continue;
+            }
+            search.relax(m, search.cost[n] + LINK_COST[d], estimate(m, b), n);
+        }
+    }
+
+    return false;
+}
+
+void Navigation::flood(NavSearch& search, unsigned source, int cluster) const
+{
+    search.begin();
+    search.relax(source, 0.0f, 0.0f, NONE);
+
+    unsigned n;
+    while ((n = search.pop()) != NONE) {
+        const unsigned* links = &mLinks[(size_t)n * 8];
+        for (int d = 0; d < 8; d++) {
+            unsigned m = links[d];
+            if (m == NONE || (cluster >= 0 && getCluster(m) != cluster)) {
+                continue;
+            }
+            search.relax(m, search.cost[n] + LINK_COST[d], 0.0f, n);
+        }
+    }
+}
+
+bool Navigation::searchHierarchical(NavSearch& search, unsigned start, unsigned goal, std::vector<unsigned>& path) const
+{
+    path.push_back(start);
+    if (start == goal) {
+        return true;
+    }
+
+    const int startCluster = getCluster(start);
+    const int goalCluster = getCluster(goal);
+    if (startCluster == goalCluster && searchNodes(search, start, goal, startCluster, path)) {
+        ++mNumLocal;
+        return true;
+    }
+    ++mNumHierarchical;
+
+    // connect the start and goal to the entries of their clusters
+    const unsigned startBegin = mClusterEntryStart[startCluster];
+    const unsigned startEnd = mClusterEntryStart[startCluster + 1];
+    const unsigned goalBegin = mClusterEntryStart[goalCluster];
+    const unsigned goalEnd = mClusterEntryStart[goalCluster + 1];
+
+    flood(search, start, startCluster);
+    search.startCost.clear();
+    for (unsigned e = startBegin; e < startEnd; e++) {
+        search.startCost.push_back(search.isSeen(mEntryNode[e]) ? search.cost[mEntryNode[e]] : -1.0f);
+    }
+    flood(search, goal, goalCluster);
+    search.goalCost.clear();
+    for (unsigned e = goalBegin; e < goalEnd; e++) {
+        search.goalCost.push_back(search.isSeen(mEntryNode[e]) ? search.cost[mEntryNode[e]] : -1.0f);
+    }
+
+    // A* over the entries, with the start and goal after them
+    const unsigned numEntries = (unsigned)mEntryNode.size();
+    const unsigned S = numEntries;
+    const unsigned G = numEntries + 1;
+
+    search.begin();
+    search.relax(S, 0.0f, estimate(start, goal), NONE);
+
+    bool found = false;
+    unsigned u;
+    while ((u = search.pop()) != NONE) {
+        if (u == G) {
+            found = true;
+            break;
+        }
+
+        float g = search.cost[u];
+        if (u == S) {
+            for (unsigned e = startBegin; e < startEnd; e++) {
+                float c = search.startCost[e - startBegin];
+                if (c >= 0) {
+                    search.relax(e, g + c, estimate(mEntryNode[e], goal), S);
+                }
+            }
+            continue;
+        }
+
+        for (unsigned k = mEdgeStart[u]; k < mEdgeStart[u + 1]; k++) {
+            unsigned v = mEdgeTo[k];
+            search.relax(v, g + mEdgeCost[k], estimate(mEntryNode[v], goal), u);
+        }
+        if (u >= goalBegin && u < goalEnd && search.goalCost[u - goalBegin] >= 0) {
+            search.relax(G, g + search.goalCost[u - goalBegin], 0.0f, u);
+        }
+    }
+    if (!found) {
+        path.clear();
+        return false;
+    }
+
+    search.abstractPath.clear();
+    for (unsigned v = search.parent[G]; v != S; v = search.parent[v]) {
+        search.abstractPath.push_back(mEntryNode[v]);
+    }
+    search.abstractPath.push_back(start);
+    std::reverse(search.abstractPath.begin(), search.abstractPath.end());
+    search.abstractPath.push_back(goal);
+
+    // refine: each edge is either a step across an entrance or a path inside one cluster
+    for (size_t i = 1; i < search.abstractPath.size(); i++) {
+        unsigned a = search.abstractPath[i - 1];
+        unsigned b = search.abstractPath[i];
+        if (a == b) {
+            continue;
+        }
+        int cluster = getCluster(a);
+        if (cluster != getCluster(b)) {
+            path.push_back(b);
+        }
+        else if (!searchNodes(search, a, b, cluster, path)) {
+            path.clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Navigation::buildField(NavSearch& search, FlowField& field) const
+{
+    // the links go both ways, so the tree of shortest paths out from the goal points every
+    // node at its next step back to it
+    flood(search, field.goal, -1);
+
+    const unsigned numNodes = (unsigned)mNodeY.size();
+    field.next.resize(numNodes);
+    for (unsigned n = 0; n < numNodes; n++) {
+        field.next[n] = search.isSeen(n) ? search.parent[n] : NONE;
+    }
+    field.next[field.goal] = field.goal;
+}
+
+bool Navigation::followField(const FlowField& field, unsigned start, std::vector<unsigned>& path) const
+{
+    if (field.next[start] == NONE) {
+        return false;
+    }
+
+    unsigned n = start;
+    path.push_back(n);
+    while (n != field.goal) {
+        n = field.next[n];
+        path.push_back(n);
+    }
+    return true;
+}
+
+void Navigation::makeWaypoints(const std::vector<unsigned>& nodes, std::vector<glm::vec3>& path) const
+{
+    path.clear();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        bool keep = i == 0 || i + 1 == nodes.size();
+        if (!keep) {
+            unsigned p = nodes[i - 1], n = nodes[i], q = nodes[i + 1];
+            keep = mNodeX[n] - mNodeX[p] != mNodeX[q] - mNodeX[n] ||
+                   mNodeZ[n] - mNodeZ[p] != mNodeZ[q] - mNodeZ[n] ||
+                   mNodeY[n] != mNodeY[p] || mNodeY[q] != mNodeY[n];
+        }
+        if (keep) {
+            path.push_back(getNodePosition(nodes[i]));
+        }
+    }
+}
+
+glm::vec3 Navigation::getNodePosition(unsigned node) const
+{
+    return mGrid->getCellCenter(mNodeX[node], mNodeY[node], mNodeZ[node]);
+}
+
+unsigned Navigation::findNode(const glm::vec3& p) const
+{
+    if (!mGrid) {
+        return NONE;
+    }
+
+    const int dimX = mGrid->getDim(0);
+    const int dimZ = mGrid->getDim(2);
+    const float cs = mGrid->getSettings().cellSize;
+    const float ch = mGrid->getSettings().cellHeight;
+
+    int x, z;
+    mGrid->getColumn(p, x, z);
+    float y = (p.y - mGrid->getOrigin().y) / ch;
+
+    // the nearest floor in the column, or in a ring around it if the point is by a wall
+    const int maxRadius = 3;
+    unsigned best = NONE;
+    float bestDistance = 0;
+    for (int r = 0; r <= maxRadius && best == NONE; r++) {
+        for (int dz = -r; dz <= r; dz++) {
+            for (int dx = -r; dx <= r; dx++) {
+                int cx = x + dx;
+                int cz = z + dz;
+                if ((std::abs(dx) != r && std::abs(dz) != r) || cx < 0 || cz < 0 || cx >= dimX || cz >= dimZ) {
+                    continue;
+                }
+                size_t column = (size_t)cz * dimX + cx;
+                for (unsigned n = mColumnStart[column]; n < mColumnStart[column + 1]; n++) {
+                    float dy = (mNodeY[n] - y) * ch;
+                    float distance = (float)(dx * dx + dz * dz) * cs * cs + dy * dy;
+                    if (best == NONE || distance < bestDistance) {
+                        best = n;
+                        bestDistance = distance;
+                    }
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
+bool Navigation::findPath(const glm::vec3& start, const glm::vec3& goal, std::vector<glm::vec3>& path, bool hierarchical) const
+{
+    path.clear();
+
+    unsigned a = findNode(start);
+    unsigned b = findNode(goal);
+    if (a == NONE || b == NONE) {
+        return false;
+    }
+
+    NavSearch* search = acquireSearch();
+    std::vector<unsigned> nodes;
+    bool found;
+    if (hierarchical) {
+        found = searchHierarchical(*search, a, b, nodes);
+    }
+    else {
+        nodes.push_back(a);
+        found = a == b || searchNodes(*search, a, b, -1, nodes);
+    }
+    releaseSearch(search);
+
+    if (found) {
+        makeWaypoints(nodes, path);
+    }
+    return found;
+}
+
+unsigned Navigation::request(const glm::vec3& start, const glm::vec3& goal)
+{
+    unsigned ticket;
+    if (!mFreeTickets.empty()) {
+        ticket = mFreeTickets.back();
+        mFreeTickets.pop_back();
+    }
+    else {
+        ticket = (unsigned)mQueries.size();
+        mQueries.push_back(Query());
+    }
+
+    Query& query = mQueries[ticket];
+    query.start = findNode(start);
+    query.goal = findNode(goal);
+    query.path.clear();
+    if (query.start == NONE || query.goal == NONE) {
+        query.status = NAV_NOT_FOUND;
+    }
+    else {
+        query.status = NAV_PENDING;
+        mPending.push_back(ticket);
+    }
+
+    return ticket;
+}
+
+NavStatus Navigation::getResult(unsigned ticket, std::vector<glm::vec3>& path)
+{
+    if (ticket >= mQueries.size()) {
+        return NAV_INVALID;
+    }
+
+    Query& query = mQueries[ticket];
+    NavStatus status = query.status;
+    if (status == NAV_PENDING || status == NAV_INVALID) {
+        return status;
+    }
+
+    path.swap(query.path);
+    query.path.clear();
+    query.status = NAV_INVALID;
+    mFreeTickets.push_back(ticket);
+    return status;
+}
+
+void Navigation::clearFlowFields()
+{
+    mFlowFields.clear();
+}
+
+unsigned Navigation::update(JobSystem& jobs, double budgetMs)
+{
+    Clock::time_point t0 = Clock::now();
+    ++mNumUpdates;
+
+    if (mPending.empty()) {
+        return 0;
+    }
+
+    //
+    // goals many of the queued queries share get a flow field, the most wanted first
+    //
+    std::unordered_map<unsigned, unsigned> goalCount;
+    for (size_t i = 0; i < mPending.size(); i++) {
+        ++goalCount[mQueries[mPending[i]].goal];
+    }
+
+    std::unordered_map<unsigned, unsigned> fieldOf;     // goal -> slot
+    for (unsigned s = 0; s < mFlowFields.size(); s++) {
+        FlowField& field = mFlowFields[s];
+        if (field.goal != NONE && goalCount.count(field.goal)) {
+            fieldOf[field.goal] = s;
+            field.lastUsed = mNumUpdates;
+        }
+    }
+
+    std::vector<std::pair<unsigned, unsigned> > wanted;     // (count, goal)
+    for (std::unordered_map<unsigned, unsigned>::const_iterator it = goalCount.begin(); it != goalCount.end(); ++it) {
+        if (it->second >= FLOW_FIELD_MIN_QUERIES && !fieldOf.count(it->first)) {
+            wanted.push_back(std::make_pair(it->second, it->first));
+        }
+    }
+    std::sort(wanted.begin(), wanted.end(), std::greater<std::pair<unsigned, unsigned> >());
+
+    // a field per worker at a time while there is time; queries to a goal whose field didn't
+    // fit in this update wait for it rather than search on their own
+    const Clock::time_point deadline = t0 + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(budgetMs));
+    const size_t fieldsPerBatch = jobs.getNumThreads();
+    std::vector<unsigned> toBuild;
+    size_t next = 0;
+    bool outOfSlots = false;
+    while (next < wanted.size() && !outOfSlots && (next == 0 || Clock::now() < deadline)) {
+        toBuild.clear();
+        for (; next < wanted.size() && toBuild.size() < fieldsPerBatch; next++) {
+            // a free slot, or the one read longest ago that this update isn't using
+            unsigned slot = NONE;
+            if (mFlowFields.size() < MAX_FLOW_FIELDS) {
+                slot = (unsigned)mFlowFields.size();
+                mFlowFields.push_back(FlowField());
+            }
+            else {
+                for (unsigned s = 0; s < mFlowFields.size(); s++) {
+                    if (mFlowFields[s].lastUsed != mNumUpdates && (slot == NONE || mFlowFields[s].lastUsed < mFlowFields[slot].lastUsed)) {
+                        slot = s;
+                    }
+                }
+            }
+            if (slot == NONE) {
+                outOfSlots = true;
+                break;
+            }
+
+            mFlowFields[slot].goal = wanted[next].second;
+            mFlowFields[slot].lastUsed = mNumUpdates;
+            fieldOf[wanted[next].second] = slot;
+            toBuild.push_back(slot);
+        }
+
+        jobs.parallelFor(toBuild.size(), 1, [this, &toBuild](size_t begin, size_t end) {
+            NavSearch* search = acquireSearch();
+            for (size_t i = begin; i < end; i++) {
+                buildField(*search, mFlowFields[toBuild[i]]);
+            }
+            releaseSearch(search);
+        });
+        mNumFlowFieldsBuilt += toBuild.size();
+    }
+    for (; next < wanted.size() && !outOfSlots; next++) {
+        fieldOf[wanted[next].second] = NONE;
+    }
+
+    //
+    // answer the queries oldest first, a batch at a time among the workers, until the time is
+    // up; a worker stops between queries once it is, and what it didn't get to stays queued
+    //
+    const size_t batch = 32 * (size_t)jobs.getNumThreads();
+    size_t done = 0;
+    while (done < mPending.size() && (done == 0 || Clock::now() < deadline)) {
+        size_t first = done;
+        size_t count = mPending.size() - first < batch ? mPending.size() - first : batch;
+
+        jobs.parallelFor(count, 1, [this, first, deadline, &fieldOf](size_t begin, size_t end) {
+            NavSearch* search = acquireSearch();
+            std::vector<unsigned> nodes;
+            for (size_t i = begin; i < end; i++) {
+                if (i > begin && Clock::now() >= deadline) {
+                    break;
+                }
+
+                Query& query = mQueries[mPending[first + i]];
+                nodes.clear();
+
+                bool found;
+                std::unordered_map<unsigned, unsigned>::const_iterator it = fieldOf.find(query.goal);
+                if (it != fieldOf.end() && it->second == NONE) {
+                    continue;
+                }
+                else if (it != fieldOf.end()) {
+                    found = followField(mFlowFields[it->second], query.start, nodes);
+                    ++mNumFlow;
+                }
+                else {
+                    found = searchHierarchical(*search, query.start, query.goal, nodes);
+                }
+
+                if (found) {
+                    makeWaypoints(nodes, query.path);
+                    query.status = NAV_FOUND;
+                }
+                else {
+                    query.status = NAV_NOT_FOUND;
+                }
+            }
+            releaseSearch(search);
+        });
+
+        done += count;
+    }
+
+    // keep the ones still waiting, in order
+    size_t kept = 0;
+    for (size_t i = 0; i < mPending.size(); i++) {
+        if (i >= done || mQueries[mPending[i]].status == NAV_PENDING) {
+            mPending[kept++] = mPending[i];
+        }
+    }
+    mPending.resize(kept);
+
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    mMaxUpdateMs = ms > mMaxUpdateMs ? ms : mMaxUpdateMs;
+
+    return (unsigned)mPending.size();
+}
+
+void Navigation::printStats() const
+{
+    std::cout << "Navigation: " << mNodeY.size() << " nodes, " << getNumClusters() << " clusters, "
+              << mEntryNode.size() << " entries, " << mEdgeTo.size() << " edges, built in " << mBuildMs << " ms" << std::endl;
+    std::cout << "  " << mNumHierarchical << " hierarchical, " << mNumLocal << " local, " << mNumFlow << " flow field queries, "
+              << mNumFlowFieldsBuilt << " fields built, max update " << mMaxUpdateMs << " ms" << std::endl;
+}
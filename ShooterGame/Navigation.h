@@ -0,0 +1,181 @@
+#ifndef NAVIGATION_H_
+#define NAVIGATION_H_
+
+#include "VoxelGrid.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+class JobSystem;
+
+enum NavStatus {
+    NAV_PENDING,
+    NAV_FOUND,
+    NAV_NOT_FOUND,              // no path, or the start or goal isn't near a walkable floor
+    NAV_INVALID                 // not a ticket that is waiting for its result
+};
+
+//
+// Paths over the walkable spans of a voxel grid.
+//
+// Every walkable span is a node, linked to the spans in the 8 neighbouring columns an agent can
+// step to (within its climb, with its height of headroom).  The columns are grouped into
+// CLUSTER_SIZE x CLUSTER_SIZE clusters, and the places where a cluster border can be crossed
+// become entrances of an abstract graph (HPA*, Botea et al.): pairs of nodes across the border
+// linked to each other, and to the other entrances of their cluster with the cost of the best
+// path inside it.  A query connects its start and goal to the entrances of their clusters,
+// runs A* over the abstract graph and refines each abstract edge with A* confined to one
+// cluster, so no search ever spans the whole level.  Queries that stay in a cluster try a
+// local search first.
+//
+// Many agents heading for the same place share a flow field instead: one Dijkstra pass out
+// from the goal gives every node its next step, and each agent's path is read off it.  Fields
+// are kept for the most recent goals.
+//
+// Queries are queued with request() and answered by update(), which splits them among the
+// workers and stops once the frame's budget is spent, leaving the rest for the next frame.
+// findPath() answers one directly, from any thread.
+//
+class Navigation {
+
+public:
+    enum {
+        CLUSTER_SIZE = 16,              // columns per cluster side
+        MAX_FLOW_FIELDS = 16,           // goals whose fields are kept
+        FLOW_FIELD_MIN_QUERIES = 16     // queries to one goal in a batch that make a field worth it
+    };
+
+    static const unsigned   NONE;
+
+private:
+    struct NavSearch;
+
+    struct FlowField {
+        unsigned            goal;           // node, NONE if the slot is free
+        unsigned long long  lastUsed;       // update() it was last read in
+        std::vector<unsigned> next;         // per node: the next node towards the goal, NONE if unreachable
+    };
+
+    struct Query {
+        unsigned            start;          // nodes
+        unsigned            goal;
+        NavStatus           status;
+        std::vector<glm::vec3> path;
+    };
+
+    const VoxelGrid*        mGrid;
+
+    // nodes, column by column (x-major within z), and their links: the orthogonal directions
+    // (+x, +z, -x, -z) then the diagonals (+x+z, -x+z, -x-z, +x-z)
+    std::vector<unsigned>   mColumnStart;
+    std::vector<unsigned short> mNodeX;
+    std::vector<unsigned short> mNodeZ;
+    std::vector<unsigned short> mNodeY;     // the floor's cell
+    std::vector<unsigned>   mLinks;         // 8 per node, NONE if not linked
+
+    // clusters and the abstract graph, whose nodes (entries) are numbered cluster by cluster
+    int                     mClusters[2];   // in x and z
+    std::vector<unsigned>   mEntryNode;
+    std::vector<unsigned>   mClusterEntryStart;     // entries of cluster c are [start[c], start[c + 1])
+    std::vector<unsigned>   mEdgeStart;     // edges of entry e are [start[e], start[e + 1])
+    std::vector<unsigned>   mEdgeTo;
+    std::vector<float>      mEdgeCost;
+
+    // search scratch, one per thread that is searching
+    mutable std::mutex      mSearchMutex;
+    mutable std::vector<NavSearch*> mFreeSearches;
+
+    // queued queries, by ticket
+    std::vector<Query>      mQueries;
+    std::vector<unsigned>   mFreeTickets;
+    std::vector<unsigned>   mPending;       // oldest first
+
+    std::vector<FlowField>  mFlowFields;
+    unsigned long long      mNumUpdates;
+
+    // stats
+    double                  mBuildMs;
+    mutable std::atomic<unsigned long long> mNumHierarchical;
+    mutable std::atomic<unsigned long long> mNumLocal;      // answered by a search inside one cluster
+    mutable std::atomic<unsigned long long> mNumFlow;       // answered by a flow field
+    unsigned long long      mNumFlowFieldsBuilt;
+    double                  mMaxUpdateMs;
+
+    NavSearch*              acquireSearch() const;
+    void                    releaseSearch(NavSearch* search) const;
+
+    // pairs of linked nodes across the cluster borders between columns (acrossX) or rows of clusters
+    void                    findEntrances(bool acrossX, std::vector<unsigned>& pairs) const;
+
+    // edges between the entries of a cluster, added to to[] and cost[] of its entries
+    void                    connectCluster(int cluster, NavSearch& search, std::vector<std::vector<unsigned> >& to,
+                                           std::vector<std::vector<float> >& cost) const;
+
+    int                     getCluster(unsigned node) const;
+    float                   estimate(unsigned a, unsigned b) const;
+
+    // A* from a to b over the nodes, confined to one cluster unless it is -1; appends the nodes
+    // after a, up to b
+    bool                    searchNodes(NavSearch& search, unsigned a, unsigned b, int cluster, std::vector<unsigned>& path) const;
+
+    // costs from a node to everything reachable in its cluster (or everywhere if cluster is -1),
+    // left in the search
+    void                    flood(NavSearch& search, unsigned source, int cluster) const;
+
+    bool                    searchHierarchical(NavSearch& search, unsigned start, unsigned goal, std::vector<unsigned>& path) const;
+    bool                    followField(const FlowField& field, unsigned start, std::vector<unsigned>& path) const;
+    void                    buildField(NavSearch& search, FlowField& field) const;
+
+    // waypoints where the path turns or changes height
+    void                    makeWaypoints(const std::vector<unsigned>& nodes, std::vector<glm::vec3>& path) const;
+
+    Navigation(const Navigation&);                  // not copyable
+    Navigation& operator=(const Navigation&);
+
+public:
+    Navigation();
+    ~Navigation();
+
+    // nodes, links and the abstract graph of a voxel grid (which must outlive this); rebuild
+    // after the grid changes
+    bool                    build(const VoxelGrid& grid, JobSystem* jobs = NULL);
+
+    void                    clear();
+
+    // the node nearest a point, NONE if there is no floor near it
+    unsigned                findNode(const glm::vec3& p) const;
+
+    // one path right away (hierarchical, or plain A* over the nodes for comparison); thread safe
+    bool                    findPath(const glm::vec3& start, const glm::vec3& goal, std::vector<glm::vec3>& path,
+                                     bool hierarchical = true) const;
+
+    // queue a query, returns its ticket
+    unsigned                request(const glm::vec3& start, const glm::vec3& goal);
+
+    // answer queued queries in parallel until about budgetMs have passed, returns how many are left
+    unsigned                update(JobSystem& jobs, double budgetMs);
+
+    // once a query is answered, take its path; the ticket is then free
+    NavStatus               getResult(unsigned ticket, std::vector<glm::vec3>& path);
+
+    void                    clearFlowFields();
+
+    unsigned                getNumNodes() const         { return (unsigned)mNodeY.size(); }
+    unsigned                getNumEntries() const       { return (unsigned)mEntryNode.size(); }
+    unsigned                getNumEdges() const         { return (unsigned)mEdgeTo.size(); }
+    unsigned                getNumClusters() const      { return (unsigned)(mClusters[0] * mClusters[1]); }
+    unsigned                getNumPending() const       { return (unsigned)mPending.size(); }
+    glm::vec3               getNodePosition(unsigned node) const;
+    double                  getBuildMs() const          { return mBuildMs; }
+    double                  getMaxUpdateMs() const      { return mMaxUpdateMs; }
+
+    unsigned long long      getNumHierarchical() const  { return mNumHierarchical; }
+    unsigned long long      getNumLocal() const         { return mNumLocal; }
+    unsigned long long      getNumFlow() const          { return mNumFlow; }
+    unsigned long long      getNumFlowFieldsBuilt() const   { return mNumFlowFieldsBuilt; }
+
+    void                    printStats() const;
+};
+
+#endif
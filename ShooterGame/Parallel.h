@@ -0,0 +1,62 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+//
+// Split [0, count) into contiguous ranges and call fn(begin, end) for each range
+// in parallel.  Ranges are at least 'grain' items long, so small inputs run
+// inline on the calling thread.
+//
+// The ranges run as jobs if a JobSystem is running, otherwise each one gets its own thread.
+//
+template <typename Fn>
+void ParallelFor(size_t count, size_t grain, Fn fn)
+{
+    JobSystem* jobs = JobSystem::GetActive();
+    if (jobs) {
+        jobs->parallelFor(count, grain, fn);
+        return;
+    }
+
+    size_t numThreads = std::thread::hardware_concurrency();
+    if (numThreads < 1) {
+        numThreads = 1;
+    }
+    if (grain < 1) {
+        grain = 1;
+    }
+    numThreads = std::min(numThreads, (count + grain - 1) / grain);
+
+    if (numThreads <= 1) {
+        if (count > 0) {
+            fn((size_t)0, count);
+        }
+        return;
+    }
+
+    size_t chunk = (count + numThreads - 1) / numThreads;
+
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads - 1);
+    for (size_t t = 1; t < numThreads; t++) {
+        size_t begin = t * chunk;
+        size_t end = std::min(count, begin + chunk);
+        if (begin < end) {
+            threads.push_back(std::thread(fn, begin, end));
+        }
+    }
+
+    // the calling thread does the first range
+    fn((size_t)0, std::min(count, chunk));
+
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+}
+
+#endif
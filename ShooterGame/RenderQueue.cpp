@@ -0,0 +1,370 @@
+#include "RenderQueue.h"
+#include "GLDebug.h"
+
+#include <algorithm>
+
+namespace {
+
+// bound-state marker that never matches a real GL name
+const GLuint UNKNOWN = ~0u;
+const unsigned NO_MATERIAL = ~0u;
+
+}
+
+Material::Material()
+    : color(1.0f, 1.0f, 1.0f, 1.0f)
+    , depthTest(true)
+    , texture(0)
+{
+}
+
+Material::Material(const glm::vec4& color, bool depthTest, GLuint texture)
+    : color(color)
+    , depthTest(depthTest)
+    , texture(texture)
+{
+}
+
+DrawItem::DrawItem()
+    : key(0)
+    , program(0)
+    , material(0)
+    , mesh(NULL)
+    , vao(0)
+    , mode(GL_TRIANGLES)
+    , indexType(0)
+    , first(0)
+    , indexOffset(NULL)
+    , count(0)
+    , modelView(1.0f)
+    , normalMatrix(1.0f)
+    , hasNormalMatrix(false)
+{
+}
+
+RenderStats::RenderStats()
+{
+    reset();
+}
+
+void RenderStats::reset()
+{
+    numDraws = 0;
+    numTriangles = 0;
+    programBinds = 0;
+    programBindsAvoided = 0;
+    vaoBinds = 0;
+    vaoBindsAvoided = 0;
+    materialBinds = 0;
+    materialBindsAvoided = 0;
+}
+
+void RenderStats::accumulate(const RenderStats& other)
+{
+    numDraws += other.numDraws;
+    numTriangles += other.numTriangles;
+    programBinds += other.programBinds;
+    programBindsAvoided += other.programBindsAvoided;
+    vaoBinds += other.vaoBinds;
+    vaoBindsAvoided += other.vaoBindsAvoided;
+    materialBinds += other.materialBinds;
+    materialBindsAvoided += other.materialBindsAvoided;
+}
+
+void DrawBucket::submit(const DrawItem& item)
+{
+    mItems.push_back(item);
+}
+
+RenderQueue::RenderQueue()
+{
+    setNumBuckets(1);
+}
+
+void RenderQueue::setNumBuckets(unsigned n)
+{
+    mBuckets.resize(n > 0 ? n : 1);
+}
+
+unsigned RenderQueue::addMaterial(const Material& mat)
+{
+    mMaterials.push_back(mat);
+    return (unsigned)mMaterials.size() - 1;
+}
+
+unsigned RenderQueue::findMaterial(const Material& mat)
+{
+    for (unsigned i = 0; i < mMaterials.size(); i++) {
+        if (mMaterials[i].color == mat.color && mMaterials[i].depthTest == mat.depthTest &&
+            mMaterials[i].texture == mat.texture) {
+            return i;
+        }
+    }
+    return addMaterial(mat);
+}
+
+unsigned long long RenderQueue::MakeKey(unsigned pass, GLuint program, unsigned material, GLuint vao, float depth, float maxDepth)
+{
+    // quantize depth front to back
+    float d = glm::clamp(depth / maxDepth, 0.0f, 1.0f);
+    unsigned long long qdepth = (unsigned long long)(d * 0xFFFF);
+
+    return ((unsigned long long)(pass & 0xF) << 60)
+         | ((unsigned long long)(program & 0xFFF) << 48)
+         | ((unsigned long long)(material & 0xFFFF) << 32)
+         | ((unsigned long long)(vao & 0xFFFF) << 16)
+         | qdepth;
+}
+
+const RenderQueue::ProgramInfo& RenderQueue::getProgramInfo(GLuint program)
+{
+    for (unsigned i = 0; i < mProgramInfo.size(); i++) {
+        if (mProgramInfo[i].program == program) {
+            return mProgramInfo[i];
+        }
+    }
+
+    ProgramInfo info;
+    info.program = program;
+    info.modelViewLoc = glGetUniformLocation(program, "u_ModelViewMatrix");
+    info.normalMatrixLoc = glGetUniformLocation(program, "u_NormalMatrix");
+    info.colorLoc = glGetUniformLocation(program, "u_Color");
+    mProgramInfo.push_back(info);
+
+    return mProgramInfo.back();
+}
+
+void RenderQueue::forgetProgram(GLuint program)
+{
+    for (unsigned i = 0; i < mProgramInfo.size(); i++) {
+        if (mProgramInfo[i].program == program) {
+            mProgramInfo.erase(mProgramInfo.begin() + i);
+            return;
+        }
+    }
+}
+
+void RenderQueue::RadixSort(std::vector<SortEntry>& entries, std::vector<SortEntry>& scratch)
+{
+    const size_t n = entries.size();
+    scratch.resize(n);
+
+    // find the bytes that differ between keys, the others don't need a pass
+    unsigned long long allOr = 0;
+    unsigned long long allAnd = ~0ULL;
+    for (size_t i = 0; i < n; i++) {
+        allOr |= entries[i].key;
+        allAnd &= entries[i].key;
+    }
+    unsigned long long varying = allOr ^ allAnd;
+
+    // LSD radix sort, 8 bits per pass
+    for (int shift = 0; shift < 64; shift += 8) {
+        if (((varying >> shift) & 0xFF) == 0) {
+            continue;
+        }
+
+        size_t counts[256] = { 0 };
+        for (size_t i = 0; i < n; i++) {
+            ++counts[(entries[i].key >> shift) & 0xFF];
+        }
+
+        size_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t c = counts[b];
+            counts[b] = offset;
+            offset += c;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            scratch[counts[(entries[i].key >> shift) & 0xFF]++] = entries[i];
+        }
+
+        entries.swap(scratch);
+    }
+}
+
+void RenderQueue::sort()
+{
+    mSorted.clear();
+
+    for (unsigned b = 0; b < mBuckets.size(); b++) {
+        const std::vector<DrawItem>& items = mBuckets[b].mItems;
+        for (unsigned i = 0; i < items.size(); i++) {
+            SortEntry e;
+            e.key = items[i].key;
+            e.bucket = b;
+            e.index = i;
+            mSorted.push_back(e);
+        }
+    }
+
+    RadixSort(mSorted, mScratch);
+}
+
+const char* RenderQueue::GetPassName(unsigned pass)
+{
+    switch (pass) {
+    case PASS_BACKGROUND:   return "background";
+    case PASS_AXES:         return "axes";
+    case PASS_DEPTH:        return "depth";
+    case PASS_OPAQUE:       return "opaque";
+    case PASS_OVERLAY:      return "overlay";
+    default:                return "?";
+    }
+}
+
+void RenderQueue::SetPassState(unsigned from, unsigned to, bool haveDepthPass)
+{
+    if (from == PASS_DEPTH) {
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        GL_DEBUG_STATE(1);
+    }
+    if (from == PASS_OPAQUE && haveDepthPass) {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+        GL_DEBUG_STATE(2);
+    }
+
+    if (to == PASS_DEPTH) {
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        GL_DEBUG_STATE(1);
+    }
+    if (to == PASS_OPAQUE && haveDepthPass) {
+        // the depth buffer already holds the nearest surfaces, so only those get shaded
+        glDepthFunc(GL_LEQUAL);
+        glDepthMask(GL_FALSE);
+        GL_DEBUG_STATE(2);
+    }
+}
+
+void RenderQueue::execute()
+{
+    mStats.reset();
+
+    GLuint curProgram = UNKNOWN;
+    GLuint curVAO = UNKNOWN;
+    unsigned curMaterial = NO_MATERIAL;
+    GLuint curTexture = UNKNOWN;
+    bool depthTest = true;
+    unsigned curPass = PASS_BACKGROUND;
+    bool haveDepthPass = false;
+
+    glEnable(GL_DEPTH_TEST);
+    GL_DEBUG_STATE(1);
+    GL_DEBUG_PUSH(GetPassName(curPass));
+
+    for (unsigned s = 0; s < mSorted.size(); s++) {
+        const DrawItem& item = mBuckets[mSorted[s].bucket].mItems[mSorted[s].index];
+
+        unsigned pass = (unsigned)(mSorted[s].key >> 60);
+        if (pass != curPass) {
+            GL_DEBUG_POP();
+            GL_DEBUG_PUSH(GetPassName(pass));
+            SetPassState(curPass, pass, haveDepthPass);
+            haveDepthPass |= pass == PASS_DEPTH;
+            curPass = pass;
+        }
+
+        if (item.program != curProgram) {
+            glUseProgram(item.program);
+            GL_DEBUG_STATE(1);
+            curProgram = item.program;
+            curMaterial = NO_MATERIAL;      // uniforms are per program
+            ++mStats.programBinds;
+        }
+        else {
+            ++mStats.programBindsAvoided;
+        }
+
+        const ProgramInfo& info = getProgramInfo(item.program);
+
+        if (item.material != curMaterial) {
+            const Material& mat = mMaterials[item.material];
+            if (info.colorLoc >= 0) {
+                glUniform4fv(info.colorLoc, 1, &mat.color[0]);
+                GL_DEBUG_CALLS(1);
+            }
+            if (mat.depthTest != depthTest) {
+                if (mat.depthTest) {
+                    glEnable(GL_DEPTH_TEST);
+                }
+                else {
+                    glDisable(GL_DEPTH_TEST);
+                }
+                GL_DEBUG_STATE(1);
+                depthTest = mat.depthTest;
+            }
+            if (mat.texture != curTexture) {
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, mat.texture);
+                GL_DEBUG_STATE(2);
+                curTexture = mat.texture;
+            }
+            curMaterial = item.material;
+            ++mStats.materialBinds;
+        }
+        else {
+            ++mStats.materialBindsAvoided;
+        }
+
+        if (info.modelViewLoc >= 0) {
+            glUniformMatrix4fv(info.modelViewLoc, 1, GL_FALSE, &item.modelView[0][0]);
+            GL_DEBUG_CALLS(1);
+        }
+        if (item.hasNormalMatrix && info.normalMatrixLoc >= 0) {
+            glUniformMatrix3fv(info.normalMatrixLoc, 1, GL_FALSE, &item.normalMatrix[0][0]);
+            GL_DEBUG_CALLS(1);
+        }
+
+        if (item.mesh) {
+            // the mesh binds its own vertex array, so we no longer know what's bound
+            item.mesh->draw();
+            GL_DEBUG_STATE(2);      // its bind and unbind
+            GL_DEBUG_DRAW();
+            curVAO = UNKNOWN;
+        }
+        else {
+            if (item.vao != curVAO) {
+                glBindVertexArray(item.vao);
+                GL_DEBUG_STATE(1);
+                curVAO = item.vao;
+                ++mStats.vaoBinds;
+            }
+            else {
+                ++mStats.vaoBindsAvoided;
+            }
+
+            if (item.indexType) {
+                glDrawElements(item.mode, item.count, item.indexType, item.indexOffset);
+            }
+            else {
+                glDrawArrays(item.mode, item.first, item.count);
+            }
+            GL_DEBUG_DRAW();
+
+            if (item.mode == GL_TRIANGLES) {
+                mStats.numTriangles += item.count / 3;
+            }
+        }
+
+        ++mStats.numDraws;
+    }
+
+    GL_DEBUG_POP();
+
+    // leave things the way we found them
+    SetPassState(curPass, PASS_OVERLAY, haveDepthPass);
+    glBindVertexArray(0);
+    if (curTexture != UNKNOWN && curTexture != 0) {
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    if (!depthTest) {
+        glEnable(GL_DEPTH_TEST);
+    }
+
+    for (unsigned b = 0; b < mBuckets.size(); b++) {
+        mBuckets[b].clear();
+    }
+    mSorted.clear();
+}
@@ -0,0 +1,154 @@
+#ifndef RENDERQUEUE_H_
+#define RENDERQUEUE_H_
+
+#include "GLSH.h"
+
+#include <vector>
+
+//
+// Sort key layout (most significant bits first):
+//
+//   63..60  pass
+//   59..48  program
+//   47..32  material
+//   31..16  vertex array
+//   15..0   depth
+//
+// Sorting by key groups the draws by pass, then by program, material and VAO,
+// so each of those is bound as few times as possible.
+//
+enum RenderPass {
+    PASS_BACKGROUND = 0,    // ground
+    PASS_AXES       = 1,    // world axes, over the ground and under everything else
+    PASS_DEPTH      = 2,    // depth only, no color writes
+    PASS_OPAQUE     = 3,    // after a depth pass: depth test LEQUAL, no depth writes
+    PASS_OVERLAY    = 4,    // gizmos drawn on top of everything
+};
+
+// render state shared by many draws
+struct Material {
+    glm::vec4               color;
+    bool                    depthTest;
+    GLuint                  texture;        // bound to unit 0, 0 for none
+
+    Material();
+    Material(const glm::vec4& color, bool depthTest = true, GLuint texture = 0);
+};
+
+struct DrawItem {
+    unsigned long long      key;
+
+    GLuint                  program;
+    unsigned                material;       // index returned by RenderQueue::addMaterial
+
+    // either a glsh mesh that binds its own buffers...
+    glsh::Mesh*             mesh;
+
+    // ...or a raw vertex array
+    GLuint                  vao;
+    GLenum                  mode;
+    GLenum                  indexType;      // 0 for glDrawArrays
+    GLint                   first;          // first vertex (glDrawArrays)
+    const GLvoid*           indexOffset;    // byte offset into the index buffer (glDrawElements)
+    GLsizei                 count;
+
+    glm::mat4               modelView;
+    glm::mat3               normalMatrix;
+    bool                    hasNormalMatrix;
+
+    DrawItem();
+};
+
+struct RenderStats {
+    unsigned                numDraws;
+    unsigned long long      numTriangles;
+
+    unsigned                programBinds;
+    unsigned                programBindsAvoided;
+    unsigned                vaoBinds;
+    unsigned                vaoBindsAvoided;
+    unsigned                materialBinds;
+    unsigned                materialBindsAvoided;
+
+    RenderStats();
+    void                    reset();
+    void                    accumulate(const RenderStats& other);
+};
+
+// draws submitted by one thread
+class DrawBucket {
+    friend class RenderQueue;
+
+    std::vector<DrawItem>   mItems;
+
+public:
+    void                    submit(const DrawItem& item);
+    void                    clear()                 { mItems.clear(); }
+    size_t                  size() const            { return mItems.size(); }
+};
+
+class RenderQueue {
+
+    // uniform locations cached per program
+    struct ProgramInfo {
+        GLuint              program;
+        GLint               modelViewLoc;
+        GLint               normalMatrixLoc;
+        GLint               colorLoc;
+    };
+
+    std::vector<DrawBucket>         mBuckets;
+    std::vector<Material>           mMaterials;
+    std::vector<ProgramInfo>        mProgramInfo;
+
+    // sorted (key, item) references into the buckets
+    struct SortEntry {
+        unsigned long long  key;
+        unsigned            bucket;
+        unsigned            index;
+    };
+    std::vector<SortEntry>          mSorted;
+    std::vector<SortEntry>          mScratch;
+
+    RenderStats                     mStats;
+
+    const ProgramInfo&      getProgramInfo(GLuint program);
+
+    // switch the color and depth write state between passes
+    static void             SetPassState(unsigned from, unsigned to, bool haveDepthPass);
+
+    static void             RadixSort(std::vector<SortEntry>& entries, std::vector<SortEntry>& scratch);
+
+public:
+    RenderQueue();
+
+    // one bucket per submitting thread; must be called while no thread is submitting
+    void                    setNumBuckets(unsigned n);
+    unsigned                getNumBuckets() const   { return (unsigned)mBuckets.size(); }
+
+    // each thread submits into its own bucket, so no locking is needed
+    DrawBucket&             getBucket(unsigned i)   { return mBuckets[i]; }
+
+    // drop the cached uniform locations of a program that is about to be deleted
+    void                    forgetProgram(GLuint program);
+
+    unsigned                addMaterial(const Material& mat);
+    // index of an equal material, added if there is none
+    unsigned                findMaterial(const Material& mat);
+    const Material&         getMaterial(unsigned i) const { return mMaterials[i]; }
+
+    static unsigned long long MakeKey(unsigned pass, GLuint program, unsigned material, GLuint vao, float depth, float maxDepth);
+
+    static const char*      GetPassName(unsigned pass);
+
+    // merge all buckets and sort by key
+    void                    sort();
+
+    // issue the sorted draws, skipping redundant binds, then clear the buckets
+    void                    execute();
+
+    // stats of the last execute()
+    const RenderStats&      getStats() const        { return mStats; }
+};
+
+#endif
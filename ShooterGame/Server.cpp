@@ -0,0 +1,491 @@
+#include "Server.h"
+#include "CollisionMesh.h"
+#include "FramePacer.h"
+#include "Game.h"
+#include "JobSystem.h"
+#include "VoxelGrid.h"
+
+#include <chrono>
+#include <csignal>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// set by Ctrl+C, the tick loop finishes the current tick and reports
+volatile std::sig_atomic_t Interrupted = 0;
+
+void OnInterrupt(int)
+{
+    Interrupted = 1;
+}
+
+// 0 <= x < 1, deterministic per match
+float NextRandom(unsigned& state)
+{
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+std::string JsonString(const std::string& s)
+{
+    std::ostringstream out;
+    out << '"';
+    for (size_t i = 0; i < s.size(); i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            out << ' ';
+        }
+        else {
+            out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+// sleep until shortly before the deadline and yield the rest, so the tick rate holds even
+// with coarse sleep granularity
+void WaitUntil(Clock::time_point deadline)
+{
+    const std::chrono::milliseconds spin(2);
+    if (Clock::now() + spin < deadline) {
+        std::this_thread::sleep_until(deadline - spin);
+    }
+    while (Clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+}
+
+struct Bot {
+    glm::vec3               position;       // feet
+    glm::vec3               velocity;
+    float                   heading;        // radians around +y
+    int                     health;
+    bool                    onGround;
+};
+
+struct Match {
+    const CollisionMesh*    map;
+    std::vector<Bot>        bots;
+    unsigned                rng;
+    unsigned long long      tick;
+
+    // bot sizes and speeds, scaled to the map
+    float                   height;
+    float                   radius;
+    float                   speed;          // units per second
+    float                   gravity;        // units per second squared
+
+    unsigned long long      raycasts;
+    unsigned long long      shots;
+    unsigned long long      hits;
+    unsigned long long      kills;
+    unsigned long long      respawns;
+};
+
+const int MAX_HEALTH = 100;
+const int SHOT_DAMAGE = 34;
+const float FIRE_INTERVAL = 0.25f;      // seconds between a bot's shots
+
+void Respawn(Match& match, Bot& bot)
+{
+    const glm::vec3& lo = match.map->getMin();
+    const glm::vec3& hi = match.map->getMax();
+    bot.position.x = lo.x + (hi.x - lo.x) * NextRandom(match.rng);
+    bot.position.z = lo.z + (hi.z - lo.z) * NextRandom(match.rng);
+    bot.position.y = hi.y + match.height;     // drop in from above
+    bot.velocity = glm::vec3(0.0f);
+    bot.heading = 6.2831853f * NextRandom(match.rng);
+    bot.health = MAX_HEALTH;
+    bot.onGround = false;
+    ++match.respawns;
+}
+
+void InitMatch(Match& match, const CollisionMesh& map, int numBots, unsigned seed)
+{
+    match.map = &map;
+    match.rng = seed * 2654435761u + 1;
+    match.tick = 0;
+
+    float size = glm::length(map.getMax() - map.getMin());
+    match.height = 0.02f * size;
+    match.radius = 0.005f * size;
+    match.speed = 0.05f * size;
+    match.gravity = 0.5f * size;
+
+    match.raycasts = 0;
+    match.shots = 0;
+    match.hits = 0;
+    match.kills = 0;
+    match.respawns = 0;
+
+    match.bots.resize(numBots);
+    for (int i = 0; i < numBots; i++) {
+        Respawn(match, match.bots[i]);
+    }
+    match.respawns = 0;     // the first spawns don't count
+}
+
+void MoveBot(Match& match, Bot& bot, float dt)
+{
+    const CollisionMesh& map = *match.map;
+    const glm::vec3 up(0.0f, 1.0f, 0.0f);
+    RayHit hit;
+
+    // wander
+    if (NextRandom(match.rng) < 2.0f * dt) {
+        bot.heading += 3.1415927f * (NextRandom(match.rng) - 0.5f);
+    }
+
+    // walk, turning around at walls
+    glm::vec3 dir(std::sin(bot.heading), 0.0f, std::cos(bot.heading));
+    float step = match.speed * dt;
+    ++match.raycasts;
+    if (map.raycast(bot.position + 0.5f * match.height * up, dir, step + match.radius, hit)) {
+        bot.heading += 3.1415927f;
+    }
+    else {
+        bot.position += step * dir;
+    }
+
+    // fall, landing on whatever is below (up to a step's height above the feet)
+    bot.velocity.y -= match.gravity * dt;
+    float stepHeight = 0.25f * match.height;
+    float drop = bot.velocity.y < 0 ? -bot.velocity.y * dt : 0.0f;
+    ++match.raycasts;
+    if (bot.velocity.y <= 0 && map.raycast(bot.position + stepHeight * up, -up, stepHeight + drop, hit)) {
+        bot.position.y = hit.point.y;
+        bot.velocity.y = 0;
+        bot.onGround = true;
+    }
+    else {
+        bot.position.y += bot.velocity.y * dt;
+        bot.onGround = false;
+    }
+
+    // fell off the map
+    const glm::vec3& lo = map.getMin();
+    const glm::vec3& hi = map.getMax();
+    if (bot.position.y < lo.y - 10 * match.height ||
+        bot.position.x < lo.x || bot.position.x > hi.x || bot.position.z < lo.z || bot.position.z > hi.z) {
+        Respawn(match, bot);
+    }
+}
+
+void TickMatch(Match& match, float dt)
+{
+    size_t numBots = match.bots.size();
+
+    for (size_t i = 0; i < numBots; i++) {
+        MoveBot(match, match.bots[i], dt);
+    }
+
+    // hitscan: each bot fires at another one every FIRE_INTERVAL, staggered over the ticks
+    unsigned long long fireTicks = (unsigned long long)(FIRE_INTERVAL / dt);
+    if (fireTicks < 1) {
+        fireTicks = 1;
+    }
+    if (numBots < 2) {
+        ++match.tick;
+        return;
+    }
+
+    for (size_t i = 0; i < numBots; i++) {
+        if ((match.tick + i) % fireTicks != 0) {
+            continue;
+        }
+
+        Bot& shooter = match.bots[i];
+        size_t j = (i + 1 + (size_t)(NextRandom(match.rng) * (numBots - 1))) % numBots;
+        Bot& target = match.bots[j];
+
+        glm::vec3 eye = shooter.position + glm::vec3(0.0f, 0.9f * match.height, 0.0f);
+        glm::vec3 aim = target.position + glm::vec3(0.0f, 0.5f * match.height, 0.0f);
+        glm::vec3 toTarget = aim - eye;
+        float dist = glm::length(toTarget);
+        if (dist < 1e-6f) {
+            continue;
+        }
+
+        ++match.shots;
+        ++match.raycasts;
+        RayHit hit;
+        if (match.map->raycast(eye, toTarget / dist, dist, hit)) {
+            continue;   // the level is in the way
+        }
+
+        ++match.hits;
+        target.health -= SHOT_DAMAGE;
+        if (target.health <= 0) {
+            ++match.kills;
+            Respawn(match, target);
+        }
+    }
+
+    ++match.tick;
+}
+
+}
+
+ServerOptions::ServerOptions()
+    : tickRate(128)
+    , numTicks(0)
+    , numMatches(1)
+    , playersPerMatch(16)
+    , paced(true)
+    , outputPath("server.json")
+{
+}
+
+int RunServer(const ServerOptions& options)
+{
+    if (options.tickRate < 1 || options.numMatches < 1 || options.playersPerMatch < 1) {
+        std::cerr << "ERROR: Tick rate, matches and players must be positive" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> levels = options.levels;
+    if (levels.empty()) {
+        std::vector<std::string> names = Game::LoadAssetList("meshes/meshes.txt");
+        for (unsigned i = 0; i < names.size(); i++) {
+            levels.push_back("meshes/" + names[i]);
+        }
+    }
+    if (levels.empty()) {
+        std::cerr << "ERROR: No levels to load" << std::endl;
+        return 1;
+    }
+
+    JobSystem jobs;
+    jobs.start();
+
+    //
+    // load the levels: parse with deferred upload, so no GL is needed, and keep only the collision data
+    //
+    Clock::time_point loadStart = Clock::now();
+
+    std::vector<CollisionMesh> maps(levels.size());
+    std::vector<char> loaded(levels.size(), 0);
+    jobs.parallelFor(levels.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            OBJMesh mesh;
+            mesh.setDeferUpload(true);
+            if (mesh.load(levels[i]) && maps[i].addMesh(mesh)) {
+                maps[i].build();
+                loaded[i] = maps[i].getNumTriangles() > 0;
+            }
+        }
+    });
+
+    double loadMs = std::chrono::duration<double, std::milli>(Clock::now() - loadStart).count();
+
+    std::vector<const CollisionMesh*> usable;
+    std::vector<std::string> usableNames;
+    for (size_t i = 0; i < levels.size(); i++) {
+        if (!loaded[i]) {
+            std::cout << "Warning: Skipping level '" << levels[i] << "'" << std::endl;
+            continue;
+        }
+        std::cout << "Level '" << levels[i] << "': " << maps[i].getNumTriangles() << " triangles, "
+                  << maps[i].getNumCells() << " cells, " << maps[i].getBytes() / 1024 << " KB" << std::endl;
+        usable.push_back(&maps[i]);
+        usableNames.push_back(levels[i]);
+    }
+    if (usable.empty()) {
+        std::cerr << "ERROR: None of the levels loaded" << std::endl;
+        jobs.stop();
+        return 1;
+    }
+    std::cout << "Loaded " << usable.size() << " levels in " << loadMs << " ms" << std::endl;
+
+    //
+    // voxelize the levels for navigation, a level at a time with its tiles in parallel, and time
+    // rebuilding every tile on its own the way a change in the geometry would
+    //
+    std::vector<VoxelGrid> grids(usable.size());
+    std::vector<double> tileRebuildMs(usable.size(), 0.0);
+    std::vector<double> maxTileRebuildMs(usable.size(), 0.0);
+    for (size_t i = 0; i < usable.size(); i++) {
+        VoxelGrid& grid = grids[i];
+        if (!grid.build(*usable[i], VoxelSettings::ForLevel(usable[i]->getMax() - usable[i]->getMin()), &jobs)) {
+            continue;
+        }
+
+        int numTiles = grid.getNumTilesX() * grid.getNumTilesZ();
+        for (int tz = 0; tz < grid.getNumTilesZ(); tz++) {
+            for (int tx = 0; tx < grid.getNumTilesX(); tx++) {
+                Clock::time_point t0 = Clock::now();
+                grid.rebuildTile(tx, tz);
+                double ms = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+                tileRebuildMs[i] += ms / numTiles;
+                maxTileRebuildMs[i] = ms > maxTileRebuildMs[i] ? ms : maxTileRebuildMs[i];
+            }
+        }
+
+        std::cout << "Voxels '" << usableNames[i] << "': " << grid.getDim(0) << "x" << grid.getDim(1) << "x" << grid.getDim(2)
+                  << ", " << grid.getNumSpans() << " spans, " << grid.getNumWalkable() << " walkable, "
+                  << grid.getBytes() / 1024 << " KB in " << grid.getBuildMs() << " ms, tile rebuild avg "
+                  << tileRebuildMs[i] << " ms, max " << maxTileRebuildMs[i] << " ms" << std::endl;
+    }
+
+    // match i plays on level i (mod the number of levels)
+    std::vector<Match> matches(options.numMatches);
+    for (int i = 0; i < options.numMatches; i++) {
+        InitMatch(matches[i], *usable[i % usable.size()], options.playersPerMatch, (unsigned)i);
+    }
+
+    //
+    // tick loop
+    //
+    const float dt = 1.0f / options.tickRate;
+    const double budgetMs = 1000.0 / options.tickRate;
+    const Clock::duration tickDuration = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(dt));
+    const std::chrono::seconds reportInterval(5);
+
+    LatencyHistogram tickTimes(0.01, 2000);         // 0 - 20 ms
+    LatencyHistogram recentTickTimes(0.01, 2000);
+    unsigned long long numTicks = 0;
+    unsigned long long overruns = 0;                // ticks that took longer than the budget
+    unsigned long long lastReportTicks = 0;
+
+    Interrupted = 0;
+    void (*previousHandler)(int) = std::signal(SIGINT, OnInterrupt);
+
+    std::cout << "Running " << matches.size() << " matches of " << options.playersPerMatch << " players at "
+              << options.tickRate << " ticks/s" << (options.paced ? "" : " (unpaced)")
+              << (options.numTicks > 0 ? "" : ", Ctrl+C to stop") << std::endl;
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start;
+    Clock::time_point lastReport = start;
+
+    while (!Interrupted && (options.numTicks <= 0 || numTicks < (unsigned long long)options.numTicks)) {
+        Clock::time_point t0 = Clock::now();
+
+        jobs.parallelFor(matches.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                TickMatch(matches[i], dt);
+            }
+        });
+
+        Clock::time_point t1 = Clock::now();
+        double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        tickTimes.add(ms);
+        recentTickTimes.add(ms);
+        if (ms > budgetMs) {
+            ++overruns;
+        }
+        ++numTicks;
+
+        if (t1 - lastReport >= reportInterval) {
+            double seconds = std::chrono::duration<double>(t1 - lastReport).count();
+            std::cout << "Tick " << numTicks << ": " << (numTicks - lastReportTicks) / seconds << " ticks/s, tick p50 "
+                      << recentTickTimes.getPercentile(0.50) << " ms, p99 " << recentTickTimes.getPercentile(0.99)
+                      << " ms, max " << recentTickTimes.getMax() << " ms" << std::endl;
+            recentTickTimes.clear();
+            lastReport = t1;
+            lastReportTicks = numTicks;
+        }
+
+        if (options.paced) {
+            // hold the rate; after a stall, start over instead of running a burst of late ticks
+            deadline += tickDuration;
+            if (deadline < t1 - tickDuration) {
+                deadline = t1;
+            }
+            WaitUntil(deadline);
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    std::signal(SIGINT, previousHandler);
+
+    unsigned long long raycasts = 0, shots = 0, hits = 0, kills = 0, respawns = 0;
+    for (size_t i = 0; i < matches.size(); i++) {
+        raycasts += matches[i].raycasts;
+        shots += matches[i].shots;
+        hits += matches[i].hits;
+        kills += matches[i].kills;
+        respawns += matches[i].respawns;
+    }
+
+    double ticksPerSecond = elapsed > 0 ? numTicks / elapsed : 0.0;
+    double mean = tickTimes.getMean();
+
+    std::cout << numTicks << " ticks in " << elapsed << " s: " << ticksPerSecond << " ticks/s (capacity "
+              << (mean > 0 ? 1000.0 / mean : 0.0) << "), tick p50 " << tickTimes.getPercentile(0.50) << " ms, p99 "
+              << tickTimes.getPercentile(0.99) << " ms, max " << tickTimes.getMax() << " ms, "
+              << overruns << " over the " << budgetMs << " ms budget" << std::endl;
+    std::cout << "  " << raycasts << " raycasts, " << shots << " shots, " << hits << " hits, "
+              << kills << " kills, " << respawns << " respawns" << std::endl;
+
+    unsigned numThreads = jobs.getNumThreads();
+    jobs.printStats();
+    jobs.stop();
+
+    if (options.outputPath.empty()) {
+        return 0;
+    }
+
+    std::ofstream file;
+    std::ostream* out = &std::cout;
+    if (options.outputPath != "-") {
+        file.open(options.outputPath.c_str());
+        if (!file) {
+            std::cerr << "ERROR: Failed to open " << options.outputPath << std::endl;
+            return 1;
+        }
+        out = &file;
+    }
+
+    *out << "{\n";
+    *out << "  \"levels\": [";
+    for (size_t i = 0; i < usableNames.size(); i++) {
+        *out << (i ? ", " : "") << "{ \"path\": " << JsonString(usableNames[i])
+             << ", \"triangles\": " << usable[i]->getNumTriangles()
+             << ", \"cells\": " << usable[i]->getNumCells()
+             << ", \"bytes\": " << usable[i]->getBytes()
+             << ", \"voxels\": [" << grids[i].getDim(0) << ", " << grids[i].getDim(1) << ", " << grids[i].getDim(2) << "]"
+             << ", \"voxel_spans\": " << grids[i].getNumSpans()
+             << ", \"walkable_spans\": " << grids[i].getNumWalkable()
+             << ", \"voxel_bytes\": " << grids[i].getBytes()
+             << ", \"voxel_build_ms\": " << grids[i].getBuildMs()
+             << ", \"tile_rebuild_ms\": " << tileRebuildMs[i]
+             << ", \"max_tile_rebuild_ms\": " << maxTileRebuildMs[i] << " }";
+    }
+    *out << "],\n";
+    *out << "  \"load_ms\": " << loadMs << ",\n";
+    *out << "  \"threads\": " << numThreads << ",\n";
+    *out << "  \"matches\": " << matches.size() << ",\n";
+    *out << "  \"players_per_match\": " << options.playersPerMatch << ",\n";
+    *out << "  \"tick_rate\": " << options.tickRate << ",\n";
+    *out << "  \"paced\": " << (options.paced ? "true" : "false") << ",\n";
+    *out << "  \"ticks\": " << numTicks << ",\n";
+    *out << "  \"seconds\": " << elapsed << ",\n";
+    *out << "  \"ticks_per_second\": " << ticksPerSecond << ",\n";
+    *out << "  \"capacity_ticks_per_second\": " << (mean > 0 ? 1000.0 / mean : 0.0) << ",\n";
+    *out << "  \"overruns\": " << overruns << ",\n";
+    *out << "  \"raycasts\": " << raycasts << ",\n";
+    *out << "  \"shots\": " << shots << ",\n";
+    *out << "  \"hits\": " << hits << ",\n";
+    *out << "  \"kills\": " << kills << ",\n";
+    *out << "  \"respawns\": " << respawns << ",\n";
+    *out << "  \"tick_time\": ";
+    tickTimes.writeJson(*out);
+    *out << "\n}\n";
+
+    if (out == &file) {
+        std::cout << "Wrote server results to " << options.outputPath << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <string>
+#include <vector>
+
+struct ServerOptions {
+    std::vector<std::string> levels;        // OBJ files used as collision maps (empty for meshes.txt)
+    int                     tickRate;       // ticks per second
+    int                     numTicks;       // ticks to run, 0 to run until interrupted
+    int                     numMatches;     // matches simulated side by side, each on one of the levels
+    int                     playersPerMatch;
+    bool                    paced;          // sleep to hold the tick rate (false runs ticks back to back)
+    std::string             outputPath;     // JSON results, '-' for stdout (empty for no file)
+
+    ServerOptions();
+};
+
+//
+// Dedicated server mode: runs the simulation side of the game at a fixed tick rate without a
+// window, GL context or shaders.  The levels go through the OBJ pipeline with deferred upload,
+// so only their CPU copies are built, and become collision meshes.  Every match is a set of
+// bots that walk, fall, collide and fire hitscan shots against the level; the matches of a
+// tick run in parallel on the job system.  Each level is also voxelized for navigation, and
+// the voxel grid and tile rebuild times are reported with the level.
+//
+// Prints ticks per second and tick-time percentiles (periodically when running until
+// interrupted) and writes them as JSON when done.
+//
+// Returns the process exit code.
+//
+int RunServer(const ServerOptions& options);
+
+#endif
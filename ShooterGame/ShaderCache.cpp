@@ -0,0 +1,376 @@
+#include "ShaderCache.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// ARB/KHR_parallel_shader_compile (not in older GLEW headers)
+#ifndef GL_MAX_SHADER_COMPILER_THREADS_ARB
+#define GL_MAX_SHADER_COMPILER_THREADS_ARB 0x91B0
+#endif
+#ifndef GL_COMPLETION_STATUS_ARB
+#define GL_COMPLETION_STATUS_ARB 0x91B1
+#endif
+
+typedef void (APIENTRY* PFNMAXSHADERCOMPILERTHREADSPROC)(GLuint count);
+
+namespace {
+
+const char          CACHE_MAGIC[4] = { 'S', 'G', 'P', 'B' };
+const unsigned      CACHE_VERSION = 1;
+
+bool ReadTextFile(const std::string& path, std::string& text)
+{
+    std::ifstream f(path.c_str(), std::ios::binary);
+    if (!f) {
+        return false;
+    }
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    text = ss.str();
+    return true;
+}
+
+void MakeDirectory(const std::string& path)
+{
+#ifdef _WIN32
+    _mkdir(path.c_str());
+#else
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+std::string GetShaderLog(GLuint shader)
+{
+    GLint len = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &len);
+    std::string log(len > 0 ? len : 1, '\0');
+    glGetShaderInfoLog(shader, len, NULL, &log[0]);
+    return log;
+}
+
+std::string GetProgramLog(GLuint program)
+{
+    GLint len = 0;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &len);
+    std::string log(len > 0 ? len : 1, '\0');
+    glGetProgramInfoLog(program, len, NULL, &log[0]);
+    return log;
+}
+
+}
+
+
+ShaderCache::ShaderCache(const std::string& dir)
+    : mDir(dir)
+    , mBinariesSupported(false)
+    , mParallelCompile(false)
+    , mNumHits(0)
+    , mNumMisses(0)
+{
+}
+
+ShaderCache::~ShaderCache()
+{
+}
+
+unsigned long long ShaderCache::Hash(const void* data, size_t size, unsigned long long h)
+{
+    // 64-bit FNV-1a
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool ShaderCache::HasExtension(const char* name)
+{
+    GLint numExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for (GLint i = 0; i < numExtensions; i++) {
+        const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (ext && std::strcmp(ext, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ShaderCache::initialize()
+{
+    const char* vendor = (const char*)glGetString(GL_VENDOR);
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    const char* version = (const char*)glGetString(GL_VERSION);
+
+    mDriverString = std::string(vendor ? vendor : "") + "|" + (renderer ? renderer : "") + "|" + (version ? version : "");
+
+    if (GLEW_ARB_get_program_binary) {
+        GLint numFormats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+        mBinariesSupported = numFormats > 0;
+    }
+
+    if (HasExtension("GL_ARB_parallel_shader_compile")) {
+        PFNMAXSHADERCOMPILERTHREADSPROC maxThreads =
+            (PFNMAXSHADERCOMPILERTHREADSPROC)glewGetProcAddress((const GLubyte*)"glMaxShaderCompilerThreadsARB");
+        if (maxThreads) {
+            maxThreads(0xFFFFFFFF);     // let the driver pick the number of threads
+        }
+        mParallelCompile = true;
+    }
+    else if (HasExtension("GL_KHR_parallel_shader_compile")) {
+        PFNMAXSHADERCOMPILERTHREADSPROC maxThreads =
+            (PFNMAXSHADERCOMPILERTHREADSPROC)glewGetProcAddress((const GLubyte*)"glMaxShaderCompilerThreadsKHR");
+        if (maxThreads) {
+            maxThreads(0xFFFFFFFF);
+        }
+        mParallelCompile = true;
+    }
+
+    if (mBinariesSupported) {
+        MakeDirectory(mDir);
+    }
+
+    std::cout << "Shader cache: binaries " << (mBinariesSupported ? "supported" : "not supported")
+              << ", parallel compile " << (mParallelCompile ? "supported" : "not supported") << std::endl;
+}
+
+std::string ShaderCache::getCachePath(unsigned long long key) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bin", key);
+    return mDir + "/" + name;
+}
+
+bool ShaderCache::loadBinary(Entry& e)
+{
+    std::ifstream f(getCachePath(e.key).c_str(), std::ios::binary);
+    if (!f) {
+        return false;
+    }
+
+    char magic[4];
+    unsigned version = 0;
+    GLenum format = 0;
+    GLint length = 0;
+
+    f.read(magic, sizeof(magic));
+    f.read((char*)&version, sizeof(version));
+    f.read((char*)&format, sizeof(format));
+    f.read((char*)&length, sizeof(length));
+
+    if (!f || std::memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 || version != CACHE_VERSION || length <= 0) {
+        return false;
+    }
+
+    std::vector<char> binary(length);
+    f.read(&binary[0], length);
+    if (!f) {
+        return false;
+    }
+
+    e.program = glCreateProgram();
+    glProgramBinary(e.program, format, &binary[0], length);
+
+    // the driver may reject binaries from other versions even if the key matches
+    GLint linked = GL_FALSE;
+    glGetProgramiv(e.program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        glDeleteProgram(e.program);
+        e.program = 0;
+        return false;
+    }
+
+    return true;
+}
+
+void ShaderCache::saveBinary(const Entry& e)
+{
+    GLint length = 0;
+    glGetProgramiv(e.program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return;
+    }
+
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(e.program, length, &length, &format, &binary[0]);
+
+    std::string path = getCachePath(e.key);
+    std::ofstream f(path.c_str(), std::ios::binary);
+    if (!f) {
+        std::cerr << "Warning: Failed to write shader cache file " << path << std::endl;
+        return;
+    }
+
+    f.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    f.write((const char*)&CACHE_VERSION, sizeof(CACHE_VERSION));
+    f.write((const char*)&format, sizeof(format));
+    f.write((const char*)&length, sizeof(length));
+    f.write(&binary[0], length);
+}
+
+void ShaderCache::compile(Entry& e, const std::string& vsSource, const std::string& fsSource)
+{
+    const char* vsText = vsSource.c_str();
+    const char* fsText = fsSource.c_str();
+
+    e.vs = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(e.vs, 1, &vsText, NULL);
+    glCompileShader(e.vs);
+
+    e.fs = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(e.fs, 1, &fsText, NULL);
+    glCompileShader(e.fs);
+
+    // link right away without checking the compile status, which would block
+    e.program = glCreateProgram();
+    glAttachShader(e.program, e.vs);
+    glAttachShader(e.program, e.fs);
+    if (mBinariesSupported) {
+        glProgramParameteri(e.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(e.program);
+}
+
+GLuint ShaderCache::request(const std::string& vsPath, const std::string& fsPath)
+{
+    Entry e;
+    e.vsPath = vsPath;
+    e.fsPath = fsPath;
+    e.key = 0;
+    e.vs = 0;
+    e.fs = 0;
+    e.program = 0;
+    e.fromCache = false;
+
+    std::string vsSource, fsSource;
+    if (!ReadTextFile(vsPath, vsSource)) {
+        std::cerr << "ERROR: Failed to open " << vsPath << std::endl;
+        return 0;
+    }
+    if (!ReadTextFile(fsPath, fsSource)) {
+        std::cerr << "ERROR: Failed to open " << fsPath << std::endl;
+        return 0;
+    }
+
+    // separators keep e.g. ("ab", "c") and ("a", "bc") from hashing the same
+    e.key = Hash(vsSource.data(), vsSource.size());
+    e.key = Hash("\0", 1, e.key);
+    e.key = Hash(fsSource.data(), fsSource.size(), e.key);
+    e.key = Hash("\0", 1, e.key);
+    e.key = Hash(mDriverString.data(), mDriverString.size(), e.key);
+
+    if (mBinariesSupported && loadBinary(e)) {
+        ++mNumHits;
+        e.fromCache = true;
+        std::cout << "Loaded cached program for " << vsPath << " + " << fsPath << std::endl;
+        return e.program;
+    }
+
+    ++mNumMisses;
+    compile(e, vsSource, fsSource);
+    mPending.push_back(e);
+
+    return e.program;
+}
+
+bool ShaderCache::complete(Entry& e)
+{
+    bool ok = true;
+
+    GLint status = GL_FALSE;
+    glGetShaderiv(e.vs, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        std::cerr << "ERROR: Failed to compile " << e.vsPath << ":\n" << GetShaderLog(e.vs) << std::endl;
+        ok = false;
+    }
+    glGetShaderiv(e.fs, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        std::cerr << "ERROR: Failed to compile " << e.fsPath << ":\n" << GetShaderLog(e.fs) << std::endl;
+        ok = false;
+    }
+    if (ok) {
+        glGetProgramiv(e.program, GL_LINK_STATUS, &status);
+        if (!status) {
+            std::cerr << "ERROR: Failed to link " << e.vsPath << " + " << e.fsPath << ":\n" << GetProgramLog(e.program) << std::endl;
+            ok = false;
+        }
+    }
+
+    // the shader objects are no longer needed once the program is linked
+    glDetachShader(e.program, e.vs);
+    glDetachShader(e.program, e.fs);
+    glDeleteShader(e.vs);
+    glDeleteShader(e.fs);
+    e.vs = e.fs = 0;
+
+    if (ok && mBinariesSupported) {
+        saveBinary(e);
+    }
+
+    return ok;
+}
+
+bool ShaderCache::poll()
+{
+    for (unsigned i = 0; i < mPending.size(); ) {
+        Entry& e = mPending[i];
+
+        if (mParallelCompile) {
+            GLint completed = GL_FALSE;
+            glGetProgramiv(e.program, GL_COMPLETION_STATUS_ARB, &completed);
+            if (!completed) {
+                ++i;
+                continue;
+            }
+        }
+
+        // without parallel compile there is no way to check without blocking
+        if (!complete(e)) {
+            std::cerr << "ERROR: Background build of " << e.vsPath << " + " << e.fsPath << " failed" << std::endl;
+        }
+        mPending.erase(mPending.begin() + i);
+    }
+
+    return mPending.empty();
+}
+
+bool ShaderCache::finish()
+{
+    bool ok = true;
+
+    for (unsigned i = 0; i < mPending.size(); i++) {
+        if (!complete(mPending[i])) {
+            ok = false;
+        }
+    }
+    mPending.clear();
+
+    std::cout << "Shader cache: " << mNumHits << " hits, " << mNumMisses << " misses" << std::endl;
+
+    return ok;
+}
+
+bool ShaderCache::isReady(GLuint program) const
+{
+    if (!program) {
+        return false;
+    }
+    for (unsigned i = 0; i < mPending.size(); i++) {
+        if (mPending[i].program == program) {
+            return false;
+        }
+    }
+    return true;
+}
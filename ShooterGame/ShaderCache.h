@@ -0,0 +1,81 @@
+#ifndef SHADERCACHE_H_
+#define SHADERCACHE_H_
+
+#include "GLSH.h"
+
+#include <string>
+#include <vector>
+
+//
+// Builds shader programs from vertex/fragment shader files, caching the linked
+// program binaries on disk (ARB_get_program_binary).
+//
+// The cache key is a hash of both shader sources and the GL vendor, renderer and
+// version strings, so editing a shader or updating the driver invalidates the entry.
+//
+// Programs are built in two steps: request() issues all the compile and link calls
+// without querying any status, and finish() (or poll()) collects the results.
+// This lets the driver compile in the background, and with ARB/KHR_parallel_shader_compile
+// the compiles are spread over multiple driver threads.
+//
+class ShaderCache {
+
+    struct Entry {
+        std::string         vsPath;
+        std::string         fsPath;
+        unsigned long long  key;
+        GLuint              vs;
+        GLuint              fs;
+        GLuint              program;
+        bool                fromCache;      // program was loaded from a binary
+    };
+
+    std::string             mDir;
+    std::string             mDriverString;
+    bool                    mBinariesSupported;
+    bool                    mParallelCompile;
+
+    std::vector<Entry>      mPending;
+
+    // stats
+    unsigned                mNumHits;
+    unsigned                mNumMisses;
+
+    std::string             getCachePath(unsigned long long key) const;
+
+    bool                    loadBinary(Entry& e);
+    void                    saveBinary(const Entry& e);
+    void                    compile(Entry& e, const std::string& vsSource, const std::string& fsSource);
+
+    // check the results of a finished build; returns false on error
+    bool                    complete(Entry& e);
+
+    static bool             HasExtension(const char* name);
+
+public:
+    ShaderCache(const std::string& dir = "shadercache");
+    ~ShaderCache();
+
+    // query GL capabilities (needs a current context)
+    void                    initialize();
+
+    // start building a program; the returned name can be stored right away,
+    // but must not be used before finish() or isReady() say it's done
+    GLuint                  request(const std::string& vsPath, const std::string& fsPath);
+
+    // non-blocking: complete the builds that are ready (reporting the ones that failed),
+    // returns true when none are pending
+    bool                    poll();
+
+    // blocking: complete all pending builds, returns false if any of them failed
+    bool                    finish();
+
+    bool                    isReady(GLuint program) const;
+
+    unsigned                getNumHits() const      { return mNumHits; }
+    unsigned                getNumMisses() const    { return mNumMisses; }
+
+    static unsigned long long Hash(const void* data, size_t size, unsigned long long h = 14695981039346656037ULL);
+};
+
+#endif
@@ -0,0 +1,231 @@
+#include "StreamBuffer.h"
+#include "GLDebug.h"
+
+#include <iostream>
+
+StreamAllocation::StreamAllocation()
+    : ptr(NULL)
+    , buffer(0)
+    , offset(0)
+    , size(0)
+{
+}
+
+StreamBuffer::StreamBuffer()
+    : mTarget(GL_ARRAY_BUFFER)
+    , mBuffer(0)
+    , mMode(MODE_NONE)
+    , mRegionSize(0)
+    , mRegion(0)
+    , mHead(0)
+    , mFlushed(0)
+    , mMapped(NULL)
+    , mNumWaits(0)
+    , mNumOverflows(0)
+{
+    for (int i = 0; i < NUM_REGIONS; i++) {
+        mFences[i] = 0;
+    }
+}
+
+StreamBuffer::~StreamBuffer()
+{
+    destroy();
+}
+
+bool StreamBuffer::create(GLenum target, GLsizeiptr frameSize, bool allowPersistent)
+{
+    destroy();
+
+    mTarget = target;
+    mRegionSize = frameSize;
+
+    glGenBuffers(1, &mBuffer);
+    if (!mBuffer) {
+        std::cerr << "ERROR: Failed to create stream buffer" << std::endl;
+        return false;
+    }
+
+    glBindBuffer(mTarget, mBuffer);
+
+    if (allowPersistent && GLEW_ARB_buffer_storage) {
+        // immutable storage for all regions, mapped once and never unmapped
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLsizeiptr totalSize = NUM_REGIONS * mRegionSize;
+
+        glBufferStorage(mTarget, totalSize, NULL, flags);
+        mMapped = (GLubyte*)glMapBufferRange(mTarget, 0, totalSize, flags);
+
+        if (mMapped) {
+            mMode = MODE_PERSISTENT;
+        }
+        else {
+            // storage is immutable, so start over with a fresh buffer
+            std::cerr << "Warning: Failed to map stream buffer persistently, falling back to orphaning" << std::endl;
+            glBindBuffer(mTarget, 0);
+            glDeleteBuffers(1, &mBuffer);
+            glGenBuffers(1, &mBuffer);
+            glBindBuffer(mTarget, mBuffer);
+        }
+    }
+
+    if (mMode == MODE_NONE) {
+        glBufferData(mTarget, mRegionSize, NULL, GL_STREAM_DRAW);
+        mStaging.resize(mRegionSize);
+        mMode = MODE_ORPHAN;
+    }
+
+    glBindBuffer(mTarget, 0);
+
+    mRegion = 0;
+    mHead = 0;
+    mFlushed = 0;
+
+    GL_DEBUG_CHECK("creating stream buffer");
+
+    std::cout << "Stream buffer: " << NUM_REGIONS << " x " << mRegionSize << " bytes, "
+              << (mMode == MODE_PERSISTENT ? "persistent mapping" : "orphaning") << std::endl;
+
+    return true;
+}
+
+void StreamBuffer::destroy()
+{
+    for (int i = 0; i < NUM_REGIONS; i++) {
+        if (mFences[i]) {
+            glDeleteSync(mFences[i]);
+            mFences[i] = 0;
+        }
+    }
+
+    if (mBuffer) {
+        if (mMapped) {
+            glBindBuffer(mTarget, mBuffer);
+            glUnmapBuffer(mTarget);
+            glBindBuffer(mTarget, 0);
+            mMapped = NULL;
+        }
+        glDeleteBuffers(1, &mBuffer);
+        mBuffer = 0;
+    }
+
+    std::vector<GLubyte>().swap(mStaging);
+
+    mMode = MODE_NONE;
+    mRegionSize = 0;
+    mHead = 0;
+    mFlushed = 0;
+}
+
+void StreamBuffer::waitForRegion(int region)
+{
+    GLsync fence = mFences[region];
+    if (!fence) {
+        return;
+    }
+
+    // poll first, so we only count the frames that actually stall
+    GLenum result = glClientWaitSync(fence, 0, 0);
+    if (result == GL_TIMEOUT_EXPIRED) {
+        ++mNumWaits;
+        do {
+            // flush on the first real wait, otherwise the fence may never be submitted
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);  // 1 ms
+        } while (result == GL_TIMEOUT_EXPIRED);
+    }
+
+    if (result == GL_WAIT_FAILED) {
+        std::cerr << "ERROR: Failed waiting on stream buffer fence" << std::endl;
+    }
+
+    glDeleteSync(fence);
+    mFences[region] = 0;
+}
+
+void StreamBuffer::beginFrame()
+{
+    mHead = 0;
+    mFlushed = 0;
+
+    if (mMode == MODE_PERSISTENT) {
+        // make sure the GPU is done reading this region from NUM_REGIONS frames ago
+        waitForRegion(mRegion);
+    }
+    else if (mMode == MODE_ORPHAN) {
+        // detach the old storage from the buffer name, so the driver doesn't have to sync
+        glBindBuffer(mTarget, mBuffer);
+        glBufferData(mTarget, mRegionSize, NULL, GL_STREAM_DRAW);
+        glBindBuffer(mTarget, 0);
+        GL_DEBUG_STATE(2);
+        GL_DEBUG_CALLS(1);
+    }
+}
+
+StreamAllocation StreamBuffer::allocate(GLsizeiptr size, GLsizeiptr alignment)
+{
+    StreamAllocation alloc;
+
+    if (mMode == MODE_NONE || size <= 0) {
+        return alloc;
+    }
+
+    // alignment is relative to the start of the buffer, not the region
+    GLsizeiptr regionStart = (mMode == MODE_PERSISTENT) ? mRegion * mRegionSize : 0;
+    GLsizeiptr start = regionStart + mHead;
+    if (alignment > 1) {
+        GLsizeiptr rem = start % alignment;
+        if (rem) {
+            start += alignment - rem;
+        }
+    }
+
+    if (start + size > regionStart + mRegionSize) {
+        if (!mNumOverflows++) {
+            std::cerr << "Warning: Stream buffer overflow (" << size << " bytes requested, "
+                      << (mRegionSize - mHead) << " free)" << std::endl;
+        }
+        return alloc;
+    }
+
+    mHead = start + size - regionStart;
+
+    alloc.buffer = mBuffer;
+    alloc.offset = start;
+    alloc.size = size;
+    if (mMode == MODE_PERSISTENT) {
+        alloc.ptr = mMapped + start;
+    }
+    else {
+        alloc.ptr = &mStaging[start];
+    }
+
+    return alloc;
+}
+
+void StreamBuffer::flush()
+{
+    if (mMode != MODE_ORPHAN || mFlushed == mHead) {
+        return;
+    }
+
+    // upload everything written since the last flush
+    glBindBuffer(mTarget, mBuffer);
+    glBufferSubData(mTarget, mFlushed, mHead - mFlushed, &mStaging[mFlushed]);
+    glBindBuffer(mTarget, 0);
+    GL_DEBUG_STATE(2);
+    GL_DEBUG_UPLOAD(mHead - mFlushed);
+
+    mFlushed = mHead;
+}
+
+void StreamBuffer::endFrame()
+{
+    if (mMode == MODE_PERSISTENT) {
+        // the GPU is done with this region when it passes this fence
+        mFences[mRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        mRegion = (mRegion + 1) % NUM_REGIONS;
+    }
+    else {
+        flush();
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef STREAMBUFFER_H_
+#define STREAMBUFFER_H_
+
+#include "GLSH.h"
+
+#include <vector>
+
+// a chunk of a stream buffer that the caller can fill this frame
+struct StreamAllocation {
+    void*       ptr;        // where to write the data (NULL if the allocation failed)
+    GLuint      buffer;     // buffer that will hold the data on the GPU
+    GLintptr    offset;     // byte offset of the chunk in the buffer
+    GLsizeiptr  size;       // size of the chunk in bytes
+
+    StreamAllocation();
+};
+
+//
+// Ring buffer for geometry and instance data that changes every frame.
+//
+// When ARB_buffer_storage is available, the buffer is mapped once for its
+// whole lifetime and split into NUM_REGIONS frame-sized regions.  Each frame
+// writes into its own region and fences it when done, so the CPU only waits
+// if the GPU is still reading a region from NUM_REGIONS frames ago.
+//
+// Otherwise, the buffer is orphaned at the start of every frame and the data
+// written by the caller is uploaded with glBufferSubData by flush().
+//
+class StreamBuffer {
+
+public:
+    enum Mode {
+        MODE_NONE,
+        MODE_PERSISTENT,        // persistently mapped storage, fence-synchronized
+        MODE_ORPHAN             // glBufferData orphaning + glBufferSubData
+    };
+
+    static const int NUM_REGIONS = 3;
+
+private:
+    GLenum                  mTarget;
+    GLuint                  mBuffer;
+    Mode                    mMode;
+
+    GLsizeiptr              mRegionSize;    // bytes available per frame
+    int                     mRegion;        // region used by the current frame
+    GLsizeiptr              mHead;          // next free byte in the current region
+    GLsizeiptr              mFlushed;       // bytes of the current region already uploaded (orphan mode)
+
+    GLubyte*                mMapped;        // start of the persistent mapping
+    GLsync                  mFences[NUM_REGIONS];
+
+    std::vector<GLubyte>    mStaging;       // CPU copy of the current frame (orphan mode)
+
+    // stats
+    unsigned                mNumWaits;      // frames that had to wait on a fence
+    unsigned                mNumOverflows;  // allocations that did not fit
+
+    void                    waitForRegion(int region);
+
+public:
+    StreamBuffer();
+    ~StreamBuffer();
+
+    bool                    create(GLenum target, GLsizeiptr frameSize, bool allowPersistent = true);
+    void                    destroy();
+
+    // call once per frame before allocating
+    void                    beginFrame();
+
+    // get space for 'size' bytes, aligned to 'alignment' bytes from the start of the buffer
+    // (alignment does not have to be a power of two, so the vertex size can be used)
+    StreamAllocation        allocate(GLsizeiptr size, GLsizeiptr alignment = 16);
+
+    // make everything allocated so far visible to the GL (no-op for persistent mappings)
+    void                    flush();
+
+    // call once per frame after the last draw call that uses the buffer
+    void                    endFrame();
+
+    GLuint                  getBuffer() const       { return mBuffer; }
+    Mode                    getMode() const         { return mMode; }
+    GLsizeiptr              getFrameSize() const    { return mRegionSize; }
+    GLsizeiptr              getBytesUsed() const    { return mHead; }
+    unsigned                getNumWaits() const     { return mNumWaits; }
+    unsigned                getNumOverflows() const { return mNumOverflows; }
+};
+
+#endif
@@ -0,0 +1,500 @@
+#include "Terrain.h"
+#include "GLDebug.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+const float Terrain::CHUNK_SIZE = 64.0f;
+const int Terrain::CHUNK_CELLS = 64;
+const unsigned Terrain::UPLOADS_PER_FRAME = 8;
+
+namespace {
+
+// 0 <= h < 1 for a lattice point
+float LatticeValue(int x, int z)
+{
+    unsigned h = (unsigned)x * 374761393u + (unsigned)z * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    h ^= h >> 16;
+    return (h & 0xFFFFFF) * (1.0f / 16777216.0f);
+}
+
+// smoothly interpolated lattice values
+float ValueNoise(float x, float z)
+{
+    float fx = std::floor(x);
+    float fz = std::floor(z);
+    int ix = (int)fx;
+    int iz = (int)fz;
+    float tx = x - fx;
+    float tz = z - fz;
+    tx = tx * tx * (3 - 2 * tx);
+    tz = tz * tz * (3 - 2 * tz);
+
+    float a = LatticeValue(ix, iz);
+    float b = LatticeValue(ix + 1, iz);
+    float c = LatticeValue(ix, iz + 1);
+    float d = LatticeValue(ix + 1, iz + 1);
+    return (a + (b - a) * tx) + ((c + (d - c) * tx) - (a + (b - a) * tx)) * tz;
+}
+
+bool CloserChunk(const std::pair<float, long long>& a, const std::pair<float, long long>& b)
+{
+    return a.first < b.first;
+}
+
+}
+
+Terrain::Terrain()
+    : mJobs(NULL)
+    , mViewDistance(0)
+    , mLodDistance(0)
+    , mNumBuilt(0)
+    , mNumEvicted(0)
+    , mUploadedBytes(0)
+{
+    for (int i = 0; i < NUM_LODS; i++) {
+        mIndexBuffers[i] = 0;
+        mNumTriangleIndices[i] = 0;
+        mNumLineIndices[i] = 0;
+    }
+}
+
+Terrain::~Terrain()
+{
+}
+
+//
+// Rolling hills, flat around the origin (where the old ground plane was) so the meshes sit on it
+//
+float Terrain::HeightAt(float x, float z)
+{
+    float height = 0;
+    float amplitude = 1;
+    float frequency = 1.0f / 256.0f;
+    for (int octave = 0; octave < 5; octave++) {
+        height += amplitude * (2 * ValueNoise(x * frequency, z * frequency) - 1);
+        amplitude *= 0.5f;
+        frequency *= 2;
+    }
+
+    float r = std::sqrt(x * x + z * z);
+    float t = glm::clamp((r - 64.0f) / 192.0f, 0.0f, 1.0f);
+    return 60.0f * height * t * t * (3 - 2 * t);
+}
+
+bool Terrain::initialize(JobSystem& jobs, float viewDistance, float lodDistance)
+{
+    mJobs = &jobs;
+    mViewDistance = viewDistance;
+    mLodDistance = lodDistance;
+
+    // one index buffer per level: the triangles, then the grid lines
+    for (int lod = 0; lod < NUM_LODS; lod++) {
+        int n = CHUNK_CELLS >> lod;
+        std::vector<GLushort> indices;
+        indices.reserve(6 * n * n + 4 * n * (n + 1));
+
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                GLushort a = (GLushort)(j * (n + 1) + i);
+                GLushort b = (GLushort)(a + 1);
+                GLushort c = (GLushort)(a + n + 1);
+                GLushort d = (GLushort)(c + 1);
+                // counterclockwise seen from above
+                indices.push_back(a); indices.push_back(c); indices.push_back(b);
+                indices.push_back(b); indices.push_back(c); indices.push_back(d);
+            }
+        }
+        mNumTriangleIndices[lod] = (GLsizei)indices.size();
+
+        for (int j = 0; j <= n; j++) {
+            for (int i = 0; i < n; i++) {
+                GLushort a = (GLushort)(j * (n + 1) + i);
+                indices.push_back(a); indices.push_back((GLushort)(a + 1));
+            }
+        }
+        for (int i = 0; i <= n; i++) {
+            for (int j = 0; j < n; j++) {
+                GLushort a = (GLushort)(j * (n + 1) + i);
+                indices.push_back(a); indices.push_back((GLushort)(a + n + 1));
+            }
+        }
+        mNumLineIndices[lod] = (GLsizei)indices.size() - mNumTriangleIndices[lod];
+
+        glGenBuffers(1, &mIndexBuffers[lod]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffers[lod]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), &indices[0], GL_STATIC_DRAW);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    return true;
+}
+
+void Terrain::shutdown()
+{
+    // the jobs write into the builds, so they must finish first
+    for (size_t i = 0; i < mBuilds.size(); i++) {
+        mJobs->wait(mBuilds[i]->done);
+        delete mBuilds[i];
+    }
+    mBuilds.clear();
+
+    for (std::unordered_map<long long, Chunk>::iterator it = mChunks.begin(); it != mChunks.end(); ++it) {
+        destroyChunk(it->second);
+    }
+    mChunks.clear();
+    mActive.clear();
+    mVisible.clear();
+
+    for (int i = 0; i < NUM_LODS; i++) {
+        glDeleteBuffers(1, &mIndexBuffers[i]);
+        mIndexBuffers[i] = 0;
+    }
+}
+
+void Terrain::destroyChunk(Chunk& chunk)
+{
+    if (chunk.vao) {
+        glDeleteVertexArrays(1, &chunk.vao);
+        glDeleteBuffers(1, &chunk.vbo);
+        chunk.vao = 0;
+        chunk.vbo = 0;
+    }
+}
+
+//
+// Runs on a worker thread, touches nothing but the build
+//
+void Terrain::BuildChunk(Build& build, int x, int z)
+{
+    const int n = CHUNK_CELLS >> build.lod;
+    const int step = 1 << build.lod;
+    const float cellSize = CHUNK_SIZE / CHUNK_CELLS;
+    const float eps = step * cellSize;
+
+    // heights with a one-sample border, for the normals
+    const int rowSize = n + 3;
+    std::vector<float> heights(rowSize * rowSize);
+    for (int j = -1; j <= n + 1; j++) {
+        for (int i = -1; i <= n + 1; i++) {
+            // from integer lattice coordinates, so neighbouring chunks sample exactly the same points
+            float wx = (x * CHUNK_CELLS + i * step) * cellSize;
+            float wz = (z * CHUNK_CELLS + j * step) * cellSize;
+            heights[(j + 1) * rowSize + (i + 1)] = HeightAt(wx, wz);
+        }
+    }
+
+    std::vector<GLfloat>& v = build.vertices;
+    v.resize((n + 1) * (n + 1) * 6);
+
+    for (int j = 0; j <= n; j++) {
+        const float* row = &heights[(j + 1) * rowSize + 1];
+        for (int i = 0; i <= n; i++) {
+            float dx = row[i + 1] - row[i - 1];
+            float dz = row[i + rowSize] - row[i - rowSize];
+            glm::vec3 normal = glm::normalize(glm::vec3(-dx, 2 * eps, -dz));
+
+            GLfloat* p = &v[(j * (n + 1) + i) * 6];
+            p[0] = i * step * cellSize;
+            p[1] = row[i];
+            p[2] = j * step * cellSize;
+            p[3] = normal.x;
+            p[4] = normal.y;
+            p[5] = normal.z;
+        }
+    }
+
+    // stitch: the odd vertices of an edge next to a coarser chunk go onto its edge
+    auto height = [&v, n](int i, int j) -> GLfloat& { return v[(j * (n + 1) + i) * 6 + 1]; };
+    for (int k = 1; k < n; k += 2) {
+        if (build.edgeMask & EDGE_WEST) {
+            height(0, k) = 0.5f * (height(0, k - 1) + height(0, k + 1));
+        }
+        if (build.edgeMask & EDGE_EAST) {
+            height(n, k) = 0.5f * (height(n, k - 1) + height(n, k + 1));
+        }
+        if (build.edgeMask & EDGE_NORTH) {
+            height(k, 0) = 0.5f * (height(k - 1, 0) + height(k + 1, 0));
+        }
+        if (build.edgeMask & EDGE_SOUTH) {
+            height(k, n) = 0.5f * (height(k - 1, n) + height(k + 1, n));
+        }
+    }
+
+    build.minY = build.maxY = v[1];
+    for (size_t i = 1; i < v.size(); i += 6) {
+        build.minY = v[i] < build.minY ? v[i] : build.minY;
+        build.maxY = v[i] > build.maxY ? v[i] : build.maxY;
+    }
+}
+
+void Terrain::stream(const glm::vec3& cameraPos, unsigned maxBuilds)
+{
+    const int camX = (int)std::floor(cameraPos.x / CHUNK_SIZE);
+    const int camZ = (int)std::floor(cameraPos.z / CHUNK_SIZE);
+    const int radius = (int)std::ceil(mViewDistance / CHUNK_SIZE);
+
+    // how high the camera is above the ground counts towards the distance of every chunk
+    float heightAbove = cameraPos.y - HeightAt(cameraPos.x, cameraPos.z);
+
+    for (std::unordered_map<long long, Chunk>::iterator it = mChunks.begin(); it != mChunks.end(); ++it) {
+        it->second.active = false;
+    }
+
+    // the chunks within the view distance, and the level each one wants
+    mActive.clear();
+    for (int z = camZ - radius; z <= camZ + radius; z++) {
+        for (int x = camX - radius; x <= camX + radius; x++) {
+            // distance to the nearest point of the chunk
+            float x0 = x * CHUNK_SIZE;
+            float z0 = z * CHUNK_SIZE;
+            float dx = cameraPos.x < x0 ? x0 - cameraPos.x : (cameraPos.x > x0 + CHUNK_SIZE ? cameraPos.x - x0 - CHUNK_SIZE : 0.0f);
+            float dz = cameraPos.z < z0 ? z0 - cameraPos.z : (cameraPos.z > z0 + CHUNK_SIZE ? cameraPos.z - z0 - CHUNK_SIZE : 0.0f);
+            float distance = std::sqrt(dx * dx + dz * dz);
+            if (distance > mViewDistance) {
+                continue;
+            }
+
+            std::pair<std::unordered_map<long long, Chunk>::iterator, bool> inserted = mChunks.insert(std::make_pair(Key(x, z), Chunk()));
+            Chunk& chunk = inserted.first->second;
+            if (inserted.second) {
+                chunk.x = x;
+                chunk.z = z;
+                chunk.vao = 0;
+                chunk.vbo = 0;
+                chunk.lod = -1;
+                chunk.edgeMask = 0;
+                chunk.minY = 0;
+                chunk.maxY = 0;
+                chunk.building = false;
+            }
+
+            chunk.active = true;
+            chunk.distance = distance;
+
+            float d = std::sqrt(distance * distance + heightAbove * heightAbove);
+            int lod = 0;
+            while (lod < NUM_LODS - 1 && d > mLodDistance * (1 << lod)) {
+                ++lod;
+            }
+            chunk.wantedLod = lod;
+
+            mActive.push_back(&chunk);
+        }
+    }
+
+    // neighbours at most one level apart, so the edges can be stitched
+    static const int NeighbourX[4] = { -1, 1, 0, 0 };
+    static const int NeighbourZ[4] = { 0, 0, -1, 1 };
+    static const unsigned NeighbourEdge[4] = { EDGE_WEST, EDGE_EAST, EDGE_NORTH, EDGE_SOUTH };
+
+    bool changed = true;
+    for (int pass = 0; pass < NUM_LODS && changed; pass++) {
+        changed = false;
+        for (size_t i = 0; i < mActive.size(); i++) {
+            Chunk& chunk = *mActive[i];
+            for (int k = 0; k < 4; k++) {
+                std::unordered_map<long long, Chunk>::iterator it = mChunks.find(Key(chunk.x + NeighbourX[k], chunk.z + NeighbourZ[k]));
+                if (it != mChunks.end() && it->second.active && chunk.wantedLod > it->second.wantedLod + 1) {
+                    chunk.wantedLod = it->second.wantedLod + 1;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < mActive.size(); i++) {
+        Chunk& chunk = *mActive[i];
+        chunk.wantedMask = 0;
+        for (int k = 0; k < 4; k++) {
+            std::unordered_map<long long, Chunk>::iterator it = mChunks.find(Key(chunk.x + NeighbourX[k], chunk.z + NeighbourZ[k]));
+            if (it != mChunks.end() && it->second.active && it->second.wantedLod > chunk.wantedLod) {
+                chunk.wantedMask |= NeighbourEdge[k];
+            }
+        }
+    }
+
+    // drop the chunks that are well out of range (with some slack, so they don't come and go
+    // at the edge); a build still in flight for one is thrown away when it finishes
+    const float evictDistance = mViewDistance + 2 * CHUNK_SIZE;
+    for (std::unordered_map<long long, Chunk>::iterator it = mChunks.begin(); it != mChunks.end(); ) {
+        Chunk& chunk = it->second;
+        if (!chunk.active) {
+            float cx = (chunk.x + 0.5f) * CHUNK_SIZE - cameraPos.x;
+            float cz = (chunk.z + 0.5f) * CHUNK_SIZE - cameraPos.z;
+            if (cx * cx + cz * cz > evictDistance * evictDistance) {
+                destroyChunk(chunk);
+                it = mChunks.erase(it);
+                ++mNumEvicted;
+                continue;
+            }
+        }
+        ++it;
+    }
+
+    // start the builds the chunks need: the ones with nothing to show first (a hole is worse
+    // than the wrong level), nearest first
+    std::vector<std::pair<float, long long> > needed;
+    for (size_t i = 0; i < mActive.size(); i++) {
+        const Chunk& chunk = *mActive[i];
+        if (!chunk.building && (chunk.lod != chunk.wantedLod || chunk.edgeMask != chunk.wantedMask)) {
+            float priority = chunk.vao ? chunk.distance + 2 * mViewDistance : chunk.distance;
+            needed.push_back(std::make_pair(priority, Key(chunk.x, chunk.z)));
+        }
+    }
+    std::sort(needed.begin(), needed.end(), CloserChunk);
+
+    for (size_t i = 0; i < needed.size() && mBuilds.size() < maxBuilds; i++) {
+        Chunk& chunk = mChunks[needed[i].second];
+        chunk.building = true;
+
+        Build* build = new Build;
+        build->key = needed[i].second;
+        build->lod = chunk.wantedLod;
+        build->edgeMask = chunk.wantedMask;
+        build->minY = 0;
+        build->maxY = 0;
+        mBuilds.push_back(build);
+
+        int x = chunk.x;
+        int z = chunk.z;
+        mJobs->run([build, x, z]() { BuildChunk(*build, x, z); }, &build->done);
+    }
+}
+
+unsigned Terrain::upload(unsigned maxUploads)
+{
+    unsigned numUploaded = 0;
+
+    for (size_t i = 0; i < mBuilds.size() && numUploaded < maxUploads; ) {
+        Build* build = mBuilds[i];
+        if (!build->done.isDone()) {
+            ++i;
+            continue;
+        }
+
+        std::unordered_map<long long, Chunk>::iterator it = mChunks.find(build->key);
+        if (it != mChunks.end()) {
+            Chunk& chunk = it->second;
+            chunk.building = false;
+
+            // a chunk with nothing to show takes any mesh; otherwise it must still be the one wanted
+            if (!chunk.vao || (build->lod == chunk.wantedLod && build->edgeMask == chunk.wantedMask)) {
+                GLsizeiptr bytes = (GLsizeiptr)(build->vertices.size() * sizeof(GLfloat));
+
+                if (!chunk.vao) {
+                    glGenVertexArrays(1, &chunk.vao);
+                    glGenBuffers(1, &chunk.vbo);
+                    glBindVertexArray(chunk.vao);
+                    glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+                    glBufferData(GL_ARRAY_BUFFER, bytes, &build->vertices[0], GL_STATIC_DRAW);
+                    glVertexAttribPointer(glsh::VA_POSITION, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (void*)0);
+                    glEnableVertexAttribArray(glsh::VA_POSITION);
+                    glVertexAttribPointer(glsh::VA_NORMAL, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (void*)(3 * sizeof(GLfloat)));
+                    glEnableVertexAttribArray(glsh::VA_NORMAL);
+                }
+                else {
+                    glBindVertexArray(chunk.vao);
+                    glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+                    glBufferData(GL_ARRAY_BUFFER, bytes, &build->vertices[0], GL_STATIC_DRAW);
+                }
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIndexBuffers[build->lod]);
+                glBindVertexArray(0);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+                GL_DEBUG_STATE(5);
+                GL_DEBUG_UPLOAD(bytes);
+
+                chunk.lod = build->lod;
+                chunk.edgeMask = build->edgeMask;
+                chunk.minY = build->minY;
+                chunk.maxY = build->maxY;
+
+                mUploadedBytes += bytes;
+                ++mNumBuilt;
+                ++numUploaded;
+            }
+        }
+
+        delete build;
+        mBuilds[i] = mBuilds.back();
+        mBuilds.pop_back();
+    }
+
+    return numUploaded;
+}
+
+void Terrain::prepare(const glm::vec3& cameraPos)
+{
+    // a couple of rounds, since the first meshes may be superseded by the stitching
+    for (int round = 0; round < 4; round++) {
+        stream(cameraPos, (unsigned)-1);
+        if (mBuilds.empty()) {
+            break;
+        }
+        for (size_t i = 0; i < mBuilds.size(); i++) {
+            mJobs->wait(mBuilds[i]->done);
+        }
+        upload((unsigned)-1);
+    }
+}
+
+void Terrain::update(const glm::vec3& cameraPos, const glm::mat4& viewProj)
+{
+    upload(UPLOADS_PER_FRAME);
+
+    // enough builds to keep the workers busy, but not more than a few frames of uploads
+    stream(cameraPos, 2 * mJobs->getNumThreads() + UPLOADS_PER_FRAME);
+
+    mFrustum.extract(viewProj);
+    mVisible.clear();
+    for (size_t i = 0; i < mActive.size(); i++) {
+        const Chunk& chunk = *mActive[i];
+        if (!chunk.vao) {
+            continue;
+        }
+        glm::vec3 boxMin(chunk.x * CHUNK_SIZE, chunk.minY, chunk.z * CHUNK_SIZE);
+        glm::vec3 boxMax(boxMin.x + CHUNK_SIZE, chunk.maxY, boxMin.z + CHUNK_SIZE);
+        if (mFrustum.intersectsBox(boxMin, boxMax)) {
+            mVisible.push_back(mActive[i]);
+        }
+    }
+}
+
+void Terrain::submit(DrawBucket& bucket, const DrawItem& item, const glm::mat4& viewMatrix,
+                     unsigned pass, bool lines, float maxSortDepth) const
+{
+    DrawItem chunkItem = item;
+    chunkItem.mode = lines ? GL_LINES : GL_TRIANGLES;
+    chunkItem.indexType = GL_UNSIGNED_SHORT;
+    chunkItem.normalMatrix = glm::transpose(glm::inverse(glm::mat3(viewMatrix)));     // chunks are only translated
+    chunkItem.hasNormalMatrix = true;
+
+    for (size_t i = 0; i < mVisible.size(); i++) {
+        const Chunk& chunk = *mVisible[i];
+
+        // chunk-local vertices keep their precision far from the origin
+        glm::vec3 origin(chunk.x * CHUNK_SIZE, 0.0f, chunk.z * CHUNK_SIZE);
+        chunkItem.modelView = glm::translate(viewMatrix, origin);
+        chunkItem.vao = chunk.vao;
+        if (lines) {
+            chunkItem.indexOffset = (const GLvoid*)(size_t)(mNumTriangleIndices[chunk.lod] * sizeof(GLushort));
+            chunkItem.count = mNumLineIndices[chunk.lod];
+        }
+        else {
+            chunkItem.indexOffset = NULL;
+            chunkItem.count = mNumTriangleIndices[chunk.lod];
+        }
+
+        glm::vec4 center = chunkItem.modelView * glm::vec4(0.5f * CHUNK_SIZE, 0.5f * (chunk.minY + chunk.maxY), 0.5f * CHUNK_SIZE, 1.0f);
+        chunkItem.key = RenderQueue::MakeKey(pass, chunkItem.program, chunkItem.material, chunkItem.vao, -center.z, maxSortDepth);
+        bucket.submit(chunkItem);
+    }
+}
+
+void Terrain::printStats() const
+{
+    std::cout << "Terrain: " << mChunks.size() << " chunks, " << mNumBuilt << " built, " << mNumEvicted << " evicted, "
+              << mUploadedBytes / (1024 * 1024) << " MB uploaded" << std::endl;
+}
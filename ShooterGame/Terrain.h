@@ -0,0 +1,140 @@
+#ifndef TERRAIN_H_
+#define TERRAIN_H_
+
+#include "GLSH.h"
+#include "Frustum.h"
+#include "JobSystem.h"
+#include "RenderQueue.h"
+
+#include <unordered_map>
+#include <vector>
+
+//
+// Streaming heightfield ground.
+//
+// The ground is split into square chunks on a grid that follows the camera.  Only the chunks
+// within the view distance exist, so the cost of a frame doesn't depend on how big the world
+// is.  Each chunk has a level of detail from its distance to the camera: level 0 has
+// CHUNK_CELLS x CHUNK_CELLS cells and every level above halves that.
+//
+// Neighbouring chunks are kept at most one level apart.  Where a chunk borders a coarser one,
+// its odd edge vertices are moved onto the coarser edge (the average of the two vertices next
+// to them), so the edges match and there are no cracks.  A chunk is rebuilt when its level or
+// that of a neighbour changes.
+//
+// Chunk vertices are generated by jobs, nearest chunks first, and uploaded a few per frame.
+// A chunk keeps drawing its previous mesh until the new one is in.  All chunks at a level have
+// the same topology, so they share one index buffer (triangles followed by grid lines).
+//
+class Terrain {
+
+public:
+    enum { NUM_LODS = 5 };                  // level l has CHUNK_CELLS >> l cells per side
+
+private:
+    struct Chunk {
+        int                 x;              // grid coordinates, the chunk starts at (x, z) * CHUNK_SIZE
+        int                 z;
+
+        GLuint              vao;            // 0 until the first mesh is uploaded
+        GLuint              vbo;
+        int                 lod;            // of the uploaded mesh
+        unsigned            edgeMask;       // edges stitched to a coarser neighbour (EDGE_* bits)
+        float               minY;           // height range of the uploaded mesh
+        float               maxY;
+
+        int                 wantedLod;
+        unsigned            wantedMask;
+        bool                building;
+        bool                active;         // within the view distance this frame
+        float               distance;       // from the camera, in the ground plane
+    };
+
+    // vertices made by a job, waiting to be uploaded
+    struct Build {
+        long long           key;
+        int                 lod;
+        unsigned            edgeMask;
+        std::vector<GLfloat> vertices;      // position (chunk-local) + normal
+        float               minY;
+        float               maxY;
+        JobCounter          done;
+    };
+
+    enum {
+        EDGE_WEST           = 1,            // -x
+        EDGE_EAST           = 2,            // +x
+        EDGE_NORTH          = 4,            // -z
+        EDGE_SOUTH          = 8             // +z
+    };
+
+    JobSystem*              mJobs;
+
+    float                   mViewDistance;
+    float                   mLodDistance;   // level l is used up to mLodDistance * 2^l away
+
+    std::unordered_map<long long, Chunk> mChunks;
+    std::vector<Chunk*>     mActive;        // pointers into mChunks (its nodes don't move)
+    std::vector<Chunk*>     mVisible;
+    std::vector<Build*>     mBuilds;        // in flight or waiting for upload
+
+    GLuint                  mIndexBuffers[NUM_LODS];
+    GLsizei                 mNumTriangleIndices[NUM_LODS];
+    GLsizei                 mNumLineIndices[NUM_LODS];
+
+    Frustum                 mFrustum;
+
+    // stats
+    unsigned long long      mNumBuilt;
+    unsigned long long      mNumEvicted;
+    unsigned long long      mUploadedBytes;
+
+    static long long        Key(int x, int z)   { return ((long long)x << 32) | (unsigned)z; }
+
+    // pick the chunks and levels for a camera position and start the builds they need
+    void                    stream(const glm::vec3& cameraPos, unsigned maxBuilds);
+
+    // upload finished builds, returns the number uploaded
+    unsigned                upload(unsigned maxUploads);
+
+    void                    destroyChunk(Chunk& chunk);
+
+    static void             BuildChunk(Build& build, int x, int z);
+
+    Terrain(const Terrain&);                // not copyable
+    Terrain& operator=(const Terrain&);
+
+public:
+    Terrain();
+    ~Terrain();
+
+    static const float      CHUNK_SIZE;     // world units per chunk side
+    static const int        CHUNK_CELLS;    // cells per chunk side at level 0
+    static const unsigned   UPLOADS_PER_FRAME;
+
+    bool                    initialize(JobSystem& jobs, float viewDistance = 1000.0f, float lodDistance = 96.0f);
+    void                    shutdown();
+
+    // build every chunk needed around a position, waiting for the jobs
+    void                    prepare(const glm::vec3& cameraPos);
+
+    // once per frame: stream chunks in and out around the camera, upload what's ready and
+    // cull the chunks against the view-projection matrix
+    void                    update(const glm::vec3& cameraPos, const glm::mat4& viewProj);
+
+    // add a draw for every visible chunk, as triangles or as grid lines; 'item' gives the
+    // program and material
+    void                    submit(DrawBucket& bucket, const DrawItem& item, const glm::mat4& viewMatrix,
+                                   unsigned pass, bool lines, float maxSortDepth) const;
+
+    // ground height anywhere (the same function the chunks are made from)
+    static float            HeightAt(float x, float z);
+
+    unsigned                getNumChunks() const        { return (unsigned)mChunks.size(); }
+    unsigned                getNumVisible() const       { return (unsigned)mVisible.size(); }
+    unsigned                getNumBuilding() const      { return (unsigned)mBuilds.size(); }
+
+    void                    printStats() const;
+};
+
+#endif
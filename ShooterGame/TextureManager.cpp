@@ -0,0 +1,576 @@
+#include "TextureManager.h"
+#include "GLDebug.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+const unsigned TextureManager::BASE_SIZE = 32;
+const unsigned TextureManager::EVICT_FRAMES = 120;
+
+TextureImage::TextureImage()
+    : width(0)
+    , height(0)
+{
+}
+
+unsigned TextureImage::getLevelWidth(unsigned level) const
+{
+    unsigned w = width >> level;
+    return w ? w : 1;
+}
+
+unsigned TextureImage::getLevelHeight(unsigned level) const
+{
+    unsigned h = height >> level;
+    return h ? h : 1;
+}
+
+
+//
+// Image decoding
+//
+
+namespace {
+
+// skip whitespace and comments between PPM header fields
+size_t SkipPPMSpace(const std::vector<unsigned char>& data, size_t pos)
+{
+    while (pos < data.size()) {
+        if (data[pos] == '#') {
+            while (pos < data.size() && data[pos] != '\n') {
+                ++pos;
+            }
+        }
+        else if (data[pos] == ' ' || data[pos] == '\t' || data[pos] == '\r' || data[pos] == '\n') {
+            ++pos;
+        }
+        else {
+            break;
+        }
+    }
+    return pos;
+}
+
+bool ReadPPMNumber(const std::vector<unsigned char>& data, size_t& pos, unsigned& value)
+{
+    pos = SkipPPMSpace(data, pos);
+    if (pos >= data.size() || data[pos] < '0' || data[pos] > '9') {
+        return false;
+    }
+    value = 0;
+    while (pos < data.size() && data[pos] >= '0' && data[pos] <= '9') {
+        value = value * 10 + (data[pos++] - '0');
+        if (value > (1u << 24)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// binary PPM (P6), 8 bits per channel
+bool DecodePPM(const std::vector<unsigned char>& data, TextureImage& image)
+{
+    size_t pos = 2;
+    unsigned w, h, maxval;
+    if (!ReadPPMNumber(data, pos, w) || !ReadPPMNumber(data, pos, h) || !ReadPPMNumber(data, pos, maxval)) {
+        return false;
+    }
+    ++pos;      // single whitespace before the pixels
+
+    if (w == 0 || h == 0 || maxval == 0 || maxval > 255 || data.size() < pos + (size_t)w * h * 3) {
+        return false;
+    }
+
+    image.width = w;
+    image.height = h;
+    image.levels.assign(1, std::vector<unsigned char>((size_t)w * h * 4));
+    unsigned char* dst = &image.levels[0][0];
+
+    // PPM rows are stored top first
+    for (unsigned y = 0; y < h; y++) {
+        const unsigned char* src = &data[pos + (size_t)(h - 1 - y) * w * 3];
+        unsigned char* row = dst + (size_t)y * w * 4;
+        for (unsigned x = 0; x < w; x++) {
+            for (int c = 0; c < 3; c++) {
+                row[x * 4 + c] = (unsigned char)(src[x * 3 + c] * 255 / maxval);
+            }
+            row[x * 4 + 3] = 255;
+        }
+    }
+    return true;
+}
+
+// TGA: true-color or grayscale, uncompressed or RLE, 8/24/32 bits per pixel
+bool DecodeTGA(const std::vector<unsigned char>& data, TextureImage& image)
+{
+    if (data.size() < 18) {
+        return false;
+    }
+
+    unsigned idLength = data[0];
+    unsigned colorMapType = data[1];
+    unsigned imageType = data[2];
+    unsigned colorMapLength = data[5] | (data[6] << 8);
+    unsigned colorMapBits = data[7];
+    unsigned w = data[12] | (data[13] << 8);
+    unsigned h = data[14] | (data[15] << 8);
+    unsigned bpp = data[16];
+    unsigned descriptor = data[17];
+
+    bool rle = imageType == 10 || imageType == 11;
+    bool gray = imageType == 3 || imageType == 11;
+    if (colorMapType != 0 || !(imageType == 2 || imageType == 3 || rle) || w == 0 || h == 0) {
+        return false;
+    }
+    if ((gray && bpp != 8) || (!gray && bpp != 24 && bpp != 32)) {
+        return false;
+    }
+
+    unsigned bytesPerPixel = bpp / 8;
+    size_t pos = 18 + idLength + colorMapLength * ((colorMapBits + 7) / 8);
+    size_t numPixels = (size_t)w * h;
+
+    image.width = w;
+    image.height = h;
+    image.levels.assign(1, std::vector<unsigned char>(numPixels * 4));
+    unsigned char* dst = &image.levels[0][0];
+
+    // convert one BGR(A) or gray pixel to RGBA
+    unsigned char pixel[4];
+    size_t n = 0;
+    while (n < numPixels) {
+        unsigned count = 1;
+        bool repeat = false;
+        if (rle) {
+            if (pos >= data.size()) {
+                return false;
+            }
+            unsigned header = data[pos++];
+            count = (header & 0x7f) + 1;
+            repeat = (header & 0x80) != 0;
+            if (n + count > numPixels) {
+                return false;
+            }
+        }
+        for (unsigned i = 0; i < count; i++) {
+            if (!repeat || i == 0) {
+                if (pos + bytesPerPixel > data.size()) {
+                    return false;
+                }
+                const unsigned char* src = &data[pos];
+                pos += bytesPerPixel;
+                if (gray) {
+                    pixel[0] = pixel[1] = pixel[2] = src[0];
+                    pixel[3] = 255;
+                }
+                else {
+                    pixel[0] = src[2];
+                    pixel[1] = src[1];
+                    pixel[2] = src[0];
+                    pixel[3] = bytesPerPixel == 4 ? src[3] : 255;
+                }
+            }
+            std::memcpy(dst + (n++) * 4, pixel, 4);
+        }
+    }
+
+    // bit 5 of the descriptor means the rows are stored top first
+    if (descriptor & 0x20) {
+        size_t rowBytes = (size_t)w * 4;
+        std::vector<unsigned char> tmp(rowBytes);
+        for (unsigned y = 0; y < h / 2; y++) {
+            unsigned char* a = dst + y * rowBytes;
+            unsigned char* b = dst + (h - 1 - y) * rowBytes;
+            std::memcpy(&tmp[0], a, rowBytes);
+            std::memcpy(a, b, rowBytes);
+            std::memcpy(b, &tmp[0], rowBytes);
+        }
+    }
+    return true;
+}
+
+} // end of unnamed namespace
+
+bool TextureManager::DecodeImage(const std::string& path, TextureImage& image)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file) {
+        std::cerr << "ERROR: Failed to open texture " << path << std::endl;
+        return false;
+    }
+    std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    bool ok;
+    if (data.size() >= 2 && data[0] == 'P' && data[1] == '6') {
+        ok = DecodePPM(data, image);
+    }
+    else {
+        ok = DecodeTGA(data, image);
+    }
+
+    if (!ok) {
+        std::cerr << "ERROR: Unsupported or corrupt image " << path << " (only TGA and binary PPM can be loaded)" << std::endl;
+        image.levels.clear();
+    }
+    return ok;
+}
+
+void TextureManager::BuildMips(TextureImage& image)
+{
+    if (image.levels.empty()) {
+        return;
+    }
+    image.levels.resize(1);
+
+    for (unsigned level = 1; ; level++) {
+        unsigned sw = image.getLevelWidth(level - 1);
+        unsigned sh = image.getLevelHeight(level - 1);
+        if (sw == 1 && sh == 1) {
+            break;
+        }
+        unsigned dw = image.getLevelWidth(level);
+        unsigned dh = image.getLevelHeight(level);
+
+        image.levels.push_back(std::vector<unsigned char>((size_t)dw * dh * 4));
+        const unsigned char* src = &image.levels[level - 1][0];
+        unsigned char* dst = &image.levels[level][0];
+
+        // average 2x2 texels (clamped at the edges of odd-sized levels)
+        for (unsigned y = 0; y < dh; y++) {
+            unsigned y0 = 2 * y;
+            unsigned y1 = (y0 + 1 < sh) ? y0 + 1 : y0;
+            for (unsigned x = 0; x < dw; x++) {
+                unsigned x0 = 2 * x;
+                unsigned x1 = (x0 + 1 < sw) ? x0 + 1 : x0;
+                for (unsigned c = 0; c < 4; c++) {
+                    unsigned sum = src[((size_t)y0 * sw + x0) * 4 + c] + src[((size_t)y0 * sw + x1) * 4 + c]
+                                 + src[((size_t)y1 * sw + x0) * 4 + c] + src[((size_t)y1 * sw + x1) * 4 + c];
+                    dst[((size_t)y * dw + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+    }
+}
+
+
+//
+// TextureManager
+//
+
+TextureManager::TextureManager()
+    : mFrame(0)
+    , mBytesUploaded(0)
+    , mResidentBytes(0)
+    , mNumEvicted(0)
+{
+}
+
+TextureManager::~TextureManager()
+{
+    shutdown();
+}
+
+bool TextureManager::initialize(GLsizeiptr uploadBytesPerFrame)
+{
+    return mUploadBuffer.create(GL_PIXEL_UNPACK_BUFFER, uploadBytesPerFrame);
+}
+
+void TextureManager::shutdown()
+{
+    for (unsigned i = 0; i < mTextures.size(); i++) {
+        Texture* t = mTextures[i];
+        // wait for the worker before its image goes away
+        if (t->decoded.valid()) {
+            t->decoded.wait();
+        }
+        if (t->tex) {
+            glDeleteTextures(1, &t->tex);
+        }
+        delete t;
+    }
+    mTextures.clear();
+    mByPath.clear();
+    mResidentBytes = 0;
+
+    mUploadBuffer.destroy();
+}
+
+unsigned long long TextureManager::LevelBytes(const TextureImage& image, unsigned level)
+{
+    return (unsigned long long)image.getLevelWidth(level) * image.getLevelHeight(level) * 4;
+}
+
+unsigned TextureManager::request(const std::string& path)
+{
+    std::map<std::string, unsigned>::iterator it = mByPath.find(path);
+    if (it != mByPath.end()) {
+        return it->second;
+    }
+
+    Texture* t = new Texture;
+    t->path = path;
+    t->tex = 0;
+    t->ready = false;
+    t->failed = false;
+    t->numLevels = 0;
+    t->baseLevel = 0;
+    t->residentLevel = 0;
+    t->streamRows = 0;
+    t->screenSize = 0;
+    t->wantedLevel = 0;
+    t->lastNeeded = mFrame;
+
+    TextureImage* image = &t->image;
+    t->decoded = std::async(std::launch::async, [path, image]() {
+        if (!DecodeImage(path, *image)) {
+            return false;
+        }
+        BuildMips(*image);
+        return true;
+    });
+
+    unsigned id = (unsigned)mTextures.size();
+    mTextures.push_back(t);
+    mByPath[path] = id;
+    return id;
+}
+
+GLuint TextureManager::getTexture(unsigned id) const
+{
+    return (id < mTextures.size() && mTextures[id]->ready) ? mTextures[id]->tex : 0;
+}
+
+void TextureManager::setScreenSize(unsigned id, float pixels)
+{
+    if (id < mTextures.size() && pixels > mTextures[id]->screenSize) {
+        mTextures[id]->screenSize = pixels;
+    }
+}
+
+bool TextureManager::createTexture(Texture& t)
+{
+    const TextureImage& image = t.image;
+    t.numLevels = (unsigned)image.levels.size();
+
+    // the first level that is small enough to upload right away
+    t.baseLevel = 0;
+    while (t.baseLevel + 1 < t.numLevels &&
+           (image.getLevelWidth(t.baseLevel) > BASE_SIZE || image.getLevelHeight(t.baseLevel) > BASE_SIZE)) {
+        ++t.baseLevel;
+    }
+
+    glGenTextures(1, &t.tex);
+    if (!t.tex) {
+        std::cerr << "ERROR: Failed to create texture for " << t.path << std::endl;
+        return false;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, t.tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, t.baseLevel);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, t.numLevels - 1);
+
+    // the smallest mips are tiny, so they go straight from client memory
+    for (unsigned level = t.baseLevel; level < t.numLevels; level++) {
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, image.getLevelWidth(level), image.getLevelHeight(level), 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, &image.levels[level][0]);
+        GL_DEBUG_UPLOAD(LevelBytes(image, level));
+        mResidentBytes += LevelBytes(image, level);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    t.residentLevel = t.baseLevel;
+    t.streamRows = 0;
+    t.lastNeeded = mFrame;
+
+    GL_DEBUG_CALLS(7);      // glGenTextures and the parameters
+    GL_DEBUG_STATE(2);
+    GL_DEBUG_CHECK("creating texture");
+
+    return true;
+}
+
+GLsizeiptr TextureManager::streamLevel(Texture& t, GLsizeiptr budget)
+{
+    const TextureImage& image = t.image;
+    unsigned level = t.residentLevel - 1;
+    unsigned w = image.getLevelWidth(level);
+    unsigned h = image.getLevelHeight(level);
+    GLsizeiptr rowBytes = (GLsizeiptr)w * 4;
+
+    // whatever is left of this frame's region (minus room for alignment)
+    GLsizeiptr space = mUploadBuffer.getFrameSize() - mUploadBuffer.getBytesUsed() - 4;
+    if (space < budget) {
+        budget = space;
+    }
+
+    unsigned rows = h - t.streamRows;
+    if (budget < rows * rowBytes) {
+        rows = (unsigned)(budget / rowBytes);
+    }
+    if (rows == 0) {
+        return 0;
+    }
+
+    StreamAllocation alloc = mUploadBuffer.allocate(rows * rowBytes, 4);
+    if (!alloc.ptr) {
+        return 0;
+    }
+    std::memcpy(alloc.ptr, &image.levels[level][t.streamRows * rowBytes], rows * rowBytes);
+    mUploadBuffer.flush();
+
+    glBindTexture(GL_TEXTURE_2D, t.tex);
+
+    if (t.streamRows == 0) {
+        // allocate the level (nothing must be bound to the unpack buffer here)
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        GL_DEBUG_CALLS(1);
+    }
+
+    // the copy is sourced from the pixel buffer, so the call returns without waiting for it
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, alloc.buffer);
+    glTexSubImage2D(GL_TEXTURE_2D, level, 0, t.streamRows, w, rows, GL_RGBA, GL_UNSIGNED_BYTE,
+        (const GLvoid*)alloc.offset);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    GL_DEBUG_STATE(3);
+    GL_DEBUG_UPLOAD(alloc.size);
+
+    t.streamRows += rows;
+    mBytesUploaded += alloc.size;
+
+    // the level is complete: start sampling from it
+    if (t.streamRows == h) {
+        t.residentLevel = level;
+        t.streamRows = 0;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+        GL_DEBUG_CALLS(1);
+        mResidentBytes += LevelBytes(image, level);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    GL_DEBUG_STATE(1);
+
+    return alloc.size;
+}
+
+void TextureManager::evictLevel(Texture& t)
+{
+    glBindTexture(GL_TEXTURE_2D, t.tex);
+
+    if (t.streamRows) {
+        // drop the partly streamed level first
+        glTexImage2D(GL_TEXTURE_2D, t.residentLevel - 1, GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        t.streamRows = 0;
+    }
+    else {
+        // a zero-sized image releases the level's storage
+        glTexImage2D(GL_TEXTURE_2D, t.residentLevel, GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        mResidentBytes -= LevelBytes(t.image, t.residentLevel);
+        ++t.residentLevel;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, t.residentLevel);
+        ++mNumEvicted;
+        GL_DEBUG_CALLS(1);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    GL_DEBUG_STATE(2);
+    GL_DEBUG_CALLS(1);
+}
+
+void TextureManager::update()
+{
+    ++mFrame;
+
+    std::vector<Texture*> wanted;
+
+    for (unsigned i = 0; i < mTextures.size(); i++) {
+        Texture& t = *mTextures[i];
+
+        if (!t.ready && !t.failed) {
+            if (t.decoded.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                continue;
+            }
+            if (t.decoded.get() && createTexture(t)) {
+                t.ready = true;
+                std::cout << "Loaded texture '" << t.path << "' (" << t.image.width << "x" << t.image.height
+                          << ", " << t.numLevels << " mips)" << std::endl;
+            }
+            else {
+                t.failed = true;
+                t.image.levels.clear();
+            }
+        }
+        if (!t.ready) {
+            continue;
+        }
+
+        // the finest level with at least one texel per pixel
+        unsigned size = t.image.width > t.image.height ? t.image.width : t.image.height;
+        t.wantedLevel = t.baseLevel;
+        if (t.screenSize > 0) {
+            t.wantedLevel = 0;
+            while (t.wantedLevel < t.baseLevel && (float)(size >> (t.wantedLevel + 1)) >= t.screenSize) {
+                ++t.wantedLevel;
+            }
+        }
+        t.screenSize = 0;       // reported again by the next draw
+
+        if (t.wantedLevel <= t.residentLevel) {
+            t.lastNeeded = mFrame;
+        }
+        if (t.wantedLevel < t.residentLevel) {
+            wanted.push_back(&t);
+        }
+        else if ((t.residentLevel < t.baseLevel || t.streamRows) && mFrame - t.lastNeeded > EVICT_FRAMES) {
+            // not needed for a while: give the memory back, one level at a time
+            evictLevel(t);
+            t.lastNeeded = mFrame;
+        }
+    }
+
+    if (wanted.empty()) {
+        return;
+    }
+
+    // textures that are furthest from the detail they need go first
+    std::stable_sort(wanted.begin(), wanted.end(), [](const Texture* a, const Texture* b) {
+        return a->residentLevel - a->wantedLevel > b->residentLevel - b->wantedLevel;
+    });
+
+    mUploadBuffer.beginFrame();
+
+    GLsizeiptr budget = mUploadBuffer.getFrameSize();
+    for (size_t i = 0; i < wanted.size() && budget > 0; i++) {
+        Texture& t = *wanted[i];
+        while (t.wantedLevel < t.residentLevel) {
+            GLsizeiptr used = streamLevel(t, budget);
+            if (used == 0) {
+                break;
+            }
+            budget -= used;
+        }
+    }
+
+    mUploadBuffer.endFrame();
+
+    GL_DEBUG_CHECK("streaming textures");
+}
+
+void TextureManager::printStats() const
+{
+    unsigned numReady = 0;
+    for (unsigned i = 0; i < mTextures.size(); i++) {
+        numReady += mTextures[i]->ready;
+    }
+
+    std::cout << "Textures: " << numReady << " of " << mTextures.size() << " ready, "
+              << mResidentBytes << " bytes resident, " << mBytesUploaded << " bytes streamed, "
+              << mNumEvicted << " mips evicted" << std::endl;
+}
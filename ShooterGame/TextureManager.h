@@ -0,0 +1,120 @@
+#ifndef TEXTUREMANAGER_H_
+#define TEXTUREMANAGER_H_
+
+#include "GLSH.h"
+#include "StreamBuffer.h"
+
+#include <future>
+#include <map>
+#include <string>
+#include <vector>
+
+// decoded RGBA8 image with its full mip chain, bottom row first (the GL convention)
+struct TextureImage {
+    unsigned                width;
+    unsigned                height;
+    std::vector<std::vector<unsigned char> > levels;   // level i is max(1, width >> i) x max(1, height >> i)
+
+    TextureImage();
+
+    unsigned                getLevelWidth(unsigned level) const;
+    unsigned                getLevelHeight(unsigned level) const;
+};
+
+//
+// Loads textures without stalling the frame.
+//
+// Images are decoded and their mipmaps are built on worker threads.  Once an image is ready,
+// its smallest mips are uploaded right away so it can be drawn, and the bigger ones stream in
+// through a pixel buffer (a StreamBuffer on GL_PIXEL_UNPACK_BUFFER), a few rows at a time,
+// under a fixed number of bytes per frame.
+//
+// Each frame, the renderer reports how big every texture is on screen.  The finest mip a
+// texture needs follows from that: textures that grow on screen get their finer mips first,
+// and mips that have not been needed for a while are dropped from the GPU (the CPU keeps
+// the whole chain, so they can stream in again).
+//
+// Only uncompressed/RLE TGA and binary PPM files are supported.
+//
+class TextureManager {
+
+    struct Texture {
+        std::string         path;
+        GLuint              tex;            // 0 until the smallest mips are uploaded
+        TextureImage        image;
+        std::future<bool>   decoded;
+        bool                ready;          // decoded and the GL texture exists
+        bool                failed;
+
+        unsigned            numLevels;
+        unsigned            baseLevel;      // this level and the smaller ones are always resident
+        unsigned            residentLevel;  // finest level on the GPU (GL_TEXTURE_BASE_LEVEL)
+        unsigned            streamRows;     // rows of residentLevel - 1 uploaded so far
+
+        float               screenSize;     // largest on-screen size this frame, in pixels
+        unsigned            wantedLevel;    // finest level needed for screenSize
+        unsigned            lastNeeded;     // last frame that needed every resident level
+    };
+
+    std::vector<Texture*>               mTextures;
+    std::map<std::string, unsigned>     mByPath;
+
+    StreamBuffer            mUploadBuffer;  // one region per frame holds the rows uploaded that frame
+    unsigned                mFrame;
+
+    // stats
+    unsigned long long      mBytesUploaded; // total through the upload buffer
+    unsigned long long      mResidentBytes; // all resident mips
+    unsigned                mNumEvicted;    // mips dropped from the GPU
+
+    bool                    createTexture(Texture& t);
+
+    // upload rows of the next finer level, returns the number of bytes used
+    GLsizeiptr              streamLevel(Texture& t, GLsizeiptr budget);
+
+    // drop the finest resident level
+    void                    evictLevel(Texture& t);
+
+    static unsigned long long LevelBytes(const TextureImage& image, unsigned level);
+
+    TextureManager(const TextureManager&);          // not copyable
+    TextureManager& operator=(const TextureManager&);
+
+public:
+    TextureManager();
+    ~TextureManager();
+
+    // levels at most this big (in either direction) are uploaded as soon as an image is decoded
+    static const unsigned   BASE_SIZE;
+
+    // frames a mip is kept after it was last needed
+    static const unsigned   EVICT_FRAMES;
+
+    bool                    initialize(GLsizeiptr uploadBytesPerFrame = 4 << 20);
+    void                    shutdown();
+
+    // start decoding an image on a worker thread, returns its id
+    // (the same path always gets the same id)
+    unsigned                request(const std::string& path);
+
+    // 0 while the texture is still decoding, or if it failed to load
+    GLuint                  getTexture(unsigned id) const;
+
+    // while drawing: the texture covers about 'pixels' pixels on screen (in its larger direction)
+    void                    setScreenSize(unsigned id, float pixels);
+
+    // call once per frame before drawing: creates the textures that finished decoding and
+    // streams in (or drops) mips for the sizes reported last frame
+    void                    update();
+
+    // decode a TGA or PPM file into the base level of 'image'
+    static bool             DecodeImage(const std::string& path, TextureImage& image);
+
+    // build the rest of the mip chain with a box filter
+    static void             BuildMips(TextureImage& image);
+
+    unsigned long long      getResidentBytes() const { return mResidentBytes; }
+    void                    printStats() const;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include "TransformHierarchy.h"
+#include "JobSystem.h"
+
+#include <atomic>
+
+const unsigned TransformHierarchy::NONE = 0xffffffffu;
+
+const unsigned TransformHierarchy::GRAIN = 4096;
+
+namespace {
+
+// the upper 3x3 of T * R * S, straight from the quaternion
+void LocalAxes(const glm::quat& q, const glm::vec3& s, glm::vec3& x, glm::vec3& y, glm::vec3& z)
+{
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+    x = glm::vec3(1 - 2 * (yy + zz), 2 * (xy + wz), 2 * (xz - wy)) * s.x;
+    y = glm::vec3(2 * (xy - wz), 1 - 2 * (xx + zz), 2 * (yz + wx)) * s.y;
+    z = glm::vec3(2 * (xz + wy), 2 * (yz - wx), 1 - 2 * (xx + yy)) * s.z;
+}
+
+// inverse transpose of the matrix with columns a, b, c: the cofactors over the determinant
+glm::mat3 NormalMatrix(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+    glm::vec3 bc = glm::cross(b, c);
+    float det = glm::dot(a, bc);
+    float invDet = det != 0 ? 1.0f / det : 0.0f;
+    return glm::mat3(bc * invDet, glm::cross(c, a) * invDet, glm::cross(a, b) * invDet);
+}
+
+}
+
+TransformHierarchy::TransformHierarchy()
+    : mOrderDirty(false)
+    , mNumUpdated(0)
+{
+}
+
+unsigned TransformHierarchy::create(unsigned parent)
+{
+    unsigned handle;
+    if (!mFreeHandles.empty()) {
+        handle = mFreeHandles.back();
+        mFreeHandles.pop_back();
+    }
+    else {
+        handle = (unsigned)mIndex.size();
+        mIndex.push_back(NONE);
+        mParentHandle.push_back(NONE);
+    }
+
+    // at the end until the next sort; the parent is always before it
+    unsigned index = (unsigned)mHandle.size();
+    mIndex[handle] = index;
+    mParentHandle[handle] = parent;
+
+    mParent.push_back(parent != NONE ? mIndex[parent] : NONE);
+    mPosition.push_back(glm::vec3(0.0f));
+    mRotation.push_back(glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+    mScale.push_back(glm::vec3(1.0f));
+    mWorld.push_back(glm::mat4(1.0f));
+    mNormal.push_back(glm::mat3(1.0f));
+    mDirty.push_back(LOCAL_CHANGED);
+    mHandle.push_back(handle);
+
+    mOrderDirty = true;
+    return handle;
+}
+
+void TransformHierarchy::destroy(unsigned node)
+{
+    // the sort leaves it out, and everything below it since it can't be reached
+    mIndex[node] = NONE;
+    mOrderDirty = true;
+}
+
+void TransformHierarchy::clear()
+{
+    mParent.clear();
+    mPosition.clear();
+    mRotation.clear();
+    mScale.clear();
+    mWorld.clear();
+    mNormal.clear();
+    mDirty.clear();
+    mHandle.clear();
+    mLevelBegin.clear();
+    mIndex.clear();
+    mParentHandle.clear();
+    mFreeHandles.clear();
+    mOrderDirty = false;
+    mNumUpdated = 0;
+}
+
+void TransformHierarchy::setPosition(unsigned node, const glm::vec3& position)
+{
+    unsigned i = mIndex[node];
+    mPosition[i] = position;
+    mDirty[i] |= LOCAL_CHANGED;
+}
+
+void TransformHierarchy::setRotation(unsigned node, const glm::quat& rotation)
+{
+    unsigned i = mIndex[node];
+    mRotation[i] = rotation;
+    mDirty[i] |= LOCAL_CHANGED;
+}
+
+void TransformHierarchy::setScale(unsigned node, const glm::vec3& scale)
+{
+    unsigned i = mIndex[node];
+    mScale[i] = scale;
+    mDirty[i] |= LOCAL_CHANGED;
+}
+
+void TransformHierarchy::setLocal(unsigned node, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+{
+    unsigned i = mIndex[node];
+    mPosition[i] = position;
+    mRotation[i] = rotation;
+    mScale[i] = scale;
+    mDirty[i] |= LOCAL_CHANGED;
+}
+
+void TransformHierarchy::invalidate()
+{
+    for (size_t i = 0; i < mDirty.size(); i++) {
+        mDirty[i] |= LOCAL_CHANGED;
+    }
+}
+
+void TransformHierarchy::sort()
+{
+    mOrderDirty = false;
+
+    const unsigned numHandles = (unsigned)mIndex.size();
+
+    // children of each live handle, as offsets into one list
+    std::vector<unsigned> firstChild(numHandles + 1, 0);
+    for (unsigned h = 0; h < numHandles; h++) {
+        unsigned p = mParentHandle[h];
+        if (mIndex[h] != NONE && p != NONE) {
+            ++firstChild[p + 1];
+        }
+    }
+    for (unsigned h = 0; h < numHandles; h++) {
+        firstChild[h + 1] += firstChild[h];
+    }
+    std::vector<unsigned> children(firstChild[numHandles]);
+    std::vector<unsigned> fill(firstChild.begin(), firstChild.end() - 1);
+    for (unsigned h = 0; h < numHandles; h++) {
+        unsigned p = mParentHandle[h];
+        if (mIndex[h] != NONE && p != NONE) {
+            children[fill[p]++] = h;
+        }
+    }
+
+    // breadth-first from the roots; a destroyed node is never reached, and neither is anything below it
+    std::vector<unsigned> order;
+    order.reserve(mHandle.size());
+    mLevelBegin.clear();
+    for (unsigned h = 0; h < numHandles; h++) {
+        if (mIndex[h] != NONE && mParentHandle[h] == NONE) {
+            order.push_back(h);
+        }
+    }
+    size_t levelBegin = 0;
+    while (levelBegin < order.size()) {
+        mLevelBegin.push_back((unsigned)levelBegin);
+        size_t levelEnd = order.size();
+        for (size_t k = levelBegin; k < levelEnd; k++) {
+            unsigned h = order[k];
+            for (unsigned c = firstChild[h]; c < firstChild[h + 1]; c++) {
+                if (mIndex[children[c]] != NONE) {
+                    order.push_back(children[c]);
+                }
+            }
+        }
+        levelBegin = levelEnd;
+    }
+    mLevelBegin.push_back((unsigned)order.size());
+
+    // move the arrays into that order
+    const size_t n = order.size();
+    std::vector<unsigned> parent(n);
+    std::vector<glm::vec3> position(n);
+    std::vector<glm::quat> rotation(n);
+    std::vector<glm::vec3> scale(n);
+    std::vector<glm::mat4> world(n);
+    std::vector<glm::mat3> normal(n);
+    std::vector<unsigned char> dirty(n);
+
+    std::vector<unsigned> newIndex(numHandles, NONE);
+    for (size_t k = 0; k < n; k++) {
+        unsigned h = order[k];
+        unsigned i = mIndex[h];
+        newIndex[h] = (unsigned)k;
+
+        parent[k] = mParentHandle[h] != NONE ? newIndex[mParentHandle[h]] : NONE;
+        position[k] = mPosition[i];
+        rotation[k] = mRotation[i];
+        scale[k] = mScale[i];
+        world[k] = mWorld[i];
+        normal[k] = mNormal[i];
+        dirty[k] = mDirty[i] & LOCAL_CHANGED;
+    }
+
+    mParent.swap(parent);
+    mPosition.swap(position);
+    mRotation.swap(rotation);
+    mScale.swap(scale);
+    mWorld.swap(world);
+    mNormal.swap(normal);
+    mDirty.swap(dirty);
+    mHandle.swap(order);
+    mIndex.swap(newIndex);
+
+    // handles of the nodes that were dropped can be used again
+    mFreeHandles.clear();
+    for (unsigned h = numHandles; h-- > 0; ) {
+        if (mIndex[h] == NONE) {
+            mFreeHandles.push_back(h);
+        }
+    }
+}
+
+unsigned TransformHierarchy::updateRange(unsigned begin, unsigned end)
+{
+    unsigned numUpdated = 0;
+
+    for (unsigned i = begin; i < end; i++) {
+        unsigned p = mParent[i];
+
+        // the parents are a depth up, so their flags are already this update's
+        bool dirty = (mDirty[i] & LOCAL_CHANGED) || (p != NONE && (mDirty[p] & WORLD_CHANGED));
+        if (!dirty) {
+            if (mDirty[i]) {
+                mDirty[i] = 0;
+            }
+            continue;
+        }
+
+        glm::vec3 x, y, z;
+        LocalAxes(mRotation[i], mScale[i], x, y, z);
+        glm::vec3 t = mPosition[i];
+
+        if (p != NONE) {
+            // affine, so only the upper 3x3 and the translation of the parent matter
+            const glm::mat4& P = mWorld[p];
+            glm::vec3 px(P[0]), py(P[1]), pz(P[2]);
+            x = px * x.x + py * x.y + pz * x.z;
+            y = px * y.x + py * y.y + pz * y.z;
+            z = px * z.x + py * z.y + pz * z.z;
+            t = px * t.x + py * t.y + pz * t.z + glm::vec3(P[3]);
+        }
+
+        glm::mat4& W = mWorld[i];
+        W[0] = glm::vec4(x, 0.0f);
+        W[1] = glm::vec4(y, 0.0f);
+        W[2] = glm::vec4(z, 0.0f);
+        W[3] = glm::vec4(t, 1.0f);
+        mNormal[i] = NormalMatrix(x, y, z);
+
+        mDirty[i] = WORLD_CHANGED;
+        ++numUpdated;
+    }
+
+    return numUpdated;
+}
+
+void TransformHierarchy::update(JobSystem* jobs)
+{
+    if (mOrderDirty) {
+        sort();
+    }
+
+    mNumUpdated = 0;
+
+    // a depth at a time, each one split among the workers
+    for (size_t level = 0; level + 1 < mLevelBegin.size(); level++) {
+        unsigned begin = mLevelBegin[level];
+        unsigned end = mLevelBegin[level + 1];
+
+        if (!jobs || end - begin <= GRAIN) {
+            mNumUpdated += updateRange(begin, end);
+            continue;
+        }
+
+        std::atomic<unsigned> numUpdated(0);
+        jobs->parallelFor(end - begin, GRAIN, [this, begin, &numUpdated](size_t b, size_t e) {
+            numUpdated += updateRange(begin + (unsigned)b, begin + (unsigned)e);
+        });
+        mNumUpdated += numUpdated;
+    }
+}
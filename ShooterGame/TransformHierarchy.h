@@ -0,0 +1,102 @@
+#ifndef TRANSFORMHIERARCHY_H_
+#define TRANSFORMHIERARCHY_H_
+
+#include "GLSH.h"
+
+#include <vector>
+
+class JobSystem;
+
+//
+// Scene transforms: nodes with a local position, rotation and scale under an optional parent.
+//
+// The nodes are stored breadth-first in parallel arrays (struct of arrays), so every parent
+// comes before its children and each depth is one contiguous range.  Setting a local transform
+// only marks the node dirty; update() then walks the arrays once, a depth at a time, and
+// recomputes the world and normal matrices of the dirty nodes and everything below them.  The
+// nodes of one depth don't depend on each other, so each depth is split among the workers.
+//
+// Nodes are named by handles that stay valid while the arrays are reordered.  Creating or
+// destroying nodes re-sorts the arrays at the next update().
+//
+class TransformHierarchy {
+
+    enum {
+        LOCAL_CHANGED = 1,                  // set by the setters
+        WORLD_CHANGED = 2                   // set by update(), for the children to see
+    };
+
+    // by index, breadth-first
+    std::vector<unsigned>   mParent;        // index, NONE for roots
+    std::vector<glm::vec3>  mPosition;
+    std::vector<glm::quat>  mRotation;
+    std::vector<glm::vec3>  mScale;
+    std::vector<glm::mat4>  mWorld;
+    std::vector<glm::mat3>  mNormal;        // inverse transpose of the world matrix's upper 3x3
+    std::vector<unsigned char> mDirty;
+    std::vector<unsigned>   mHandle;        // of the node at each index
+
+    std::vector<unsigned>   mLevelBegin;    // first index of each depth, and the end
+
+    // by handle
+    std::vector<unsigned>   mIndex;         // NONE if free
+    std::vector<unsigned>   mParentHandle;
+    std::vector<unsigned>   mFreeHandles;
+
+    bool                    mOrderDirty;    // nodes were created or destroyed since the last sort
+
+    // stats of the last update()
+    unsigned                mNumUpdated;
+
+    // breadth-first order again, dropping the destroyed nodes
+    void                    sort();
+
+    // world and normal matrices of [begin, end) at one depth, returns how many were dirty
+    unsigned                updateRange(unsigned begin, unsigned end);
+
+    TransformHierarchy(const TransformHierarchy&);      // not copyable
+    TransformHierarchy& operator=(const TransformHierarchy&);
+
+public:
+    static const unsigned   NONE;
+
+    // nodes per job in update()
+    static const unsigned   GRAIN;
+
+    TransformHierarchy();
+
+    // a node at the origin of its parent (NONE for a root), returns its handle
+    unsigned                create(unsigned parent = NONE);
+
+    // destroy a node and everything below it
+    void                    destroy(unsigned node);
+
+    void                    clear();
+
+    // destroyed nodes count until the next update()
+    unsigned                getNumNodes() const         { return (unsigned)(mIndex.size() - mFreeHandles.size()); }
+
+    void                    setPosition(unsigned node, const glm::vec3& position);
+    void                    setRotation(unsigned node, const glm::quat& rotation);
+    void                    setScale(unsigned node, const glm::vec3& scale);
+    void                    setLocal(unsigned node, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+
+    const glm::vec3&        getPosition(unsigned node) const    { return mPosition[mIndex[node]]; }
+    const glm::quat&        getRotation(unsigned node) const    { return mRotation[mIndex[node]]; }
+    const glm::vec3&        getScale(unsigned node) const       { return mScale[mIndex[node]]; }
+
+    // recompute the world and normal matrices of the changed subtrees (in parallel if jobs is given)
+    void                    update(JobSystem* jobs = NULL);
+
+    // as of the last update()
+    const glm::mat4&        getWorld(unsigned node) const       { return mWorld[mIndex[node]]; }
+    const glm::mat3&        getNormal(unsigned node) const      { return mNormal[mIndex[node]]; }
+
+    // mark every node dirty, so the next update() recomputes them all
+    void                    invalidate();
+
+    unsigned                getNumUpdated() const       { return mNumUpdated; }
+    unsigned                getNumLevels() const        { return mLevelBegin.empty() ? 0 : (unsigned)mLevelBegin.size() - 1; }
+};
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef VERTEXFORMAT_H_
+#define VERTEXFORMAT_H_
+
+#include "Wavefront.h"
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+//
+// Vertex formats described at compile time.
+//
+// A format is a list of attribute types, e.g. VertexFormat<VertexPosition, VertexNormal>.
+// The list gives the stride and the offset of every attribute, and from it the compiler
+// generates the reindexer, an interleave loop without per-vertex branches and the
+// glVertexAttribPointer calls.  Code that only knows the layout at run time picks the
+// instantiation once per mesh with FindVertexFormat.
+//
+
+// the attribute arrays of a mesh being built (attributes a format doesn't use may be NULL)
+struct VertexStreams {
+    std::vector<Vec3>*      positions;
+    std::vector<Vec3>*      normals;
+    std::vector<TexCoord>*  texcoords;
+    std::vector<Vec4>*      tangents;
+
+    VertexStreams()
+        : positions(NULL), normals(NULL), texcoords(NULL), tangents(NULL)
+    {
+    }
+};
+
+//
+// Attributes.  Each one knows its type, size and shader location, whether it is read from
+// the OBJ file and through which index, where its stream is and how it is written into a
+// vertex and described in OBJMesh.
+//
+
+struct VertexPosition {
+    typedef Vec3 Type;
+    enum { SIZE = 3, LOCATION = glsh::VA_POSITION, FROM_OBJ = 1 };
+
+    static int              ObjIndex(const OBJVertex& v)        { return v.v; }
+    static std::vector<Type>& Stream(const VertexStreams& s)    { return *s.positions; }
+    static void             Write(GLfloat* out, const Type& a)  { out[0] = a.x; out[1] = a.y; out[2] = a.z; }
+    static void             Describe(OBJMesh& m, size_t offset) { m.mPositionSize = SIZE; m.mPositionOffset = (GLvoid*)offset; }
+};
+
+struct VertexNormal {
+    typedef Vec3 Type;
+    enum { SIZE = 3, LOCATION = glsh::VA_NORMAL, FROM_OBJ = 1 };
+
+    static int              ObjIndex(const OBJVertex& v)        { return v.vn; }
+    static std::vector<Type>& Stream(const VertexStreams& s)    { return *s.normals; }
+    static void             Write(GLfloat* out, const Type& a)  { out[0] = a.x; out[1] = a.y; out[2] = a.z; }
+    static void             Describe(OBJMesh& m, size_t offset) { m.mNormalSize = SIZE; m.mNormalOffset = (GLvoid*)offset; }
+};
+
+struct VertexTexCoord {
+    typedef TexCoord Type;
+    enum { SIZE = 2, LOCATION = glsh::VA_TEXCOORD, FROM_OBJ = 1 };
+
+    static int              ObjIndex(const OBJVertex& v)        { return v.vt; }
+    static std::vector<Type>& Stream(const VertexStreams& s)    { return *s.texcoords; }
+    static void             Write(GLfloat* out, const Type& a)  { out[0] = a.s; out[1] = a.t; }
+    static void             Describe(OBJMesh& m, size_t offset) { m.mTexCoordSize = SIZE; m.mTexCoordOffset = (GLvoid*)offset; }
+};
+
+// computed after reindexing, so it has no OBJ index
+struct VertexTangent {
+    typedef Vec4 Type;
+    enum { SIZE = 4, LOCATION = glsh::VA_TANGENT, FROM_OBJ = 0 };
+
+    static int              ObjIndex(const OBJVertex&)          { return 0; }
+    static std::vector<Type>& Stream(const VertexStreams& s)    { return *s.tangents; }
+    static void             Write(GLfloat* out, const Type& a)  { out[0] = a.x; out[1] = a.y; out[2] = a.z; out[3] = a.w; }
+    static void             Describe(OBJMesh& m, size_t offset) { m.mTangentSize = SIZE; m.mTangentlOffset = (GLvoid*)offset; }
+};
+
+
+namespace VertexFormatDetail {
+
+// floats in a list of attributes
+template <typename... Attribs>
+struct Floats;
+
+template <>
+struct Floats<> {
+    enum { VALUE = 0 };
+};
+
+template <typename First, typename... Rest>
+struct Floats<First, Rest...> {
+    enum { VALUE = First::SIZE + Floats<Rest...>::VALUE };
+};
+
+// offset of Attrib in a list, in floats
+template <typename Attrib, typename... Attribs>
+struct OffsetOf;
+
+template <typename Attrib, typename... Rest>
+struct OffsetOf<Attrib, Attrib, Rest...> {
+    enum { VALUE = 0 };
+};
+
+template <typename Attrib, typename First, typename... Rest>
+struct OffsetOf<Attrib, First, Rest...> {
+    enum { VALUE = First::SIZE + OffsetOf<Attrib, Rest...>::VALUE };
+};
+
+// evaluates its arguments (a pack expansion) in order
+struct Expand {
+    template <typename... T>
+    Expand(const T&...) {}
+};
+
+template <size_t N>
+struct KeyHash {
+    size_t operator()(const std::array<int, N>& key) const
+    {
+        unsigned long long h = 0;
+        for (size_t i = 0; i < N; i++) {
+            h ^= (unsigned long long)key[i] * 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+        }
+        return (size_t)h;
+    }
+};
+
+} // end of namespace VertexFormatDetail
+
+
+template <typename... Attribs>
+struct VertexFormat {
+
+    enum {
+        FLOATS = VertexFormatDetail::Floats<Attribs...>::VALUE,
+        STRIDE = FLOATS * sizeof(GLfloat),
+        NUM_ATTRIBS = sizeof...(Attribs)
+    };
+
+    template <typename Attrib>
+    struct Offset {
+        enum {
+            FLOATS = VertexFormatDetail::OffsetOf<Attrib, Attribs...>::VALUE,
+            BYTES = FLOATS * sizeof(GLfloat)
+        };
+    };
+
+    // fill in OBJMesh's attribute sizes, offsets and stride, returns the floats per vertex
+    static int Describe(OBJMesh& mesh)
+    {
+        VertexFormatDetail::Expand{ (Attribs::Describe(mesh, Offset<Attribs>::BYTES), 0)... };
+        mesh.mStride = STRIDE;
+        return FLOATS;
+    }
+
+    //
+    // Give each distinct combination of OBJ indices its own vertex, in the order they are
+    // first used, and rearrange the streams to match.
+    //
+    static void Reindex(const std::vector<OBJTriangle>& faces, std::vector<IndexTriangle>& newFaces, const VertexStreams& streams)
+    {
+        typedef std::array<int, NUM_ATTRIBS> Key;
+        typedef std::unordered_map<Key, unsigned, VertexFormatDetail::KeyHash<NUM_ATTRIBS> > IndexTable;
+
+        newFaces.resize(faces.size());
+
+        IndexTable indexTable;
+        indexTable.reserve(faces.size() * 3 / 2);
+
+        // the first OBJ vertex of each new index
+        std::vector<const OBJVertex*> firstUse;
+        firstUse.reserve(faces.size() * 3 / 2);
+
+        // for each face...
+        for (size_t i = 0; i < faces.size(); i++) {
+            // for each vertex in the face...
+            for (int j = 0; j < 3; j++) {
+                const OBJVertex& vert = faces[i].verts[j];
+                Key key = {{ Attribs::ObjIndex(vert)... }};
+
+                std::pair<typename IndexTable::iterator, bool> insertionResult =
+                    indexTable.insert(std::make_pair(key, (unsigned)firstUse.size()));
+
+                if (insertionResult.second) {
+                    // vertex was not seen yet, new index inserted
+                    firstUse.push_back(&vert);
+                }
+                newFaces[i].index[j] = insertionResult.first->second;
+            }
+        }
+
+        VertexFormatDetail::Expand{ (Gather<Attribs>(streams, firstUse), 0)... };
+    }
+
+    // write numVertices interleaved vertices to 'out'
+    static void Interleave(const VertexStreams& streams, size_t numVertices, GLfloat* out)
+    {
+        for (size_t i = 0; i < numVertices; i++) {
+            GLfloat* v = out + i * FLOATS;
+            VertexFormatDetail::Expand{ (Attribs::Write(v + Offset<Attribs>::FLOATS, Attribs::Stream(streams)[i]), 0)... };
+        }
+    }
+
+    // describe the attributes in the bound GL_ARRAY_BUFFER to the bound vertex array: the
+    // vertices are 'stride' bytes apart and 'shift' bytes of each are not in this buffer
+    // (the positions are left out if they have a buffer of their own)
+    static void SetAttribPointers(GLsizei stride, size_t shift, bool skipPosition)
+    {
+        VertexFormatDetail::Expand{ (SetAttribPointer<Attribs>(stride, shift, skipPosition), 0)... };
+    }
+
+private:
+    template <typename Attrib>
+    static void Gather(const VertexStreams& streams, const std::vector<const OBJVertex*>& firstUse)
+    {
+        if (!Attrib::FROM_OBJ) {
+            return;     // computed later
+        }
+
+        std::vector<typename Attrib::Type>& stream = Attrib::Stream(streams);
+        std::vector<typename Attrib::Type> newStream;
+        newStream.reserve(firstUse.size());
+        for (size_t i = 0; i < firstUse.size(); i++) {
+            newStream.push_back(stream[Attrib::ObjIndex(*firstUse[i]) - 1]);
+        }
+
+        // replace the old with the new
+        stream.swap(newStream);
+    }
+
+    template <typename Attrib>
+    static void SetAttribPointer(GLsizei stride, size_t shift, bool skipPosition)
+    {
+        if (skipPosition && std::is_same<Attrib, VertexPosition>::value) {
+            return;
+        }
+        glVertexAttribPointer(Attrib::LOCATION, Attrib::SIZE, GL_FLOAT, GL_FALSE, stride,
+            (const GLvoid*)(Offset<Attrib>::BYTES - shift));
+        glEnableVertexAttribArray(Attrib::LOCATION);
+    }
+};
+
+// the formats OBJMesh uses (tangents need normals and texcoords)
+typedef VertexFormat<VertexPosition>                                                    VertexFormatP;
+typedef VertexFormat<VertexPosition, VertexNormal>                                      VertexFormatPN;
+typedef VertexFormat<VertexPosition, VertexTexCoord>                                    VertexFormatPT;
+typedef VertexFormat<VertexPosition, VertexNormal, VertexTexCoord>                      VertexFormatPNT;
+typedef VertexFormat<VertexPosition, VertexNormal, VertexTexCoord, VertexTangent>       VertexFormatPNTT;
+
+//
+// One instantiation behind plain function pointers, so the layout is only looked at once per mesh
+//
+struct VertexFormatOps {
+    int                     floats;         // per vertex
+
+    int                     (*describe)(OBJMesh& mesh);
+    void                    (*reindex)(const std::vector<OBJTriangle>& faces, std::vector<IndexTriangle>& newFaces, const VertexStreams& streams);
+    void                    (*interleave)(const VertexStreams& streams, size_t numVertices, GLfloat* out);
+    void                    (*setAttribPointers)(GLsizei stride, size_t shift, bool skipPosition);
+};
+
+template <typename Format>
+const VertexFormatOps* GetVertexFormatOps()
+{
+    static const VertexFormatOps ops = {
+        Format::FLOATS,
+        &Format::Describe, &Format::Reindex, &Format::Interleave, &Format::SetAttribPointers
+    };
+    return &ops;
+}
+
+// the format with the given attributes, NULL if there is none (tangents need normals and texcoords)
+inline const VertexFormatOps* FindVertexFormat(bool haveNormals, bool haveTexCoords, bool haveTangents)
+{
+    if (haveTangents) {
+        if (!haveNormals || !haveTexCoords) {
+            return NULL;
+        }
+        return GetVertexFormatOps<VertexFormatPNTT>();
+    }
+    if (haveNormals && haveTexCoords) {
+        return GetVertexFormatOps<VertexFormatPNT>();
+    }
+    if (haveNormals) {
+        return GetVertexFormatOps<VertexFormatPN>();
+    }
+    if (haveTexCoords) {
+        return GetVertexFormatOps<VertexFormatPT>();
+    }
+    return GetVertexFormatOps<VertexFormatP>();
+}
+
+#endif
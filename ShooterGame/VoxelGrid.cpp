@@ -0,0 +1,519 @@
+#include "VoxelGrid.h"
+#include "JobSystem.h"
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include <xmmintrin.h>
+
+const unsigned short VoxelGrid::NO_CEILING = 0xffff;
+
+namespace {
+
+typedef std::chrono::high_resolution_clock Clock;
+
+// the most voxels a column can have, so heights fit in 16 bits with NO_CEILING to spare
+const int MAX_HEIGHT = 0xfff0;
+
+int Clamp(int v, int lo, int hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+int FloorToInt(float v)
+{
+    return (int)std::floor(v);
+}
+
+//
+// A triangle set up for the separating axis test against unit voxels: its normal and the nine
+// cross products of its edges with the box axes, each with the interval the voxel center's
+// projection must fall in for the two to overlap.  The box's own axes are covered by only
+// visiting the voxels in the triangle's bounds.
+//
+struct VoxelTriangle {
+    enum { NUM_AXES = 10 };
+
+    float                   ax[NUM_AXES];
+    float                   ay[NUM_AXES];
+    float                   az[NUM_AXES];
+    float                   lo[NUM_AXES];
+    float                   hi[NUM_AXES];
+
+    glm::vec3               min;
+    glm::vec3               max;
+
+    void                    setup(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
+};
+
+void VoxelTriangle::setup(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2)
+{
+    const glm::vec3 e[3] = { v1 - v0, v2 - v1, v0 - v2 };
+
+    glm::vec3 axes[NUM_AXES];
+    axes[0] = glm::cross(e[0], e[1]);
+    for (int i = 0; i < 3; i++) {
+        axes[1 + 3 * i] = glm::vec3(0.0f, e[i].z, -e[i].y);     // e x X
+        axes[2 + 3 * i] = glm::vec3(-e[i].z, 0.0f, e[i].x);     // e x Y
+        axes[3 + 3 * i] = glm::vec3(e[i].y, -e[i].x, 0.0f);     // e x Z
+    }
+
+    for (int a = 0; a < NUM_AXES; a++) {
+        const glm::vec3& n = axes[a];
+        float p0 = glm::dot(n, v0);
+        float p1 = glm::dot(n, v1);
+        float p2 = glm::dot(n, v2);
+        float tmin = p0 < p1 ? (p0 < p2 ? p0 : p2) : (p1 < p2 ? p1 : p2);
+        float tmax = p0 > p1 ? (p0 > p2 ? p0 : p2) : (p1 > p2 ? p1 : p2);
+
+        // the box's half-extent along the axis, a little larger so touching counts
+        float r = 0.5f * (std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z)) * 1.0001f;
+
+        ax[a] = n.x;
+        ay[a] = n.y;
+        az[a] = n.z;
+        lo[a] = tmin - r;
+        hi[a] = tmax + r;
+    }
+
+    min = glm::vec3(v0.x < v1.x ? (v0.x < v2.x ? v0.x : v2.x) : (v1.x < v2.x ? v1.x : v2.x),
+                    v0.y < v1.y ? (v0.y < v2.y ? v0.y : v2.y) : (v1.y < v2.y ? v1.y : v2.y),
+                    v0.z < v1.z ? (v0.z < v2.z ? v0.z : v2.z) : (v1.z < v2.z ? v1.z : v2.z));
+    max = glm::vec3(v0.x > v1.x ? (v0.x > v2.x ? v0.x : v2.x) : (v1.x > v2.x ? v1.x : v2.x),
+                    v0.y > v1.y ? (v0.y > v2.y ? v0.y : v2.y) : (v1.y > v2.y ? v1.y : v2.y),
+                    v0.z > v1.z ? (v0.z > v2.z ? v0.z : v2.z) : (v1.z > v2.z ? v1.z : v2.z));
+}
+
+}
+
+VoxelSettings::VoxelSettings()
+    : cellSize(0.3f)
+    , cellHeight(0.2f)
+    , agentHeight(2.0f)
+    , agentClimb(0.9f)
+    , maxSlope(45.0f)
+    , tileSize(64)
+{
+}
+
+VoxelSettings VoxelSettings::ForLevel(const glm::vec3& extent)
+{
+    float size = glm::length(extent);
+
+    VoxelSettings settings;
+    settings.cellSize = 0.005f * size;
+    settings.cellHeight = 0.5f * settings.cellSize;
+    settings.agentHeight = 0.02f * size;
+    settings.agentClimb = 0.25f * settings.agentHeight;
+    return settings;
+}
+
+VoxelGrid::VoxelGrid()
+{
+    clear();
+}
+
+void VoxelGrid::clear()
+{
+    mLevel = NULL;
+    mOrigin = glm::vec3(0.0f);
+    mDims[0] = mDims[1] = mDims[2] = 0;
+    mTiles[0] = mTiles[1] = 0;
+    mTileData.clear();
+    mTileTriStart.clear();
+    mTileTris.clear();
+    mHeightCells = 1;
+    mClimbCells = 0;
+    mBuildMs = 0;
+    mMaxTileMs = 0;
+}
+
+bool VoxelGrid::build(const CollisionMesh& level, const VoxelSettings& settings, JobSystem* jobs)
+{
+    Clock::time_point t0 = Clock::now();
+
+    clear();
+
+    if (level.getNumTriangles() == 0 || !(settings.cellSize > 0) || !(settings.cellHeight > 0) || settings.tileSize < 1) {
+        std::cerr << "ERROR: Nothing to voxelize, or bad voxel settings" << std::endl;
+        return false;
+    }
+
+    mLevel = &level;
+    mSettings = settings;
+
+    glm::vec3 extent = level.getMax() - level.getMin();
+    if (extent.y / mSettings.cellHeight > MAX_HEIGHT) {
+        mSettings.cellHeight = extent.y / MAX_HEIGHT;
+        std::cout << "Warning: The level is too tall for the voxel height, using " << mSettings.cellHeight << std::endl;
+    }
+
+    mOrigin = level.getMin();
+    mDims[0] = (int)std::ceil(extent.x / mSettings.cellSize);
+    mDims[1] = (int)std::ceil(extent.y / mSettings.cellHeight) + 1;
+    mDims[2] = (int)std::ceil(extent.z / mSettings.cellSize);
+    mDims[0] = mDims[0] < 1 ? 1 : mDims[0];
+    mDims[2] = mDims[2] < 1 ? 1 : mDims[2];
+
+    mHeightCells = (int)std::ceil(mSettings.agentHeight / mSettings.cellHeight);
+    mClimbCells = (int)std::floor(mSettings.agentClimb / mSettings.cellHeight);
+
+    const int T = mSettings.tileSize;
+    mTiles[0] = (mDims[0] + T - 1) / T;
+    mTiles[1] = (mDims[2] + T - 1) / T;
+    const size_t numTiles = (size_t)mTiles[0] * mTiles[1];
+    mTileData.resize(numTiles);
+
+    // bin the triangles by the tiles their bounds overlap: count, then fill (kept for rebuildTile)
+    const std::vector<glm::vec3>& vertices = level.getVertices();
+    const std::vector<unsigned>& indices = level.getIndices();
+    const unsigned numTris = level.getNumTriangles();
+
+    std::vector<int> triTiles(4 * numTris);
+    std::vector<unsigned>& tileStart = mTileTriStart;
+    tileStart.assign(numTiles + 1, 0);
+    for (unsigned t = 0; t < numTris; t++) {
+        const glm::vec3& a = vertices[indices[3 * t + 0]];
+        const glm::vec3& b = vertices[indices[3 * t + 1]];
+        const glm::vec3& c = vertices[indices[3 * t + 2]];
+        float minX = a.x < b.x ? (a.x < c.x ? a.x : c.x) : (b.x < c.x ? b.x : c.x);
+        float maxX = a.x > b.x ? (a.x > c.x ? a.x : c.x) : (b.x > c.x ? b.x : c.x);
+        float minZ = a.z < b.z ? (a.z < c.z ? a.z : c.z) : (b.z < c.z ? b.z : c.z);
+        float maxZ = a.z > b.z ? (a.z > c.z ? a.z : c.z) : (b.z > c.z ? b.z : c.z);
+
+        int* range = &triTiles[4 * t];
+        range[0] = Clamp(FloorToInt((minX - mOrigin.x) / mSettings.cellSize) / T, 0, mTiles[0] - 1);
+        range[1] = Clamp(FloorToInt((minZ - mOrigin.z) / mSettings.cellSize) / T, 0, mTiles[1] - 1);
+        range[2] = Clamp(FloorToInt((maxX - mOrigin.x) / mSettings.cellSize) / T, 0, mTiles[0] - 1);
+        range[3] = Clamp(FloorToInt((maxZ - mOrigin.z) / mSettings.cellSize) / T, 0, mTiles[1] - 1);
+        for (int tz = range[1]; tz <= range[3]; tz++) {
+            for (int tx = range[0]; tx <= range[2]; tx++) {
+                ++tileStart[tz * mTiles[0] + tx + 1];
+            }
+        }
+    }
+    for (size_t i = 0; i < numTiles; i++) {
+        tileStart[i + 1] += tileStart[i];
+    }
+    std::vector<unsigned>& tileTris = mTileTris;
+    tileTris.resize(tileStart[numTiles]);
+    std::vector<unsigned> fill(tileStart.begin(), tileStart.end() - 1);
+    for (unsigned t = 0; t < numTris; t++) {
+        const int* range = &triTiles[4 * t];
+        for (int tz = range[1]; tz <= range[3]; tz++) {
+            for (int tx = range[0]; tx <= range[2]; tx++) {
+                tileTris[fill[tz * mTiles[0] + tx]++] = t;
+            }
+        }
+    }
+
+    // rasterize the tiles, each thread with its own scratch block
+    std::vector<double> tileMs(numTiles, 0.0);
+    auto buildRange = [&](size_t begin, size_t end) {
+        std::vector<unsigned char> scratch;
+        for (size_t i = begin; i < end; i++) {
+            Clock::time_point tileStartTime = Clock::now();
+            const unsigned* tris = tileStart[i + 1] > tileStart[i] ? &tileTris[tileStart[i]] : NULL;
+            buildTile((int)(i % mTiles[0]), (int)(i / mTiles[0]), tris, tileStart[i + 1] - tileStart[i], scratch, mTileData[i]);
+            tileMs[i] = std::chrono::duration<double, std::milli>(Clock::now() - tileStartTime).count();
+        }
+    };
+    if (jobs) {
+        jobs->parallelFor(numTiles, 1, buildRange);
+    }
+    else {
+        buildRange(0, numTiles);
+    }
+
+    for (size_t i = 0; i < numTiles; i++) {
+        mMaxTileMs = tileMs[i] > mMaxTileMs ? tileMs[i] : mMaxTileMs;
+    }
+    mBuildMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+
+    return true;
+}
+
+void VoxelGrid::buildTile(int tx, int tz, const unsigned* tris, size_t numTris,
+                          std::vector<unsigned char>& scratch, Tile& tile) const
+{
+    enum { SOLID = 1, WALKABLE = 2 };
+
+    const int T = mSettings.tileSize;
+    const int x0 = tx * T;
+    const int z0 = tz * T;
+    const int x1 = (x0 + T < mDims[0] ? x0 + T : mDims[0]) - 1;     // inclusive
+    const int z1 = (z0 + T < mDims[2] ? z0 + T : mDims[2]) - 1;
+
+    const std::vector<glm::vec3>& vertices = mLevel->getVertices();
+    const std::vector<unsigned>& indices = mLevel->getIndices();
+
+    const glm::vec3 toGrid(1.0f / mSettings.cellSize, 1.0f / mSettings.cellHeight, 1.0f / mSettings.cellSize);
+    const float cosSlope = std::cos(mSettings.maxSlope * 3.1415927f / 180.0f);
+
+    // set up the triangles in grid units, where voxel (x, y, z) is the unit cube at (x, y, z)
+    std::vector<VoxelTriangle> setup(numTris);
+    std::vector<unsigned char> flags(numTris);
+    int ylo = mDims[1];
+    int yhi = -1;
+    for (size_t i = 0; i < numTris; i++) {
+        unsigned t = tris[i];
+        const glm::vec3& a = vertices[indices[3 * t + 0]];
+        const glm::vec3& b = vertices[indices[3 * t + 1]];
+        const glm::vec3& c = vertices[indices[3 * t + 2]];
+        setup[i].setup((a - mOrigin) * toGrid, (b - mOrigin) * toGrid, (c - mOrigin) * toGrid);
+
+        // either side up, since OBJ windings can't be trusted to face out
+        glm::vec3 n = glm::cross(b - a, c - a);
+        float len = glm::length(n);
+        flags[i] = SOLID | (len > 0 && std::fabs(n.y) >= cosSlope * len ? WALKABLE : 0);
+
+        int y0 = FloorToInt(setup[i].min.y);
+        int y1 = FloorToInt(setup[i].max.y);
+        ylo = y0 < ylo ? y0 : ylo;
+        yhi = y1 > yhi ? y1 : yhi;
+    }
+    ylo = Clamp(ylo, 0, mDims[1] - 1);
+    yhi = Clamp(yhi, 0, mDims[1] - 1);
+
+    // a dense block only as tall as the triangles reach, a column at a time
+    const int h = yhi >= ylo ? yhi - ylo + 1 : 0;
+    scratch.assign((size_t)T * T * h, 0);
+
+    for (size_t i = 0; i < numTris && h > 0; i++) {
+        const VoxelTriangle& tri = setup[i];
+        const unsigned char flag = flags[i];
+
+        int bx0 = Clamp(FloorToInt(tri.min.x), x0, x1);
+        int bx1 = Clamp(FloorToInt(tri.max.x), x0, x1);
+        int bz0 = Clamp(FloorToInt(tri.min.z), z0, z1);
+        int bz1 = Clamp(FloorToInt(tri.max.z), z0, z1);
+        int by0 = Clamp(FloorToInt(tri.min.y), ylo, yhi);
+        int by1 = Clamp(FloorToInt(tri.max.y), ylo, yhi);
+
+        __m128 ay[VoxelTriangle::NUM_AXES];
+        __m128 lo[VoxelTriangle::NUM_AXES];
+        __m128 hi[VoxelTriangle::NUM_AXES];
+        for (int a = 0; a < VoxelTriangle::NUM_AXES; a++) {
+            ay[a] = _mm_set1_ps(tri.ay[a]);
+            lo[a] = _mm_set1_ps(tri.lo[a]);
+            hi[a] = _mm_set1_ps(tri.hi[a]);
+        }
+
+        for (int z = bz0; z <= bz1; z++) {
+            for (int x = bx0; x <= bx1; x++) {
+                // the part of each projection that doesn't change along the column
+                __m128 base[VoxelTriangle::NUM_AXES];
+                for (int a = 0; a < VoxelTriangle::NUM_AXES; a++) {
+                    base[a] = _mm_set1_ps(tri.ax[a] * (x + 0.5f) + tri.az[a] * (z + 0.5f));
+                }
+
+                unsigned char* column = &scratch[((size_t)(z - z0) * T + (x - x0)) * h];
+
+                // four voxels up the column per test
+                for (int y = by0; y <= by1; y += 4) {
+                    __m128 cy = _mm_set_ps(y + 3.5f, y + 2.5f, y + 1.5f, y + 0.5f);
+                    __m128 inside = _mm_cmpge_ps(_mm_add_ps(base[0], _mm_mul_ps(ay[0], cy)), lo[0]);
+                    for (int a = 0; a < VoxelTriangle::NUM_AXES; a++) {
+                        __m128 d = _mm_add_ps(base[a], _mm_mul_ps(ay[a], cy));
+                        inside = _mm_and_ps(inside, _mm_and_ps(_mm_cmpge_ps(d, lo[a]), _mm_cmple_ps(d, hi[a])));
+                    }
+
+                    int hits = _mm_movemask_ps(inside);
+                    for (int k = 0; k < 4 && y + k <= by1; k++) {
+                        if (hits & (1 << k)) {
+                            column[y + k - ylo] |= flag;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // runs of solid voxels per column
+    Tile result;
+    result.spanStart.resize((size_t)T * T + 1);
+    for (int c = 0; c < T * T; c++) {
+        result.spanStart[c] = (unsigned)result.spans.size();
+
+        int lx = c % T;
+        int lz = c / T;
+        if (h == 0 || x0 + lx > x1 || z0 + lz > z1) {
+            continue;
+        }
+
+        const unsigned char* column = &scratch[(size_t)c * h];
+        int y = 0;
+        while (y < h) {
+            if (!column[y]) {
+                ++y;
+                continue;
+            }
+            int start = y;
+            while (y < h && column[y]) {
+                ++y;
+            }
+            VoxelSpan span;
+            span.ymin = (unsigned short)(start + ylo);
+            span.ymax = (unsigned short)(y + ylo);
+            span.walkable = (column[y - 1] & WALKABLE) != 0;
+            result.spans.push_back(span);
+        }
+    }
+    result.spanStart[(size_t)T * T] = (unsigned)result.spans.size();
+
+    // floors with room to stand above them
+    result.walkableStart.resize((size_t)T * T + 1);
+    for (int c = 0; c < T * T; c++) {
+        result.walkableStart[c] = (unsigned)result.walkable.size();
+        unsigned begin = result.spanStart[c];
+        unsigned end = result.spanStart[c + 1];
+        for (unsigned s = begin; s < end; s++) {
+            if (!result.spans[s].walkable) {
+                continue;
+            }
+            WalkableSpan floor;
+            floor.floor = result.spans[s].ymax;
+            floor.clearance = s + 1 < end ? (unsigned short)(result.spans[s + 1].ymin - floor.floor) : NO_CEILING;
+            if (floor.clearance >= mHeightCells) {
+                result.walkable.push_back(floor);
+            }
+        }
+    }
+    result.walkableStart[(size_t)T * T] = (unsigned)result.walkable.size();
+
+    tile.spanStart.swap(result.spanStart);
+    tile.spans.swap(result.spans);
+    tile.walkableStart.swap(result.walkableStart);
+    tile.walkable.swap(result.walkable);
+}
+
+void VoxelGrid::rebuildTile(int tx, int tz)
+{
+    if (!mLevel || tx < 0 || tz < 0 || tx >= mTiles[0] || tz >= mTiles[1]) {
+        return;
+    }
+
+    const size_t i = (size_t)tz * mTiles[0] + tx;
+    const unsigned* tris = mTileTriStart[i + 1] > mTileTriStart[i] ? &mTileTris[mTileTriStart[i]] : NULL;
+    std::vector<unsigned char> scratch;
+    buildTile(tx, tz, tris, mTileTriStart[i + 1] - mTileTriStart[i], scratch, mTileData[i]);
+}
+
+unsigned VoxelGrid::rebuildRegion(const glm::vec3& lo, const glm::vec3& hi, JobSystem* jobs)
+{
+    if (!mLevel) {
+        return 0;
+    }
+
+    const int T = mSettings.tileSize;
+    int tx0 = Clamp(FloorToInt((lo.x - mOrigin.x) / mSettings.cellSize) / T, 0, mTiles[0] - 1);
+    int tz0 = Clamp(FloorToInt((lo.z - mOrigin.z) / mSettings.cellSize) / T, 0, mTiles[1] - 1);
+    int tx1 = Clamp(FloorToInt((hi.x - mOrigin.x) / mSettings.cellSize) / T, 0, mTiles[0] - 1);
+    int tz1 = Clamp(FloorToInt((hi.z - mOrigin.z) / mSettings.cellSize) / T, 0, mTiles[1] - 1);
+
+    const int w = tx1 - tx0 + 1;
+    const size_t numTiles = (size_t)w * (tz1 - tz0 + 1);
+
+    // tiles are independent, so they can be rebuilt side by side
+    auto rebuildRange = [this, tx0, tz0, w](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            rebuildTile(tx0 + (int)(i % w), tz0 + (int)(i / w));
+        }
+    };
+    if (jobs) {
+        jobs->parallelFor(numTiles, 1, rebuildRange);
+    }
+    else {
+        rebuildRange(0, numTiles);
+    }
+
+    return (unsigned)numTiles;
+}
+
+const VoxelSpan* VoxelGrid::getSpans(int x, int z, unsigned& count) const
+{
+    count = 0;
+    if (x < 0 || z < 0 || x >= mDims[0] || z >= mDims[2]) {
+        return NULL;
+    }
+
+    const int T = mSettings.tileSize;
+    const Tile& tile = mTileData[(z / T) * mTiles[0] + x / T];
+    int c = (z % T) * T + x % T;
+    count = tile.spanStart[c + 1] - tile.spanStart[c];
+    return count ? &tile.spans[tile.spanStart[c]] : NULL;
+}
+
+const WalkableSpan* VoxelGrid::getWalkable(int x, int z, unsigned& count) const
+{
+    count = 0;
+    if (x < 0 || z < 0 || x >= mDims[0] || z >= mDims[2]) {
+        return NULL;
+    }
+
+    const int T = mSettings.tileSize;
+    const Tile& tile = mTileData[(z / T) * mTiles[0] + x / T];
+    int c = (z % T) * T + x % T;
+    count = tile.walkableStart[c + 1] - tile.walkableStart[c];
+    return count ? &tile.walkable[tile.walkableStart[c]] : NULL;
+}
+
+bool VoxelGrid::isSolid(int x, int y, int z) const
+{
+    unsigned count;
+    const VoxelSpan* spans = getSpans(x, z, count);
+    for (unsigned i = 0; i < count; i++) {
+        if (y >= spans[i].ymin && y < spans[i].ymax) {
+            return true;
+        }
+    }
+    return false;
+}
+
+glm::vec3 VoxelGrid::getCellCenter(int x, int y, int z) const
+{
+    return mOrigin + glm::vec3((x + 0.5f) * mSettings.cellSize, y * mSettings.cellHeight, (z + 0.5f) * mSettings.cellSize);
+}
+
+bool VoxelGrid::getColumn(const glm::vec3& p, int& x, int& z) const
+{
+    x = FloorToInt((p.x - mOrigin.x) / mSettings.cellSize);
+    z = FloorToInt((p.z - mOrigin.z) / mSettings.cellSize);
+    return x >= 0 && z >= 0 && x < mDims[0] && z < mDims[2];
+}
+
+int VoxelGrid::getCellY(float y) const
+{
+    return FloorToInt((y - mOrigin.y) / mSettings.cellHeight);
+}
+
+unsigned long long VoxelGrid::getNumSpans() const
+{
+    unsigned long long n = 0;
+    for (size_t i = 0; i < mTileData.size(); i++) {
+        n += mTileData[i].spans.size();
+    }
+    return n;
+}
+
+unsigned long long VoxelGrid::getNumWalkable() const
+{
+    unsigned long long n = 0;
+    for (size_t i = 0; i < mTileData.size(); i++) {
+        n += mTileData[i].walkable.size();
+    }
+    return n;
+}
+
+unsigned long long VoxelGrid::getBytes() const
+{
+    unsigned long long bytes = mTileData.capacity() * sizeof(Tile) +
+                               (mTileTriStart.capacity() + mTileTris.capacity()) * sizeof(unsigned);
+    for (size_t i = 0; i < mTileData.size(); i++) {
+        const Tile& tile = mTileData[i];
+        bytes += (tile.spanStart.capacity() + tile.walkableStart.capacity()) * sizeof(unsigned) +
+                 tile.spans.capacity() * sizeof(VoxelSpan) + tile.walkable.capacity() * sizeof(WalkableSpan);
+    }
+    return bytes;
+}
@@ -0,0 +1,133 @@
+#ifndef VOXELGRID_H_
+#define VOXELGRID_H_
+
+#include "CollisionMesh.h"
+
+#include <vector>
+
+class JobSystem;
+
+struct VoxelSettings {
+    float                   cellSize;       // voxel width and depth (x and z)
+    float                   cellHeight;     // voxel height (y)
+    float                   agentHeight;    // headroom a walkable floor needs
+    float                   agentClimb;     // step between floors an agent can take
+    float                   maxSlope;       // steepest walkable surface, degrees
+    int                     tileSize;       // columns per tile side
+
+    VoxelSettings();
+
+    // sizes relative to a level's extent, the way the server scales its bots
+    static VoxelSettings    ForLevel(const glm::vec3& extent);
+};
+
+// a run of solid voxels in a column, [ymin, ymax)
+struct VoxelSpan {
+    unsigned short          ymin;
+    unsigned short          ymax;
+    bool                    walkable;       // the top voxel is touched by a floor that isn't too steep
+};
+
+// a floor an agent can stand on: the empty cell above a walkable span, and the headroom above it
+struct WalkableSpan {
+    unsigned short          floor;
+    unsigned short          clearance;      // in cells, NO_CEILING if nothing is above
+};
+
+//
+// Voxels of a level, for navigation and coarse collision.
+//
+// The triangles of a collision mesh are rasterized conservatively: every voxel a triangle
+// touches is solid, found with the separating axis test (Akenine-Moller), four voxels of a
+// column at a time with SSE.  The grid is cut into tiles of tileSize x tileSize columns that
+// are rasterized in parallel, each into a dense scratch block only as tall as its triangles
+// reach, and then compressed into runs of solid voxels per column.  Empty columns take no
+// space beyond their offset.
+//
+// From the runs come the walkable spans: the tops of solid runs that are flat enough and
+// have an agent's height of free space above them.
+//
+// A tile can be rebuilt on its own when the geometry in it changes: it re-reads the triangles
+// binned to it by build() and replaces only that tile.  Triangles that move into other tiles,
+// or new ones, need a full build.
+//
+class VoxelGrid {
+
+    struct Tile {
+        std::vector<unsigned>   spanStart;      // spans of column c are spans[spanStart[c] .. spanStart[c + 1])
+        std::vector<VoxelSpan>  spans;
+        std::vector<unsigned>   walkableStart;
+        std::vector<WalkableSpan> walkable;
+    };
+
+    const CollisionMesh*    mLevel;
+    VoxelSettings           mSettings;
+
+    glm::vec3               mOrigin;        // min corner of voxel (0, 0, 0)
+    int                     mDims[3];       // voxels in x, y and z
+    int                     mTiles[2];      // tiles in x and z
+    std::vector<Tile>       mTileData;      // x-major within z
+
+    // triangles whose bounds overlapped each tile at build(), for rebuilds: tile i's are
+    // mTileTris[mTileTriStart[i] .. mTileTriStart[i + 1])
+    std::vector<unsigned>   mTileTriStart;
+    std::vector<unsigned>   mTileTris;
+
+    // agent size in cells
+    int                     mHeightCells;
+    int                     mClimbCells;
+
+    // stats
+    double                  mBuildMs;
+    double                  mMaxTileMs;
+
+    // rasterize the triangles into one tile; scratch is reused between tiles on a thread
+    void                    buildTile(int tx, int tz, const unsigned* tris, size_t numTris,
+                                      std::vector<unsigned char>& scratch, Tile& tile) const;
+
+    VoxelGrid(const VoxelGrid&);                    // not copyable
+    VoxelGrid& operator=(const VoxelGrid&);
+
+public:
+    static const unsigned short NO_CEILING;
+
+    VoxelGrid();
+
+    // voxelize a level (which must outlive the grid, for rebuilds), in parallel if jobs is given
+    bool                    build(const CollisionMesh& level, const VoxelSettings& settings, JobSystem* jobs = NULL);
+
+    // after the level's triangles in a tile changed in place (not while the grid is being read)
+    void                    rebuildTile(int tx, int tz);
+
+    // the tiles that overlap a box in world space, returns how many
+    unsigned                rebuildRegion(const glm::vec3& lo, const glm::vec3& hi, JobSystem* jobs = NULL);
+
+    void                    clear();
+
+    const VoxelSettings&    getSettings() const         { return mSettings; }
+    const glm::vec3&        getOrigin() const           { return mOrigin; }
+    int                     getDim(int axis) const      { return mDims[axis]; }
+    int                     getNumTilesX() const        { return mTiles[0]; }
+    int                     getNumTilesZ() const        { return mTiles[1]; }
+    int                     getHeightCells() const      { return mHeightCells; }
+    int                     getClimbCells() const       { return mClimbCells; }
+
+    // spans of column (x, z), NULL if it has none
+    const VoxelSpan*        getSpans(int x, int z, unsigned& count) const;
+    const WalkableSpan*     getWalkable(int x, int z, unsigned& count) const;
+
+    bool                    isSolid(int x, int y, int z) const;
+
+    // world position of the middle of a cell's floor, and the column a point is in
+    glm::vec3               getCellCenter(int x, int y, int z) const;
+    bool                    getColumn(const glm::vec3& p, int& x, int& z) const;
+    int                     getCellY(float y) const;
+
+    unsigned long long      getNumSpans() const;
+    unsigned long long      getNumWalkable() const;
+    unsigned long long      getBytes() const;
+    double                  getBuildMs() const          { return mBuildMs; }
+    double                  getMaxTileMs() const        { return mMaxTileMs; }
+};
+
+#endif
@@ -6,114 +6,29 @@
 #include <iostream>
 #include <fstream>
 #include <limits>
-
-// OBJ vertex format flags
-enum {
-    OBJ_VFF_POSITION = 1,
-    OBJ_VFF_NORMAL = 2,
-    OBJ_VFF_TEXCOORD = 4
-};
-
-struct OBJVertex {
-    int v, vn, vt;
-    OBJVertex();
-    OBJVertex(const std::string& str);
-    int getFormat() const;
-};
-
-struct OBJTriangle {
-    OBJVertex verts[3];
-    OBJTriangle();
-    OBJTriangle(const OBJVertex& a, const OBJVertex& b, const OBJVertex& c);
-};
-
-struct IndexTriangle {
-    unsigned index[3];
-    IndexTriangle();
-};
-
-typedef glm::vec3 Vec3;
-typedef glm::vec4 Vec4;
-typedef glm::vec2 TexCoord;
-
-class OBJMesh {
-
-public:
-    // vertex and index buffer ids
-    GLuint mVAO;
-    GLuint mVBO;
-    GLuint mIBO;
-
-    // number of components in each vertex attribute
-    // (needed by glEnableVertexArray and glVertexAttribPointer)
-    GLint mPositionSize;
-    GLint mNormalSize;
-    GLint mTangentSize;
-    GLint mTexCoordSize;
-
-    // vertex attribute offsets in buffer
-    // (needed by glVertexAttribPointer)
-    GLvoid* mPositionOffset;
-    GLvoid* mNormalOffset;
-    GLvoid* mTangentlOffset;
-    GLvoid* mTexCoordOffset;
-
-    // vertex size in bytes
-    // (needed by glVertexAttribPointer)
-    GLsizei mStride;
-
-    // number of vertices
-    GLsizei mNumVertices;
-
-    // number of indices
-    // (needed by glDrawElements)
-    GLsizei mNumIndices;
-
-    // zerofy all variables
-    void clear();
-
-    // Reindex positions
-    static void Reindex(std::vector<Vec3>& positions,
-        const std::vector<OBJTriangle>& faces,
-        std::vector<IndexTriangle>& newFaces);
-
-    // Reindex positions and normals
-    static void Reindex(std::vector<Vec3>& positions,
-        std::vector<Vec3>& normals,
-        const std::vector<OBJTriangle>& faces,
-        std::vector<IndexTriangle>& newFaces);
-
-    // Reindex positions and texcoords
-    static void Reindex(std::vector<Vec3>& positions,
-        std::vector<TexCoord>& texcoords,
-        const std::vector<OBJTriangle>& faces,
-        std::vector<IndexTriangle>& newFaces);
-
-    // Reindex positions, normals, and texcoords
-    static void Reindex(std::vector<Vec3>& positions,
-        std::vector<Vec3>& normals,
-        std::vector<TexCoord>& texcoords,
-        const std::vector<OBJTriangle>& faces,
-        std::vector<IndexTriangle>& newFaces);
-
-    // compute tangents for normal mapping
-    static void ComputeTangents(const std::vector<Vec3>& positions,
-        const std::vector<Vec3>& normals,
-        const std::vector<TexCoord>& texcoords,
-        const std::vector<IndexTriangle>& triangles,
-        std::vector<Vec4>& tangents);
-
-public:
-
-    OBJMesh();
-    OBJMesh(const std::string& path, bool shouldComputeTangents = false);
-    ~OBJMesh();
-
-    bool isLoaded() const;
-
-    bool load(const std::string& path, bool shouldComputeTangents = false);
-};
-
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include "CompressedFile.h"
+#include "MappedFile.h"
+#include "MeshCodec.h"
+#include "Parallel.h"
+#include "ShaderCache.h"
+#include "VertexFormat.h"
+#include "GLDebug.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OBJ_USE_SSE 1
+#endif
 
 inline OBJVertex::OBJVertex()
     : v(-1), vn(-1), vt(-1)
@@ -221,28 +136,236 @@ std::vector<OBJTriangle> Tesselate(const std::vector<OBJVertex>& v)
 
 
 
+inline OBJMeshChunk::OBJMeshChunk()
+    : vao(0), vbo(0), ibo(0), positionVBO(0), depthVAO(0), numVertices(0), numIndices(0)
+{
+}
+
+OBJMaterial::OBJMaterial()
+    : diffuse(0.8f, 0.8f, 0.8f), defined(false)
+{
+}
+
+OBJSubmesh::OBJSubmesh()
+    : material(0), firstIndex(0), numIndices(0)
+{
+}
+
+
+OBJWeldSettings::OBJWeldSettings()
+    : enabled(false), position(1e-5f), normalAngle(0.5f), texCoord(1e-5f)
+{
+}
+
+
 OBJMesh::OBJMesh()
-    : mVAO(0)
-    , mVBO(0)
-    , mIBO(0)
 {
-    memset(this, 0, sizeof(*this));
+    clear();
 }
 
-OBJMesh::OBJMesh(const std::string& path, bool shouldComputeTangents)
-    : mVAO(0)
-    , mVBO(0)
-    , mIBO(0)
+const float OBJMesh::DEFAULT_CREASE_ANGLE = 60.0f;
+const unsigned long long OBJMesh::OUT_OF_CORE_THRESHOLD = 1ULL << 30;     // 1 GB
+bool OBJMesh::UseCache = true;
+OBJBufferLayout OBJMesh::DefaultBufferLayout = OBJ_BUFFERS_SPLIT;
+OBJWeldSettings OBJMesh::DefaultWeld;
+
+OBJMesh::OBJMesh(const std::string& path, bool shouldComputeTangents, float creaseAngle)
 {
-    memset(this, 0, sizeof(*this));
+    clear();
 
-    load(path, shouldComputeTangents);
+    load(path, shouldComputeTangents, creaseAngle);
 }
 
 OBJMesh::~OBJMesh()
 {
 }
 
+void OBJMesh::clear()
+{
+    clearGeometry();
+
+    mBufferLayout = DefaultBufferLayout;
+    mDeferUpload = false;
+    mUploadingDeferred = false;
+    mUseCache = true;
+    mWeld = DefaultWeld;
+}
+
+void OBJMesh::clearGeometry()
+{
+    mVAO = 0;
+    mVBO = 0;
+    mIBO = 0;
+
+    mPositionSize = 0;
+    mNormalSize = 0;
+    mTangentSize = 0;
+    mTexCoordSize = 0;
+
+    mPositionOffset = NULL;
+    mNormalOffset = NULL;
+    mTangentlOffset = NULL;
+    mTexCoordOffset = NULL;
+
+    mStride = 0;
+    mVertexFormat = NULL;
+    mNumVertices = 0;
+    mNumIndices = 0;
+
+    mChunks.clear();
+
+    mContentHash = ShaderCache::Hash(NULL, 0);
+    mGPUBytes = 0;
+    mRadius = 0;
+
+    mPendingChunks.clear();
+
+    mMaterials.clear();
+    mSubmeshes.clear();
+    mMaterialRanges.clear();
+    mMaterialLibs.clear();
+}
+
+bool OBJMesh::isLoaded() const
+{
+    return mVAO != 0;
+}
+
+void OBJMesh::draw() const
+{
+    for (unsigned i = 0; i < mChunks.size(); i++) {
+        glBindVertexArray(mChunks[i].vao);
+        glDrawElements(GL_TRIANGLES, mChunks[i].numIndices, GL_UNSIGNED_INT, 0);
+    }
+    glBindVertexArray(0);
+}
+
+void OBJMesh::freeChunks()
+{
+    // chunks that were never uploaded have no GL objects, and there may be no context to call
+    for (unsigned i = 0; i < mChunks.size(); i++) {
+        OBJMeshChunk& chunk = mChunks[i];
+        if (chunk.vao) {
+            glDeleteVertexArrays(1, &chunk.vao);
+        }
+        if (chunk.vbo) {
+            glDeleteBuffers(1, &chunk.vbo);
+        }
+        if (chunk.ibo) {
+            glDeleteBuffers(1, &chunk.ibo);
+        }
+        if (chunk.depthVAO) {
+            glDeleteVertexArrays(1, &chunk.depthVAO);
+        }
+        if (chunk.positionVBO) {
+            glDeleteBuffers(1, &chunk.positionVBO);
+        }
+    }
+
+    clearGeometry();
+}
+
+void OBJMesh::destroy()
+{
+    freeChunks();
+    clear();
+}
+
+void OBJMesh::setBufferLayout(OBJBufferLayout layout)
+{
+    mBufferLayout = layout;
+}
+
+GLuint OBJMesh::getDepthVAO(unsigned chunk) const
+{
+    return mChunks[chunk].depthVAO ? mChunks[chunk].depthVAO : mChunks[chunk].vao;
+}
+
+unsigned long long OBJMesh::getCPUBytes() const
+{
+    unsigned long long bytes = sizeof(OBJMesh);
+    bytes += mChunks.capacity() * sizeof(OBJMeshChunk);
+
+    bytes += mMaterials.capacity() * sizeof(OBJMaterial);
+    for (unsigned i = 0; i < mMaterials.size(); i++) {
+        bytes += mMaterials[i].name.capacity() + mMaterials[i].diffuseMap.capacity();
+    }
+    bytes += mSubmeshes.capacity() * sizeof(OBJSubmesh);
+    for (unsigned i = 0; i < mSubmeshes.size(); i++) {
+        bytes += mSubmeshes[i].group.capacity();
+    }
+    bytes += mMaterialRanges.capacity() * sizeof(OBJSubmesh);
+    bytes += mMaterialLibs.capacity() * sizeof(std::string);
+    for (unsigned i = 0; i < mMaterialLibs.size(); i++) {
+        bytes += mMaterialLibs[i].capacity();
+    }
+
+    bytes += mPendingChunks.capacity() * sizeof(OBJPendingChunk);
+    for (unsigned i = 0; i < mPendingChunks.size(); i++) {
+        bytes += mPendingChunks[i].vertexData.capacity() * sizeof(GLfloat);
+        bytes += mPendingChunks[i].indices.capacity() * sizeof(unsigned);
+    }
+
+    return bytes;
+}
+
+void OBJMesh::setDeferUpload(bool defer)
+{
+    mDeferUpload = defer;
+}
+
+void OBJMesh::setWeld(const OBJWeldSettings& settings)
+{
+    mWeld = settings;
+}
+
+void OBJMesh::setUseCache(bool use)
+{
+    mUseCache = use;
+}
+
+bool OBJMesh::uploadDeferred(unsigned maxChunks)
+{
+    // chunks are uploaded in order, mChunks has an entry for each of them
+    unsigned n = 0;
+    for (unsigned i = 0; i < mPendingChunks.size() && n < maxChunks; i++) {
+        OBJPendingChunk& pending = mPendingChunks[i];
+        if (pending.indices.empty()) {
+            continue;   // already uploaded
+        }
+
+        OBJMeshChunk& chunk = mChunks[i];
+        mUploadingDeferred = true;
+        bool uploaded = uploadChunk(&pending.vertexData[0], chunk.numVertices, &pending.indices[0], chunk.numIndices, chunk);
+        mUploadingDeferred = false;
+        if (!uploaded) {
+            return false;
+        }
+
+        // free the RAM copy right away
+        std::vector<GLfloat>().swap(pending.vertexData);
+        std::vector<unsigned>().swap(pending.indices);
+        ++n;
+    }
+
+    for (unsigned i = 0; i < mPendingChunks.size(); i++) {
+        if (!mPendingChunks[i].indices.empty()) {
+            return false;
+        }
+    }
+
+    mPendingChunks.clear();
+    mDeferUpload = false;
+
+    if (!mChunks.empty()) {
+        mVAO = mChunks[0].vao;
+        mVBO = mChunks[0].vbo;
+        mIBO = mChunks[0].ibo;
+    }
+
+    return true;
+}
+
 
 //
 //
@@ -251,22 +374,75 @@ OBJMesh::~OBJMesh()
 //
 
 
-bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
+bool OBJMesh::load(const std::string& path, bool shouldComputeTangents, float creaseAngle)
 {
-    std::cout << "Loading '" << path << "'" << std::endl;
+    // .obj.gz and .obj.zst are parsed as they are decompressed (always in core)
+    CompressionFormat compression = CompressedFile::GetFormat(path);
 
-    std::ifstream file(path.c_str());
+    std::ifstream plainFile;
+    if (compression == COMPRESSION_NONE) {
+        plainFile.open(path.c_str());
 
-    if (!file) {
-        std::cerr << "ERROR: Failed to open " << path << std::endl;
+        if (!plainFile) {
+            std::cerr << "ERROR: Failed to open " << path << std::endl;
+            return false;
+        }
+
+        // huge files don't fit in RAM the way this function builds them
+        plainFile.seekg(0, std::ios::end);
+        unsigned long long fileSize = (unsigned long long)plainFile.tellg();
+        plainFile.seekg(0, std::ios::beg);
+        if (fileSize >= OUT_OF_CORE_THRESHOLD) {
+            plainFile.close();
+            if (shouldComputeTangents) {
+                std::cout << "Warning: Tangents are not supported for out-of-core meshes" << std::endl;
+            }
+            return loadOutOfCore(path);
+        }
+    }
+
+    if (UseCache && mUseCache && loadCache(path, shouldComputeTangents, creaseAngle)) {
+        return true;
+    }
+
+    CompressedFile compressedFile;
+    if (compression != COMPRESSION_NONE && !compressedFile.open(path, compression)) {
         return false;
     }
 
+    std::streambuf* source = &compressedFile;
+    if (compression == COMPRESSION_NONE) {
+        source = plainFile.rdbuf();
+    }
+    std::istream file(source);
+
+    std::cout << "Loading '" << path << "'" << std::endl;
+
+    // a failed cache read may have left some of these behind
+    mMaterials.clear();
+    mSubmeshes.clear();
+    mMaterialRanges.clear();
+    mMaterialLibs.clear();
+
     std::vector<Vec3> positions;
     std::vector<Vec3> normals;
     std::vector<TexCoord> texcoords;
     std::vector<OBJTriangle> faces;
 
+    // material and group of each triangle
+    std::vector<unsigned> triMaterial;
+    std::vector<unsigned> triGroup;
+    std::vector<std::string> groupNames(1);     // group 0 is for faces before any "o" or "g"
+    int curMaterial = -1;
+    unsigned curGroup = 0;
+
+    // MTL files are relative to the OBJ
+    std::string dir;
+    size_t slash = path.find_last_of("/\\");
+    if (slash != std::string::npos) {
+        dir = path.substr(0, slash + 1);
+    }
+
     std::string line;
     int lineno = 0;
 
@@ -397,6 +573,12 @@ bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
                 for (unsigned i = 0; i < tris.size(); i++)
                     faces.push_back(tris[i]);
 
+                if (curMaterial < 0) {
+                    curMaterial = findMaterial("");
+                }
+                triMaterial.resize(faces.size(), curMaterial);
+                triGroup.resize(faces.size(), curGroup);
+
                 ++numFaces;
 
 #if 0
@@ -429,14 +611,76 @@ bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
                 faces.push_back(tri);
 #endif
             }
+            else if (tokens[0] == "mtllib") {
+                for (unsigned i = 1; i < tokens.size(); i++) {
+                    loadMaterialLibrary(dir + tokens[i]);
+                }
+            }
+            else if (tokens[0] == "usemtl") {
+                curMaterial = findMaterial(tokens.size() > 1 ? tokens[1] : "");
+            }
+            else if (tokens[0] == "o" || tokens[0] == "g") {
+                std::string name;
+                for (unsigned i = 1; i < tokens.size(); i++) {
+                    name += (i > 1 ? " " : "") + tokens[i];
+                }
+                curGroup = (unsigned)(std::find(groupNames.begin(), groupNames.end(), name) - groupNames.begin());
+                if (curGroup == groupNames.size()) {
+                    groupNames.push_back(name);
+                }
+            }
         }
     }
 
+    if (compression != COMPRESSION_NONE) {
+        if (compressedFile.failed()) {
+            return false;   // the decompressor said why
+        }
+        compressedFile.printStats();
+    }
+
     std::cout << "  Loaded " << positions.size() << " positions" << std::endl;
     std::cout << "  Loaded " << normals.size() << " normals" << std::endl;
     std::cout << "  Loaded " << texcoords.size() << " texture coordinates" << std::endl;
     std::cout << "  Loaded " << numFaces << " faces (" << faces.size() << " triangles)" << std::endl;
 
+    for (unsigned i = 0; i < mMaterials.size(); i++) {
+        if (!mMaterials[i].defined && !mMaterials[i].name.empty()) {
+            std::cout << "  Warning: Material '" << mMaterials[i].name << "' is not defined in any MTL file" << std::endl;
+        }
+    }
+
+    if (mMaterials.size() > 1 || groupNames.size() > 1) {
+        // sort the triangles by material, then by group, so each material is drawn as one range
+        std::vector<unsigned> order(faces.size());
+        for (unsigned i = 0; i < order.size(); i++) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+            if (triMaterial[a] != triMaterial[b]) {
+                return triMaterial[a] < triMaterial[b];
+            }
+            return triGroup[a] < triGroup[b];
+        });
+
+        std::vector<OBJTriangle> sortedFaces(faces.size());
+        std::vector<unsigned> sortedMaterial(faces.size());
+        std::vector<unsigned> sortedGroup(faces.size());
+        for (unsigned i = 0; i < order.size(); i++) {
+            sortedFaces[i] = faces[order[i]];
+            sortedMaterial[i] = triMaterial[order[i]];
+            sortedGroup[i] = triGroup[order[i]];
+        }
+        faces.swap(sortedFaces);
+        triMaterial.swap(sortedMaterial);
+        triGroup.swap(sortedGroup);
+    }
+
+    buildSubmeshes(triMaterial, triGroup, groupNames);
+    if (mMaterials.size() > 1 || groupNames.size() > 1) {
+        std::cout << "  " << mMaterials.size() << " materials, " << mSubmeshes.size() << " submeshes" << std::endl;
+    }
+
     bool haveNormals = (vertexFormat & OBJ_VFF_NORMAL) == OBJ_VFF_NORMAL;
     if (!haveNormals && normals.size() == positions.size()) {
         // normals were not specified with vertex format in faces,
@@ -448,6 +692,17 @@ bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
         haveNormals = true;
     }
 
+    if (!haveNormals && !faces.empty()) {
+        // no normals at all, so make some up (the lighting shaders need them)
+        std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+
+        GenerateNormals(positions, faces, normals, creaseAngle);
+        haveNormals = true;
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+        std::cout << "  Generated " << normals.size() << " normals (crease angle " << creaseAngle << ") in " << ms << " ms" << std::endl;
+    }
+
     bool haveTexCoords = (vertexFormat & OBJ_VFF_TEXCOORD) == OBJ_VFF_TEXCOORD;
     if (!haveTexCoords && texcoords.size() == positions.size()) {
         // texcoords were not specified with vertex format in faces,
@@ -459,30 +714,9 @@ bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
         haveTexCoords = true;
     }
 
-    int floatsPerVertex = 0;
-
-    mPositionSize = 3;
-    mPositionOffset = (void*)(floatsPerVertex * sizeof(GLfloat));
-    floatsPerVertex += mPositionSize;
-
-    if (haveNormals) {
-        mNormalSize = 3;
-        mNormalOffset = (void*)(floatsPerVertex * sizeof(GLfloat));
-        floatsPerVertex += mNormalSize;
-    }
-
-    if (haveTexCoords) {
-        mTexCoordSize = 2;
-        mTexCoordOffset = (void*)(floatsPerVertex * sizeof(GLfloat));
-        floatsPerVertex += mTexCoordSize;
-    }
-
     if (shouldComputeTangents) {
         if (haveNormals && haveTexCoords) {
             std::cout << "  Tangents will be computed" << std::endl;
-            mTangentSize = 4;
-            mTangentlOffset = (void*)(floatsPerVertex * sizeof(GLfloat));
-            floatsPerVertex += mTangentSize;
         }
         else {
             std::cout << "  Warning: Tangents will not be computed because normals and/or texture coordinates are missing" << std::endl;
@@ -493,30 +727,33 @@ bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
         std::cout << "  Tangents will not be computed" << std::endl;
     }
 
-    // vertex size in bytes
-    mStride = floatsPerVertex * sizeof(GLfloat);
+    int floatsPerVertex = setVertexLayout(haveNormals, haveTexCoords, shouldComputeTangents);
+
+    std::vector<Vec4> tangents;
+    VertexStreams streams;
+    streams.positions = &positions;
+    streams.normals = &normals;
+    streams.texcoords = &texcoords;
+    streams.tangents = &tangents;
 
     //
     // Reindex
     //
 
     std::vector<IndexTriangle> newFaces;
+    mVertexFormat->reindex(faces, newFaces, streams);
 
-    if (haveNormals && haveTexCoords) {
-        Reindex(positions, normals, texcoords, faces, newFaces);
-    }
-    else if (haveNormals && !haveTexCoords) {
-        Reindex(positions, normals, faces, newFaces);
-    }
-    else if (!haveNormals && haveTexCoords) {
-        Reindex(positions, texcoords, faces, newFaces);
-    }
-    else {
-        Reindex(positions, faces, newFaces);
+    if (mWeld.enabled) {
+        std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+
+        size_t numBefore = positions.size();
+        WeldVertices(mWeld, positions, mNormalSize > 0 ? &normals : NULL, mTexCoordSize > 0 ? &texcoords : NULL, newFaces);
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+        std::cout << "  Welded " << numBefore << " vertices into " << positions.size() << " in " << ms << " ms" << std::endl;
     }
 
     // compute tangents, if needed
-    std::vector<Vec4> tangents;
     if (shouldComputeTangents)
         ComputeTangents(positions, normals, texcoords, newFaces, tangents);
 
@@ -526,10 +763,10 @@ bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
     std::cout << "  Found " << mNumVertices << " unique vertices" << std::endl;
     std::cout << "  Using " << mNumIndices << " indices" << std::endl;
 
-    unsigned indexSize = sizeof(newFaces[0].index[0]);
-    unsigned vboSize = mNumVertices * mStride;
-    unsigned iboSize = mNumIndices * indexSize;
-    unsigned totalSize = vboSize + iboSize;
+    unsigned long long indexSize = sizeof(newFaces[0].index[0]);
+    unsigned long long vboSize = mNumVertices * mStride;
+    unsigned long long iboSize = mNumIndices * indexSize;
+    unsigned long long totalSize = vboSize + iboSize;
 
     std::cout << "  Vertex size: " << mStride << " bytes" << std::endl;
     std::cout << "  Index size:  " << indexSize << " bytes" << std::endl;
@@ -537,7 +774,7 @@ bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
     std::cout << "  IBO size:    " << iboSize << " bytes" << std::endl;
     std::cout << "  Total size:  " << totalSize << " bytes" << std::endl;
 
-    unsigned naiveSize = 3 * faces.size() * mStride;
+    unsigned long long naiveSize = 3ULL * faces.size() * mStride;
     std::cout << "  Naive size:  " << naiveSize << " bytes (without IBO)" << std::endl;
 
     std::cout << "  Bounding box:\n";
@@ -549,297 +786,1549 @@ bool OBJMesh::load(const std::string& path, bool shouldComputeTangents)
     //
     // build the vertex buffer
     //
-    std::vector<GLfloat> vertexData(mNumVertices * floatsPerVertex);
-    std::vector<GLfloat>::iterator it = vertexData.begin();
-
-    for (int i = 0; i < mNumVertices; i++) {
-        // write position
-        *it++ = positions[i].x;
-        *it++ = positions[i].y;
-        *it++ = positions[i].z;
-        // write normal
-        if (haveNormals) {
-            *it++ = normals[i].x;
-            *it++ = normals[i].y;
-            *it++ = normals[i].z;
-        }
-        // write texcoord
-        if (haveTexCoords) {
-            *it++ = texcoords[i].s;
-            *it++ = texcoords[i].t;
-        }
-        // write tangent
-        if (shouldComputeTangents) {
-            *it++ = tangents[i].x;
-            *it++ = tangents[i].y;
-            *it++ = tangents[i].z;
-            *it++ = tangents[i].w;
-        }
+    std::vector<GLfloat> vertexData((size_t)mNumVertices * floatsPerVertex);
+    if (!vertexData.empty()) {
+        mVertexFormat->interleave(streams, (size_t)mNumVertices, &vertexData[0]);
     }
 
-    GLSH_CHECK_GL_ERRORS("poop");
-
-    // create a vertex array object (VAO)
-    glGenVertexArrays(1, &mVAO);
-    if (!mVAO) {
-        std::cerr << "*** Poop: Failed to create VAO" << std::endl;
+    if (newFaces.empty()) {
+        std::cerr << "ERROR: No faces in " << path << std::endl;
         return false;
     }
 
-    GLSH_CHECK_GL_ERRORS("poop");
-
-    // bind the VAO (subsequent vertex attribute info will be stored in this VAO)
-    glBindVertexArray(mVAO);
-
-    // generate vertex buffer
-    glGenBuffers(1, &mVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, mVBO);
-    glBufferData(GL_ARRAY_BUFFER,                           // the buffer to resize and fill
-        vertexData.size() * sizeof(vertexData[0]), // total size in bytes
-        &vertexData[0],                            // address of data in RAM
-        GL_STATIC_DRAW);                           // buffer usage mode (GL_STATIC_DRAW == read-only == fast drawing)
-
-    GLSH_CHECK_GL_ERRORS("poop");
-
-    // describe vertex attributes
-    if (mPositionSize > 0) {
-        glVertexAttribPointer(glsh::VA_POSITION, mPositionSize, GL_FLOAT, GL_FALSE, mStride, mPositionOffset);
-        glEnableVertexAttribArray(glsh::VA_POSITION);
-    }
-    if (mNormalSize > 0) {
-        glVertexAttribPointer(glsh::VA_NORMAL, mNormalSize, GL_FLOAT, GL_FALSE, mStride, mNormalOffset);
-        glEnableVertexAttribArray(glsh::VA_NORMAL);
-    }
-    if (mTexCoordSize > 0) {
-        glVertexAttribPointer(glsh::VA_TEXCOORD, mTexCoordSize, GL_FLOAT, GL_FALSE, mStride, mTexCoordOffset);
-        glEnableVertexAttribArray(glsh::VA_TEXCOORD);
-    }
-    if (mTangentSize > 0) {
-        glVertexAttribPointer(glsh::VA_TANGENT, mTangentSize, GL_FLOAT, GL_FALSE, mStride, mTangentlOffset);
-        glEnableVertexAttribArray(glsh::VA_TANGENT);
+    if (mNumIndices > (unsigned long long)std::numeric_limits<GLsizei>::max()) {
+        std::cerr << "ERROR: Too many indices for a single draw call, use loadOutOfCore" << std::endl;
+        return false;
     }
 
-    GLSH_CHECK_GL_ERRORS("poop");
-
-    // generate index buffer
-    glGenBuffers(1, &mIBO);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mIBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER,                   // the buffer to resize and fill
-        newFaces.size() * sizeof(newFaces[0]),     // total size in bytes
-        &newFaces[0],                              // address of data in RAM
-        GL_STATIC_DRAW);                           // buffer usage mode (GL_STATIC_DRAW == read-only == fast drawing)
-
-    GLSH_CHECK_GL_ERRORS("poop");
+    OBJMeshChunk chunk;
+    if (!createChunk(&vertexData[0], mNumVertices, &newFaces[0].index[0], mNumIndices, chunk)) {
+        return false;
+    }
 
-    // unbind stuff, for now
-    glBindVertexArray(0);
+    mChunks.push_back(chunk);
+    mVAO = chunk.vao;
+    mVBO = chunk.vbo;
+    mIBO = chunk.ibo;
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    hashMaterials();
 
-    GLSH_CHECK_GL_ERRORS("poop");
+    if (UseCache) {
+        saveCache(path, shouldComputeTangents, creaseAngle, vertexData, &newFaces[0].index[0]);
+    }
 
     return true;
 }
 
+
+//
+//
+// Compressed mesh cache
 //
-// Reindex positions
 //
-void OBJMesh::Reindex(std::vector<Vec3>& positions,
-    const std::vector<OBJTriangle>& faces,
-    std::vector<IndexTriangle>& newFaces)
-{
-    std::vector<Vec3> newPositions;
-
-    newPositions.reserve(positions.size());
-
-    newFaces.resize(faces.size());
-
-    std::map<int, unsigned> indexTable;
 
-    int index = 0;
+namespace {
 
-    // for each face...
-    for (unsigned i = 0; i < faces.size(); i++) {
-        // for each vertex in the face...
-        for (int j = 0; j < 3; j++) {
+const char MESH_CACHE_MAGIC[4] = { 'S', 'G', 'M', 'C' };
+const unsigned MESH_CACHE_VERSION = 3;      // 2: materials and submeshes, 3: welding
 
-            int v = faces[i].verts[j].v;
+enum MeshCacheFlags {
+    CACHE_NORMALS               = 1 << 0,
+    CACHE_TEXCOORDS             = 1 << 1,
+    CACHE_TANGENTS              = 1 << 2,
+    CACHE_TANGENTS_REQUESTED    = 1 << 3,
+    CACHE_WELDED                = 1 << 4,
+};
 
-            std::pair<std::map<int, unsigned>::iterator, bool> insertionResult;
+// laid out without padding so it can be written as is
+struct MeshCacheHeader {
+    char                magic[4];
+    unsigned            version;
+    unsigned long long  sourceSize;     // size and modification time of the OBJ it was built from
+    long long           sourceTime;
+    unsigned            flags;
+    float               creaseAngle;
+    unsigned long long  numVertices;
+    unsigned long long  numIndices;
+    unsigned long long  vertexBytes;    // compressed sizes
+    unsigned long long  indexBytes;
+    float               weldPosition;   // tolerances, if CACHE_WELDED
+    float               weldNormalAngle;
+    float               weldTexCoord;
+    unsigned            reserved;
+};
 
-            insertionResult = indexTable.insert(std::make_pair(v, index));
+// the material and submesh tables follow the compressed streams
+void WriteString(std::ostream& out, const std::string& str)
+{
+    unsigned len = (unsigned)str.size();
+    out.write((const char*)&len, sizeof(len));
+    out.write(str.data(), len);
+}
 
-            if (insertionResult.second) {
-                // vertex was not seen yet, new index inserted
-                newPositions.push_back(positions[v - 1]);
-                newFaces[i].index[j] = index++;
-            }
-            else {
-                // vertex already seen, use existing index
-                newFaces[i].index[j] = insertionResult.first->second;
-            }
-        }
+bool ReadString(std::istream& in, std::string& str)
+{
+    unsigned len;
+    if (!in.read((char*)&len, sizeof(len)) || len > (1u << 20)) {
+        return false;
     }
-
-    // replace the old with the new
-    positions.swap(newPositions);
+    str.resize(len);
+    return len == 0 || (bool)in.read(&str[0], len);
 }
 
-//
-// Reindex positions and normals
-//
-void OBJMesh::Reindex(std::vector<Vec3>& positions,
-    std::vector<Vec3>& normals,
-    const std::vector<OBJTriangle>& faces,
-    std::vector<IndexTriangle>& newFaces)
+void WriteSubmeshes(std::ostream& out, const std::vector<OBJSubmesh>& subs)
 {
-    std::vector<Vec3> newPositions;
-    std::vector<Vec3> newNormals;
-
-    newPositions.reserve(positions.size());
-    newNormals.reserve(normals.size());
-
-    newFaces.resize(faces.size());
-
-    std::map<int, std::map<int, unsigned> > indexTable;
-
-    int index = 0;
-
-    // for each face...
-    for (unsigned i = 0; i < faces.size(); i++) {
-        // for each vertex in the face...
-        for (int j = 0; j < 3; j++) {
-
-            int v = faces[i].verts[j].v;
-            int vn = faces[i].verts[j].vn;
-
-            std::pair<std::map<int, unsigned>::iterator, bool> insertionResult;
-
-            insertionResult = indexTable[v].insert(std::make_pair(vn, index));
+    unsigned n = (unsigned)subs.size();
+    out.write((const char*)&n, sizeof(n));
+    for (unsigned i = 0; i < n; i++) {
+        WriteString(out, subs[i].group);
+        out.write((const char*)&subs[i].material, sizeof(subs[i].material));
+        out.write((const char*)&subs[i].firstIndex, sizeof(subs[i].firstIndex));
+        out.write((const char*)&subs[i].numIndices, sizeof(subs[i].numIndices));
+    }
+}
 
-            if (insertionResult.second) {
-                // vertex was not seen yet, new index inserted
-                newPositions.push_back(positions[v - 1]);
-                newNormals.push_back(normals[vn - 1]);
-                newFaces[i].index[j] = index++;
-            }
-            else {
-                // vertex already seen, use existing index
-                newFaces[i].index[j] = insertionResult.first->second;
-            }
+bool ReadSubmeshes(std::istream& in, std::vector<OBJSubmesh>& subs, size_t numMaterials, unsigned long long numIndices)
+{
+    unsigned n;
+    if (!in.read((char*)&n, sizeof(n))) {
+        return false;
+    }
+    subs.resize(n);
+    for (unsigned i = 0; i < n; i++) {
+        if (!ReadString(in, subs[i].group) ||
+            !in.read((char*)&subs[i].material, sizeof(subs[i].material)) ||
+            !in.read((char*)&subs[i].firstIndex, sizeof(subs[i].firstIndex)) ||
+            !in.read((char*)&subs[i].numIndices, sizeof(subs[i].numIndices))) {
+            return false;
+        }
+        if (subs[i].material >= numMaterials || subs[i].firstIndex + subs[i].numIndices > numIndices) {
+            return false;
         }
     }
-
-    // replace the old with the new
-    positions.swap(newPositions);
-    normals.swap(newNormals);
+    return true;
 }
 
-//
-// Reindex positions and texcoords
-//
-void OBJMesh::Reindex(std::vector<Vec3>& positions,
-    std::vector<TexCoord>& texcoords,
-    const std::vector<OBJTriangle>& faces,
-    std::vector<IndexTriangle>& newFaces)
+bool GetFileStamp(const std::string& path, unsigned long long& size, long long& mtime)
 {
-    std::vector<Vec3> newPositions;
-    std::vector<TexCoord> newTexcoords;
+#ifdef _WIN32
+    struct __stat64 st;
+    if (_stat64(path.c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    size = (unsigned long long)st.st_size;
+    mtime = (long long)st.st_mtime;
+    return true;
+}
 
-    newPositions.reserve(positions.size());
-    newTexcoords.reserve(texcoords.size());
+}
 
-    newFaces.resize(faces.size());
+bool OBJMesh::loadCache(const std::string& path, bool shouldComputeTangents, float creaseAngle)
+{
+    std::string cachePath = path + ".smesh";
 
-    std::map<int, std::map<int, unsigned> > indexTable;
+    unsigned long long sourceSize;
+    long long sourceTime;
+    if (!GetFileStamp(path, sourceSize, sourceTime)) {
+        return false;
+    }
 
-    int index = 0;
+    std::ifstream file(cachePath.c_str(), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    MeshCacheHeader header;
+    if (!file.read((char*)&header, sizeof(header))) {
+        return false;
+    }
+
+    if (std::memcmp(header.magic, MESH_CACHE_MAGIC, 4) != 0 || header.version != MESH_CACHE_VERSION) {
+        return false;
+    }
+    if (header.sourceSize != sourceSize || header.sourceTime != sourceTime) {
+        return false;   // stale
+    }
+    if (((header.flags & CACHE_TANGENTS_REQUESTED) != 0) != shouldComputeTangents || header.creaseAngle != creaseAngle) {
+        return false;   // built with different options
+    }
+    if (((header.flags & CACHE_WELDED) != 0) != mWeld.enabled ||
+        (mWeld.enabled && (header.weldPosition != mWeld.position || header.weldNormalAngle != mWeld.normalAngle ||
+                           header.weldTexCoord != mWeld.texCoord))) {
+        return false;
+    }
+    if (header.numIndices == 0 || header.numIndices > (unsigned long long)std::numeric_limits<GLsizei>::max()) {
+        return false;
+    }
+
+    std::vector<unsigned char> compressed((size_t)(header.vertexBytes + header.indexBytes));
+    if (compressed.empty() || !file.read((char*)&compressed[0], compressed.size())) {
+        std::cout << "Warning: Truncated mesh cache " << cachePath << std::endl;
+        return false;
+    }
+
+    // material names are cached, but their colors are read from the MTL files again,
+    // so editing a material doesn't need the OBJ to be re-parsed
+    std::vector<std::string> libs;
+    unsigned numLibs, numMaterials;
+    bool ok = (bool)file.read((char*)&numLibs, sizeof(numLibs));
+    for (unsigned i = 0; ok && i < numLibs; i++) {
+        libs.push_back(std::string());
+        ok = ReadString(file, libs.back());
+    }
+    ok = ok && file.read((char*)&numMaterials, sizeof(numMaterials));
+    for (unsigned i = 0; ok && i < numMaterials; i++) {
+        std::string name;
+        ok = ReadString(file, name);
+        findMaterial(name);
+    }
+    ok = ok && mMaterials.size() == numMaterials &&
+         ReadSubmeshes(file, mSubmeshes, mMaterials.size(), header.numIndices) &&
+         ReadSubmeshes(file, mMaterialRanges, mMaterials.size(), header.numIndices);
+    if (!ok) {
+        std::cout << "Warning: Corrupt mesh cache " << cachePath << std::endl;
+        mMaterials.clear();
+        mSubmeshes.clear();
+        mMaterialRanges.clear();
+        return false;
+    }
+    for (unsigned i = 0; i < libs.size(); i++) {
+        loadMaterialLibrary(libs[i]);
+    }
+
+    bool haveNormals = (header.flags & CACHE_NORMALS) != 0;
+    bool haveTexCoords = (header.flags & CACHE_TEXCOORDS) != 0;
+    bool haveTangents = (header.flags & CACHE_TANGENTS) != 0;
+    int floatsPerVertex = setVertexLayout(haveNormals, haveTexCoords, haveTangents);
+
+    std::vector<GLfloat> vertexData((size_t)header.numVertices * floatsPerVertex);
+    std::vector<unsigned> indices((size_t)header.numIndices);
+
+    std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+
+    if (!MeshCodec::DecodeVertices(&compressed[0], (size_t)header.vertexBytes, vertexData.empty() ? NULL : &vertexData[0], (size_t)header.numVertices, floatsPerVertex) ||
+        !MeshCodec::DecodeIndices(&compressed[(size_t)header.vertexBytes], (size_t)header.indexBytes, &indices[0], indices.size())) {
+        std::cout << "Warning: Corrupt mesh cache " << cachePath << std::endl;
+        return false;
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (indices[i] >= header.numVertices) {
+            std::cout << "Warning: Corrupt mesh cache " << cachePath << std::endl;
+            return false;
+        }
+    }
+
+    mNumVertices = header.numVertices;
+    mNumIndices = header.numIndices;
+
+    unsigned long long rawSize = mNumVertices * mStride + mNumIndices * sizeof(unsigned);
+
+    std::cout << "Loading '" << path << "' from cache" << std::endl;
+    std::cout << "  " << mNumVertices << " vertices, " << mNumIndices << " indices" << std::endl;
+    std::cout << "  Compressed: " << compressed.size() << " bytes ("
+              << (double)rawSize / compressed.size() << ":1 vs raw buffers, "
+              << (double)sourceSize / compressed.size() << ":1 vs OBJ)" << std::endl;
+    std::cout << "  Decoded in " << ms << " ms (" << (ms > 0 ? rawSize / (ms * 1e6) : 0.0) << " GB/s)" << std::endl;
+    std::cout << std::endl;
+
+    OBJMeshChunk chunk;
+    if (!createChunk(&vertexData[0], mNumVertices, &indices[0], mNumIndices, chunk)) {
+        return false;
+    }
+
+    mChunks.push_back(chunk);
+    mVAO = chunk.vao;
+    mVBO = chunk.vbo;
+    mIBO = chunk.ibo;
+
+    hashMaterials();
+
+    return true;
+}
+
+void OBJMesh::saveCache(const std::string& path, bool shouldComputeTangents, float creaseAngle,
+    const std::vector<GLfloat>& vertexData, const unsigned* indices)
+{
+    std::string cachePath = path + ".smesh";
+
+    MeshCacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MESH_CACHE_MAGIC, 4);
+    header.version = MESH_CACHE_VERSION;
+    if (!GetFileStamp(path, header.sourceSize, header.sourceTime)) {
+        return;
+    }
+
+    header.flags = 0;
+    if (mNormalSize > 0)
+        header.flags |= CACHE_NORMALS;
+    if (mTexCoordSize > 0)
+        header.flags |= CACHE_TEXCOORDS;
+    if (mTangentSize > 0)
+        header.flags |= CACHE_TANGENTS;
+    if (shouldComputeTangents)
+        header.flags |= CACHE_TANGENTS_REQUESTED;
+    header.creaseAngle = creaseAngle;
+    if (mWeld.enabled) {
+        header.flags |= CACHE_WELDED;
+        header.weldPosition = mWeld.position;
+        header.weldNormalAngle = mWeld.normalAngle;
+        header.weldTexCoord = mWeld.texCoord;
+    }
+    header.numVertices = mNumVertices;
+    header.numIndices = mNumIndices;
+
+    int floatsPerVertex = mStride / sizeof(GLfloat);
+
+    std::vector<unsigned char> compressed;
+    MeshCodec::EncodeVertices(&vertexData[0], (size_t)mNumVertices, floatsPerVertex, compressed);
+    header.vertexBytes = compressed.size();
+    MeshCodec::EncodeIndices(indices, (size_t)mNumIndices, compressed);
+    header.indexBytes = compressed.size() - header.vertexBytes;
+
+    std::ofstream file(cachePath.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cout << "Warning: Could not write mesh cache " << cachePath << std::endl;
+        return;
+    }
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)&compressed[0], compressed.size());
+
+    unsigned numLibs = (unsigned)mMaterialLibs.size();
+    file.write((const char*)&numLibs, sizeof(numLibs));
+    for (unsigned i = 0; i < numLibs; i++) {
+        WriteString(file, mMaterialLibs[i]);
+    }
+    unsigned numMaterials = (unsigned)mMaterials.size();
+    file.write((const char*)&numMaterials, sizeof(numMaterials));
+    for (unsigned i = 0; i < numMaterials; i++) {
+        WriteString(file, mMaterials[i].name);
+    }
+    WriteSubmeshes(file, mSubmeshes);
+    WriteSubmeshes(file, mMaterialRanges);
+    if (!file) {
+        file.close();
+        std::remove(cachePath.c_str());
+        std::cout << "Warning: Could not write mesh cache " << cachePath << std::endl;
+        return;
+    }
+
+    unsigned long long rawSize = mNumVertices * mStride + mNumIndices * sizeof(unsigned);
+    std::cout << "  Wrote " << cachePath << ": " << compressed.size() << " bytes ("
+              << (double)rawSize / compressed.size() << ":1)" << std::endl;
+}
+
+
+//
+//
+// Materials and submeshes
+//
+//
+
+unsigned OBJMesh::findMaterial(const std::string& name)
+{
+    for (unsigned i = 0; i < mMaterials.size(); i++) {
+        if (mMaterials[i].name == name) {
+            return i;
+        }
+    }
 
-    // for each face...
-    for (unsigned i = 0; i < faces.size(); i++) {
-        // for each vertex in the face...
-        for (int j = 0; j < 3; j++) {
+    OBJMaterial mat;
+    mat.name = name;
+    mMaterials.push_back(mat);
+    return (unsigned)mMaterials.size() - 1;
+}
 
-            int v = faces[i].verts[j].v;
-            int vt = faces[i].verts[j].vt;
+bool OBJMesh::loadMaterialLibrary(const std::string& path)
+{
+    std::ifstream file(path.c_str());
+    if (!file) {
+        std::cout << "  Warning: Failed to open material library " << path << std::endl;
+        return false;
+    }
 
-            std::pair<std::map<int, unsigned>::iterator, bool> insertionResult;
+    if (std::find(mMaterialLibs.begin(), mMaterialLibs.end(), path) == mMaterialLibs.end()) {
+        mMaterialLibs.push_back(path);
+    }
 
-            insertionResult = indexTable[v].insert(std::make_pair(vt, index));
+    // texture maps are relative to the MTL file
+    std::string dir;
+    size_t slash = path.find_last_of("/\\");
+    if (slash != std::string::npos) {
+        dir = path.substr(0, slash + 1);
+    }
 
-            if (insertionResult.second) {
-                // vertex was not seen yet, new index inserted
-                newPositions.push_back(positions[v - 1]);
-                newTexcoords.push_back(texcoords[vt - 1]);
-                newFaces[i].index[j] = index++;
+    OBJMaterial* mat = NULL;
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> tokens = glsh::Tokenize(line);
+        if (tokens.empty() || tokens[0][0] == '#') {
+            continue;
+        }
+
+        if (tokens[0] == "newmtl" && tokens.size() > 1) {
+            // usemtl may already have referred to it
+            mat = &mMaterials[findMaterial(tokens[1])];
+            mat->defined = true;
+        }
+        else if (tokens[0] == "Kd" && tokens.size() >= 4 && mat) {
+            mat->diffuse = Vec3(glsh::FromString<float>(tokens[1]),
+                                glsh::FromString<float>(tokens[2]),
+                                glsh::FromString<float>(tokens[3]));
+        }
+        else if (tokens[0] == "map_Kd" && tokens.size() > 1 && mat) {
+            // the file name comes last, after any options (which are ignored)
+            mat->diffuseMap = dir + tokens.back();
+        }
+    }
+
+    return true;
+}
+
+void OBJMesh::buildSubmeshes(const std::vector<unsigned>& triMaterial, const std::vector<unsigned>& triGroup,
+    const std::vector<std::string>& groupNames)
+{
+    mSubmeshes.clear();
+    mMaterialRanges.clear();
+
+    for (size_t i = 0; i < triMaterial.size(); ) {
+        size_t end = i + 1;
+        while (end < triMaterial.size() && triMaterial[end] == triMaterial[i] && triGroup[end] == triGroup[i]) {
+            ++end;
+        }
+
+        OBJSubmesh sub;
+        sub.group = groupNames[triGroup[i]];
+        sub.material = triMaterial[i];
+        sub.firstIndex = 3ULL * i;
+        sub.numIndices = 3ULL * (end - i);
+        mSubmeshes.push_back(sub);
+
+        // consecutive submeshes with the same material make up one material range
+        if (!mMaterialRanges.empty() && mMaterialRanges.back().material == sub.material) {
+            mMaterialRanges.back().numIndices += sub.numIndices;
+        }
+        else {
+            OBJSubmesh range = sub;
+            range.group.clear();
+            mMaterialRanges.push_back(range);
+        }
+
+        i = end;
+    }
+}
+
+//
+// Set up the interleaved vertex layout, returns the number of floats per vertex
+//
+int OBJMesh::setVertexLayout(bool haveNormals, bool haveTexCoords, bool haveTangents)
+{
+    // tangents are only computed along with normals and texcoords
+    mVertexFormat = FindVertexFormat(haveNormals, haveTexCoords, haveTangents && haveNormals && haveTexCoords);
+    return mVertexFormat->describe(*this);
+}
+
+//
+// Add one chunk of the mesh: hash it and create its vertex array and buffers
+// (or keep its data for uploadDeferred)
+//
+bool OBJMesh::createChunk(const GLfloat* vertexData, unsigned long long numVertices,
+    const unsigned* indices, unsigned long long numIndices,
+    OBJMeshChunk& chunk)
+{
+    chunk.numVertices = (GLsizei)numVertices;
+    chunk.numIndices = (GLsizei)numIndices;
+
+    // identical meshes end up with identical hashes, so the resource manager can share them
+    GLint layout[4] = { mPositionSize, mNormalSize, mTexCoordSize, mTangentSize };
+    unsigned long long vboSize = numVertices * mStride;
+    unsigned long long iboSize = numIndices * sizeof(unsigned);
+    mContentHash = ShaderCache::Hash(layout, sizeof(layout), mContentHash);
+    mContentHash = ShaderCache::Hash(vertexData, (size_t)vboSize, mContentHash);
+    mContentHash = ShaderCache::Hash(indices, (size_t)iboSize, mContentHash);
+
+    mGPUBytes += vboSize + iboSize;
+    if (mBufferLayout == OBJ_BUFFERS_POSITION_STREAM) {
+        mGPUBytes += numVertices * mPositionSize * sizeof(GLfloat);     // the copy of the positions
+    }
+
+    // positions come first in each vertex
+    const GLsizei floatsPerVertex = mStride / sizeof(GLfloat);
+    for (unsigned long long i = 0; i < numVertices; i++) {
+        const GLfloat* p = vertexData + i * floatsPerVertex;
+        float r = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        if (r > mRadius) {
+            mRadius = r;
+        }
+    }
+
+    if (mDeferUpload) {
+        OBJPendingChunk pending;
+        pending.vertexData.assign(vertexData, vertexData + (size_t)(vboSize / sizeof(GLfloat)));
+        pending.indices.assign(indices, indices + (size_t)numIndices);
+        mPendingChunks.push_back(pending);
+        return true;
+    }
+
+    return uploadChunk(vertexData, numVertices, indices, numIndices, chunk);
+}
+
+//
+// Add the materials and where they are drawn to the content hash: the same geometry with
+// other materials can't be shared
+//
+void OBJMesh::hashMaterials()
+{
+    for (unsigned i = 0; i < mMaterials.size(); i++) {
+        const OBJMaterial& mat = mMaterials[i];
+        size_t nameSize = mat.name.size();
+        size_t mapSize = mat.diffuseMap.size();
+        mContentHash = ShaderCache::Hash(&nameSize, sizeof(nameSize), mContentHash);
+        mContentHash = ShaderCache::Hash(mat.name.data(), nameSize, mContentHash);
+        mContentHash = ShaderCache::Hash(&mat.diffuse, sizeof(mat.diffuse), mContentHash);
+        mContentHash = ShaderCache::Hash(&mapSize, sizeof(mapSize), mContentHash);
+        mContentHash = ShaderCache::Hash(mat.diffuseMap.data(), mapSize, mContentHash);
+    }
+
+    for (unsigned i = 0; i < mMaterialRanges.size(); i++) {
+        const OBJSubmesh& range = mMaterialRanges[i];
+        unsigned long long fields[3] = { range.material, range.firstIndex, range.numIndices };
+        mContentHash = ShaderCache::Hash(fields, sizeof(fields), mContentHash);
+    }
+}
+
+//
+// Create the GL objects for a chunk
+//
+bool OBJMesh::uploadChunk(const GLfloat* vertexData, unsigned long long numVertices,
+    const unsigned* indices, unsigned long long numIndices,
+    OBJMeshChunk& chunk)
+{
+    // a deferred load may run on a thread without a GL context, only uploadDeferred may get here
+    if (mDeferUpload && !mUploadingDeferred) {
+        std::cerr << "ERROR: GL upload of a mesh whose upload is deferred" << std::endl;
+        return false;
+    }
+
+    GL_DEBUG_GROUP("mesh upload");
+
+    // create a vertex array object (VAO)
+    glGenVertexArrays(1, &chunk.vao);
+    if (!chunk.vao) {
+        std::cerr << "*** Poop: Failed to create VAO" << std::endl;
+        return false;
+    }
+
+    // positions come first in each vertex, so they are easy to pull out into their own stream
+    const GLsizei positionBytes = mPositionSize * sizeof(GLfloat);
+    const GLsizei floatsPerVertex = mStride / sizeof(GLfloat);
+    bool positionStream = mBufferLayout != OBJ_BUFFERS_INTERLEAVED && mPositionSize > 0 && mPositionOffset == 0;
+    bool split = positionStream && mBufferLayout == OBJ_BUFFERS_SPLIT && mStride > positionBytes;
+
+    std::vector<GLfloat> positions;
+    std::vector<GLfloat> attributes;        // the rest of each vertex, for OBJ_BUFFERS_SPLIT
+    if (positionStream) {
+        positions.resize((size_t)numVertices * mPositionSize);
+        if (split) {
+            attributes.resize((size_t)numVertices * (floatsPerVertex - mPositionSize));
+        }
+        for (size_t i = 0; i < numVertices; i++) {
+            const GLfloat* v = vertexData + i * floatsPerVertex;
+            std::memcpy(&positions[i * mPositionSize], v, positionBytes);
+            if (split) {
+                std::memcpy(&attributes[i * (floatsPerVertex - mPositionSize)], v + mPositionSize, mStride - positionBytes);
             }
-            else {
-                // vertex already seen, use existing index
-                newFaces[i].index[j] = insertionResult.first->second;
+        }
+    }
+
+    // the attribute buffer and where each attribute is in it
+    const GLfloat* vboData = split ? &attributes[0] : vertexData;
+    GLsizei vboStride = split ? mStride - positionBytes : mStride;
+    size_t vboShift = split ? positionBytes : 0;
+
+    // bind the VAO (subsequent vertex attribute info will be stored in this VAO)
+    glBindVertexArray(chunk.vao);
+
+    // generate vertex buffer
+    glGenBuffers(1, &chunk.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+    glBufferData(GL_ARRAY_BUFFER,                           // the buffer to resize and fill
+        (GLsizeiptr)(numVertices * vboStride),     // total size in bytes
+        vboData,                                   // address of data in RAM
+        GL_STATIC_DRAW);                           // buffer usage mode (GL_STATIC_DRAW == read-only == fast drawing)
+    GL_DEBUG_UPLOAD(numVertices * vboStride);
+
+    GL_DEBUG_CHECK("creating mesh vertex buffer");
+
+    // describe vertex attributes (split positions are in a buffer of their own)
+    mVertexFormat->setAttribPointers(vboStride, vboShift, split);
+
+    if (positionStream) {
+        glGenBuffers(1, &chunk.positionVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, chunk.positionVBO);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(numVertices * positionBytes), &positions[0], GL_STATIC_DRAW);
+        GL_DEBUG_UPLOAD(numVertices * positionBytes);
+        if (split) {
+            glVertexAttribPointer(glsh::VA_POSITION, mPositionSize, GL_FLOAT, GL_FALSE, positionBytes, 0);
+            glEnableVertexAttribArray(glsh::VA_POSITION);
+        }
+    }
+
+    GL_DEBUG_CHECK("creating mesh position buffer");
+
+    // generate index buffer
+    glGenBuffers(1, &chunk.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,                   // the buffer to resize and fill
+        (GLsizeiptr)(numIndices * sizeof(unsigned)), // total size in bytes
+        indices,                                   // address of data in RAM
+        GL_STATIC_DRAW);                           // buffer usage mode (GL_STATIC_DRAW == read-only == fast drawing)
+    GL_DEBUG_UPLOAD(numIndices * sizeof(unsigned));
+
+    GL_DEBUG_CHECK("creating mesh index buffer");
+
+    // a second vertex array that only fetches the packed positions
+    if (positionStream) {
+        glGenVertexArrays(1, &chunk.depthVAO);
+        glBindVertexArray(chunk.depthVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, chunk.positionVBO);
+        glVertexAttribPointer(glsh::VA_POSITION, mPositionSize, GL_FLOAT, GL_FALSE, positionBytes, 0);
+        glEnableVertexAttribArray(glsh::VA_POSITION);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, chunk.ibo);
+
+        GL_DEBUG_CHECK("creating mesh depth vertex array");
+    }
+
+    // unbind stuff, for now
+    glBindVertexArray(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    GL_DEBUG_CHECK("creating mesh chunk");
+
+    return true;
+}
+
+//
+//
+// Out-of-core loading
+//
+//
+
+namespace {
+
+// reads a file in fixed-size windows and hands out one line at a time
+class OBJWindowReader {
+
+    std::ifstream           mFile;
+    std::vector<char>       mWindow;
+    size_t                  mBegin;     // start of the next line in the window
+    size_t                  mEnd;       // end of valid data in the window
+    bool                    mEof;
+
+    // move the partial line to the front and read more data after it
+    bool refill()
+    {
+        size_t remaining = mEnd - mBegin;
+        if (remaining + 1 >= mWindow.size()) {
+            // a single line longer than the window, make room for it
+            mWindow.resize(2 * mWindow.size());
+        }
+        if (remaining > 0 && mBegin > 0) {
+            std::memmove(&mWindow[0], &mWindow[mBegin], remaining);
+        }
+        mBegin = 0;
+        mEnd = remaining;
+
+        mFile.read(&mWindow[mEnd], mWindow.size() - 1 - mEnd);     // keep room for a terminator
+        std::streamsize n = mFile.gcount();
+        mEnd += (size_t)n;
+        if (n == 0) {
+            mEof = true;
+        }
+        return n > 0;
+    }
+
+public:
+    OBJWindowReader()
+        : mBegin(0), mEnd(0), mEof(false)
+    {
+    }
+
+    bool open(const std::string& path, size_t windowSize)
+    {
+        mFile.open(path.c_str(), std::ios::binary);
+        mWindow.resize(std::max(windowSize, (size_t)4096));
+        mBegin = mEnd = 0;
+        mEof = false;
+        return mFile.is_open();
+    }
+
+    // get the next line as a null-terminated string that stays valid until the next call
+    bool nextLine(char*& line)
+    {
+        for (;;) {
+            char* start = &mWindow[mBegin];
+            char* nl = (char*)std::memchr(start, '\n', mEnd - mBegin);
+            if (nl) {
+                *nl = '\0';
+                mBegin = (nl - &mWindow[0]) + 1;
+                line = start;
+                return true;
             }
+            if (mEof || !refill()) {
+                if (mBegin < mEnd) {
+                    // last line without a newline
+                    mWindow[mEnd] = '\0';
+                    line = &mWindow[mBegin];
+                    mBegin = mEnd;
+                    return true;
+                }
+                return false;
+            }
+        }
+    }
+};
+
+// appends fixed-size records to a temporary file
+class SpillWriter {
+
+    std::ofstream           mFile;
+    std::string             mPath;
+    unsigned long long      mCount;
+
+public:
+    SpillWriter()
+        : mCount(0)
+    {
+    }
+
+    ~SpillWriter()
+    {
+        if (!mPath.empty()) {
+            mFile.close();
+            std::remove(mPath.c_str());
         }
     }
 
-    // replace the old with the new
-    positions.swap(newPositions);
-    texcoords.swap(newTexcoords);
+    bool open(const std::string& tag)
+    {
+        mPath = MappedFile::MakeTempPath(tag);
+        mFile.open(mPath.c_str(), std::ios::binary | std::ios::trunc);
+        return mFile.is_open();
+    }
+
+    template <typename T>
+    void write(const T& record)
+    {
+        mFile.write((const char*)&record, sizeof(T));
+        ++mCount;
+    }
+
+    // finish writing and map the records for reading
+    bool map(MappedFile& mapping)
+    {
+        mFile.close();
+        return mapping.open(mPath, false);
+    }
+
+    unsigned long long count() const        { return mCount; }
+    bool good() const                       { return !mFile.fail(); }
+};
+
+// OBJ face vertex with 64-bit indices
+struct OOCVertex {
+    long long v, vn, vt;
+
+    int getFormat() const
+    {
+        int fmt = 0;
+        if (v > 0)
+            fmt |= OBJ_VFF_POSITION;
+        if (vn > 0)
+            fmt |= OBJ_VFF_NORMAL;
+        if (vt > 0)
+            fmt |= OBJ_VFF_TEXCOORD;
+        return fmt;
+    }
+
+    bool operator==(const OOCVertex& other) const
+    {
+        return v == other.v && vn == other.vn && vt == other.vt;
+    }
+};
+
+struct OOCTriangle {
+    OOCVertex verts[3];
+};
+
+struct OOCVertexHash {
+    size_t operator()(const OOCVertex& x) const
+    {
+        unsigned long long h = (unsigned long long)x.v * 0x9E3779B97F4A7C15ULL;
+        h ^= (unsigned long long)x.vn * 0xC2B2AE3D27D4EB4FULL + (h << 6) + (h >> 2);
+        h ^= (unsigned long long)x.vt * 0x165667B19E3779F9ULL + (h << 6) + (h >> 2);
+        return (size_t)h;
+    }
+};
+
+inline char* SkipSpace(char* p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        ++p;
+    }
+    return p;
+}
+
+// parse up to n floats, returns how many were found
+int ParseFloats(char* p, float* out, int n)
+{
+    int count = 0;
+    while (count < n) {
+        char* end;
+        float f = std::strtof(p, &end);
+        if (end == p) {
+            break;
+        }
+        out[count++] = f;
+        p = end;
+    }
+    return count;
+}
+
+// parse a "v", "v/vt", "v//vn" or "v/vt/vn" token; p is left after the token
+bool ParseFaceVertex(char*& p, OOCVertex& vert)
+{
+    vert.v = vert.vn = vert.vt = 0;
+
+    char* end;
+    vert.v = std::strtoll(p, &end, 10);
+    if (end == p) {
+        return false;
+    }
+    p = end;
+
+    if (*p == '/') {
+        ++p;
+        if (*p != '/') {
+            vert.vt = std::strtoll(p, &end, 10);
+            p = end;
+        }
+        if (*p == '/') {
+            ++p;
+            vert.vn = std::strtoll(p, &end, 10);
+            p = end;
+        }
+    }
+
+    return true;
+}
+
+// resolve a negative (relative) index, returns false if it's out of range
+inline bool ResolveIndex(long long& index, unsigned long long count)
+{
+    if (index < 0) {
+        index = (long long)count + index + 1;
+    }
+    return index == 0 || (index >= 1 && (unsigned long long)index <= count);
+}
+
+}
+
+
+bool OBJMesh::loadOutOfCore(const std::string& path, size_t windowSize, size_t trianglesPerChunk)
+{
+    std::cout << "Loading '" << path << "' out of core" << std::endl;
+
+    // keep the load options (deferred upload in particular: this may be a thread without GL)
+    freeChunks();
+
+    OBJWindowReader reader;
+    if (!reader.open(path, windowSize)) {
+        std::cerr << "ERROR: Failed to open " << path << std::endl;
+        return false;
+    }
+
+    //
+    // pass 1: parse the file, spilling everything to temp files
+    //
+
+    SpillWriter positionsOut, normalsOut, texcoordsOut, trianglesOut;
+    if (!positionsOut.open("positions") || !normalsOut.open("normals") ||
+        !texcoordsOut.open("texcoords") || !trianglesOut.open("triangles")) {
+        std::cerr << "ERROR: Failed to create temporary files" << std::endl;
+        return false;
+    }
+
+    unsigned long long lineno = 0;
+    unsigned long long numFaces = 0;
+    int vertexFormat = 0;
+
+    Vec3 bmin(std::numeric_limits<float>::infinity());
+    Vec3 bmax(-std::numeric_limits<float>::infinity());
+
+    std::vector<OOCVertex> verts;
+    char* line;
+
+    while (reader.nextLine(line)) {
+        ++lineno;
+
+        char* p = SkipSpace(line);
+
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            Vec3 pos;
+            if (ParseFloats(p + 2, &pos.x, 3) != 3) {
+                std::cerr << "ERROR: Incorrect number of vertex position components on line " << lineno << std::endl;
+                return false;
+            }
+            bmin = glm::min(bmin, pos);
+            bmax = glm::max(bmax, pos);
+            positionsOut.write(pos);
+        }
+        else if (p[0] == 'v' && p[1] == 'n') {
+            Vec3 n;
+            if (ParseFloats(p + 2, &n.x, 3) != 3) {
+                std::cerr << "ERROR: Incorrect number of vertex normal components on line " << lineno << std::endl;
+                return false;
+            }
+            normalsOut.write(n);
+        }
+        else if (p[0] == 'v' && p[1] == 't') {
+            float uv[3];
+            if (ParseFloats(p + 2, uv, 3) < 2) {
+                std::cerr << "ERROR: Incorrect number of texture coordinates on line " << lineno << std::endl;
+                return false;
+            }
+            texcoordsOut.write(TexCoord(uv[0], uv[1]));
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            verts.clear();
+            p = SkipSpace(p + 1);
+            while (*p) {
+                OOCVertex vert;
+                if (!ParseFaceVertex(p, vert)) {
+                    std::cerr << "ERROR: Invalid face element on line " << lineno << std::endl;
+                    return false;
+                }
+                if (!ResolveIndex(vert.v, positionsOut.count()) ||
+                    !ResolveIndex(vert.vn, normalsOut.count()) ||
+                    !ResolveIndex(vert.vt, texcoordsOut.count())) {
+                    std::cerr << "ERROR: Face index out of range on line " << lineno << std::endl;
+                    return false;
+                }
+                verts.push_back(vert);
+                p = SkipSpace(p);
+            }
+
+            // need at least 3 vertices per face
+            if (verts.size() < 3) {
+                std::cerr << "ERROR: Incorrect number of face elements on line " << lineno << std::endl;
+                return false;
+            }
+
+            // format checking
+            if (!vertexFormat) {
+                vertexFormat = verts[0].getFormat();
+                if ((vertexFormat & OBJ_VFF_POSITION) != OBJ_VFF_POSITION) {
+                    std::cerr << "Invalid vertex format!" << std::endl;
+                    return false;
+                }
+            }
+            for (unsigned i = 0; i < verts.size(); i++) {
+                if (verts[i].getFormat() != vertexFormat) {
+                    std::cerr << "Inconsistent vertex format!" << std::endl;
+                    return false;
+                }
+            }
+
+            // triangulate (fan) and spill
+            for (unsigned i = 2; i < verts.size(); i++) {
+                OOCTriangle tri;
+                tri.verts[0] = verts[0];
+                tri.verts[1] = verts[i - 1];
+                tri.verts[2] = verts[i];
+                trianglesOut.write(tri);
+            }
+
+            ++numFaces;
+        }
+    }
+
+    if (!positionsOut.good() || !normalsOut.good() || !texcoordsOut.good() || !trianglesOut.good()) {
+        std::cerr << "ERROR: Failed to write temporary files (out of disk space?)" << std::endl;
+        return false;
+    }
+
+    unsigned long long numPositions = positionsOut.count();
+    unsigned long long numNormals = normalsOut.count();
+    unsigned long long numTexCoords = texcoordsOut.count();
+    unsigned long long numTris = trianglesOut.count();
+
+    std::cout << "  Loaded " << numPositions << " positions" << std::endl;
+    std::cout << "  Loaded " << numNormals << " normals" << std::endl;
+    std::cout << "  Loaded " << numTexCoords << " texture coordinates" << std::endl;
+    std::cout << "  Loaded " << numFaces << " faces (" << numTris << " triangles)" << std::endl;
+
+    if (numTris == 0) {
+        std::cerr << "ERROR: No faces in " << path << std::endl;
+        return false;
+    }
+
+    MappedFile positionsMap, normalsMap, texcoordsMap, trianglesMap;
+    if (!positionsOut.map(positionsMap) || !normalsOut.map(normalsMap) ||
+        !texcoordsOut.map(texcoordsMap) || !trianglesOut.map(trianglesMap)) {
+        return false;
+    }
+
+    const Vec3* positions = (const Vec3*)positionsMap.data();
+    const Vec3* normals = (const Vec3*)normalsMap.data();
+    const TexCoord* texcoords = (const TexCoord*)texcoordsMap.data();
+    const OOCTriangle* triangles = (const OOCTriangle*)trianglesMap.data();
+
+    // normals and texcoords given without indices are assumed to match the positions 1:1
+    bool haveNormals = (vertexFormat & OBJ_VFF_NORMAL) == OBJ_VFF_NORMAL;
+    bool normalsByPosition = !haveNormals && numNormals == numPositions;
+    bool haveTexCoords = (vertexFormat & OBJ_VFF_TEXCOORD) == OBJ_VFF_TEXCOORD;
+    bool texcoordsByPosition = !haveTexCoords && numTexCoords == numPositions;
+
+    //
+    // no normals: accumulate area-weighted face normals per position in a mapped file
+    //
+    MappedFile generatedNormalsMap;
+    if (!haveNormals && !normalsByPosition) {
+        std::string tmpPath = MappedFile::MakeTempPath("smooth-normals");
+        generatedNormalsMap.setDeleteOnClose(true);
+        if (!generatedNormalsMap.open(tmpPath, true, numPositions * sizeof(Vec3))) {
+            return false;
+        }
+
+        Vec3* acc = (Vec3*)generatedNormalsMap.data();     // new file pages are zero-filled
+        for (unsigned long long t = 0; t < numTris; t++) {
+            const OOCTriangle& tri = triangles[t];
+            const Vec3& a = positions[tri.verts[0].v - 1];
+            const Vec3& b = positions[tri.verts[1].v - 1];
+            const Vec3& c = positions[tri.verts[2].v - 1];
+            Vec3 n = glm::cross(b - a, c - a);
+            for (int j = 0; j < 3; j++) {
+                acc[tri.verts[j].v - 1] += n;
+            }
+        }
+        for (unsigned long long i = 0; i < numPositions; i++) {
+            float len = glm::length(acc[i]);
+            acc[i] = (len > 0) ? acc[i] / len : Vec3(0.0f, 1.0f, 0.0f);
+        }
+
+        normals = acc;
+        normalsByPosition = true;
+        std::cout << "  Generated " << numPositions << " smooth normals" << std::endl;
+    }
+
+    haveNormals = true;
+    haveTexCoords = haveTexCoords || texcoordsByPosition;
+
+    int floatsPerVertex = setVertexLayout(haveNormals, haveTexCoords, false);
+
+    //
+    // pass 2: reindex and upload one chunk of triangles at a time
+    //
+
+    trianglesPerChunk = std::max(trianglesPerChunk, (size_t)1);
+
+    std::unordered_map<OOCVertex, unsigned, OOCVertexHash> indexTable;
+    std::vector<GLfloat> vertexData;
+    std::vector<unsigned> indices;
+
+    mNumVertices = 0;
+    mNumIndices = 0;
+    unsigned long long vboSize = 0;
+    unsigned long long iboSize = 0;
+
+    for (unsigned long long t0 = 0; t0 < numTris; t0 += trianglesPerChunk) {
+        unsigned long long t1 = std::min(numTris, t0 + trianglesPerChunk);
+
+        indexTable.clear();
+        vertexData.clear();
+        indices.clear();
+
+        for (unsigned long long t = t0; t < t1; t++) {
+            for (int j = 0; j < 3; j++) {
+                OOCVertex key = triangles[t].verts[j];
+                if (normalsByPosition) {
+                    key.vn = key.v;
+                }
+                if (texcoordsByPosition) {
+                    key.vt = key.v;
+                }
+
+                unsigned index = (unsigned)indexTable.size();
+                std::pair<std::unordered_map<OOCVertex, unsigned, OOCVertexHash>::iterator, bool> insertionResult =
+                    indexTable.insert(std::make_pair(key, index));
+
+                if (insertionResult.second) {
+                    // vertex was not seen yet in this chunk
+                    const Vec3& pos = positions[key.v - 1];
+                    const Vec3& n = normals[key.vn - 1];
+                    vertexData.push_back(pos.x);
+                    vertexData.push_back(pos.y);
+                    vertexData.push_back(pos.z);
+                    vertexData.push_back(n.x);
+                    vertexData.push_back(n.y);
+                    vertexData.push_back(n.z);
+                    if (haveTexCoords) {
+                        const TexCoord& uv = texcoords[key.vt - 1];
+                        vertexData.push_back(uv.s);
+                        vertexData.push_back(uv.t);
+                    }
+                }
+                else {
+                    index = insertionResult.first->second;
+                }
+
+                indices.push_back(index);
+            }
+        }
+
+        unsigned long long numChunkVertices = vertexData.size() / floatsPerVertex;
+
+        OBJMeshChunk chunk;
+        if (!createChunk(&vertexData[0], numChunkVertices, &indices[0], indices.size(), chunk)) {
+            freeChunks();
+            return false;
+        }
+        mChunks.push_back(chunk);
+
+        mNumVertices += numChunkVertices;
+        mNumIndices += indices.size();
+        vboSize += numChunkVertices * mStride;
+        iboSize += indices.size() * sizeof(unsigned);
+    }
+
+    mVAO = mChunks[0].vao;
+    mVBO = mChunks[0].vbo;
+    mIBO = mChunks[0].ibo;
+
+    std::cout << "  Found " << mNumVertices << " vertices in " << mChunks.size() << " chunks" << std::endl;
+    std::cout << "  Using " << mNumIndices << " indices" << std::endl;
+    std::cout << "  Vertex size: " << mStride << " bytes" << std::endl;
+    std::cout << "  VBO size:    " << vboSize << " bytes" << std::endl;
+    std::cout << "  IBO size:    " << iboSize << " bytes" << std::endl;
+    std::cout << "  Total size:  " << (vboSize + iboSize) << " bytes" << std::endl;
+
+    std::cout << "  Bounding box:\n";
+    std::cout << "    Width:    " << (bmax.x - bmin.x) << " [" << bmin.x << ", " << bmax.x << "]\n";
+    std::cout << "    Height:   " << (bmax.y - bmin.y) << " [" << bmin.y << ", " << bmax.y << "]\n";
+    std::cout << "    Depth:    " << (bmax.z - bmin.z) << " [" << bmin.z << ", " << bmax.z << "]\n";
+    std::cout << std::endl;
+
+    return true;
 }
 
 //
-// Reindex positions, normals, and texcoords
+// Generate smooth normals
 //
-void OBJMesh::Reindex(std::vector<Vec3>& positions,
+void OBJMesh::GenerateNormals(const std::vector<Vec3>& positions,
+    std::vector<OBJTriangle>& faces,
     std::vector<Vec3>& normals,
-    std::vector<TexCoord>& texcoords,
-    const std::vector<OBJTriangle>& faces,
-    std::vector<IndexTriangle>& newFaces)
+    float creaseAngle)
 {
-    std::vector<Vec3> newPositions;
-    std::vector<Vec3> newNormals;
-    std::vector<TexCoord> newTexcoords;
+    const size_t numTris = faces.size();
+    const size_t numPositions = positions.size();
+    const size_t numCorners = 3 * numTris;
+    const float cosCrease = std::cos(glm::radians(creaseAngle));
 
-    newPositions.reserve(positions.size());
-    newNormals.reserve(normals.size());
-    newTexcoords.reserve(texcoords.size());
+    //
+    // per-triangle data: area-weighted normal (cross product, length = twice the area),
+    // unit normal for the crease test, and the angle at each corner
+    //
+    std::vector<float> wx(numTris), wy(numTris), wz(numTris);
+    std::vector<float> ux(numTris), uy(numTris), uz(numTris);
+    std::vector<float> angles(numCorners);
+
+    ParallelFor(numTris, 4096, [&](size_t begin, size_t end) {
+        size_t i = begin;
+
+#ifdef OBJ_USE_SSE
+        // four triangles at a time
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 tiny = _mm_set1_ps(1e-30f);
+        for (; i + 4 <= end; i += 4) {
+            float p[3][3][4];   // [corner][axis][triangle]
+            for (int k = 0; k < 4; k++) {
+                for (int j = 0; j < 3; j++) {
+                    const Vec3& pos = positions[faces[i + k].verts[j].v - 1];
+                    p[j][0][k] = pos.x;
+                    p[j][1][k] = pos.y;
+                    p[j][2][k] = pos.z;
+                }
+            }
 
-    newFaces.resize(faces.size());
+            __m128 ax = _mm_loadu_ps(p[0][0]), ay = _mm_loadu_ps(p[0][1]), az = _mm_loadu_ps(p[0][2]);
+            __m128 bx = _mm_loadu_ps(p[1][0]), by = _mm_loadu_ps(p[1][1]), bz = _mm_loadu_ps(p[1][2]);
+            __m128 cx = _mm_loadu_ps(p[2][0]), cy = _mm_loadu_ps(p[2][1]), cz = _mm_loadu_ps(p[2][2]);
+
+            // edges a->b, a->c, b->c
+            __m128 e1x = _mm_sub_ps(bx, ax), e1y = _mm_sub_ps(by, ay), e1z = _mm_sub_ps(bz, az);
+            __m128 e2x = _mm_sub_ps(cx, ax), e2y = _mm_sub_ps(cy, ay), e2z = _mm_sub_ps(cz, az);
+            __m128 e3x = _mm_sub_ps(cx, bx), e3y = _mm_sub_ps(cy, by), e3z = _mm_sub_ps(cz, bz);
+
+            // weighted normal = e1 x e2
+            __m128 nx = _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y));
+            __m128 ny = _mm_sub_ps(_mm_mul_ps(e1z, e2x), _mm_mul_ps(e1x, e2z));
+            __m128 nz = _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x));
+
+            // unit normal (zero for degenerate triangles)
+            __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+            __m128 valid = _mm_cmpgt_ps(len, zero);
+            __m128 inv = _mm_and_ps(valid, _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(len, tiny)));
+
+            _mm_storeu_ps(&wx[i], nx);
+            _mm_storeu_ps(&wy[i], ny);
+            _mm_storeu_ps(&wz[i], nz);
+            _mm_storeu_ps(&ux[i], _mm_mul_ps(nx, inv));
+            _mm_storeu_ps(&uy[i], _mm_mul_ps(ny, inv));
+            _mm_storeu_ps(&uz[i], _mm_mul_ps(nz, inv));
+
+            // cosines of the corner angles
+            __m128 l1 = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, e1x), _mm_mul_ps(e1y, e1y)), _mm_mul_ps(e1z, e1z)));
+            __m128 l2 = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, e2x), _mm_mul_ps(e2y, e2y)), _mm_mul_ps(e2z, e2z)));
+            __m128 l3 = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e3x, e3x), _mm_mul_ps(e3y, e3y)), _mm_mul_ps(e3z, e3z)));
+            __m128 d12 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, e2x), _mm_mul_ps(e1y, e2y)), _mm_mul_ps(e1z, e2z));
+            __m128 d13 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, e3x), _mm_mul_ps(e1y, e3y)), _mm_mul_ps(e1z, e3z));
+            __m128 d23 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, e3x), _mm_mul_ps(e2y, e3y)), _mm_mul_ps(e2z, e3z));
+
+            float cosA[4], cosB[4], cosC[4];
+            _mm_storeu_ps(cosA, _mm_div_ps(d12, _mm_max_ps(_mm_mul_ps(l1, l2), tiny)));
+            _mm_storeu_ps(cosB, _mm_div_ps(_mm_sub_ps(zero, d13), _mm_max_ps(_mm_mul_ps(l1, l3), tiny)));
+            _mm_storeu_ps(cosC, _mm_div_ps(d23, _mm_max_ps(_mm_mul_ps(l2, l3), tiny)));
+
+            for (int k = 0; k < 4; k++) {
+                angles[3 * (i + k) + 0] = std::acos(glm::clamp(cosA[k], -1.0f, 1.0f));
+                angles[3 * (i + k) + 1] = std::acos(glm::clamp(cosB[k], -1.0f, 1.0f));
+                angles[3 * (i + k) + 2] = std::acos(glm::clamp(cosC[k], -1.0f, 1.0f));
+            }
+        }
+#endif
 
-    std::map<int, std::map<int, std::map<int, unsigned> > > indexTable;
+        // leftovers (or everything, without SSE)
+        for (; i < end; i++) {
+            const Vec3& a = positions[faces[i].verts[0].v - 1];
+            const Vec3& b = positions[faces[i].verts[1].v - 1];
+            const Vec3& c = positions[faces[i].verts[2].v - 1];
 
-    int index = 0;
+            Vec3 e1 = b - a;
+            Vec3 e2 = c - a;
+            Vec3 e3 = c - b;
 
-    // for each face...
-    for (unsigned i = 0; i < faces.size(); i++) {
-        // for each vertex in the face...
-        for (int j = 0; j < 3; j++) {
+            Vec3 n = glm::cross(e1, e2);
+            float len = glm::length(n);
+            Vec3 u = (len > 0) ? n / len : Vec3(0.0f);
 
-            int v = faces[i].verts[j].v;
-            int vn = faces[i].verts[j].vn;
-            int vt = faces[i].verts[j].vt;
+            wx[i] = n.x; wy[i] = n.y; wz[i] = n.z;
+            ux[i] = u.x; uy[i] = u.y; uz[i] = u.z;
 
-            std::pair<std::map<int, unsigned>::iterator, bool> insertionResult;
+            float l1 = glm::length(e1), l2 = glm::length(e2), l3 = glm::length(e3);
+            angles[3 * i + 0] = std::acos(glm::clamp(glm::dot(e1, e2) / std::max(l1 * l2, 1e-30f), -1.0f, 1.0f));
+            angles[3 * i + 1] = std::acos(glm::clamp(-glm::dot(e1, e3) / std::max(l1 * l3, 1e-30f), -1.0f, 1.0f));
+            angles[3 * i + 2] = std::acos(glm::clamp(glm::dot(e2, e3) / std::max(l2 * l3, 1e-30f), -1.0f, 1.0f));
+        }
+    });
 
-            insertionResult = indexTable[v][vn].insert(std::make_pair(vt, index));
+    //
+    // list the corners that use each position (corner id = 3 * triangle + vertex)
+    //
+    std::vector<unsigned> cornerStart(numPositions + 1, 0);
+    for (size_t c = 0; c < numCorners; c++) {
+        ++cornerStart[faces[c / 3].verts[c % 3].v];
+    }
+    for (size_t p = 0; p < numPositions; p++) {
+        cornerStart[p + 1] += cornerStart[p];
+    }
 
-            if (insertionResult.second) {
-                // vertex was not seen yet, new index inserted
-                newPositions.push_back(positions[v - 1]);
-                newNormals.push_back(normals[vn - 1]);
-                newTexcoords.push_back(texcoords[vt - 1]);
-                newFaces[i].index[j] = index++;
+    std::vector<unsigned> corners(numCorners);
+    {
+        std::vector<unsigned> cursor(cornerStart.begin(), cornerStart.end() - 1);
+        for (size_t c = 0; c < numCorners; c++) {
+            corners[cursor[faces[c / 3].verts[c % 3].v - 1]++] = (unsigned)c;
+        }
+    }
+
+    //
+    // normal at each corner: sum of the weighted normals of the faces around the
+    // position that are within the crease angle of the corner's own face
+    //
+    std::vector<Vec3> cornerNormals(numCorners);
+    std::vector<unsigned> cornerLocal(numCorners);     // unique normal number within the position
+    std::vector<unsigned> numUnique(numPositions + 1, 0);
+
+    ParallelFor(numPositions, 1024, [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++) {
+            unsigned first = cornerStart[p];
+            unsigned last = cornerStart[p + 1];
+            unsigned unique = 0;
+
+            for (unsigned a = first; a < last; a++) {
+                unsigned ca = corners[a];
+                unsigned fa = ca / 3;
+
+                // a degenerate face has no direction of its own, so it takes the average of its neighbours
+                bool degenerate = (ux[fa] == 0 && uy[fa] == 0 && uz[fa] == 0);
+
+                Vec3 n(0.0f);
+                for (unsigned b = first; b < last; b++) {
+                    unsigned cb = corners[b];
+                    unsigned fb = cb / 3;
+                    float d = ux[fa] * ux[fb] + uy[fa] * uy[fb] + uz[fa] * uz[fb];
+                    if (fb == fa || degenerate || d >= cosCrease) {
+                        float w = angles[cb];
+                        n.x += wx[fb] * w;
+                        n.y += wy[fb] * w;
+                        n.z += wz[fb] * w;
+                    }
+                }
+
+                float len = glm::length(n);
+                if (len > 0) {
+                    n = n / len;
+                }
+                else {
+                    n = Vec3(0.0f, 1.0f, 0.0f);     // degenerate, pick something
+                }
+
+                // corners that gathered the same faces end up with bit-identical normals
+                unsigned local = unique;
+                for (unsigned b = first; b < a; b++) {
+                    if (cornerNormals[corners[b]] == n) {
+                        local = cornerLocal[corners[b]];
+                        break;
+                    }
+                }
+                if (local == unique) {
+                    ++unique;
+                }
+
+                cornerNormals[ca] = n;
+                cornerLocal[ca] = local;
             }
-            else {
-                // vertex already seen, use existing index
-                newFaces[i].index[j] = insertionResult.first->second;
+
+            numUnique[p + 1] = unique;
+        }
+    });
+
+    // normals of each position are stored contiguously
+    for (size_t p = 0; p < numPositions; p++) {
+        numUnique[p + 1] += numUnique[p];
+    }
+
+    normals.resize(numUnique[numPositions]);
+
+    ParallelFor(numPositions, 1024, [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++) {
+            for (unsigned a = cornerStart[p]; a < cornerStart[p + 1]; a++) {
+                unsigned c = corners[a];
+                unsigned index = numUnique[p] + cornerLocal[c];
+                normals[index] = cornerNormals[c];
+                faces[c / 3].verts[c % 3].vn = index + 1;   // OBJ indices are 1-based
+            }
+        }
+    });
+}
+
+namespace {
+
+unsigned WeldCellHash(int x, int y, int z)
+{
+    return ((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u);
+}
+
+}
+
+//
+// Weld near-identical vertices
+//
+// The positions are hashed into a grid of cells at least as big as the position tolerance, so
+// any vertex that could match one is in one of the 27 cells around it.  Each vertex looks for
+// the first earlier vertex it matches (in parallel), and joins it if that one was kept.  A
+// vertex never joins one that was welded away itself, so nothing moves by more than the
+// tolerances.  The kept vertices stay in order and keep their own attributes; triangles that
+// collapse are left in, so the index ranges of the submeshes still hold.
+//
+size_t OBJMesh::WeldVertices(const OBJWeldSettings& settings,
+    std::vector<Vec3>& positions,
+    std::vector<Vec3>* normals,
+    std::vector<TexCoord>* texcoords,
+    std::vector<IndexTriangle>& triangles)
+{
+    const size_t numVertices = positions.size();
+    if (numVertices < 2) {
+        return numVertices;
+    }
+
+    const float positionTolerance2 = settings.position * settings.position;
+    const float cosNormal = std::cos(glm::radians(settings.normalAngle));
+    const float texCoordTolerance = settings.texCoord;
+
+    // cells as big as the tolerance, but few enough per side that their coordinates fit an int
+    Vec3 lo = positions[0];
+    Vec3 hi = positions[0];
+    for (size_t i = 1; i < numVertices; i++) {
+        const Vec3& p = positions[i];
+        lo.x = std::min(lo.x, p.x); lo.y = std::min(lo.y, p.y); lo.z = std::min(lo.z, p.z);
+        hi.x = std::max(hi.x, p.x); hi.y = std::max(hi.y, p.y); hi.z = std::max(hi.z, p.z);
+    }
+    float extent = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
+    float cellSize = std::max(settings.position, extent * 1e-6f);
+    if (!(cellSize > 0)) {
+        cellSize = 1.0f;
+    }
+    const float invCellSize = 1.0f / cellSize;
+
+    // the grid is a hash table of cells, listing the vertices of each bucket in order
+    size_t numBuckets = 1;
+    while (numBuckets < numVertices) {
+        numBuckets <<= 1;
+    }
+    const unsigned bucketMask = (unsigned)(numBuckets - 1);
+
+    std::vector<int> cells(3 * numVertices);
+    std::vector<unsigned> bucketStart(numBuckets + 1, 0);
+    std::vector<unsigned> vertexBucket(numVertices);
+
+    ParallelFor(numVertices, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            int* c = &cells[3 * i];
+            c[0] = (int)std::floor((positions[i].x - lo.x) * invCellSize);
+            c[1] = (int)std::floor((positions[i].y - lo.y) * invCellSize);
+            c[2] = (int)std::floor((positions[i].z - lo.z) * invCellSize);
+            vertexBucket[i] = WeldCellHash(c[0], c[1], c[2]) & bucketMask;
+        }
+    });
+
+    for (size_t i = 0; i < numVertices; i++) {
+        ++bucketStart[vertexBucket[i] + 1];
+    }
+    for (size_t b = 0; b < numBuckets; b++) {
+        bucketStart[b + 1] += bucketStart[b];
+    }
+
+    std::vector<unsigned> bucketVertices(numVertices);
+    {
+        std::vector<unsigned> cursor(bucketStart.begin(), bucketStart.end() - 1);
+        for (size_t i = 0; i < numVertices; i++) {
+            bucketVertices[cursor[vertexBucket[i]]++] = (unsigned)i;
+        }
+    }
+
+    //
+    // the first earlier vertex each vertex matches (itself if none)
+    //
+    std::vector<unsigned> match(numVertices);
+
+    ParallelFor(numVertices, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const int* c = &cells[3 * i];
+            unsigned best = (unsigned)i;
+
+            for (int dz = -1; dz <= 1; dz++) {
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        unsigned b = WeldCellHash(c[0] + dx, c[1] + dy, c[2] + dz) & bucketMask;
+
+                        for (unsigned k = bucketStart[b]; k < bucketStart[b + 1]; k++) {
+                            unsigned j = bucketVertices[k];
+                            if (j >= best) {
+                                break;      // the bucket is in order, so nothing earlier follows
+                            }
+
+                            Vec3 d = positions[i] - positions[j];
+                            if (glm::dot(d, d) > positionTolerance2) {
+                                continue;
+                            }
+                            if (normals) {
+                                const Vec3& a = (*normals)[i];
+                                const Vec3& n = (*normals)[j];
+                                if (a != n && glm::dot(a, n) < cosNormal * glm::length(a) * glm::length(n)) {
+                                    continue;
+                                }
+                            }
+                            if (texcoords) {
+                                const TexCoord& a = (*texcoords)[i];
+                                const TexCoord& t = (*texcoords)[j];
+                                if (std::fabs(a.s - t.s) > texCoordTolerance || std::fabs(a.t - t.t) > texCoordTolerance) {
+                                    continue;
+                                }
+                            }
+
+                            best = j;
+                            break;
+                        }
+                    }
+                }
             }
+
+            match[i] = best;
+        }
+    });
+
+    //
+    // keep the vertices that matched nothing, or something that was welded away itself
+    //
+    std::vector<unsigned> remap(numVertices);
+    size_t numKept = 0;
+    for (size_t i = 0; i < numVertices; i++) {
+        unsigned m = match[i];
+        if (m != i && match[m] == m) {
+            remap[i] = remap[m];
+        }
+        else {
+            match[i] = (unsigned)i;
+            remap[i] = (unsigned)numKept++;
         }
     }
 
-    // replace the old with the new
-    positions.swap(newPositions);
-    normals.swap(newNormals);
-    texcoords.swap(newTexcoords);
+    if (numKept == numVertices) {
+        return numVertices;
+    }
+
+    // kept vertices only move down, so this works in place
+    for (size_t i = 0; i < numVertices; i++) {
+        if (match[i] == i) {
+            positions[remap[i]] = positions[i];
+            if (normals) {
+                (*normals)[remap[i]] = (*normals)[i];
+            }
+            if (texcoords) {
+                (*texcoords)[remap[i]] = (*texcoords)[i];
+            }
+        }
+    }
+    positions.resize(numKept);
+    if (normals) {
+        normals->resize(numKept);
+    }
+    if (texcoords) {
+        texcoords->resize(numKept);
+    }
+
+    ParallelFor(triangles.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            for (int j = 0; j < 3; j++) {
+                triangles[i].index[j] = remap[triangles[i].index[j]];
+            }
+        }
+    });
+
+    return numKept;
 }
 
 //
@@ -927,9 +2416,19 @@ glsh::Mesh* LoadWavefrontOBJ(const std::string& path)
 {
     OBJMesh mesh;
 
-    if (mesh.load(path, false)) {
-        return new glsh::IndexedMesh(mesh.mVBO, mesh.mIBO, mesh.mVAO, GL_TRIANGLES, GL_UNSIGNED_INT, mesh.mNumIndices);
+    // the glsh mesh takes over the vertex array and buffers, and only knows about one of each
+    mesh.setBufferLayout(OBJ_BUFFERS_INTERLEAVED);
+
+    if (!mesh.load(path, false)) {
+        return NULL;
+    }
+
+    if (mesh.mChunks.size() > 1) {
+        std::cerr << "ERROR: " << path << " was loaded out of core in " << mesh.mChunks.size()
+                  << " chunks, which a glsh mesh can't draw (use OBJMesh)" << std::endl;
+        mesh.destroy();
+        return NULL;
     }
 
-    return NULL;
+    return new glsh::IndexedMesh(mesh.mVBO, mesh.mIBO, mesh.mVAO, GL_TRIANGLES, GL_UNSIGNED_INT, mesh.mChunks[0].numIndices);
 }
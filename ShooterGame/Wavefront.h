@@ -3,6 +3,299 @@
 
 #include "GLSH.h"
 
+#include <string>
+#include <vector>
+
+// OBJ vertex format flags
+enum {
+    OBJ_VFF_POSITION = 1,
+    OBJ_VFF_NORMAL = 2,
+    OBJ_VFF_TEXCOORD = 4
+};
+
+struct OBJVertex {
+    int v, vn, vt;
+    OBJVertex();
+    OBJVertex(const std::string& str);
+    int getFormat() const;
+};
+
+struct OBJTriangle {
+    OBJVertex verts[3];
+    OBJTriangle();
+    OBJTriangle(const OBJVertex& a, const OBJVertex& b, const OBJVertex& c);
+};
+
+struct IndexTriangle {
+    unsigned index[3];
+    IndexTriangle();
+};
+
+typedef glm::vec3 Vec3;
+typedef glm::vec4 Vec4;
+typedef glm::vec2 TexCoord;
+
+// how the vertex attributes are laid out in buffers
+enum OBJBufferLayout {
+    OBJ_BUFFERS_INTERLEAVED,        // everything in one interleaved buffer
+    OBJ_BUFFERS_POSITION_STREAM,    // the interleaved buffer plus a tightly packed copy of the positions
+    OBJ_BUFFERS_SPLIT               // tightly packed positions, and the other attributes interleaved
+};
+
+// a part of the mesh with its own vertex array and buffers
+// (big meshes are split so that each part fits in a single draw call)
+struct OBJMeshChunk {
+    GLuint vao;
+    GLuint vbo;                 // all attributes, or all but the positions (OBJ_BUFFERS_SPLIT)
+    GLuint ibo;
+    GLuint positionVBO;         // packed positions, 0 for OBJ_BUFFERS_INTERLEAVED
+    GLuint depthVAO;            // positions only, for depth-only passes (0 if there's no position stream)
+    GLsizei numVertices;
+    GLsizei numIndices;
+
+    OBJMeshChunk();
+};
+
+// material from an MTL library (only the diffuse color and map are used)
+struct OBJMaterial {
+    std::string name;
+    Vec3 diffuse;
+    std::string diffuseMap;     // map_Kd path relative to the working directory, empty if none
+    bool defined;               // false if no library defines it (or for faces without usemtl)
+
+    OBJMaterial();
+};
+
+// a range of the index buffer drawn with one material
+// (faces are sorted by material, then by group, so each material is one contiguous range)
+struct OBJSubmesh {
+    std::string group;          // "o" or "g" name, empty for material ranges
+    unsigned material;          // index into OBJMesh::mMaterials
+    unsigned long long firstIndex;
+    unsigned long long numIndices;
+
+    OBJSubmesh();
+};
+
+// how close vertices must be to be welded into one after reindexing (see OBJMesh::WeldVertices)
+struct OBJWeldSettings {
+    bool enabled;
+    float position;             // distance between the positions, in model units
+    float normalAngle;          // degrees between the normals
+    float texCoord;             // difference in each texture coordinate
+
+    OBJWeldSettings();
+};
+
+// chunk data kept in RAM until it can be uploaded (see OBJMesh::setDeferUpload)
+struct OBJPendingChunk {
+    std::vector<GLfloat> vertexData;
+    std::vector<unsigned> indices;
+};
+
+struct VertexFormatOps;
+
+class OBJMesh {
+
+public:
+    // vertex and index buffer ids
+    GLuint mVAO;
+    GLuint mVBO;
+    GLuint mIBO;
+
+    // number of components in each vertex attribute
+    // (needed by glEnableVertexArray and glVertexAttribPointer)
+    GLint mPositionSize;
+    GLint mNormalSize;
+    GLint mTangentSize;
+    GLint mTexCoordSize;
+
+    // vertex attribute offsets in buffer
+    // (needed by glVertexAttribPointer)
+    GLvoid* mPositionOffset;
+    GLvoid* mNormalOffset;
+    GLvoid* mTangentlOffset;
+    GLvoid* mTexCoordOffset;
+
+    // vertex size in bytes
+    // (needed by glVertexAttribPointer)
+    GLsizei mStride;
+
+    // the compiled vertex format that matches the layout above (see VertexFormat.h)
+    const VertexFormatOps* mVertexFormat;
+
+    // total number of vertices
+    unsigned long long mNumVertices;
+
+    // total number of indices
+    unsigned long long mNumIndices;
+
+    // vertex arrays and buffers to draw (the first one is mVAO/mVBO/mIBO)
+    std::vector<OBJMeshChunk> mChunks;
+
+    // materials, and the index ranges that use them (empty for out-of-core meshes)
+    std::vector<OBJMaterial> mMaterials;
+    std::vector<OBJSubmesh> mSubmeshes;         // one per group and material
+    std::vector<OBJSubmesh> mMaterialRanges;    // one per material
+    std::vector<std::string> mMaterialLibs;     // paths of the MTL files
+
+    // hash of the layout and of all vertex and index data uploaded so far, and once loaded, of
+    // the materials and their ranges
+    unsigned long long mContentHash;
+
+    // size of the vertex and index buffers
+    unsigned long long mGPUBytes;
+
+    // radius of a bounding sphere centered at the origin
+    float mRadius;
+
+    // buffer layout of the chunks
+    OBJBufferLayout mBufferLayout;
+
+    // load() keeps the chunks in mPendingChunks instead of creating GL objects
+    bool mDeferUpload;
+    bool mUploadingDeferred;        // uploadDeferred is the caller, the only one allowed GL calls
+    std::vector<OBJPendingChunk> mPendingChunks;
+
+    // load() may read the .smesh cache (and UseCache allows it)
+    bool mUseCache;
+
+    // welding done by load()
+    OBJWeldSettings mWeld;
+
+    // zerofy all variables
+    void clear();
+
+    // zerofy all but the load options (buffer layout, deferred upload, cache use and welding)
+    void clearGeometry();
+
+    // free the GL objects and the chunk data, keeping the load options
+    void freeChunks();
+
+    // set up the interleaved vertex layout and pick its vertex format, returns the number of floats per vertex
+    int setVertexLayout(bool haveNormals, bool haveTexCoords, bool haveTangents);
+
+    // add one chunk of the mesh: hash it and create its vertex array and buffers
+    // (or keep its data for uploadDeferred)
+    bool createChunk(const GLfloat* vertexData, unsigned long long numVertices,
+        const unsigned* indices, unsigned long long numIndices,
+        OBJMeshChunk& chunk);
+
+    // create the GL objects for a chunk
+    bool uploadChunk(const GLfloat* vertexData, unsigned long long numVertices,
+        const unsigned* indices, unsigned long long numIndices,
+        OBJMeshChunk& chunk);
+
+    // fold the materials and material ranges into mContentHash
+    void hashMaterials();
+
+    // compressed cache of the built vertex and index arrays, stored next to the OBJ file
+    // as <path>.smesh and used as long as the OBJ's size and timestamp match
+    bool loadCache(const std::string& path, bool shouldComputeTangents, float creaseAngle);
+    void saveCache(const std::string& path, bool shouldComputeTangents, float creaseAngle,
+        const std::vector<GLfloat>& vertexData, const unsigned* indices);
+
+    // find a material by name, adding an undefined one if it's not there
+    unsigned findMaterial(const std::string& name);
+
+    // read the materials of an MTL file into mMaterials
+    bool loadMaterialLibrary(const std::string& path);
+
+    // build mSubmeshes and mMaterialRanges from the per-triangle material and group
+    // (the triangles must already be sorted)
+    void buildSubmeshes(const std::vector<unsigned>& triMaterial, const std::vector<unsigned>& triGroup,
+        const std::vector<std::string>& groupNames);
+
+    // generate smooth normals for faces that have none, weighted by face area and corner angle;
+    // faces meeting at more than creaseAngle degrees get separate normals (fills in the vn indices)
+    static void GenerateNormals(const std::vector<Vec3>& positions,
+        std::vector<OBJTriangle>& faces,
+        std::vector<Vec3>& normals,
+        float creaseAngle);
+
+    // compute tangents for normal mapping
+    static void ComputeTangents(const std::vector<Vec3>& positions,
+        const std::vector<Vec3>& normals,
+        const std::vector<TexCoord>& texcoords,
+        const std::vector<IndexTriangle>& triangles,
+        std::vector<Vec4>& tangents);
+
+    // merge the vertices whose attributes are all within the tolerances, after reindexing:
+    // exporters often write the same vertex under different OBJ indices (seams, per-face
+    // normals that happen to agree); normals and texcoords are NULL if the format has none,
+    // returns the number of vertices left
+    static size_t WeldVertices(const OBJWeldSettings& settings,
+        std::vector<Vec3>& positions,
+        std::vector<Vec3>* normals,
+        std::vector<TexCoord>* texcoords,
+        std::vector<IndexTriangle>& triangles);
+
+public:
+
+    OBJMesh();
+    // default crease angle (degrees) for generated normals
+    static const float DEFAULT_CREASE_ANGLE;
+
+    // files at least this big are loaded with loadOutOfCore
+    static const unsigned long long OUT_OF_CORE_THRESHOLD;
+
+    // set to false to always parse the OBJ text
+    static bool UseCache;
+
+    // buffer layout of new meshes
+    static OBJBufferLayout DefaultBufferLayout;
+
+    // welding of new meshes (off unless enabled)
+    static OBJWeldSettings DefaultWeld;
+
+    OBJMesh(const std::string& path, bool shouldComputeTangents = false, float creaseAngle = DEFAULT_CREASE_ANGLE);
+    ~OBJMesh();
+
+    bool isLoaded() const;
+
+    bool load(const std::string& path, bool shouldComputeTangents = false, float creaseAngle = DEFAULT_CREASE_ANGLE);
+
+    // load a mesh that may not fit in RAM: the file is read in windows of 'windowSize' bytes,
+    // the parsed data is spilled to temporary memory-mapped files, and the triangles are
+    // uploaded in chunks of at most 'trianglesPerChunk', each with its own buffers
+    // (normals are smoothed without creases and tangents are not supported); with deferred
+    // upload every chunk stays in RAM until uploadDeferred
+    bool loadOutOfCore(const std::string& path, size_t windowSize = 16 << 20, size_t trianglesPerChunk = 1 << 20);
+
+    // parse without touching GL, so load() can run on a worker thread
+    void setDeferUpload(bool defer);
+
+    // call before load() with false to re-parse the OBJ even if its .smesh cache is current
+    // (the cache does not notice changes to the material libraries)
+    void setUseCache(bool use);
+
+    // on the GL thread: create the GL objects for up to maxChunks of the deferred chunks,
+    // returns true once all of them are uploaded
+    bool uploadDeferred(unsigned maxChunks);
+
+    // call before load() to use a different buffer layout than DefaultBufferLayout
+    void setBufferLayout(OBJBufferLayout layout);
+
+    // call before load() to weld differently than DefaultWeld (out-of-core loads don't weld)
+    void setWeld(const OBJWeldSettings& settings);
+
+    // vertex array for a depth-only pass: only the positions are fetched, if possible
+    GLuint getDepthVAO(unsigned chunk) const;
+
+    // RAM the mesh holds on to: the object, its chunks, materials and submeshes, and the data
+    // of chunks that are still waiting for uploadDeferred
+    unsigned long long getCPUBytes() const;
+
+    // draw all triangles
+    void draw() const;
+
+    // free the GL objects
+    void destroy();
+};
+
+
+// a glsh mesh that owns the GL objects of an OBJ, NULL if it fails to load or is too big for
+// one chunk (load those with OBJMesh)
 glsh::Mesh* LoadWavefrontOBJ(const std::string& path);
 
 #endif
@@ -1,8 +1,171 @@
 #include "Game.h"
+#include "Benchmark.h"
+#include "Server.h"
+#include "Wavefront.h"
 
-int main()
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+static void PrintUsage()
+{
+    std::cout << "Usage: ShooterGame [options]\n"
+              << "  --benchmark           run headless and write frame timings\n"
+              << "  --job-benchmark       measure the job scheduler and write the results\n"
+              << "  --transform-benchmark measure transform hierarchy updates and write the results\n"
+              << "  --nav-benchmark       measure pathfinding as the number of agents grows and write the results\n"
+              << "  --script <file>       camera script to replay (default: orbit)\n"
+              << "  --out <file>          benchmark or server results, '-' for stdout (default: benchmark.json, server.json)\n"
+              << "  --size <w> <h>        benchmark resolution (default: 1280 720)\n"
+              << "  --warmup <frames>     unmeasured frames per mesh (default: 10)\n"
+              << "  --record <file>       record the camera path as a benchmark script\n"
+              << "  --depth <mode>        normal, prepass (depth-only pass first) or only (depth pass alone)\n"
+              << "  --low-latency         read input right before drawing and queue at most one frame\n"
+              << "  --lighting <mode>     clustered (point lights, the default) or directional\n"
+              << "  --weld                merge vertices that are nearly the same when loading meshes\n"
+              << "  --weld-tolerance <position> <normal degrees> <texcoord>\n"
+              << "                        how near vertices must be to merge (default: 1e-5 0.5 1e-5)\n"
+              << "  --server              run matches headless, without GL, and report tick times\n"
+              << "  --level <file>        OBJ level for the server or --nav-benchmark, may be repeated (default: meshes.txt)\n"
+              << "  --tick-rate <n>       server ticks per second (default: 128)\n"
+              << "  --ticks <n>           server ticks to run, 0 until Ctrl+C (default: 0)\n"
+              << "  --matches <n>         matches the server runs at once (default: 1)\n"
+              << "  --players <n>         bots per match (default: 16)\n"
+              << "  --unpaced             run server ticks back to back to measure throughput\n";
+}
+
+int main(int argc, char* argv[])
 {
     Game game;
 
+    bool benchmark = false;
+    bool jobBenchmark = false;
+    bool transformBenchmark = false;
+    bool navBenchmark = false;
+    bool server = false;
+    BenchmarkOptions options;
+    ServerOptions serverOptions;
+    std::string recordPath;
+
+    for (int i = 1; i < argc; i++) {
+        bool haveArg = i + 1 < argc;
+        if (!std::strcmp(argv[i], "--benchmark")) {
+            benchmark = true;
+        }
+        else if (!std::strcmp(argv[i], "--job-benchmark")) {
+            jobBenchmark = true;
+        }
+        else if (!std::strcmp(argv[i], "--transform-benchmark")) {
+            transformBenchmark = true;
+        }
+        else if (!std::strcmp(argv[i], "--nav-benchmark")) {
+            navBenchmark = true;
+        }
+        else if (!std::strcmp(argv[i], "--script") && haveArg) {
+            options.scriptPath = argv[++i];
+        }
+        else if (!std::strcmp(argv[i], "--out") && haveArg) {
+            options.outputPath = argv[++i];
+            serverOptions.outputPath = options.outputPath;
+        }
+        else if (!std::strcmp(argv[i], "--size") && i + 2 < argc) {
+            options.width = std::atoi(argv[++i]);
+            options.height = std::atoi(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--warmup") && haveArg) {
+            options.warmupFrames = std::atoi(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--record") && haveArg) {
+            recordPath = argv[++i];
+        }
+        else if (!std::strcmp(argv[i], "--low-latency")) {
+            game.setLowLatency(true);
+        }
+        else if (!std::strcmp(argv[i], "--lighting") && haveArg) {
+            ++i;
+            if (!std::strcmp(argv[i], "clustered")) {
+                game.setClusteredLighting(true);
+            }
+            else if (!std::strcmp(argv[i], "directional")) {
+                game.setClusteredLighting(false);
+            }
+            else {
+                PrintUsage();
+                return 1;
+            }
+        }
+        else if (!std::strcmp(argv[i], "--server")) {
+            server = true;
+        }
+        else if (!std::strcmp(argv[i], "--level") && haveArg) {
+            serverOptions.levels.push_back(argv[++i]);
+            options.levels.push_back(serverOptions.levels.back());
+        }
+        else if (!std::strcmp(argv[i], "--tick-rate") && haveArg) {
+            serverOptions.tickRate = std::atoi(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--ticks") && haveArg) {
+            serverOptions.numTicks = std::atoi(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--matches") && haveArg) {
+            serverOptions.numMatches = std::atoi(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--players") && haveArg) {
+            serverOptions.playersPerMatch = std::atoi(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--unpaced")) {
+            serverOptions.paced = false;
+        }
+        else if (!std::strcmp(argv[i], "--weld")) {
+            OBJMesh::DefaultWeld.enabled = true;
+        }
+        else if (!std::strcmp(argv[i], "--weld-tolerance") && i + 3 < argc) {
+            OBJMesh::DefaultWeld.enabled = true;
+            OBJMesh::DefaultWeld.position = (float)std::atof(argv[++i]);
+            OBJMesh::DefaultWeld.normalAngle = (float)std::atof(argv[++i]);
+            OBJMesh::DefaultWeld.texCoord = (float)std::atof(argv[++i]);
+        }
+        else if (!std::strcmp(argv[i], "--depth") && haveArg) {
+            ++i;
+            int mode = 0;
+            while (mode < NUM_DEPTH_MODES && std::strcmp(argv[i], Game::GetDepthModeName((DepthMode)mode))) {
+                ++mode;
+            }
+            if (mode == NUM_DEPTH_MODES) {
+                PrintUsage();
+                return 1;
+            }
+            game.setDepthMode((DepthMode)mode);
+        }
+        else {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    if (server) {
+        return RunServer(serverOptions);
+    }
+
+    if (jobBenchmark) {
+        return RunJobBenchmark(options);
+    }
+
+    if (transformBenchmark) {
+        return RunTransformBenchmark(options);
+    }
+
+    if (navBenchmark) {
+        return RunNavBenchmark(options);
+    }
+
+    if (benchmark) {
+        return RunBenchmark(game, options);
+    }
+
+    if (!recordPath.empty() && !game.startRecording(recordPath)) {
+        return 1;
+    }
+
     glsh::System::Run(game, "Hello, world", 800, 600);
 }
@@ -0,0 +1,61 @@
+#version 330
+
+// inputs from application
+uniform vec4 u_Color;
+
+// directional light info
+uniform vec3 u_LightColor;
+uniform vec3 u_LightDir;    // direction to light (in camera space!)
+
+// point lights, see ClusteredLighting.h
+uniform samplerBuffer u_Lights;             // 2 texels per light: camera space position + radius, color
+uniform usamplerBuffer u_ClusterLights;     // (first index, count) per cluster
+uniform usamplerBuffer u_LightIndices;
+uniform vec4 u_ClusterGrid;                 // tiles per pixel in x and y, tiles in x and y
+uniform vec4 u_ClusterSlices;               // slices, depth scale and bias, 1 if the depth is logarithmic
+
+// input from rasterizer
+in vec3 var_Position;
+in vec3 var_Normal;
+
+// outputs to framebuffer
+out vec4 out_Color;
+
+// the directional light plus the point lights of this fragment's cluster
+vec3 ComputeLighting(vec3 P, vec3 N)
+{
+	vec3 light = max(dot(N, normalize(u_LightDir)), 0.2) * u_LightColor;
+
+	// find the cluster
+	ivec2 tile = ivec2(gl_FragCoord.xy * u_ClusterGrid.xy);
+	tile = clamp(tile, ivec2(0), ivec2(u_ClusterGrid.zw) - 1);
+	float depth = -P.z;
+	float s = (u_ClusterSlices.w > 0.5 ? log(max(depth, 1e-6)) : depth) * u_ClusterSlices.y + u_ClusterSlices.z;
+	int slice = clamp(int(s), 0, int(u_ClusterSlices.x) - 1);
+	int cluster = (slice * int(u_ClusterGrid.w) + tile.y) * int(u_ClusterGrid.z) + tile.x;
+
+	// only the lights that reach it
+	uvec2 range = texelFetch(u_ClusterLights, cluster).xy;
+	for (uint i = 0u; i < range.y; i++) {
+		int index = int(texelFetch(u_LightIndices, int(range.x + i)).x);
+		vec4 posRadius = texelFetch(u_Lights, 2 * index);
+		vec3 toLight = posRadius.xyz - P;
+		float dist2 = dot(toLight, toLight);
+		float r2 = posRadius.w * posRadius.w;
+		if (dist2 < r2) {
+			// smooth falloff to zero at the radius
+			float falloff = 1.0 - dist2 / r2;
+			float NdotL = max(dot(N, toLight * inversesqrt(max(dist2, 1e-8))), 0.0);
+			light += (falloff * falloff * NdotL) * texelFetch(u_Lights, 2 * index + 1).rgb;
+		}
+	}
+
+	return light;
+}
+
+void main(void)
+{
+	vec3 light = ComputeLighting(var_Position, normalize(var_Normal));
+	out_Color.rgb = u_Color.rgb * light;
+	out_Color.a = u_Color.a;
+}
@@ -0,0 +1,31 @@
+#version 330
+
+// vertex attributes
+layout(location=0) in vec4 in_Position;
+layout(location=2) in vec3 in_Normal;
+layout(location=3) in vec2 in_TexCoord;
+
+// the depth pre-pass and the lit passes must produce exactly the same depth
+invariant gl_Position;
+
+// transform
+uniform mat4 u_ProjectionMatrix;
+uniform mat4 u_ModelViewMatrix;
+uniform mat3 u_NormalMatrix;
+
+// outputs to rasterizer, lit per pixel (in camera space)
+out vec3 var_Position;
+out vec3 var_Normal;
+out vec2 var_TexCoord;
+
+void main(void)
+{
+	vec4 P = u_ModelViewMatrix * in_Position;
+
+	// output transformed vertex position
+	gl_Position = u_ProjectionMatrix * u_ModelViewMatrix * in_Position;
+
+	var_Position = P.xyz / P.w;
+	var_Normal = u_NormalMatrix * in_Normal;
+	var_TexCoord = in_TexCoord;		// (0, 0) for meshes without texture coordinates
+}
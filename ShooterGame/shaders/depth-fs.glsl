@@ -0,0 +1,7 @@
+#version 330
+
+// color writes are masked off, only depth is written
+
+void main(void)
+{
+}
@@ -0,0 +1,17 @@
+#version 330
+
+// vertex attributes
+layout(location=0) in vec4 in_Position;
+
+// the depth pre-pass and the lit passes must produce exactly the same depth
+invariant gl_Position;
+
+// transform
+uniform mat4 u_ProjectionMatrix;
+uniform mat4 u_ModelViewMatrix;
+
+void main(void)
+{
+	// only the position is needed to lay down depth
+	gl_Position = u_ProjectionMatrix * u_ModelViewMatrix * in_Position;
+}
@@ -0,0 +1,19 @@
+#version 330
+
+// inputs from application
+uniform vec4 u_Color;
+uniform sampler2D u_Texture;    // texture unit 0
+
+// input from rasterizer
+in vec3 var_LightColor;		// interpolated per-vertex light color
+in vec2 var_TexCoord;
+
+// outputs to framebuffer
+out vec4 out_Color;
+
+void main(void)
+{
+	vec4 texColor = texture(u_Texture, var_TexCoord);
+	out_Color.rgb = u_Color.rgb * texColor.rgb * var_LightColor;
+	out_Color.a = u_Color.a * texColor.a;
+}
@@ -0,0 +1,38 @@
+#version 330
+
+// vertex attributes
+layout(location=0) in vec4 in_Position;
+layout(location=2) in vec3 in_Normal;
+layout(location=3) in vec2 in_TexCoord;
+
+// the depth pre-pass and the lit passes must produce exactly the same depth
+invariant gl_Position;
+
+// transform
+uniform mat4 u_ProjectionMatrix;
+uniform mat4 u_ModelViewMatrix;
+uniform mat3 u_NormalMatrix;
+
+// directional light info
+uniform vec3 u_LightColor;
+uniform vec3 u_LightDir;    // direction to light (in camera space!)
+
+// outputs to rasterizer
+out vec3 var_LightColor;
+out vec2 var_TexCoord;
+
+void main(void)
+{
+	// output transformed vertex position
+	gl_Position = u_ProjectionMatrix * u_ModelViewMatrix * in_Position;
+
+	vec3 N = normalize(u_NormalMatrix * in_Normal);		// transform surface normal
+	vec3 L = normalize(u_LightDir);						// direction to light
+
+	// compute diffuse lighting intensity
+	float NdotL = max(dot(N, L), 0.2);
+
+	// pass light color and texture coordinates to rasterizer
+	var_LightColor = NdotL * u_LightColor;
+	var_TexCoord = in_TexCoord;
+}
@@ -4,6 +4,9 @@
 layout(location=0) in vec4 in_Position;
 layout(location=2) in vec3 in_Normal;
 
+// the depth pre-pass and the lit passes must produce exactly the same depth
+invariant gl_Position;
+
 // transform
 uniform mat4 u_ProjectionMatrix;
 uniform mat4 u_ModelViewMatrix;